@@ -290,7 +290,7 @@ int main( int argc, char* argv[] )
             tdp::ManagedHostVolume<tdp::TSDFval> tmpTSDF(wTSDF, hTSDF, dTSDF);
             tmpTSDF.CopyFrom(cuTSDF, cudaMemcpyDeviceToHost);
             std::cout << "start writing TSDF to " << tsdfOutputPath << std::endl;
-            tdp::TSDF::SaveTSDF(tmpTSDF, grid0, dGrid, T_wG, tsdfOutputPath);
+            tdp::TSDF::SaveTSDFSnapshot(tmpTSDF, grid0, dGrid, T_wG, tsdfOutputPath);
             std::cout << "done writing TSDF to " << tsdfOutputPath << std::endl;
           }
           std::this_thread::sleep_for(std::chrono::microseconds(100));
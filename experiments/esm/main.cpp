@@ -27,6 +27,7 @@
 #include <tdp/preproc/grey.h>
 #include <tdp/manifold/SL3.h>
 #include <tdp/esm/esm.h>
+#include <tdp/esm/esm_tracker.h>
 #include <tdp/data/managed_pyramid.h>
 
 #include <tdp/gui/gui.hpp>
@@ -136,6 +137,8 @@ int main( int argc, char* argv[] )
   pangolin::Var<int>   esmIter3("ui.ESM iter lvl 3",0,0,10);
   pangolin::Var<int>   esmIter4("ui.ESM iter lvl 4",0,0,10);
 
+  tdp::ESMTracker esm;
+
   tdp::Homography<float> H_rand(tdp::SL3<float>::Random());
   tdp::Homography<float> H_est;
   tdp::SL3<float> H;
@@ -198,11 +201,9 @@ int main( int argc, char* argv[] )
     if (gui.frame > 1 && pangolin::Pushed(estimateH)) {
       tdp::SL3<float> G;
       std::vector<size_t> maxIt{esmIter0,esmIter1,esmIter2,esmIter3,esmIter4};
-      tdp::ESM::EstimateHomography(
-          pyrGrey_m, pyrGreydu_m, pyrGreydv_m,
-          pyrGrey, pyrGreydu, pyrGreydv,
-          maxIt,
-          G);
+      esm.verbose_ = true;
+      esm.SetTemplate(pyrGrey_m, pyrGreydu_m, pyrGreydv_m);
+      esm.Track(pyrGrey, pyrGreydu, pyrGreydv, maxIt, G);
 
       H_est = G;
       H = tdp::SL3<float>(Kinv * G.matrix() * K);
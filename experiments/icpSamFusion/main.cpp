@@ -27,6 +27,7 @@
 #include <tdp/gui/quickView.h>
 #include <tdp/icp/icp.h>
 #include <tdp/icp/icpTexture.h>
+#include <tdp/icp/kdtree_icp.h>
 #include <tdp/manifold/SE3.h>
 #include <tdp/nvidia/helper_cuda.h>
 #include <tdp/preproc/convolutionSeparable.h>
@@ -42,6 +43,7 @@
 #include <tdp/preproc/grey.h>
 #include <tdp/slam/keyframe.h>
 #include <tdp/slam/keyframe_slam.h>
+#include <tdp/slam/keyframe_store.h>
 #include <tdp/gl/shaders.h>
 #include <tdp/rtmf/vMFMMF.h>
 #include <tdp/utils/colorMap.h>
@@ -225,12 +227,7 @@ int main( int argc, char* argv[] )
 
   tdp::SE3f T_abSuccess;
 
-  tdp::ManagedDeviceImage<tdp::Vector3fda> cuPcA(wc, hc);
-  tdp::ManagedDeviceImage<tdp::Vector3fda> cuNA(wc, hc);
-  tdp::ManagedDeviceImage<tdp::Vector3fda> cuPcB(wc, hc);
-  tdp::ManagedDeviceImage<tdp::Vector3fda> cuNB(wc, hc);
-  tdp::ManagedHostImage<int> assoc_ba(wc,hc);
-  tdp::ManagedDeviceImage<int> cuAssoc_ba(wc,hc);
+  tdp::KdTreeICP icpKd;
 
   tdp::ManagedDeviceImage<uint16_t> cuDraw(wc, hc);
   tdp::ManagedDeviceImage<float> cuD(wc, hc);
@@ -402,7 +399,13 @@ int main( int argc, char* argv[] )
   Eigen::Matrix<float,6,6> Sigma_ac = Eigen::Matrix<float,6,6>::Zero();
 
   tdp::KeyframeSLAM kfSLAM;
-  std::vector<tdp::KeyFrame> kfs;
+  // back projection rays of the stacked rig images for deriving
+  // keyframes from their compact form in the keyframe store
+  tdp::ManagedHostImage<tdp::Vector3fda> kfRays(wc, hc);
+  tdp::ManagedHostImage<tdp::Vector3fda> kfOrigins(wc, hc);
+  rig.ComputeRaysCpu(true, kfRays, kfOrigins);
+  tdp::KeyFrameStore kfs(kfRays, &kfOrigins, 32, true);
+  tdp::ManagedHostImage<float> kfGrey(wc, hc);
   std::vector<tdp::BinaryKF> binaryKfs;
   std::vector<float> logHs;
   std::vector<tdp::SE3f> T_mos;
@@ -420,7 +423,7 @@ int main( int argc, char* argv[] )
           if (pangolin::Pushed(saveTSDF)) {
             TSDF.CopyFrom(cuTSDF);
             std::cout << "start writing TSDF to " << tsdfOutputPath << std::endl;
-            tdp::TSDF::SaveTSDF(TSDF, grid0, dGrid, T_wG, tsdfOutputPath);
+            tdp::TSDF::SaveTSDFSnapshot(TSDF, grid0, dGrid, T_wG, tsdfOutputPath);
             std::cout << "done writing TSDF to " << tsdfOutputPath << std::endl;
           }
           std::this_thread::sleep_for(std::chrono::microseconds(100));
@@ -430,9 +433,14 @@ int main( int argc, char* argv[] )
   tdp::ThreadedValue<bool> runLoopClosure(true);
   std::mutex mut;
 
-  auto loopCloseKfs = [&](int idA, int idB) -> bool {
-      tdp::KeyFrame& kfA = kfs[idA];
-      tdp::KeyFrame& kfB = kfs[idB];
+  // overlapBefore and rmseBefore are the photometric overlap of the
+  // keyframes at their current relative pose as scored by OverlapCpu
+  auto loopCloseKfs = [&](int idA, int idB, float overlapBefore,
+      float rmseBefore) -> bool {
+      std::shared_ptr<tdp::KeyFrame> kfAptr = kfs.Get(idA);
+      std::shared_ptr<tdp::KeyFrame> kfBptr = kfs.Get(idB);
+      tdp::KeyFrame& kfA = *kfAptr;
+      tdp::KeyFrame& kfB = *kfBptr;
       Eigen::Matrix<float,6,1> se3 = kfA.T_wk_.Log(kfB.T_wk_);
       if ( se3.head<3>().norm()*180./M_PI < loopCloseAngleThresh
         && se3.tail<3>().norm()           < loopCloseDistThresh) {
@@ -443,16 +451,6 @@ int main( int argc, char* argv[] )
           << se3.tail<3>().norm()          
           << std::endl;
 
-        photoErrBefore.Fill(0.);
-        float overlapBefore, rmseBefore;
-
-        TICK("Overlap");
-        cudaMemset(cuPhotoErrAfter.ptr_, 0, cuPhotoErrAfter.SizeBytes());
-        Overlap(kfA, kfB, rig, icpLoopCloseOverlapLvl, overlapBefore, 
-            rmseBefore, nullptr, &cuPhotoErrAfter);
-        photoErrBefore.CopyFrom(cuPhotoErrAfter);
-        TOCK("Overlap");
-
         if (overlapBefore > icpLoopCloseOverlapThr || useRansac) {
 
           size_t numInliers = 0;
@@ -472,13 +470,9 @@ int main( int argc, char* argv[] )
           float count=10000;
           Eigen::Matrix<float,6,6> Sigma_ab = 1e-6*Eigen::Matrix<float,6,6>::Identity();
           if (useANN) {
-            cuPcA.CopyFrom(kfA.pc_);
-            cuNA.CopyFrom(kfA.n_);
-            cuPcB.CopyFrom(kfB.pc_);
-            cuNB.CopyFrom(kfB.n_);
-            tdp::ICP::ComputeANN(kfA.pc_, cuPcA, cuNA, kfB.pc_, cuPcB, cuNB, 
-              assoc_ba, cuAssoc_ba, T_ab, icpLoopCloseIter0, 
-              icpLoopCloseAngleThr_deg, icpLoopCloseDistThr, 
+            icpKd.SetTarget(kfB.pc_, kfB.n_, icpDownSample);
+            icpKd.Compute(kfA.pc_, kfA.n_, T_ab, icpLoopCloseIter0,
+              icpLoopCloseAngleThr_deg, icpLoopCloseDistThr,
               icpDownSample, gui.verbose, err, count);
             count *= icpDownSample;
           } else {
@@ -559,7 +553,13 @@ int main( int argc, char* argv[] )
 //            kfSLAM.AddLoopClosure(ids.second, ids.first, T_ab.Inverse());
 //            loopClosures.emplace(std::make_pair(ids.first, ids.second), T_ab);
 
-            // update views
+            // update views; the error image before the alignment is
+            // only needed for display
+            float overlap0, rmse0;
+            cudaMemset(cuPhotoErrAfter.ptr_, 0, cuPhotoErrAfter.SizeBytes());
+            Overlap(kfA, kfB, rig, icpLoopCloseOverlapLvl, overlap0, rmse0,
+                nullptr, &cuPhotoErrAfter);
+            photoErrBefore.CopyFrom(cuPhotoErrAfter);
             viewDebugA.SetImage(photoErrBefore);
             viewDebugB.SetImage(photoErrAfter);
             viewDebugC.SetImage(kfA.pyrGrey_.GetImage(0));
@@ -572,26 +572,26 @@ int main( int argc, char* argv[] )
             std::cout << "optimizing graph" << std::endl;
             kfSLAM.Optimize(); 
             if (useOptimizedPoses) {
-              T_ac = kfSLAM.GetPose(idActive).Inverse()*kfs[idActive].T_wk_*T_ac;
+              T_ac = kfSLAM.GetPose(idActive).Inverse()*kfs.Pose(idActive)*T_ac;
               for (size_t i=0; i < kfs.size(); ++i) {
-                kfs[i].T_wk_ = kfSLAM.GetPose(i);
+                kfs.SetPose(i, kfSLAM.GetPose(i));
               }
             }
 
             if (computePhotometricError) {
+              std::vector<tdp::OverlapHypothesis> hyps;
               for (auto& it : kfSLAM.loopClosures_) {
-                tdp::KeyFrame& kfA = kfs[it.first];
-                tdp::KeyFrame& kfB = kfs[it.second];
-                float overlap, rmse;
-                TICK("Overlap");
-                //        cudaMemset(cuPhotoErrAfter.ptr_, 0, cuPhotoErrAfter.SizeBytes());
-                Overlap(kfA, kfB, rig, icpLoopCloseOverlapLvl, overlap, 
-                    rmse, nullptr, nullptr); //&cuPhotoErrAfter);
-                //        photoErrBefore.CopyFrom(cuPhotoErrAfter);
-                TOCK("Overlap");
-                std::cout << it.first << " to " << it.second << ":\tRMSE " << rmse
-                  << "\toverlap " << overlap << std::endl;
-                rmses[it] = rmse;
+                hyps.emplace_back(it.first, it.second,
+                    kfs.Pose(it.first).Inverse()*kfs.Pose(it.second));
+              }
+              TICK("Overlap");
+              tdp::OverlapCpu([&](size_t id) { return kfs.Get(id); }, rig,
+                  icpLoopCloseOverlapLvl, hyps);
+              TOCK("Overlap");
+              for (auto& hyp : hyps) {
+                std::cout << hyp.idA << " to " << hyp.idB << ":\tRMSE "
+                  << hyp.rmse << "\toverlap " << hyp.overlap << std::endl;
+                rmses[std::pair<int,int>(hyp.idA, hyp.idB)] = hyp.rmse;
               }
 
               auto mapComp = [](const std::pair<std::pair<int,int>,float>& a, 
@@ -601,8 +601,8 @@ int main( int argc, char* argv[] )
                 std::max_element(rmses.begin(), rmses.end(),
                     mapComp)->first;
 
-              viewDebugE.SetImage(kfs[idMax.first].pyrGrey_.GetImage(0));
-              viewDebugF.SetImage(kfs[idMax.second].pyrGrey_.GetImage(0));
+              viewDebugE.SetImage(kfs.Get(idMax.first)->pyrGrey_.GetImage(0));
+              viewDebugF.SetImage(kfs.Get(idMax.second)->pyrGrey_.GetImage(0));
             }
             return true;
           } else {
@@ -627,16 +627,42 @@ int main( int argc, char* argv[] )
 
   auto computeLoopClosures = [&]() {
     size_t I = loopClose.size()/10 +1;
-    for(size_t i=0; i < I; ++i) {
-      std::pair<int,int> ids(-1,-1);
-      if (loopClose.size() > 0) {
-        ids = loopClose.front();
-        loopClose.pop_front();
+    // gate the candidates by their relative pose, score the remaining
+    // ones in one batch and only attempt loop closures with enough
+    // overlap
+    std::vector<tdp::OverlapHypothesis> hyps;
+    for(size_t i=0; i < I && loopClose.size() > 0; ++i) {
+      std::pair<int,int> ids = loopClose.front();
+      loopClose.pop_front();
+      const tdp::SE3f T_wa = kfs.Pose(ids.first);
+      const tdp::SE3f T_wb = kfs.Pose(ids.second);
+      Eigen::Matrix<float,6,1> se3 = T_wa.Log(T_wb);
+      if ( se3.head<3>().norm()*180./M_PI >= loopCloseAngleThresh
+        || se3.tail<3>().norm()           >= loopCloseDistThresh) {
+        std::cout << " skipping " << ids.first << " -> " << ids.second
+          << ": " << se3.head<3>().norm()*180./M_PI << " "
+          << se3.tail<3>().norm()          << std::endl;
+        continue;
       }
-      if (ids.first < 0 && ids.second < 0) {
-        break;
+      hyps.emplace_back(ids.first, ids.second, T_wa.Inverse()*T_wb);
+    }
+    TICK("Overlap candidates");
+    tdp::OverlapCpu([&](size_t id) { return kfs.Get(id); }, rig,
+        icpLoopCloseOverlapLvl, hyps);
+    TOCK("Overlap candidates");
+    for (size_t i=0; i<hyps.size(); ++i) {
+      const tdp::OverlapHypothesis& hyp = hyps[i];
+      if (hyp.overlap <= icpLoopCloseOverlapThr && !useRansac) {
+        std::cout << "skipping " << hyp.idA << " -> " << hyp.idB
+          << " because overlap " << hyp.overlap << " is to small"
+          << std::endl;
+        continue;
       }
-      if (loopCloseKfs(ids.first, ids.second)) {
+      if (loopCloseKfs(hyp.idA, hyp.idB, hyp.overlap, hyp.rmse)) {
+        // the graph was optimized; the candidates not tried yet go back
+        // to the front of the queue to be scored at the new poses
+        for (size_t j=hyps.size(); j > i+1; --j)
+          loopClose.emplace_front(hyps[j-1].idA, hyps[j-1].idB);
         break;
       }
     }
@@ -659,7 +685,6 @@ int main( int argc, char* argv[] )
   tdp::ManagedDeviceImage<tdp::Vector3fda> cuNMmf(Nmmf,1);
   pangolin::GlBuffer vboNMmf(pangolin::GlArrayBuffer,Nmmf,GL_FLOAT,3);
 
-  kfs.reserve(1000);
   binaryKfs.reserve(1000);
 
   // Stream and display video
@@ -682,7 +707,7 @@ int main( int argc, char* argv[] )
     if ((runSlamFusion.GuiChanged() && runSlamFusion)
        || (gui.finished() && !runSlamFusion && loopClose.size() == 0)) {
       T_mos.clear();
-      T_mo = kfs[0].T_wk_;
+      T_mo = kfs.Pose(0);
       idActive = 0;
       gui.Seek(0);
       gui.finished_ = false;
@@ -699,8 +724,9 @@ int main( int argc, char* argv[] )
           Eigen::Vector2f ids = 
             0.5*(Eigen::Vector2f::Random()+Eigen::Vector2f::Ones());
           int32_t idKf = floor(ids(0)*kfs.size());
-          int32_t idPt = floor(ids(1)*kfs[idKf].pyrN_.GetImage(2).Area());
-          ni = kfs[idKf].T_wk_.rotation()*kfs[idKf].pyrN_.GetImage(2)[idPt];
+          std::shared_ptr<tdp::KeyFrame> kf = kfs.Get(idKf);
+          int32_t idPt = floor(ids(1)*kf->pyrN_.GetImage(2).Area());
+          ni = kfs.Pose(idKf).rotation()*kf->pyrN_.GetImage(2)[idPt];
         } while (!tdp::IsValidData(ni));
         nMmf[i] = ni;
       }
@@ -725,8 +751,9 @@ int main( int argc, char* argv[] )
           Eigen::Vector2f ids = 
             0.5*(Eigen::Vector2f::Random()+Eigen::Vector2f::Ones());
           int32_t idKf = floor(ids(0)*kfs.size());
-          int32_t idPt = floor(ids(1)*kfs[idKf].pyrPc_.GetImage(2).Area());
-          pi = T_wG.Inverse()*kfs[idKf].T_wk_*kfs[idKf].pyrPc_.GetImage(2)[idPt];
+          std::shared_ptr<tdp::KeyFrame> kf = kfs.Get(idKf);
+          int32_t idPt = floor(ids(1)*kf->pyrPc_.GetImage(2).Area());
+          pi = T_wG.Inverse()*kfs.Pose(idKf)*kf->pyrPc_.GetImage(2)[idPt];
         } while (!tdp::IsValidData(pi));
         grid0 = grid0.array().min(pi.array());
         gridE = gridE.array().max(pi.array());
@@ -769,9 +796,9 @@ int main( int argc, char* argv[] )
       for (size_t i=0; i<kfs.size(); ++i) {
         if (true || gui.verbose)
           std::cout << "add KF " << i << " to tsdf" << std::endl;
-        const auto& kfA = kfs[i];
-        const tdp::SE3f& T_mk = kfA.T_wk_;
-        cuD.CopyFrom(kfA.d_);
+        std::shared_ptr<tdp::KeyFrame> kfA = kfs.Get(i);
+        const tdp::SE3f T_mk = kfs.Pose(i);
+        cuD.CopyFrom(kfA->d_);
         TICK("Add To TSDF");
 //        AddToTSDF(cuTSDF, cuD, T_mk, camD, grid0, dGrid, tsdfMu, tsdfWMax); 
         rig.AddToTSDF(cuD, T_wG.Inverse()*T_mk, useRgbCamParasForDepth, 
@@ -819,7 +846,7 @@ int main( int argc, char* argv[] )
         //      float angMin = 1e9;
         float valMin = 1e9;
         for (int i=0; i<kfs.size(); ++i) {
-          Eigen::Matrix<float,6,1> se3 = kfs[i].T_wk_.Log(T_mo);
+          Eigen::Matrix<float,6,1> se3 = kfs.Pose(i).Log(T_mo);
           float dist = se3.tail<3>().norm();
           float ang = se3.head<3>().norm();
           //        if (ang < angMin && dist < distMin) {
@@ -832,14 +859,15 @@ int main( int argc, char* argv[] )
         }
         if (iMin != idActive) {
           std::cout << "switching to tracking against KF " << iMin << std::endl;
-          T_ac = kfs[iMin].T_wk_.Inverse()*kfs[idActive].T_wk_*T_ac;
+          T_ac = kfs.Pose(iMin).Inverse()*kfs.Pose(idActive)*T_ac;
           std::cout << T_ac << std::endl;
           idActive = iMin;
-          viewKf.SetImage(kfs[idActive].rgb_);
+          viewKf.SetImage(kfs.Get(idActive)->rgb_);
         } 
       }
 
-      tdp::KeyFrame& kf = kfs[idActive];
+      std::shared_ptr<tdp::KeyFrame> kfPtr = kfs.Get(idActive);
+      tdp::KeyFrame& kf = *kfPtr;
       pcs_m.CopyFrom(kf.pyrPc_);
       ns_m.CopyFrom(kf.pyrN_);
       // TODO:
@@ -879,7 +907,7 @@ int main( int argc, char* argv[] )
 //            icpDistThr, gui.verbose); 
       }
       TOCK("ICP");
-      T_mo = kfs[idActive].T_wk_*T_ac;
+      T_mo = kfs.Pose(idActive)*T_ac;
       T_mos.push_back(T_mo);
 //      Sigma_ac += dSigma_ac;
       Sigma_ac = dSigma_ac;
@@ -890,7 +918,7 @@ int main( int argc, char* argv[] )
       Eigen::Matrix<float,6,1> se3 = Eigen::Matrix<float,6,1>::Zero();
       float dH = 0.;
       if (kfs.size() > 0) {
-        se3 = kfs[idActive].T_wk_.Log(T_mo);
+        se3 = kfs.Pose(idActive).Log(T_mo);
         float logH = ((Sigma_ac.eigenvalues()).array().log().sum()).real();
         // capture the entropy of the transformation right after new KF
         if (kfs.size() > numKfsPrev) {
@@ -919,20 +947,23 @@ int main( int argc, char* argv[] )
 
 //        tdp::ConstructPyramidFromImage(cuGrey, pyrGrey);
         numKfsPrev = kfs.size();
-        kfs.emplace_back(pcs_c, ns_c, cuPyrGrey_c, cuPyrGradGrey_c,
-            rgb, cuD, T_mo);
+        d.CopyFrom(cuD);
+        kfGrey.CopyFrom(cuPyrGrey_c.GetImage(0));
+        kfs.Add(d, kfGrey, rgb, T_mo);
         
         tdp::Convert(cuPyrGrey_c, cuPyrGreyB_c, 255., 0.);
         binaryKfs.emplace_back(cuPyrGreyB_c,pcs_c);
         binaryKfs.back().Extract(kfs.size()-1, fastLvl, fastB,
             kappaHarris, harrisThr);
+        // only the features are needed for matching
+        binaryKfs.back().ReleaseImages();
 
         for (int i=kfs.size()-3; 
             i > std::max(-1,(int)kfs.size()-maxLoopClosures-1); --i) {
           loopClose.emplace_front(kfs.size()-1,i);
         }
 
-        T_mo = kfs[kfs.size()-1].T_wk_;
+        T_mo = kfs.Pose(kfs.size()-1);
 
         if (kfs.size() == 1) {
           std::cout << "first KF -> adding origin" << std::endl;
@@ -964,15 +995,15 @@ int main( int argc, char* argv[] )
           << ";  "<< loopClose.back().first << ", " << loopClose.back().second
           << std::endl;
 
-        viewKf.SetImage(kfs[idActive].rgb_);
+        viewKf.SetImage(kfs.Get(idActive)->rgb_);
 
         if (saveKfs) {
           float overlap = 0.;
           if (idActive > 0) {
-            const auto& kfA = kfs[idActive-1];
-            const auto& kfB = kfs[idActive];
+            std::shared_ptr<tdp::KeyFrame> kfA = kfs.Get(idActive-1);
+            std::shared_ptr<tdp::KeyFrame> kfB = kfs.Get(idActive);
             float rmse = 0.;
-            tdp::Overlap(kfA, kfB, rig, 0, overlap, rmse, &T_ac);
+            tdp::Overlap(*kfA, *kfB, rig, 0, overlap, rmse, &T_ac);
           }
 
           tdp::ManagedHostImage<tdp::Vector3fda> pc(wc, hc);
@@ -1037,12 +1068,12 @@ int main( int argc, char* argv[] )
       pangolin::glDrawAlignedBox(box);
       pangolin::glUnsetFrameOfReference();
 
-      pangolin::glDrawAxis(kfs[idActive].T_wk_.matrix(),0.08f);
+      pangolin::glDrawAxis(kfs.Pose(idActive).matrix(),0.08f);
       pangolin::glDrawAxis(T_mo.matrix(), 0.05f);
       glColor4f(1.,1.,0.,0.6);
       glDrawPoses(T_mos,-1);
       for (size_t i=0; i<kfs.size(); ++i) {
-        tdp::SE3f& T_wk = kfs[i].T_wk_;
+        const tdp::SE3f T_wk = kfs.Pose(i);
         pangolin::glDrawAxis(T_wk.matrix(), 0.03f);
       }
       for (size_t i=0; i<kfSLAM.size(); ++i) {
@@ -1064,8 +1095,8 @@ int main( int argc, char* argv[] )
       if (!useOptimizedPoses) {
         glColor4f(1.,0.3,0.3,0.6);
         for (auto& it : kfSLAM.loopClosures_) {
-          tdp::SE3f& T_wk_A = kfs[it.first].T_wk_;
-          tdp::SE3f& T_wk_B = kfs[it.second].T_wk_;
+          const tdp::SE3f T_wk_A = kfs.Pose(it.first);
+          const tdp::SE3f T_wk_B = kfs.Pose(it.second);
           tdp::glDrawLine(T_wk_A.translation(), T_wk_B.translation());
         }
       }
@@ -1091,11 +1122,12 @@ int main( int argc, char* argv[] )
       }
       // render model and observed point cloud
       if (showPcModel && kfs.size() > 0) {
-        tdp::KeyFrame& kf = kfs[idActive];
+        std::shared_ptr<tdp::KeyFrame> kfPtr = kfs.Get(idActive);
+        tdp::KeyFrame& kf = *kfPtr;
         pcs_m.CopyFrom(kf.pyrPc_);
         ns_m.CopyFrom(kf.pyrN_);
 
-        pangolin::glSetFrameOfReference(kfs[idActive].T_wk_.matrix());
+        pangolin::glSetFrameOfReference(kfs.Pose(idActive).matrix());
         {
           pangolin::CudaScopedMappedPtr cuPcbufp(cuPcbuf);
           cudaMemset(*cuPcbufp,0,hc*wc*sizeof(tdp::Vector3fda));
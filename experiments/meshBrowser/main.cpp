@@ -30,6 +30,7 @@
 #include <pangolin/utils/timer.h>
 
 #include <tdp/io/tinyply.h>
+#include <tdp/io/ply_cache.h>
 #include <tdp/preproc/curvature.h>
 #include <tdp/gl/shaders.h>
 #include <tdp/gl/matcap.h>
@@ -103,26 +104,37 @@ int main( int argc, char* argv[] )
     container.AddDisplay(view);
   }
 
-//  LoadPointCloud( const std::string& path,
-//        ManagedHostImage<Vector3fda>& verts);
-
-
-  tdp::ManagedHostImage<tdp::Vector3fda> verts;
-  tdp::ManagedHostImage<tdp::Vector3fda> ns;
   int sliderPrev = -W*H;
   pangolin::Var<int> slider("ui.slide", 0, 0, files.size()-W*H);
   pangolin::Var<int> matcapId("ui.matcap", 4, 0, 10);
+  pangolin::Var<int> numAhead("ui.# prefetch", 2*W*H, 0, 10*W*H);
 
   pangolin::RegisterKeyPressCallback('l', [&](){
-      slider = std::min((int)(files.size())-1,slider+1);
+      slider = std::min((int)(files.size()-W*H),slider+1);
   });
   pangolin::RegisterKeyPressCallback('h', [&](){
       slider = std::max(0,slider-1);
   });
 
-  std::vector<pangolin::GlBuffer*> vbos(W*H, nullptr);
-  std::vector<pangolin::GlBuffer*> nbos(W*H, nullptr);
-
+  // PLY decoding happens on loader threads ahead of the slider; only the
+  // GL upload is done here on the render thread.
+  tdp::PlyCache cache(files, 2048ul*1024*1024, 2);
+  // GL buffers of the currently visible files keyed by file id
+  std::map<size_t, std::pair<pangolin::GlBuffer*,pangolin::GlBuffer*>> bos;
+
+  auto isVisible = [&](size_t fileId) {
+    return (size_t)slider <= fileId && fileId < (size_t)slider+W*H
+      && fileId < files.size();
+  };
+  auto upload = [&](size_t fileId, const tdp::PlyAsset& asset) {
+    pangolin::GlBuffer* vbo = new pangolin::GlBuffer(pangolin::GlArrayBuffer,
+        asset.pc.w_,  GL_FLOAT, 3, GL_DYNAMIC_DRAW);
+    vbo->Upload(asset.pc.ptr_, asset.pc.SizeBytes(), 0);
+    pangolin::GlBuffer* nbo = new pangolin::GlBuffer(pangolin::GlArrayBuffer,
+        asset.n.w_,  GL_FLOAT, 3, GL_DYNAMIC_DRAW);
+    nbo->Upload(asset.n.ptr_, asset.n.SizeBytes(), 0);
+    bos[fileId] = std::make_pair(vbo, nbo);
+  };
 
   int frame = 0;
   // Stream and display video
@@ -132,50 +144,37 @@ int main( int argc, char* argv[] )
     glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
     glColor3f(1.0f, 1.0f, 1.0f);
 
-    if (slider.GuiChanged() || slider != sliderPrev || frame==0) {
-      int i0=0;
-      int iE=W*H-1;
-      int iInc=1;
-      if (slider < sliderPrev) {
-        iE = -1;
-        i0 = W*H-1;
-        iInc=-1;
-      }
-      std::cout << "---- reloading ----" << std::endl;
-      for (int i=i0; i!=iE; i+=iInc) {
-        int j = -sliderPrev+slider+i;
-        if (0 <= j && j < W*H) {
-          std::cout << "reusing loaded one "<< j << " -> " << i << std::endl;
-          vbos[i] = vbos[j];
-          nbos[i] = nbos[j];
-          if (i!=j) {
-            nbos[j] = nullptr;
-            vbos[j] = nullptr;
-          }
+    if (slider.GuiChanged() || numAhead.GuiChanged() 
+        || slider != sliderPrev || frame==0) {
+      cache.Schedule(slider, W*H, slider >= sliderPrev ? 1 : -1, numAhead);
+      for (auto it = bos.begin(); it != bos.end(); ) {
+        if (!isVisible(it->first)) {
+          delete it->second.first;
+          delete it->second.second;
+          it = bos.erase(it);
+        } else {
+          ++it;
         }
       }
-      pangolin::GlBuffer* vbo;
-      pangolin::GlBuffer* nbo;
-      for (int i=0; i<W*H; ++i) {
-        std::cout << files[slider+i] << std::endl;
-        int j = -sliderPrev+slider+i;
-        if (j < 0 || j >= W*H) {
-//          std::cout << "loading " << files[slider+i] << " for " << i << std::endl;
-          tdp::LoadPointCloud(files[slider+i], verts, ns);
-          vbo = new pangolin::GlBuffer(pangolin::GlArrayBuffer,
-              verts.w_,  GL_FLOAT, 3, GL_DYNAMIC_DRAW);
-          vbo->Upload(verts.ptr_, verts.SizeBytes(), 0);
-          nbo = new pangolin::GlBuffer(pangolin::GlArrayBuffer,
-              ns.w_,  GL_FLOAT, 3, GL_DYNAMIC_DRAW);
-          nbo->Upload(ns.ptr_, ns.SizeBytes(), 0);
-          if (vbos[i]) delete vbos[i];
-          if (nbos[i]) delete nbos[i];
-          vbos[i] = vbo;
-          nbos[i] = nbo;
-        }
+      for (size_t i=0; i<W*H; ++i) {
+        size_t fileId = slider+i;
+        if (!isVisible(fileId) || bos.count(fileId)) 
+          continue;
+        std::shared_ptr<tdp::PlyAsset> asset = cache.Get(fileId);
+        if (asset) 
+          upload(fileId, *asset);
       }
       sliderPrev = slider;
     }
+    // upload visible files that finished decoding in the meantime
+    size_t fileId;
+    std::shared_ptr<tdp::PlyAsset> asset;
+    while (cache.PopLoaded(fileId, asset)) {
+      if (isVisible(fileId) && !bos.count(fileId)) {
+        std::cout << "uploading " << files[fileId] << std::endl;
+        upload(fileId, *asset);
+      }
+    }
 
     // Draw 3D stuff
     glEnable(GL_DEPTH_TEST);
@@ -184,7 +183,10 @@ int main( int argc, char* argv[] )
     for (size_t i=0; i<W*H; ++i) {
       pangolin::Display(viewNames[i]).Activate(s_cam);
       pangolin::glDrawAxis(0.1);
-      if (vbos[i] && nbos[i]) {
+      auto it = bos.find(slider+i);
+      if (it != bos.end()) {
+        pangolin::GlBuffer* vbo = it->second.first;
+        pangolin::GlBuffer* nbo = it->second.second;
         auto& shader = tdp::Shaders::Instance()->matcapShader_;
         shader.Bind();
         shader.SetUniform("P",P);
@@ -192,21 +194,21 @@ int main( int argc, char* argv[] )
         glEnable(GL_TEXTURE_2D);
         tdp::Matcap::Instance()->Bind(matcapId);
         shader.SetUniform("matcap",0);
-        nbos[i]->Bind();
+        nbo->Bind();
         glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0); 
-        vbos[i]->Bind();
+        vbo->Bind();
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0); 
         glEnableVertexAttribArray(0);
         glEnableVertexAttribArray(1);
         glPointSize(1.);
-        glDrawArrays(GL_POINTS, 0, vbos[i]->num_elements);
+        glDrawArrays(GL_POINTS, 0, vbo->num_elements);
         tdp::Matcap::Instance()->Unbind();
         glDisable(GL_TEXTURE_2D);
         tdp::Shaders::Instance()->matcapShader_.Unbind();
         glDisableVertexAttribArray(1);
-        nbos[i]->Unbind();
+        nbo->Unbind();
         glDisableVertexAttribArray(0);
-        vbos[i]->Unbind();
+        vbo->Unbind();
         shader.Unbind();
       }
     }
@@ -218,6 +220,10 @@ int main( int argc, char* argv[] )
     pangolin::FinishFrame();
     ++frame;
   }
+  for (auto& bo : bos) {
+    delete bo.second.first;
+    delete bo.second.second;
+  }
   return 0;
 }
 
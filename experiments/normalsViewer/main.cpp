@@ -225,6 +225,8 @@ int main( int argc, char* argv[] )
 
   pangolin::Var<bool> runRtmf("ui.rtmf", false,true);
   pangolin::Var<float> tauR("ui.tau R", 10., 1., 100);
+  pangolin::Var<bool> rtmfCpu("ui.rtmf on CPU", false,true);
+  pangolin::Var<int> rtmfMaxSamples("ui.rtmf max samples", 20000, 0, 100000);
 
   pangolin::Var<float> gradNormThr("ui.grad norm thr", 6, 0, 10);
 
@@ -432,7 +434,12 @@ int main( int argc, char* argv[] )
       }
       if (runRtmf) {
         TICK("Compute RTMF");
-        rtmf.Compute(cuN, maxIt, verbose);
+        if (rtmfCpu) {
+          n.CopyFrom(cuN);
+          rtmf.ComputeCpu(n, maxIt, verbose, rtmfMaxSamples);
+        } else {
+          rtmf.Compute(cuN, maxIt, verbose);
+        }
         tdp::SO3f R_wc(rtmf.Rs_[0]);
         tdp::TransformPc(R_wc.Inverse(),cuN);
         TOCK("Compute RTMF");
@@ -1,6 +1,7 @@
 /* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
  * under the MIT license. See the license file LICENSE.
  */
+#include <atomic>
 #include <thread>
 #include <pangolin/pangolin.h>
 #include <pangolin/video/video_record_repeat.h>
@@ -22,10 +23,12 @@
 #include <tdp/data/pyramid.h>
 #include <tdp/data/volume.h>
 #include <tdp/data/circular_buffer.h>
+#include <tdp/data/published_cursor.h>
 #include <tdp/gl/gl_draw.h>
 #include <tdp/gui/gui_base.hpp>
 #include <tdp/gui/quickView.h>
 #include <tdp/icp/photoSO3.h>
+#include <tdp/icp/sparse_surfel_icp.h>
 #include <tdp/manifold/SE3.h>
 #include <tdp/nvidia/helper_cuda.h>
 #include <tdp/preproc/depth.h>
@@ -38,6 +41,7 @@
 #include <tdp/preproc/grad.h>
 #include <tdp/preproc/grey.h>
 #include <tdp/preproc/mask.h>
+#include <tdp/preproc/mask_sampler.h>
 #include <tdp/camera/ray.h>
 #include <tdp/preproc/curvature.h>
 #include <tdp/geometry/cosy.h>
@@ -52,11 +56,14 @@
 #include <tdp/preproc/blur.h>
 #include <tdp/gl/render.h>
 #include <tdp/gl/labels.h>
+#include <tdp/gl/upload.h>
 #include <tdp/preproc/convert.h>
 #include <tdp/preproc/plane.h>
 #include <tdp/features/lsh.h>
 #include <tdp/utils/timer.hpp>
 #include <tdp/camera/projective_labels.h>
+#include <tdp/camera/projective_raster.h>
+#include <tdp/slam/surfel_map.h>
 #include <tdp/ransac/ransac.h>
 #include <tdp/utils/file.h>
 #include <tdp/io/tinyply.h>
@@ -65,6 +72,8 @@
 #include <tdp/sampling/vmf.hpp>
 #include <tdp/sampling/vmfPrior.hpp>
 #include <tdp/sampling/normal.hpp>
+#include <tdp/sampling/dpvmf_gibbs.hpp>
+#include <tdp/stats/label_sufficient_stats.h>
 
 //#include "planeHelpers.h"
 //#include "icpHelper.h"
@@ -83,73 +92,6 @@ namespace tdp {
 typedef Eigen::Matrix<float,  zKTrac,1,Eigen::DontAlign> VectorZfda;
 typedef Eigen::Matrix<uint16_t,zKTrac,1,Eigen::DontAlign> VectorZuda;
 
-void AccumulateGaussianSS(
-    const tdp::Vector3fda& x,
-    tdp::Vector3fda& xSum,
-    tdp::Matrix3fda& xOuter,
-    float& xCount
-    ) {
-  xSum += x; 
-  xOuter += x*x.transpose(); 
-  xCount ++;
-}
-
-void RunningAvgGaussianSS(
-    const tdp::Vector3fda& x,
-    float xCountMax,
-    tdp::Vector3fda& xSum,
-    tdp::Matrix3fda& xOuter,
-    float& xCount
-    ) {
-  xSum = (xSum*xCount + x)/(xCount+1); 
-  xOuter = (xOuter*xCount + x*x.transpose())/(xCount+1);
-  xCount = std::min(xCountMax, xCount+1);
-}
-
-void ComputeSampleCov(
-    const tdp::Vector3fda& xSum,
-    const tdp::Matrix3fda& xOuter,
-    const float xCount,
-    tdp::Matrix3fda& cov
-    ) {
-  cov = (xOuter - xSum*xSum.transpose()/xCount)/xCount;
-}
-
-void ComputeSampleCovFromRunAvg(
-    const tdp::Vector3fda& xMean,
-    const tdp::Matrix3fda& xMeanOuter,
-    tdp::Matrix3fda& cov
-    ) {
-  cov = xMeanOuter - xMean*xMean.transpose();
-}
-
-void ComputeSampleMean(
-    const tdp::Vector3fda& xSum,
-    const float xCount,
-    tdp::Vector3fda& mean
-    ) {
-  mean = xSum/xCount;
-}
-
-void AccumulatevMFSS(
-    const tdp::Vector3fda& x,
-    tdp::Vector3fda& xSum,
-    uint32_t& xCount
-    ) {
-  xSum += x;
-  xCount ++;
-}
-
-void RunningAvgvMFSS(
-    const tdp::Vector3fda& x,
-    float xCountMax,
-    tdp::Vector3fda& xSum,
-    float& xCount
-    ) {
-  xSum = (xSum*xCount + x)/(xCount+1); 
-  xCount = std::min(xCountMax, xCount+1);
-}
-
 void InsertLabelML(VectorZuda& ids, VectorZfda& counts, uint16_t id,
     float countThr,
     uint16_t& idMax, float& countMax) {
@@ -295,18 +237,13 @@ void ExtractPlanes(
     const Image<Vector6dda>& outerRaysInt, 
     Image<Vector4fda>& dpc, 
     ManagedHostCircularBuffer<Plane>& pl_w,
-    ManagedHostCircularBuffer<Vector3fda>& pc_w,
+    SurfelColumns& surfels,
     ManagedHostCircularBuffer<Matrix3fda>& pc0Info_w,
     ManagedHostCircularBuffer<Matrix3fda>& pc0Cov_w,
-    ManagedHostCircularBuffer<Vector3bda>& rgb_w,
-    ManagedHostCircularBuffer<Vector3fda>& n_w,
-    ManagedHostCircularBuffer<Vector3fda>& grad_w,
     ManagedHostCircularBuffer<float>& ImSum,
     ManagedHostCircularBuffer<float>& ImSqSum,
     ManagedHostCircularBuffer<float>& ImCount,
     ManagedHostCircularBuffer<float>& ImVar,
-    ManagedHostCircularBuffer<float>& rs,
-    ManagedHostCircularBuffer<uint16_t>& ts,
     int normalMethod,
     bool useTrackingUncertainty
     ) {
@@ -343,7 +280,6 @@ void ExtractPlanes(
 //            p, n, T_wc, cam, Wscaled, i%mask.w_, i/mask.w_, feat);
         pl.p_ = T_wc*p;
         pl.n_ = T_wc.rotation()*n;
-        pl.p0_ = pl.p_;
         pl.curvature_ = curv;
         pl.rgb_ = rgb[i];
         pl.gradGrey_ = gradGrey[i];
@@ -391,12 +327,7 @@ void ExtractPlanes(
         pc0Cov_w.Insert(SigmaO);
         pc0Info_w.Insert(SigmaO.inverse());
         pl_w.Insert(pl);
-        pc_w.Insert(pl.p_);
-        n_w.Insert(pl.n_);
-        grad_w.Insert(pl.grad_);
-        rgb_w.Insert(pl.rgb_);
-        rs.Insert(pl.r_);
-        ts.Insert(pl.lastFrame_);
+        InsertColumns(pl, surfels);
 
         ImSum.Insert(greyFl[i]);
         ImSqSum.Insert(greyFl[i]*greyFl[i]);
@@ -544,282 +475,6 @@ bool EnsureNormal(
 //}
 
 
-bool AccumulateP2Pl(const Plane& pl, 
-    tdp::SE3f& T_wc, 
-    tdp::SE3f& T_cw, 
-    const Vector3fda& pc_ci,
-    const Vector3fda& n_ci,
-    float p2plThr, 
-    float dotThr,
-    Eigen::Matrix<float,6,6>& A,
-    Eigen::Matrix<float,6,1>& Ai,
-    Eigen::Matrix<float,6,1>& b,
-    float& err
-    ) {
-  const tdp::Vector3fda& n_w =  pl.n_;
-  const tdp::Vector3fda& pc_w = pl.p_;
-  Eigen::Vector3f n_w_in_c = T_cw.rotation()*n_w;
-  if (n_w_in_c.dot(n_ci) > dotThr) {
-    float p2pl = n_w.dot(pc_w - T_wc*pc_ci);
-    if (fabs(p2pl) < p2plThr) {
-      Ai.topRows<3>() = pc_ci.cross(n_w_in_c); 
-      Ai.bottomRows<3>() = n_w_in_c; 
-      A += Ai * Ai.transpose();
-      b += Ai * p2pl;
-      err += p2pl;
-      return true;
-    }
-  }
-  return false;
-}
-
-/// uses texture as well
-bool AccumulateP2Pl3DGrad(const Plane& pl, 
-    tdp::SE3f& T_wc, 
-    tdp::SE3f& T_cw, 
-    CameraT& cam,
-    const Vector3fda& pc_ci,
-    const Vector3fda& n_ci,
-    float grey_ci,
-    const Vector2fda& gradGrey_ci,
-    float u, float v,
-    float p2plThr, 
-    float dotThr,
-    float lambda,
-    Eigen::Matrix<float,6,6>& A,
-    Eigen::Matrix<float,6,1>& Ai,
-    Eigen::Matrix<float,6,1>& b,
-    float& err
-    ) {
-  const tdp::Vector3fda& n_w =  pl.n_;
-  const tdp::Vector3fda& pc_w = pl.p_;
-  tdp::Vector3fda pc_c_in_w = T_wc*pc_ci;
-  float bi=0;
-    Eigen::Vector3f n_w_in_c = T_cw.rotation()*n_w;
-    if (n_w_in_c.dot(n_ci) > dotThr) {
-      float p2pl = n_w.dot(pc_w - pc_c_in_w);
-      if (fabs(p2pl) < p2plThr) {
-        // p2pl
-        Ai.topRows<3>() = pc_ci.cross(n_w_in_c); 
-        Ai.bottomRows<3>() = n_w_in_c; 
-//        Ai.bottomRows<3>() = n_w; 
-        bi = p2pl;
-        A += Ai * Ai.transpose();
-        b += Ai * bi;
-        err += bi;
-//        std::cout << " p2pl " << bi << " " << Ai.transpose() << std::endl;
-        tdp::Rayfda ray(tdp::Vector3fda::Zero(),
-            cam.Unproject(u + gradGrey_ci(0),v + gradGrey_ci(1),1.));
-        tdp::Vector3fda grad3d = ray.IntersectPlane(pc_ci,n_ci)-pc_ci;
-        // texture inverse transform verified Jse3 
-        Eigen::Matrix<float,3,6> Jse3;
-        Jse3 << SO3mat<float>::invVee(T_cw.rotation()*(pc_w-T_wc.translation())), 
-             -Eigen::Matrix3f::Identity();
-        Ai = Jse3.transpose() * grad3d;
-        bi = - grey_ci + pl.grey_;
-        A += lambda*(Ai * Ai.transpose());
-        b += lambda*(Ai * bi);
-//        std::cout << " intensity " << bi << " " << Ai.transpose() << std::endl;
-//        std::cout << Jse3 << std::endl;
-//        std::cout << Jpi << std::endl;
-//        std::cout << gradGrey_ci << std::endl;
-        err += lambda*bi;
-        // accumulate
-        return true;
-      }
-  }
-  return false;
-}
-
-
-/// uses texture as well
-bool AccumulateP2PlIntensity(const Plane& pl, 
-    tdp::SE3f& T_wc, 
-    tdp::SE3f& T_cw, 
-    CameraT& cam,
-    const Vector3fda& pc_ci,
-    const Vector3fda& n_ci,
-    float grey_ci,
-    const Vector2fda& gradGrey_ci,
-    float p2plThr, 
-    float dotThr,
-    float sqrtInfoP2Pl,
-    float sqrtInfoIm,
-    Eigen::Matrix<float,6,6>& Ap2pl,
-    Eigen::Matrix<float,6,1>& bp2pl,
-    Eigen::Matrix<float,6,6>& Aphoto,
-    Eigen::Matrix<float,6,1>& bphoto,
-    Eigen::Matrix<float,6,1>& Ai,
-    float& err
-    ) {
-  const tdp::Vector3fda& n_w =  pl.n_;
-  const tdp::Vector3fda& pc_w = pl.p_;
-  tdp::Vector3fda pc_c_in_w = T_wc*pc_ci;
-  float bi=0;
-    Eigen::Vector3f n_w_in_c = T_cw.rotation()*n_w;
-    if (n_w_in_c.dot(n_ci) > dotThr) {
-      float p2pl = n_w.dot(pc_w - pc_c_in_w);
-      if (fabs(p2pl) < p2plThr) {
-        // p2pl
-        Ai.topRows<3>() = pc_ci.cross(n_w_in_c); 
-        Ai.bottomRows<3>() = n_w_in_c; 
-//        Ai.bottomRows<3>() = n_w; 
-        bi = p2pl;
-        Ap2pl +=   sqrtInfoP2Pl*(Ai * Ai.transpose());
-        bp2pl +=   sqrtInfoP2Pl*(Ai * bi);
-        err += sqrtInfoP2Pl*(bi);
-//        std::cout << " p2pl " << bi << " " << Ai.transpose() << std::endl;
-        // texture inverse transform verified Jse3 
-        Eigen::Matrix<float,2,3> Jpi = cam.Jproject(T_cw*pc_w);
-        Eigen::Matrix<float,3,6> Jse3;
-        Jse3 << SO3mat<float>::invVee(T_cw.rotation()*(pc_w-T_wc.translation())), 
-             -Eigen::Matrix3f::Identity();
-        Ai = Jse3.transpose() * Jpi.transpose() * gradGrey_ci;
-        bi = - grey_ci + pl.grey_;
-        Aphoto += sqrtInfoIm*(Ai * Ai.transpose());
-        bphoto += sqrtInfoIm*(Ai * bi);
-
-//        std::cout << " intensity " << bi << " " << Ai.transpose() << std::endl;
-//        std::cout << Jse3 << std::endl;
-//        std::cout << Jpi << std::endl;
-//        std::cout << gradGrey_ci << std::endl;
-        err += sqrtInfoIm*bi;
-        // accumulate
-        return true;
-      }
-  }
-  return false;
-}
-
-
-/// uses texture and normal as well
-/// the use of the image gradient information was wrong here since this
-/// derivation was using the fact that we know the pose between
-/// observing the gradiant and the current image. This is not given
-/// since we only know pose to world;
-//bool AccumulateP2Pl(const Plane& pl, 
-//    tdp::SE3f& T_wc, 
-//    tdp::SE3f& T_cw, 
-//    CameraT& cam,
-//    const Vector3fda& pc_ci,
-//    const Vector3fda& n_ci,
-//    float grey_ci,
-//    float distThr, 
-//    float p2plThr, 
-//    float dotThr,
-//    float gamma,
-//    float lambda,
-//    Eigen::Matrix<float,6,6>& A,
-//    Eigen::Matrix<float,6,1>& Ai,
-//    Eigen::Matrix<float,6,1>& b,
-//    float& err
-//    ) {
-//  const tdp::Vector3fda& n_w =  pl.n_;
-//  const tdp::Vector3fda& pc_w = pl.p_;
-//  tdp::Vector3fda pc_c_in_w = T_wc*pc_ci;
-//  float bi=0;
-//  float dist = (pc_w - pc_c_in_w).norm();
-//  if (dist < distThr) {
-//    Eigen::Vector3f n_w_in_c = T_cw.rotation()*n_w;
-//    if (n_w_in_c.dot(n_ci) > dotThr) {
-//      float p2pl = n_w.dot(pc_w - pc_c_in_w);
-//      if (fabs(p2pl) < p2plThr) {
-//        // p2pl
-//        Ai.topRows<3>() = pc_ci.cross(n_w_in_c); 
-//        Ai.bottomRows<3>() = n_w_in_c; 
-//        bi = p2pl;
-//        A += Ai * Ai.transpose();
-//        b += Ai * bi;
-//        err += bi;
-////        std::cout << "--" << std::endl;
-////        std::cout << Ai.transpose() << "; " << bi << std::endl;
-//        // normal old
-////        Ai.topRows<3>() = -n_ci.cross(n_w_in_c); 
-////        Ai.bottomRows<3>().fill(0.); 
-////        bi = n_ci.dot(n_w_in_c) - 1.;
-////        A += gamma*(Ai * Ai.transpose());
-////        b += gamma*(Ai * bi);
-////        err += gamma*bi;
-//        // normal new
-//        Eigen::Matrix3f Asi = -T_wc.rotation().matrix()*tdp::SO3fda::invVee(n_ci);
-//        Eigen::Vector3f bsi = -(T_wc.rotation()*n_ci - n_w);
-//        A.topLeftCorner<3,3>() += gamma*(Asi*Asi.transpose());
-//        b.topRows<3>() += gamma*(Ai.transpose() * bi);
-//        err += gamma*bi.norm();
-////        std::cout << Ai.transpose() << "; " << bi << std::endl;
-//        // texture
-//        Eigen::Matrix<float,2,3> Jpi = cam.Jproject(pc_c_in_w);
-//        Eigen::Matrix<float,3,6> Jse3;
-//        Jse3.leftColumns<3>() = -(T_wc.rotation().matrix()*SO3mat<float>::invVee(pc_ci));
-//        Jse3.rightColumns<3>() = Eigen::Matrix3f::Identity();
-////        Jse3 << -(T_wc.rotation().matrix()*SO3mat<float>::invVee(pc_ci)), 
-////             Eigen::Matrix3f::Identity();
-//        // TODO: should not be using the model image gradient here!!
-//        Ai = Jse3.transpose() * Jpi.transpose() * pl.gradGrey_;
-//        bi = grey_ci - pl.grey_;
-//        A += lambda*(Ai * Ai.transpose());
-//        b += lambda*(Ai * bi);
-//        err += lambda*bi;
-////        std::cout << Ai.transpose() << "; " << bi << std::endl;
-//        // accumulate
-//        return true;
-//      }
-//    }
-//  }
-//  return false;
-//}
-//
-/// uses normals and p2pl
-bool AccumulateP2PlNormal(const Plane& pl, 
-    const tdp::Vector3fda& n_w,
-    tdp::SE3f& T_wc, 
-    tdp::SE3f& T_cw, 
-    CameraT& cam,
-    const Vector3fda& pc_ci,
-    const Vector3fda& n_ci,
-    float p2plThr, 
-    float dotThr,
-    float gamma,
-    Eigen::Matrix<float,6,6>& A,
-    Eigen::Matrix<float,6,1>& Ai,
-    Eigen::Matrix<float,6,1>& b,
-    float& err
-    ) {
-  const tdp::Vector3fda& pc_w = pl.p_;
-  float bi=0;
-    Eigen::Vector3f n_w_in_c = T_cw.rotation()*n_w;
-    if (n_w_in_c.dot(n_ci) > dotThr) {
-      float p2pl = n_w.dot(pc_w - T_wc*pc_ci);
-      if (fabs(p2pl) < p2plThr) {
-        // p2pl
-        Ai.topRows<3>() = pc_ci.cross(n_w_in_c); 
-        Ai.bottomRows<3>() = n_w_in_c; 
-        bi = p2pl;
-        A += Ai * Ai.transpose();
-        b += Ai * bi;
-        err += bi;
-//        std::cout << "--" << std::endl;
-//        std::cout << Ai.transpose() << "; " << bi << std::endl;
-        // normal old
-        Ai.topRows<3>() = -n_ci.cross(n_w_in_c); 
-        Ai.bottomRows<3>().fill(0.); 
-        bi = n_ci.dot(n_w_in_c) - 1.;
-        A += gamma*(Ai * Ai.transpose());
-        b += gamma*(Ai * bi);
-        err += gamma*bi;
-        // normal new
-//        Eigen::Matrix3f Asi = -T_wc.rotation().matrix()*tdp::SO3fda::invVee(n_ci);
-//        Eigen::Vector3f bsi = -(T_wc.rotation()*n_ci - n_w);
-//        A.topLeftCorner<3,3>() += gamma*(Asi*Asi.transpose());
-//        b.topRows<3>() += gamma*(Asi.transpose() * bsi);
-//        err += gamma*bsi.norm();
-        // accumulate
-        return true;
-      }
-  }
-  return false;
-}
-
 /// uses gradient only
 bool AccumulateIntDiff(const Plane& pl, 
     tdp::SE3f& T_cw, 
@@ -884,85 +539,6 @@ bool AccumulatePhotoSO3only(
   return true;
 }
 
-/// uses gradient and normal as well
-bool AccumulateP2PlIntensityNormals(const Plane& pl, 
-    const tdp::Vector3fda& n_w,
-    tdp::SE3f& T_wc, 
-    tdp::SE3f& T_cw, 
-    CameraT& cam,
-    const Vector3fda& pc_ci,
-    const Vector3fda& n_ci,
-    float grey_ci,
-    const Vector2fda& gradGrey_ci,
-    float p2plThr, 
-    float dotThr,
-    float gamma,
-    float lambda,
-    Eigen::Matrix<float,6,6>& A,
-    Eigen::Matrix<float,6,1>& Ai,
-    Eigen::Matrix<float,6,1>& b,
-    float& err
-    ) {
-  const tdp::Vector3fda& pc_w = pl.p_;
-  tdp::Vector3fda pc_c_in_w = T_wc*pc_ci;
-  float bi=0;
-    Eigen::Vector3f n_w_in_c = T_cw.rotation()*n_w;
-    if (n_w_in_c.dot(n_ci) > dotThr) {
-      float p2pl = n_w.dot(pc_w - pc_c_in_w);
-      if (fabs(p2pl) < p2plThr) {
-        // p2pl
-        Ai.topRows<3>() = pc_ci.cross(n_w_in_c); 
-        Ai.bottomRows<3>() = n_w_in_c; 
-        bi = p2pl;
-        A += Ai * Ai.transpose();
-        b += Ai * bi;
-        err += bi;
-//        std::cout << "--" << std::endl;
-//        std::cout << Ai.transpose() << "; " << bi << std::endl;
-        // normal old
-//        Ai.topRows<3>() = -n_ci.cross(n_w_in_c); 
-//        Ai.bottomRows<3>().fill(0.); 
-//        bi = n_ci.dot(n_w_in_c) - 1.;
-//        A += gamma*(Ai * Ai.transpose());
-//        b += gamma*(Ai * bi);
-//        err += gamma*bi;
-        // normal new
-        Eigen::Matrix3f Asi = -T_wc.rotation().matrix()*tdp::SO3fda::invVee(n_ci);
-        Eigen::Vector3f bsi = -(T_wc.rotation()*n_ci - n_w);
-        A.topLeftCorner<3,3>() += gamma*(Asi*Asi.transpose());
-        b.topRows<3>() += gamma*(Asi.transpose() * bsi);
-        err += gamma*bsi.norm();
-//        std::cout << Ai.transpose() << "; " << bi << std::endl;
-        // texture
-//        if (tdp::IsValidData(pl.grad_)) {
-//          Eigen::Matrix<float,3,6> Jse3;
-//          Jse3.leftCols<3>() = -(T_wc.rotation().matrix()*SO3mat<float>::invVee(pc_ci));
-//          Jse3.rightCols<3>() = Eigen::Matrix3f::Identity();
-//          Ai = Jse3.transpose() * pl.grad_;
-//          bi = grey_ci - pl.grey_;
-//          A += lambda*(Ai * Ai.transpose());
-//          b += lambda*(Ai * bi);
-//          err += lambda*bi;
-//        } else {
-//          std::cout << "gradient is nan " << std::endl;
-//        }
-        // texture inverse transform verified Jse3 
-        Eigen::Matrix<float,2,3> Jpi = cam.Jproject(T_cw*pc_w);
-        Eigen::Matrix<float,3,6> Jse3;
-        Jse3 << SO3mat<float>::invVee(T_cw.rotation()*(pc_w-T_wc.translation())), 
-             -Eigen::Matrix3f::Identity();
-        Ai = Jse3.transpose() * Jpi.transpose() * gradGrey_ci;
-        bi = -grey_ci + pl.grey_;
-        A += lambda*(Ai * Ai.transpose());
-        b += lambda*(Ai * bi);
-        err += lambda*bi;
-        // accumulate
-        return true;
-      }
-  }
-  return false;
-}
-
 // uses texture and projective term
 bool AccumulateP2PlProj(const Plane& pl, 
     tdp::SE3f& T_wc, 
@@ -1074,25 +650,6 @@ bool AccumulateRot(const Plane& pl,
   return false;
 }
 
-template<int D>
-bool CheckEntropyTermination(const Eigen::Matrix<float,D,D>& A,
-    float Hprev,
-    float HThr, float condEntropyThr, float negLogEvThr,
-    float& H, bool verbose) {
-
-  Eigen::SelfAdjointEigenSolver<Eigen::Matrix<float,D,D>> eig(A);
-  Eigen::Matrix<float,D,1> negLogEv = -eig.eigenvalues().real().array().log();
-  H = negLogEv.sum();
-  if ((H < HThr || Hprev - H < condEntropyThr) 
-      && (negLogEv.array() < negLogEvThr).all()) {
-    if (verbose)
-      std::cout <<  " H " << H << " cond H " << (Hprev-H) 
-        << " neg log evs: " << negLogEv.transpose() << std::endl;
-    return true;
-  }
-  return false;
-}
-
 template<int D>
 void AddToSortedIndexList(Eigen::Matrix<int32_t,D,1,Eigen::DontAlign>& ids, 
     Eigen::Matrix<float,D,1,Eigen::DontAlign>&
@@ -1490,6 +1047,8 @@ int main( int argc, char* argv[] )
 
   pangolin::Var<int> numMapPoints("ui.num Map",0,0,0);
   pangolin::Var<int> numPruned("ui.num Pruned",0,0,0);
+  pangolin::Var<int> numCarved("ui.num Carved",0,0,0);
+  pangolin::Var<int> numCompactions("ui.num Compactions",0,0,0);
   pangolin::Var<int> numProjected("ui.num Proj",0,0,0);
   pangolin::Var<int> numInl("ui.num Inl",0,0,0);
   pangolin::Var<int> idMapUpdate("ui.id Map",0,0,0);
@@ -1506,6 +1065,9 @@ int main( int argc, char* argv[] )
   pangolin::Var<float> pruneHThr("mapPanel.prune H Thr",-7.5,-20.,-0.);
   pangolin::Var<float> pruneNumObsThr("mapPanel.prune NumObsThr",10,3,30);
   pangolin::Var<int> survivalTime("mapPanel.survival Time",100,0,200);
+  pangolin::Var<bool> rayCarving("mapPanel.ray carve",true,true);
+  pangolin::Var<int> rayCarveStride("mapPanel.ray carve stride",8,1,32);
+  pangolin::Var<bool> compactMap("mapPanel.compact map",true,true);
   pangolin::Var<int> numObsToTake("mapPanel.num Obs2take",1000,0,1000);
 
   pangolin::Var<int> smoothGrey("ui.smooth grey",1,0,2);
@@ -1565,6 +1127,7 @@ int main( int argc, char* argv[] )
   pangolin::Var<bool> greyScaleFromExpectation("icpPanel.grey from Expect",true,true);
 
   pangolin::Var<int> dtAssoc("icpPanel.dtAssoc",5000,1,1000);
+  pangolin::Var<bool> cpuAssoc("icpPanel.cpu assoc",false,true);
   pangolin::Var<float> lambdaNs("icpPanel.lamb Ns",0.1,0.001,1.);
   pangolin::Var<float> lambdaTex("icpPanel.lamb Tex",0.1,0.0001,0.1);
   pangolin::Var<float> lambdaP2Pl("icpPanel.lamb p2pl",1.0,0.001,1.);
@@ -1675,15 +1238,19 @@ int main( int argc, char* argv[] )
   pangolin::GlBuffer valuebo(pangolin::GlArrayBuffer,MAP_SIZE,GL_FLOAT,1);
   pangolin::GlBuffer vboEst_w(pangolin::GlArrayBuffer,MAP_SIZE,GL_FLOAT,3);
 
-  tdp::ManagedHostCircularBuffer<tdp::Vector3fda> pc_w(MAP_SIZE);
-  tdp::ManagedHostCircularBuffer<float> rs(MAP_SIZE); // radius of surfels
+  tdp::ManagedHostCircularBuffer<tdp::Plane> pl_w(MAP_SIZE);
+  // hot fields of pl_w in columns so that map sweeps only stream what
+  // they read; the columns share their insertion index
+  tdp::SurfelColumns surfels(MAP_SIZE);
+  tdp::ManagedHostCircularBuffer<tdp::Vector3fda>& pc_w = surfels.Get<tdp::kSurfelP>();
+  tdp::ManagedHostCircularBuffer<tdp::Vector3fda>& n_w = surfels.Get<tdp::kSurfelN>();
+  tdp::ManagedHostCircularBuffer<tdp::Vector3bda>& rgb_w = surfels.Get<tdp::kSurfelRgb>();
+  tdp::ManagedHostCircularBuffer<tdp::Vector3fda>& grad_w = surfels.Get<tdp::kSurfelGrad>();
+  tdp::ManagedHostCircularBuffer<float>& rs = surfels.Get<tdp::kSurfelR>(); // radius of surfels
+  tdp::ManagedHostCircularBuffer<uint16_t>& ts = surfels.Get<tdp::kSurfelT>(); // last observation
+  tdp::ManagedHostCircularBuffer<tdp::Vector3fda>& p0_w = surfels.Get<tdp::kSurfelP0>();
   tdp::ManagedHostCircularBuffer<float> rsNN(MAP_SIZE); // radius of surfels
   tdp::ManagedHostCircularBuffer<float> rsScaled(MAP_SIZE); // radius of surfels
-  tdp::ManagedHostCircularBuffer<uint16_t> ts(MAP_SIZE); // radius of surfels
-  tdp::ManagedHostCircularBuffer<tdp::Vector3bda> rgb_w(MAP_SIZE);
-  tdp::ManagedHostCircularBuffer<tdp::Plane> pl_w(MAP_SIZE);
-  tdp::ManagedHostCircularBuffer<tdp::Vector3fda> n_w(MAP_SIZE);
-  tdp::ManagedHostCircularBuffer<tdp::Vector3fda> grad_w(MAP_SIZE);
   tdp::ManagedHostCircularBuffer<tdp::Vector3fda> gradDir_w(MAP_SIZE);
 
 
@@ -1718,15 +1285,11 @@ int main( int argc, char* argv[] )
   size_t zMaxSampleCount = 0;
   size_t zMinSampleCount = 0;
 
-  rs.Fill(NAN);
+  const tdp::Vector3fda nan3(NAN,NAN,NAN);
+  surfels.Fill(nan3, nan3, tdp::Vector3bda::Zero(), nan3, NAN, 0, nan3);
   rsNN.Fill(NAN);
   rsScaled.Fill(NAN);
-  ts.Fill(0);
-  pc_w.Fill(tdp::Vector3fda(NAN,NAN,NAN));
-  rgb_w.Fill(tdp::Vector3bda::Zero());
-  grad_w.Fill(tdp::Vector3fda(NAN,NAN,NAN));
   gradDir_w.Fill(tdp::Vector3fda(NAN,NAN,NAN));
-  n_w.Fill(tdp::Vector3fda(NAN,NAN,NAN));
   
   vbo_w.Upload(pc_w.ptr_, pc_w.SizeBytes(), 0);
   nbo_w.Upload(n_w.ptr_, n_w.SizeBytes(), 0);
@@ -1782,9 +1345,30 @@ int main( int argc, char* argv[] )
   tdp::ThreadedValue<bool> runTopologyThread(true);
   tdp::ThreadedValue<bool> runMappingThread(true);
 
-  std::mutex pl_wLock;
-  std::mutex nnLock;
+  // insert indices of pl_w (published by the tracking loop) and of nn
+  // (published by the topology thread once the kNN of a surfel is set)
+  tdp::PublishedCursor plPublished;
+  tdp::PublishedCursor nnPublished;
   std::mutex mapLock;
+  // the map threads read the map within this epoch for each iteration
+  // so that the map can be compacted in between; compacting keeps them
+  // from entering it again
+  std::atomic<bool> compacting(false);
+  tdp::ReadEpoch mapEpoch;
+  // number of finished compactions; cleared compacting comes first
+  tdp::PublishedCursor compactionsDone;
+  // Block while the map is being compacted; returns true if it waited.
+  // Has to be called outside of the map epoch.
+  auto waitCompaction = [&]() {
+    const int32_t numDone = compactionsDone.Acquire();
+    if (!compacting) return false;
+    compactionsDone.WaitChange(numDone);
+    return true;
+  };
+  // dpvmf statistics of the surfel normals per label; the threads that
+  // change a normal or a surfel touch it
+  tdp::LabelSufficientStats labelStats(0, MAP_SIZE);
+
   std::thread topology([&]() {
     int32_t iReadNext = 0;
     int32_t sizeToReadPrev = 0;
@@ -1794,11 +1378,17 @@ int main( int argc, char* argv[] )
     tdp::VectorkNNfda valuesCur;
     std::mt19937 rnd(0);
     while(runTopologyThread.Get()) {
-      sizeToReadPrev = sizeToRead;
-      {
-        std::lock_guard<std::mutex> lock(pl_wLock); 
-        sizeToRead = pl_w.SizeToRead();
+      // block until there are surfels or the map is compacted; never
+      // within the map epoch
+      if (plPublished.Acquire() == 0) {
+        plPublished.WaitChange(0);
+        continue;
       }
+      if (waitCompaction()) continue;
+      tdp::ReadEpoch::Guard mapGuard(mapEpoch);
+      if (compacting) continue;
+      sizeToReadPrev = sizeToRead;
+      sizeToRead = plPublished.Acquire();
       if (sizeToRead ==0) continue;
 //      if (sizeToRead > sizeToReadPrev) {
 //        for (int32_t i=sizeToReadPrev; i<sizeToRead; ++i)
@@ -1836,12 +1426,13 @@ int main( int argc, char* argv[] )
         TICK("full NN pass");
         float maxDistSq = maxNnDist*maxNnDist;
         float minDistSq = minNnDist*minNnDist;
+        // sweep the p0 column and only touch the records of surfels
+        // within range
         for (int32_t i=0; i<sizeToRead; ++i) {
-          if (i != iReadNext && pl_w[i].valid_) {
-            float distSq = (pl.p0_-pl_w[i].p0_).squaredNorm();
-            if (minDistSq < distSq && distSq < maxDistSq)
-              tdp::AddToSortedIndexList<kNN>(ids, values, i, distSq);
-          }
+          float distSq = (p0_w.GetCircular(iReadNext)-p0_w[i]).squaredNorm();
+          if (minDistSq < distSq && distSq < maxDistSq
+              && i != iReadNext && pl_w[i].valid_)
+            tdp::AddToSortedIndexList<kNN>(ids, values, i, distSq);
         }
         TOCK("full NN pass");
 
@@ -1878,6 +1469,7 @@ int main( int argc, char* argv[] )
             rs[iReadNext] = NAN;
             rsNN[iReadNext] = NAN;
             pl.valid_ = false;
+            labelStats.Touch(iReadNext);
             std::cout << "pruning " << iReadNext 
               << " NN " << int(nnFixed[iReadNext])
               << " H " << pl.Hp_ << " HThr " << pruneHThr
@@ -1899,10 +1491,8 @@ int main( int argc, char* argv[] )
         }
       }
       iReadNext = (iReadNext+1)%sizeToRead;
-      {
-        std::lock_guard<std::mutex> lock(nnLock); 
-        nn.iInsert_ = std::max(iReadNext, nn.iInsert_);
-      }
+      nn.iInsert_ = std::max(iReadNext, nn.iInsert_);
+      nnPublished.Publish(nn.iInsert_);
       idNNUpdate = iReadNext;
     };
   });
@@ -1935,6 +1525,9 @@ int main( int argc, char* argv[] )
   tdp::ManagedHostCircularBuffer<tdp::Vector4fda> vmfSS(10000);
   vmfSS.Fill(tdp::Vector4fda::Zero());
 
+  // background pruning, free space carving and compaction of the map
+  tdp::SurfelMapMaintenance mapMaint(pl_w, 0.05);
+
   std::thread samplingNormals([&]() {
     int32_t i = 0;
     int32_t sizeToReadPrev = 0;
@@ -1946,11 +1539,15 @@ int main( int argc, char* argv[] )
     Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> eig;
     TICK("sampleNormals");
     while(runSampling.Get()) {
+      if (nnPublished.Acquire() == 0) {
+        nnPublished.WaitChange(0);
+        continue;
+      }
+      if (waitCompaction()) continue;
+      tdp::ReadEpoch::Guard mapGuard(mapEpoch);
+      if (compacting) continue;
       if (i%100 == 0 || sizeToRead == 0) {
-        {
-          std::lock_guard<std::mutex> lock(nnLock); 
-          sizeToRead = nn.iInsert_;
-        }
+        sizeToRead = nnPublished.Acquire();
       }
       if (sizeToRead ==0) continue;
       i = (i+1)% sizeToRead;
@@ -2030,6 +1627,7 @@ int main( int argc, char* argv[] )
 //      tdp::RunningAvgvMFSS(ni, nSampleCountMax, nSampleSum_w[i],
 //          nSampleCountRAvg[i]);
 //      nSampleCount[i]++;
+      labelStats.Touch(i);
       tdp::AccumulatevMFSS(ni, nSampleSum_w[i], nSampleCount[i]);
       nTotalSampleCount ++;
       nMaxSampleCount = std::max(nMaxSampleCount, (size_t) nSampleCount[i]);
@@ -2052,66 +1650,50 @@ int main( int argc, char* argv[] )
 //    std::random_device rd_;
     std::mt19937 rnd(0);
     Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> eig;
+    tdp::DpvmfLabelSampler<kNN> labelSampler(0);
+    auto labelAndNormal = [&](size_t i, uint32_t& k, tdp::Vector3fda& x) {
+      if (!pl_w[i].valid_ || !tdp::IsValidData(nS[i])) return false;
+      k = zS[i];
+      x = nS[i];
+      return true;
+    };
+    // surfels removed or moved by the map maintenance need a full pass;
+    // the count is taken before the pass so that removals during it
+    // trigger another one
+    size_t numRemoved = std::numeric_limits<size_t>::max();
     while(runSampling.Get()) {
-      {
-        std::lock_guard<std::mutex> lock(nnLock); 
-        iInsert = nn.iInsert_;
+      if (nnPublished.Acquire() == 0) {
+        nnPublished.WaitChange(0);
+        continue;
       }
+      if (waitCompaction()) continue;
+      tdp::ReadEpoch::Guard mapGuard(mapEpoch);
+      if (compacting) continue;
+      iInsert = nnPublished.Acquire();
       if (iInsert == 0) continue;
       TICK("sampleLabels");
-      pS.iInsert_ = nn.iInsert_;
-      nS.iInsert_ = nn.iInsert_;
+      pS.iInsert_ = iInsert;
+      nS.iInsert_ = iInsert;
       size_t Ksample = vmfs.size();
-      vmfSS.Fill(tdp::Vector4fda::Zero());
-      for (int32_t i = 0; i!=iInsert; i=(i+1)%nn.w_) {
-        if (!pl_w[i].valid_ || !tdp::IsValidData(nS[i])) continue;
-        vmfSS[zS[i]].topRows<3>() += nS[i];
-        vmfSS[zS[i]](3) ++;
+      labelStats.Resize(Ksample);
+      const size_t numRemovedNow = mapMaint.NumRemovals();
+      if (numRemovedNow != numRemoved) {
+        labelStats.Accumulate(iInsert, labelAndNormal);
+        numRemoved = numRemovedNow;
+      } else {
+        labelStats.SyncTouched(labelAndNormal);
       }
+      labelStats.CopyFirstOrder(vmfSS);
 //      TOCK("sample normals");
       // sample dpvmf labels
-      for (int32_t i = 0; i!=iInsert; i=(i+1)%nn.w_) {
-        tdp::Vector3fda& ni = nS[i];
-        if (!pl_w[i].valid_ || !tdp::IsValidData(ni)) continue;
-        Eigen::VectorXf logPdfs(Ksample+1);
-        Eigen::VectorXf pdfs(Ksample+1);
-
-        uint16_t& zi = zS[i];
-        tdp::VectorkNNida& ids = nn[i];
-
-        Eigen::VectorXf neighNs = Eigen::VectorXf::Zero(Ksample);
-        for (int i=0; i<kNN; ++i) {
-          if (ids[i] > -1  && zS[ids[i]] < Ksample) {
-            neighNs[zS[ids[i]]] += 1.f;
-          }
-        }
-        for (size_t k=0; k<Ksample; ++k) {
-          logPdfs[k] = lambdaMRF*(neighNs[k]-kNN);
-          if (zi == k) {
-            logPdfs[k] += log(vmfSS[k](3)-1)+vmfs[k].logPdf(ni);
-          } else {
-            logPdfs[k] += log(vmfSS[k](3))+vmfs[k].logPdf(ni);
-          }
-        }
-        logPdfs[Ksample] = logAlpha + base.logMarginal(ni);
-        logPdfs = logPdfs.array() - logSumExp<float>(logPdfs);
-        pdfs = logPdfs.array().exp();
-        uint16_t zPrev = zi;
-        zi = sampleDisc(pdfs, rnd);
-        //      std::cout << z[i] << " " << Ksample << ": " << pdfs.transpose() << std::endl;
-        if (zi == Ksample) {
-          vmfsLock.lock();
-          vmfs.push_back(base.posterior(ni,1).sample(rnd));
-          vmfsLock.unlock();
-          Ksample++;
-        }
-        if (zPrev != zi) {
-          vmfSS[zPrev].topRows<3>() -= ni;
-          vmfSS[zPrev](3) --;
-          vmfSS[zi].topRows<3>() += ni;
-          vmfSS[zi](3) ++;
-        }
-      }
+      labelSampler.Sweep(iInsert, [&](size_t i) {
+          return pl_w[i].valid_ && tdp::IsValidData(nS[i]);
+        }, nS, nn, zS, vmfs, vmfsLock, base, logAlpha, lambdaMRF, vmfSS);
+      Ksample = vmfs.size();
+      for (uint32_t i : labelSampler.Moved()) labelStats.Touch(i);
+      labelStats.Resize(Ksample);
+      labelStats.SyncTouched(labelAndNormal);
+      labelStats.CopyFirstOrder(vmfSS);
       TOCK("sampleLabels");
       TICK("sampleParams");
       std::vector<uint32_t> labelMap(Ksample);
@@ -2133,14 +1715,17 @@ int main( int argc, char* argv[] )
             vmfSS[labelMap[k]] = vmfSS[k];
           }
         }
+        // labels opened in this sweep are remapped as well
+        const size_t Kprev = Ksample;
         Ksample = j;
         vmfs.resize(Ksample);
+        labelStats.Relabel(labelMap, Ksample);
 //      }
 //      {
         uint16_t zMli = 0;
         float countMli = 0;
         for (int32_t i = 0; i!=iInsert; i=(i+1)%nn.w_) {
-          if (!pl_w[i].valid_ || zS[i] >= K) continue;
+          if (!pl_w[i].valid_ || zS[i] >= Kprev) continue;
           tdp::InsertLabelML(zSampleIds[i], zSampleCounts[i], zS[i],
               zSampleCountMax, zMli, countMli);
           zTotalSampleCount ++;
@@ -2151,7 +1736,7 @@ int main( int argc, char* argv[] )
 //            std::cout << zSampleIds[i].transpose() << std::endl << zSampleCounts[i].transpose() << std::endl 
 //              << "ML: " << zMli << " " << countMli << " zi=" << zS[i] << std::endl;
           for (uint32_t k=0; k<zKTrac; ++k) {
-            if (zSampleIds[i](k) < K)
+            if (zSampleIds[i](k) < Kprev)
               zSampleIds[i](k) = labelMap[zSampleIds[i](k)];
           }
           zS[i] = labelMap[zS[i]];
@@ -2174,12 +1759,16 @@ int main( int argc, char* argv[] )
     std::uniform_real_distribution<float> coin(0, 1);
     // sample points
     while(runSampling.Get()) {
+      if (nnPublished.Acquire() == 0) {
+        nnPublished.WaitChange(0);
+        continue;
+      }
+      if (waitCompaction()) continue;
+      tdp::ReadEpoch::Guard mapGuard(mapEpoch);
+      if (compacting) continue;
       if (!samplePoints) continue;
       if (i%100 == 0 || sizeToRead == 0) {
-        {
-          std::lock_guard<std::mutex> lock(nnLock); 
-          sizeToRead = nn.iInsert_;
-        }
+        sizeToRead = nnPublished.Acquire();
       }
       if (sizeToRead ==0) continue;
       i = (i+1)% sizeToRead;
@@ -2241,6 +1830,7 @@ int main( int argc, char* argv[] )
           pl.valid_ = false;
           pc_w[i] = tdp::Vector3fda(NAN,NAN,NAN);
           n_w[i] = tdp::Vector3fda(NAN,NAN,NAN);
+          labelStats.Touch(i);
         }
         Eigen::Matrix3f Sigma = Info.inverse();
         Eigen::Vector3f mu = Info.ldlt().solve(xi);
@@ -2327,6 +1917,7 @@ int main( int argc, char* argv[] )
   float curTrackingMinStd =0;
 
   tdp::ProjectiveAssociation<CameraT::NumParams, CameraT> projAssoc(cam, w, h);
+  tdp::ProjectiveRasterizer<CameraT> projRaster(cam, w, h);
 
   std::vector<std::pair<size_t, size_t>> assoc;
   assoc.reserve(10000);
@@ -2343,6 +1934,7 @@ int main( int argc, char* argv[] )
 
   std::vector<uint32_t> idNew;
   idNew.reserve(w*h);
+  tdp::GradientMaskSampler maskSampler;
 
   pyrMask.Fill(0);
   std::vector<std::vector<uint32_t>*> idsCur;
@@ -2410,6 +2002,70 @@ int main( int argc, char* argv[] )
       T_wc = tdp::SE3f();
     }
 
+    if (compactMap && mapMaint.CompactionPending()) {
+      TICK("compactMap");
+      compacting = true;
+      mapEpoch.Synchronize();
+      size_t numBefore = pl_w.SizeToRead();
+      size_t numLive = mapMaint.BeginCompaction();
+      mapMaint.Compact(surfels, nan3, nan3, tdp::Vector3bda::Zero(), nan3,
+          NAN, 0, nan3);
+      mapMaint.Compact(rsNN, NAN);
+      mapMaint.Compact(rsScaled, NAN);
+      mapMaint.Compact(gradDir_w, nan3);
+      mapMaint.Compact(zSampleCount, 0);
+      mapMaint.Compact(zSampleCounts, tdp::VectorZfda::Zero());
+      mapMaint.Compact(zSampleIds, tdp::VectorZuda::Ones()*999);
+      mapMaint.Compact(zMl, 0);
+      mapMaint.Compact(zMlCount, 0);
+      mapMaint.Compact(nSampleSum_w, tdp::Vector3fda::Zero());
+      mapMaint.Compact(pSampleOuter_w, tdp::Matrix3fda::Zero());
+      mapMaint.Compact(pSampleCov_w, tdp::Matrix3fda::Zero());
+      mapMaint.Compact(pSampleSum_w, tdp::Vector3fda::Zero());
+      mapMaint.Compact(pSampleEst_w, tdp::Vector3fda::Zero());
+      mapMaint.Compact(pSampleCount, 0);
+      mapMaint.Compact(nnFixed, 0);
+      mapMaint.RemapIds(nn);
+      mapMaint.Compact(nSum_w, tdp::Vector3fda::Zero());
+      mapMaint.Compact(numSum_w, 0);
+      mapMaint.Compact(tauOSum_w, 0);
+      mapMaint.Compact(pcObsInfo_w, tdp::Matrix3fda::Zero());
+      mapMaint.Compact(pcObsXi_w, tdp::Vector3fda::Zero());
+      mapMaint.Compact(pcObsMu_w, tdp::Vector3fda::Zero());
+      mapMaint.Compact(p2plSum, 0);
+      mapMaint.Compact(p2plSqSum, 0);
+      mapMaint.Compact(p2plCount, 0);
+      mapMaint.Compact(p2plVar, sigmaPl*sigmaPl);
+      mapMaint.Compact(ImMapSum, 0);
+      mapMaint.Compact(ImMapSqSum, 0);
+      mapMaint.Compact(ImMapCount, 0);
+      mapMaint.Compact(ImMapVar, 0);
+      mapMaint.Compact(ImSum, 0);
+      mapMaint.Compact(ImSqSum, 0);
+      mapMaint.Compact(ImCount, 0);
+      mapMaint.Compact(ImVar, 0);
+      mapMaint.Compact(zS, 9999);
+      mapMaint.Compact(nSampleCount, 0);
+      mapMaint.Compact(nSampleCountRAvg, 0);
+      mapMaint.Compact(nSamplePReject, NAN);
+      mapMaint.Compact(nS, nan3);
+      mapMaint.Compact(pS, nan3);
+      mapMaint.RemapPairs(mapNN, kNN);
+      mapMaint.EndCompaction();
+      plPublished.Publish(pl_w.SizeToRead());
+      nnPublished.Publish(nn.iInsert_);
+      compacting = false;
+      compactionsDone.Publish(compactionsDone.Acquire()+1);
+      tdp::UploadToRead(vbo_w, pc_w);
+      tdp::UploadToRead(nbo_w, n_w);
+      tdp::UploadToRead(tbo, ts);
+      numCompactions = mapMaint.NumCompactions();
+      TOCK("compactMap");
+      if (gui.verbose)
+        std::cout << "compacted map from " << numBefore << " to "
+          << numLive << " surfels" << std::endl;
+    }
+
     idNew.clear();
     if (!gui.paused() && !gui.finished()
         && frame > 0
@@ -2420,8 +2076,13 @@ int main( int argc, char* argv[] )
 
       // update mask only once to know where to insert new planes
       TICK("dataAssoc");
-      projAssoc.Associate(vbo_w, nbo_w, tbo, T_wc.Inverse(), dMin,
-          dMax, std::max(0, frame-dtAssoc), pl_w.SizeToRead());
+      if (cpuAssoc) {
+        projRaster.Associate(pc_w, n_w, ts, T_wc.Inverse(), dMin,
+            dMax, std::max(0, frame-dtAssoc), pl_w.SizeToRead());
+      } else {
+        projAssoc.Associate(vbo_w, nbo_w, tbo, T_wc.Inverse(), dMin,
+            dMax, std::max(0, frame-dtAssoc), pl_w.SizeToRead());
+      }
       TOCK("dataAssoc");
       TICK("extractAssoc");
 //      z.Fill(0);
@@ -2429,7 +2090,14 @@ int main( int argc, char* argv[] )
 //      projAssoc.GetAssoc(z, mask, idsCur);
 //      projAssoc.GetAssocOcclusion(pl_w, pc, T_wc.Inverse(),
 //          occlusionDepthThr, z, mask, idsCur);
-      if (sigmaOclusion) {
+      if (cpuAssoc && sigmaOclusion) {
+        projRaster.GetAssocOcclusion(pl_w, pyrPc, pyrRay, Sigma_wc,
+            numSigmaOclusion, dMin, dMax, ICPmaxLvl+1, freeSpaceCarving,
+            pyrZ, pyrMask, idsCur);
+      } else if (cpuAssoc) {
+        projRaster.GetAssocOcclusion(pyrPc, occlusionDepthThr, dMin, dMax,
+            ICPmaxLvl, pyrZ, pyrMask, idsCur);
+      } else if (sigmaOclusion) {
         projAssoc.GetAssocOcclusion(pl_w, pyrPc, pyrRay,
             T_wc.Inverse(), Sigma_wc, numSigmaOclusion, dMin, dMax,
             ICPmaxLvl+1, freeSpaceCarving, pyrZ, pyrMask, idsCur);
@@ -2446,21 +2114,22 @@ int main( int argc, char* argv[] )
         pyrMaskDisp.CopyFrom(pyrMask);
       }
       TICK("mask");
-      tdp::GradientNormBiasedResampleEmptyPartsOfMask(pc, cam, mask,
-          greyGradNorm, W, subsample, gen, 32, 32, w, h, pUniform, idNew);
+      maskSampler.ResampleEmptyParts(pc, mask, greyGradNorm, subsample,
+          gen, 32, 32, w, h, pUniform, idNew);
+//      tdp::GradientNormBiasedResampleEmptyPartsOfMask(pc, cam, mask,
+//          greyGradNorm, W, subsample, gen, 32, 32, w, h, pUniform, idNew);
 //      tdp::UniformResampleEmptyPartsOfMask(pc, cam, mask, W,
 //          subsample, gen, 32, 32, w, h);
       TOCK("mask");
       {
         iReadCurW = pl_w.iInsert_;
-        std::lock_guard<std::mutex> lock(pl_wLock); 
         TICK("newPlanes");
         tdp::Image<uint32_t> z = pyrZ.GetImage(0);
         ExtractPlanes(pc, rgb, z, greyFl, gradGrey,
              mask, W, frame, T_wc, Sigma_wc, cam, rho, rays, outerRaysInt,
-             dpc, pl_w, pc_w, pcObsInfo_w,
-             pSampleCov_w, rgb_w, n_w, grad_w, ImSum, ImSqSum, ImCount,
-             ImVar, rs, ts, normalExtractMethod, useTrackingUncertainty);
+             dpc, pl_w, surfels, pcObsInfo_w,
+             pSampleCov_w, ImSum, ImSqSum, ImCount,
+             ImVar, normalExtractMethod, useTrackingUncertainty);
 
         if (gui.verbose)
           std::cout << " extracted " << pl_w.iInsert_-iReadCurW 
@@ -2480,19 +2149,11 @@ int main( int argc, char* argv[] )
         }
         TOCK("newPlanes");
       }
-//      vbo_w.Upload(pc_w.ptr_, pc_w.SizeBytes(), 0);
-      vbo_w.Upload(&pc_w.ptr_[iReadCurW], 
-          pc_w.SizeToRead(iReadCurW)*sizeof(tdp::Vector3fda), 
-          iReadCurW*sizeof(tdp::Vector3fda));
-      nbo_w.Upload(&n_w.ptr_[iReadCurW], 
-          pc_w.SizeToRead(iReadCurW)*sizeof(tdp::Vector3fda), 
-          iReadCurW*sizeof(tdp::Vector3fda));
-//      rbo.Upload(&rs.ptr_[iReadCurW],
-//          rs.SizeToRead(iReadCurW)*sizeof(float),
-//          iReadCurW*sizeof(float));
-      tbo.Upload(&ts.ptr_[iReadCurW],
-          ts.SizeToRead(iReadCurW)*sizeof(uint16_t),
-          iReadCurW*sizeof(int16_t));
+      plPublished.Publish(pl_w.SizeToRead());
+      // upload only the newly inserted surfels of the rendered columns
+      tdp::UploadToRead(vbo_w, pc_w, iReadCurW);
+      tdp::UploadToRead(nbo_w, n_w, iReadCurW);
+      tdp::UploadToRead(tbo, ts, iReadCurW);
 
       for (size_t lvl=0; lvl<PYR; ++lvl) {
         std::random_shuffle(idsCur[lvl]->begin(), idsCur[lvl]->end());
@@ -2745,149 +2406,91 @@ int main( int argc, char* argv[] )
       if (runICP) {
         if (gui.verbose) std::cout << "SE3 ICP" << std::endl;
         TICK("icp");
-        Eigen::Matrix<float,6,6> Ap2pl;
-        Eigen::Matrix<float,6,1> bp2pl;
-        Eigen::Matrix<float,6,6> Aphoto;
-        Eigen::Matrix<float,6,1> bphoto;
-        Eigen::Matrix<float,6,6> A;
-        Eigen::Matrix<float,6,1> b;
-        Eigen::Matrix<float,6,1> Ai;
+        Eigen::Matrix<float,6,6> A = Eigen::Matrix<float,6,6>::Zero();
         std::vector<uint32_t> maxItLvl = {maxIt0, maxIt1, maxIt2, maxIt3};
+        tdp::SparseSurfelIcp icp;
+        icp.maxObs_ = maxObsIcp;
+        icp.condEntropyThr_ = condEntropyThr;
+        icp.sigmaOcclusion_ = sigmaOclusion;
+        icp.numSigmaOcclusion_ = numSigmaOclusion;
+        icp.occlusionDepthThr_ = occlusionDepthThr;
+        icp.verbose_ = gui.verbose;
+        tdp::P2PlResidual p2plRes;
+        tdp::P2PlIntensityResidual p2plIntensityRes(lambdaP2Pl, lambdaTex,
+            sigmaPl, estSigmaPl ? &p2plVar : nullptr,
+            estSigmaIm ? &ImVar : nullptr);
+        tdp::P2Pl3DGradResidual p2pl3DGradRes(lambdaTex);
+        tdp::P2PlNormalResidual p2plNormalRes(lambdaNs, usevMFmeans);
+        tdp::P2PlIntensityNormalsResidual p2plIntensityNormalsRes(lambdaNs,
+            lambdaTex, usevMFmeans);
         for (int32_t pyr=frame==1? 0 : ICPmaxLvl; pyr>=0; --pyr) {
-          std::vector<size_t> indK(invInd[pyr]->size(),0);
-          float dotThr = cos(angleThr*M_PI/180.);
+          icp.SetCandidates(*invInd[pyr]);
+          icp.HThr_ = HThr+pyr*dPyrHThr;
+          icp.negLogEvThr_ = negLogEvThr+pyr*dPyrNewLogEvHThr;
           float scale = pow(0.5,pyr);
-          CameraT camLvl = cam.Scale(scale);
-          tdp::Image<float> dLvl = pyrD.GetImage(pyr);
+          tdp::SparseIcpFrame<CameraT> lvl;
+          lvl.cam = cam.Scale(scale);
+          lvl.d = pyrD.GetImage(pyr);
+          lvl.pc = pyrPc.GetImage(pyr);
+          lvl.n = pyrN.GetImage(pyr);
+          lvl.ray = pyrRay.GetImage(pyr);
+          lvl.grey = pyrGreyFl.GetImage(pyr);
+          lvl.gradGrey = pyrGradGrey.GetImage(pyr);
+          lvl.p2plThr = p2plThr;
+          lvl.dotThr = cos(angleThr*M_PI/180.);
           tdp::Image<float> rhoLvl = pyrRho.GetImage(pyr);
-          tdp::Image<float> greyFlLvl = pyrGreyFl.GetImage(pyr);
-          tdp::Image<tdp::Vector2fda> gradGreyLvl = pyrGradGrey.GetImage(pyr);
-          tdp::Image<tdp::Vector3fda> pcLvl = pyrPc.GetImage(pyr);
-          tdp::Image<tdp::Vector3fda> nLvl = pyrN.GetImage(pyr);
-          tdp::Image<tdp::Vector3fda> rayLvl = pyrRay.GetImage(pyr);
           tdp::Image<tdp::Vector6dda> outerRaysIntLvl = pyrOuterRaysInt.GetImage(pyr);
+          auto ensureNormal = [&](int32_t u, int32_t v) {
+            return EnsureNormal(lvl.pc, dpc, rhoLvl, lvl.ray, outerRaysIntLvl,
+                W, lvl.n, curv, rad, u, v, normalExtractMethod);
+          };
           if (gui.verbose) std::cout << "pyramid lvl " << pyr << " scale " << scale << std::endl;
           for (size_t it = 0; it < maxItLvl[pyr]; ++it) {
             TICK("icpIt");
             for (auto& ass : assoc) mask[ass.second] = 0;
-            assoc.clear();
-            indK = std::vector<size_t>(invInd[pyr]->size(),0);
-            numProjected = 0;
-            Ap2pl = Eigen::Matrix<float,6,6>::Zero();
-            bp2pl = Eigen::Matrix<float,6,1>::Zero();
-            Aphoto = Eigen::Matrix<float,6,6>::Zero();
-            bphoto = Eigen::Matrix<float,6,1>::Zero();
-            A = Eigen::Matrix<float,6,6>::Zero();
-            b = Eigen::Matrix<float,6,1>::Zero();
-            Ai = Eigen::Matrix<float,6,1>::Zero();
-            float err = 0.;
-            float H = 1e10;
-            float Hprev = 1e10;
-            tdp::SE3f T_cw = T_wc.Inverse();
+            lvl.T_wc = T_wc;
+            lvl.T_cw = T_wc.Inverse();
+            lvl.Sigma_t = Sigma_wc.bottomRightCorner<3,3>();
             // associate new data until enough
-            bool exploredAll = false;
-            uint32_t k = 0;
-            while (assoc.size() < maxObsIcp && !exploredAll) {
-              k = (k+1) % invInd[pyr]->size();
-              while (indK[k] < invInd[pyr]->at(k).size()) {
-                size_t i = invInd[pyr]->at(k)[indK[k]++];
-                tdp::Plane& pl = pl_w.GetCircular(i);
-                if (!pl.valid_)
-                  continue;
-                tdp::Vector3fda pc_w_in_c = T_cw*pl.p_;
-                Eigen::Vector2f x = camLvl.Project(pc_w_in_c);
-//                std::cout << x.transpose() << std::endl;
-                if (!dLvl.Inside(x)) 
-                  continue;
-                int32_t u = floor(x(0)+0.5f);
-                int32_t v = floor(x(1)+0.5f);
-                float d_c = dLvl.GetBilinear(x(0),x(1));
-//                std::cout << d_c << std::endl;
-                float nguyenSigmaAxial = 0.0012 + 0.0019*(d_c-0.4)*(d_c-0.4);
-                float threeSigma_d = numSigmaOclusion*(nguyenSigmaAxial + sqrtf(rayLvl(u,v).dot(Sigma_wc.bottomRightCorner<3,3>()*rayLvl(u,v))));
-//                float threeSigma_d = numSigmaOclusion*sqrtf(rayLvl(u,v).dot(pSampleCov_w[i]*rayLvl(u,v)));
-                if (d_c != d_c 
-                    || (!sigmaOclusion && fabs(d_c-pc_w_in_c(2)) > occlusionDepthThr)
-                    || (sigmaOclusion  && fabs(d_c-pc_w_in_c(2)) > threeSigma_d)
-                    )
-                  continue;
-                numProjected = numProjected + 1;
-                if (!EnsureNormal(pcLvl, dpc, rhoLvl, rayLvl,
-                      outerRaysIntLvl, W, nLvl, curv, rad, u, v,
-                      normalExtractMethod))
-                  //              if (!tdp::ProjectiveAssocNormalExtract(pl, T_cw, camLvl, pc,
-                  //                    W, dpc, n, curv, u,v ))
-                  continue;
-                if (useTexture) {
-                  float sqrtInfoP2Pl = estSigmaPl ? lambdaP2Pl/sqrtf(p2plVar[i]) : 1./sigmaPl;
-                  float sqrtInfoIm = estSigmaIm ? lambdaTex/sqrtf(ImVar[i]) : lambdaTex/sigmaPl;
-                  if (!AccumulateP2PlIntensity(pl, T_wc, T_cw, camLvl, pcLvl(u,v),
-                        nLvl(u,v), greyFlLvl(u,v), gradGreyLvl(u,v), p2plThr, dotThr,
-                        sqrtInfoP2Pl, sqrtInfoIm, Ap2pl, bp2pl, Aphoto, bphoto, Ai, err))
-                    continue;
-                  A = Aphoto + Ap2pl;
-                  b = bphoto + bp2pl;
-                } else if (use3dGrads) {
-                  if (!AccumulateP2Pl3DGrad(pl, T_wc, T_cw, camLvl, pcLvl(u,v),
-                        nLvl(u,v), greyFlLvl(u,v), gradGreyLvl(u,v),
-                        x(0),x(1), p2plThr, dotThr, lambdaTex, A, Ai, b,
-                        err))
-                    continue;
-                } else if (useNormals) {
-                  tdp::Vector3fda n_wi = pl.n_;
-                  if (usevMFmeans) {
-                    std::lock_guard<std::mutex> lock(vmfsLock);
-                    n_wi = vmfs[pl.z_].mu_;
-                  }
-                  if (!AccumulateP2PlNormal(pl, n_wi, T_wc, T_cw, camLvl, pcLvl(u,v),
-                        nLvl(u,v), p2plThr, dotThr, lambdaNs, A, Ai, b, err)) {
-                    continue;
-                  }
-                } else if (useNormalsAndTexture) {
-                  tdp::Vector3fda n_wi = pl.n_;
-                  if (usevMFmeans) {
-                    std::lock_guard<std::mutex> lock(vmfsLock);
-                    n_wi = vmfs[pl.z_].mu_;
-                  }
-                  if (!AccumulateP2PlIntensityNormals(pl, n_wi, T_wc, T_cw, camLvl, pcLvl(u,v),
-                        nLvl(u,v), greyFlLvl(u,v),gradGreyLvl(u,v), p2plThr, dotThr,
-                        lambdaNs, lambdaTex, A, Ai, b, err)) {
-                    continue;
-                  }
-                } else {
-                  if (!AccumulateP2Pl(pl, T_wc, T_cw, pcLvl(u,v), nLvl(u,v),
-                        p2plThr, dotThr, A, Ai, b, err))
-                    continue;
-                }
-                mask(u,v) = 255;
-                assoc.emplace_back(i,u+v*pc.w_);
-                break;
+            if (useTexture) {
+              icp.Step(pl_w, lvl, p2plIntensityRes, ensureNormal);
+            } else if (use3dGrads) {
+              icp.Step(pl_w, lvl, p2pl3DGradRes, ensureNormal);
+            } else if (useNormals) {
+              if (usevMFmeans) {
+                std::lock_guard<std::mutex> lock(vmfsLock);
+                p2plNormalRes.SnapshotMeans(vmfs.begin(), vmfs.end());
               }
-              if (k == 0) {
-                if (tdp::CheckEntropyTermination(A, Hprev, HThr+pyr*dPyrHThr, condEntropyThr, 
-                      negLogEvThr+pyr*dPyrNewLogEvHThr, H, gui.verbose))
-                  break;
-                Hprev = H;
+              icp.Step(pl_w, lvl, p2plNormalRes, ensureNormal);
+            } else if (useNormalsAndTexture) {
+              if (usevMFmeans) {
+                std::lock_guard<std::mutex> lock(vmfsLock);
+                p2plIntensityNormalsRes.SnapshotMeans(vmfs.begin(), vmfs.end());
               }
-              exploredAll = true;
-              for (size_t k=0; k<indK.size(); ++k) exploredAll &= indK[k] >= invInd[pyr]->at(k).size();
+              icp.Step(pl_w, lvl, p2plIntensityNormalsRes, ensureNormal);
+            } else {
+              icp.Step(pl_w, lvl, p2plRes, ensureNormal);
             }
+            A = icp.A_;
+            assoc = icp.assoc_;
+            for (auto& ass : assoc) mask[ass.second] = 255;
+            numProjected = icp.numProjected_;
             numInl = assoc.size();
             Eigen::Matrix<float,6,1> x = Eigen::Matrix<float,6,1>::Zero();
             if (assoc.size() > 6) { // solve for x using ldlt
-              //            std::cout << "A: " << std::endl << A << std::endl << "b: " << b.transpose() << std::endl;
-              x = (A.cast<double>().ldlt().solve(b.cast<double>())).cast<float>(); 
+              x = (A.cast<double>().ldlt().solve(icp.b_.cast<double>())).cast<float>(); 
               T_wc = T_wc * tdp::SE3f::Exp_(x*pow(dPyrdAlpha,pyr));
             }
             if (gui.verbose) {
-              std::cout << "\tit " << it << ": err=" << err 
+              std::cout << "\tit " << it << ": err=" << icp.err_ 
                 << "\t# inliers: " << numInl
                 << "\t|x|: " << x.topRows(3).norm()*180./M_PI 
                 << " " <<  x.bottomRows(3).norm() << std::endl;
             }
+            float H = icp.H_;
             if (x.topRows<3>().norm()*180./M_PI < icpdRThr
                 && x.bottomRows<3>().norm() < icpdtThr
-                && tdp::CheckEntropyTermination(A, Hprev, HThr+pyr*dPyrHThr, 0.f,
+                && tdp::CheckEntropyTermination(A, icp.Hprev_, HThr+pyr*dPyrHThr, 0.f,
                   negLogEvThr+pyr*dPyrNewLogEvHThr, H, gui.verbose)) {
               break;
             }
@@ -3090,6 +2693,18 @@ int main( int argc, char* argv[] )
         
 //        if (gui.verbose) std::cout << "num NN measured " << numNN << std::endl;
         TOCK("updatePlanes");
+
+        if (rayCarving) {
+          TICK("rayCarve");
+          mapMaint.CarveFreeSpace(pc, T_wc, frame, dMin, rayCarveStride);
+          numCarved = mapMaint.NumCarved();
+          TOCK("rayCarve");
+        }
+        mapMaint.survivalTime_ = survivalTime;
+        mapMaint.pruneHThr_ = pruneHThr;
+        mapMaint.pruneNumObsThr_ = pruneNumObsThr;
+        mapMaint.prune_ = pruneNoise;
+        mapMaint.Update(frame);
       }
     }
 
@@ -3187,7 +2802,7 @@ int main( int argc, char* argv[] )
       if (showSamples) {
         nbo_w.Upload(nS.ptr_, n_w.SizeToReadBytes(), 0);
       } else {
-        nbo_w.Upload(n_w.ptr_, n_w.SizeToReadBytes(), 0);
+        tdp::UploadToRead(nbo_w, n_w);
       }
       TOCK("Draw3DnboUpload");
 
@@ -3195,8 +2810,8 @@ int main( int argc, char* argv[] )
         TICK("Draw3DrenderPC");
         // TODO I should not need to upload all of pc_w everytime;
         // might break things though
-        vbo_w.Upload(pc_w.ptr_, pc_w.SizeToReadBytes(), 0);
-        cbo_w.Upload(rgb_w.ptr_, rgb_w.SizeToReadBytes(), 0);
+        tdp::UploadToRead(vbo_w, pc_w);
+        tdp::UploadToRead(cbo_w, rgb_w);
         if (surfelRadiusFromNN) {
           for (size_t i=0; i<rs.SizeToRead(); ++i) 
             rsScaled[i] = rsNN[i]*surfelRadiusScale;
@@ -3381,7 +2996,7 @@ int main( int argc, char* argv[] )
       if (showPc0) {
         glColor4f(1,0,1,0.5);
         for (size_t i=0; i<pl_w.SizeToRead(); i+=step) {
-          tdp::glDrawLine(pl_w[i].p_, pl_w[i].p0_);
+          tdp::glDrawLine(pl_w[i].p_, p0_w[i]);
         }
       }
       if (showOccThr) {
@@ -3527,6 +3142,8 @@ int main( int argc, char* argv[] )
       outStats << "NumNewPlanes\t" << idNew.size() << std::endl;
       outStats << "NumPlanesProjected\t" << numProjected << std::endl;
       outStats << "NumPruned\t" << numPruned<< std::endl;
+      outStats << "NumPrunedBatch\t" << mapMaint.NumPruned() << std::endl;
+      outStats << "NumCarved\t" << numCarved << std::endl;
       outStats << "trackingH\t" << curTrackingH<< std::endl;
       outStats << "trackingMaxStd\t" << curTrackingMaxStd << std::endl;
       outStats << "trackingMinStd\t" << curTrackingMinStd << std::endl;
@@ -3575,6 +3192,16 @@ int main( int argc, char* argv[] )
   outT.close();
   outStats.close();
 
+  runTopologyThread.Set(false);
+  runSampling.Set(false);
+  plPublished.Close();
+  nnPublished.Close();
+  compactionsDone.Close();
+  topology.join();
+  samplingNormals.join();
+  sampling.join();
+  samplingPoints.join();
+
   for (size_t lvl=0; lvl<PYR; ++lvl) {
     delete idsCur[lvl];
     delete invInd[lvl];
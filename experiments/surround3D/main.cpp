@@ -37,6 +37,7 @@
 
 #include <tdp/gui/gui_base.hpp>
 #include <tdp/camera/rig.h>
+#include <tdp/camera/rig_ingest.h>
 #include <tdp/manifold/SE3.h>
 #include <tdp/inertial/imu_factory.h>
 #include <tdp/inertial/imu_interpolator.h>
@@ -186,7 +187,6 @@ int main( int argc, char* argv[] )
   tdp::ManagedHostImage<tdp::Vector3bda> n2D(w, h);
 
   // device image: image in GPU memory
-  tdp::ManagedDeviceImage<uint16_t> cuDraw(w, h);
   tdp::ManagedDeviceImage<float> cuD(w, h);
   tdp::ManagedDeviceImage<tdp::Vector3fda> cuN(w, h);
   tdp::ManagedDeviceImage<tdp::Vector3bda> cuN2D(w, h);
@@ -208,6 +208,11 @@ int main( int argc, char* argv[] )
   tdp::ManagedDeviceVolume<tdp::TSDFval> cuTSDF(wTSDF, hTSDF, dTSDF);
   cuTSDF.CopyFrom(TSDF);
 
+  // per-stream depth conversion and unprojection into stacked buffers
+  tdp::RigIngest<CameraT> ingest(rig);
+  tdp::ManagedHostImage<float> dIngest(w, h);
+  tdp::ManagedHostImage<tdp::Vector3fda> pcIngest(w, h);
+
   pangolin::GlBuffer vbo(pangolin::GlArrayBuffer,w*h,GL_FLOAT,3);
   pangolin::GlBuffer cbo(pangolin::GlArrayBuffer,w*h,GL_UNSIGNED_BYTE,3);
 
@@ -216,6 +221,7 @@ int main( int argc, char* argv[] )
   pangolin::Var<float> dMax("ui.d max",8.,0.1,10.);
 
   pangolin::Var<bool> useRgbCamParasForDepth("ui.use rgb cams", true, true);
+  pangolin::Var<int> maxSkewUs("ui.max stream skew us", 10000, 0, 100000);
 
   pangolin::Var<bool> odomImu("ui.odom IMU", false, true);
   pangolin::Var<bool> odomFrame2Frame("ui.odom frame2frame", false, true);
@@ -335,16 +341,16 @@ int main( int argc, char* argv[] )
     // get next frames from the video source
     gui.NextFrames();
 
-    TICK("rgb collection");
-    rig.CollectRGB(gui, rgb);
-    TOCK("rgb collection");
-    TICK("depth collection");
+    TICK("collection");
     int64_t t_host_us_d = 0;
-    cudaMemset(cuDraw.ptr_, 0, cuDraw.SizeBytes());
-    rig.CollectD(gui, dMin, dMax, cuDraw, cuD, t_host_us_d);
-    TOCK("depth collection");
+    ingest.maxSkewUs_ = maxSkewUs;
+    ingest.Collect(gui, dMin, dMax, useRgbCamParasForDepth, dIngest,
+        pcIngest, &rgb, t_host_us_d);
+    cuD.CopyFrom(dIngest);
+    pcs_o.GetImage(0).CopyFrom(pcIngest);
+    TOCK("collection");
     TICK("pc and normals");
-    rig.ComputePc(cuD, useRgbCamParasForDepth, pcs_o);
+    tdp::CompletePyramid<tdp::Vector3fda,3>(pcs_o);
     rig.ComputeNormals(cuD, useRgbCamParasForDepth, ns_o);
     TOCK("pc and normals");
 
@@ -0,0 +1,48 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <algorithm>
+#include <Eigen/Dense>
+#include <tdp/camera/camera_base.h>
+#include <tdp/data/image.h>
+#include <tdp/manifold/SE3.h>
+#include <tdp/manifold/batch.h>
+
+namespace tdp {
+
+/// Transform all points of p by T_cp and project them into uv with cam
+/// in one pass; NaN points project to NaN. Large images are processed
+/// on numThreads threads (0: all cores).
+template<typename T, int D, class Derived, int Options>
+void ProjectBatch(const CameraBase<T,D,Derived>& cam,
+    const SE3<T,Options>& T_cp,
+    const Image<Eigen::Matrix<T,3,1,Eigen::DontAlign>>& p,
+    Image<Eigen::Matrix<T,2,1,Eigen::DontAlign>>& uv,
+    size_t numThreads = 0) {
+  const Eigen::Matrix<T,3,3> R = T_cp.rotation().matrix();
+  const Eigen::Matrix<T,3,1> t = T_cp.translation();
+  ForEachRowChunk(std::min(p.w_, uv.w_), std::min(p.h_, uv.h_), numThreads,
+    [&](size_t v, size_t u0, size_t u1) {
+      Eigen::Matrix<T,3,1,Eigen::DontAlign> p_c[kBatchBlock];
+      const Eigen::Matrix<T,3,1,Eigen::DontAlign>* pRow = p.RowPtr(v);
+      Eigen::Matrix<T,2,1,Eigen::DontAlign>* uvRow = uv.RowPtr(v);
+      for (size_t u=u0; u<u1; u+=kBatchBlock) {
+        const size_t n = std::min(kBatchBlock, u1-u);
+        TransformBlock(R.data(), t.data(), pRow+u, p_c, n);
+        for (size_t i=0; i<n; ++i)
+          uvRow[u+i] = cam.Project(p_c[i]);
+      }
+    });
+}
+
+/// Project all points of p into uv; NaN points project to NaN.
+template<typename T, int D, class Derived>
+void ProjectBatch(const CameraBase<T,D,Derived>& cam,
+    const Image<Eigen::Matrix<T,3,1,Eigen::DontAlign>>& p,
+    Image<Eigen::Matrix<T,2,1,Eigen::DontAlign>>& uv,
+    size_t numThreads = 0) {
+  ProjectBatch(cam, SE3<T,Eigen::DontAlign>(), p, uv, numThreads);
+}
+
+}
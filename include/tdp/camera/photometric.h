@@ -1,7 +1,10 @@
 #pragma once 
 #include <tdp/data/image.h>
+#include <tdp/data/managed_image.h>
 #include <tdp/camera/camera_base.h>
 #include <tdp/camera/rig.h>
+#include <tdp/camera/camera_batch.h>
+#include <tdp/manifold/batch.h>
 
 namespace tdp {
 
@@ -10,11 +13,13 @@ void Overlap(const Image<Vector3fda>& pcA,
     const Image<Vector3fda>& pcB, 
     const SE3f& T_ab, 
     const CameraBase<float,D,Derived>& camA, float& overlap) {
+  ManagedHostImage<Vector2fda> xB(pcB.w_, pcB.h_);
+  ProjectBatch(camA, T_ab, pcB, xB);
   float N = 0.f;
   overlap = 0.f;
   for (size_t i=0; i<pcB.Area(); ++i) {
     if (IsValidData(pcB[i])) {
-      Eigen::Vector2f x = camA.Project(T_ab*pcB[i]);
+      const Vector2fda& x = xB[i];
       if (pcA.Inside(x)) {
         ++overlap;
       }
@@ -32,6 +37,8 @@ void Overlap(const Image<T>& greyA, const Image<T>& greyB,
     const CameraBase<float,D,Derived>& camA, float& overlap, float& rmse, 
     Image<float>* errB=nullptr) {
 
+  ManagedHostImage<Vector2fda> xB(pcB.w_, pcB.h_);
+  ProjectBatch(camA, T_ab, pcB, xB);
   float N = 0.f;
   overlap = 0.f;
   rmse = 0.f;
@@ -39,7 +46,7 @@ void Overlap(const Image<T>& greyA, const Image<T>& greyB,
 //    std::cout << errB->Description() << std::endl;
   for (size_t i=0; i<pcB.Area(); ++i) {
     if (IsValidData(pcB[i])) {
-      Eigen::Vector2f x = camA.Project(T_ab*pcB[i]);
+      const Vector2fda& x = xB[i];
       if (greyA.Inside(x) && i < greyB.Area()) {
         ++overlap;
         float y = greyA.GetBilinear(x)-greyB[i];
@@ -109,4 +116,80 @@ void OverlapGpu(
   rmse /= rig.dStream2cam_.size();
   overlap /= rig.dStream2cam_.size();
 }
+
+/// CPU version of KernelOverlap: accumulates into stats the squared
+/// photometric error of points of B that overlap A (stats(0)), their
+/// number (stats(1)) and the number of valid points of B (stats(2)). A
+/// point overlaps if it projects into A within distThr of the point of
+/// A at that pixel. T_ab maps points of B into the frame of pcA and T_ca
+/// from there into the frame of camA. Points of B are transformed in
+/// blocks with the batch kernel before projection.
+template <int D, class Derived>
+void OverlapStatsCpu(const Image<float>& greyA, const Image<float>& greyB,
+    const Image<Vector3fda>& pcA,
+    const Image<Vector3fda>& pcB,
+    const SE3f& T_ab,
+    const CameraBase<float,D,Derived>& camA,
+    Eigen::Vector3d& stats,
+    Image<float>* errB=nullptr,
+    const SE3f& T_ca=SE3f(),
+    float distThr=0.03) {
+  const Eigen::Matrix3f R = T_ab.rotation().matrix();
+  const Eigen::Vector3f t = T_ab.translation();
+  Vector3fda pBinA[kBatchBlock];
+  for (size_t v=0; v<pcB.h_; ++v) {
+    const Vector3fda* pBrow = pcB.RowPtr(v);
+    for (size_t u0=0; u0<pcB.w_; u0+=kBatchBlock) {
+      const size_t n = std::min(kBatchBlock, pcB.w_-u0);
+      TransformBlock(R.data(), t.data(), pBrow+u0, pBinA, n);
+      for (size_t i=0; i<n; ++i) {
+        if (!IsValidData(pBrow[u0+i])) continue;
+        stats(2) += 1.;
+        const Eigen::Vector2f uv = camA.Project(T_ca*pBinA[i]);
+        if (!greyA.Inside(uv)) continue;
+        const Vector3fda& pA = pcA(floor(uv(0)), floor(uv(1)));
+        if (!IsValidData(pA) || (pBinA[i]-pA).norm() >= distThr) continue;
+        const float diff = greyA.GetBilinear(uv) - greyB(u0+i,v);
+        stats(0) += diff*diff;
+        stats(1) += 1.;
+        if (errB) (*errB)(u0+i,v) = fabs(diff);
+      }
+    }
+  }
+}
+
+/// CPU version of OverlapGpu for stacked rig images at the given scale
+/// of the original image size.
+template <typename CamT>
+void OverlapCpu(
+    const Image<float>& greyA, const Image<float>& greyB,
+    const Image<Vector3fda>& pcA,
+    const Image<Vector3fda>& pcB,
+    const SE3f& T_ab,
+    const Rig<CamT>& rig, float scale, float& overlap,
+    float& rmse, Image<float>* errB=nullptr) {
+  overlap = 0.f;
+  rmse = 0.f;
+  for (size_t sId=0; sId < rig.dStream2cam_.size(); sId++) {
+    int32_t cId = rig.rgbStream2cam_[sId];
+    CamT cam = rig.cams_[cId].Scale(scale);
+    tdp::SE3f T_rc = rig.T_rcs_[cId];
+
+    Image<float> errBi;
+    if (errB) errBi = rig.GetStreamRoiOrigSize(*errB, sId, scale);
+    Eigen::Vector3d stats = Eigen::Vector3d::Zero();
+    OverlapStatsCpu(rig.GetStreamRoiOrigSize(greyA, sId, scale),
+        rig.GetStreamRoiOrigSize(greyB, sId, scale),
+        rig.GetStreamRoiOrigSize(pcA, sId, scale),
+        rig.GetStreamRoiOrigSize(pcB, sId, scale),
+        T_ab, cam, stats, errB ? &errBi : nullptr, T_rc.Inverse());
+    if (stats(2) > 0.) {
+      overlap += stats(1)/stats(2);
+      rmse += sqrt(stats(0)/stats(2));
+    }
+  }
+  rmse /= rig.dStream2cam_.size();
+  overlap /= rig.dStream2cam_.size();
+}
+
 }
@@ -3,6 +3,7 @@
 #include <tdp/preproc/plane.h>
 #include <tdp/gl/render.h>
 #include <tdp/camera/camera_base.h>
+#include <tdp/camera/projective_raster.h>
 
 namespace tdp {
 
@@ -107,41 +108,8 @@ class ProjectiveAssociation {
       tdp::Pyramid<uint8_t ,LEVELS>& pyrMask, 
       std::vector<std::vector<uint32_t>*>& ids
       ) {
-    for (size_t lvl=1; lvl < std::min(maxLvl,LEVELS); ++lvl) {
-      tdp::Image<tdp::Vector3fda> pc0 = pyrPc.GetConstImage(lvl-1);
-      tdp::Image<uint32_t> z0 = pyrZ.GetImage(lvl-1);
-      tdp::Image<uint8_t> mask0 = pyrMask.GetImage(lvl-1);
-      tdp::Image<tdp::Vector3fda> pc1 = pyrPc.GetConstImage(lvl);
-      tdp::Image<uint32_t> z1 = pyrZ.GetImage(lvl);
-      tdp::Image<uint8_t> mask1 = pyrMask.GetImage(lvl);
-      tdp::Vector4ida zs;
-      tdp::Vector4fda ds;
-      for (size_t v=0; v<pc1.h_; ++v)  {
-        for (size_t u=0; u<pc1.w_; ++u)  {
-          zs(0) = z0(2*u,2*v);
-          zs(1) = z0(2*u,2*v+1);
-          zs(2) = z0(2*u+1,2*v);
-          zs(3) = z0(2*u+1,2*v+1);
-          ds(0) = pc0(2*u,2*v)(2);
-          ds(1) = pc0(2*u,2*v+1)(2);
-          ds(2) = pc0(2*u+1,2*v)(2);
-          ds(3) = pc0(2*u+1,2*v+1)(2);
-          ds(0) = ds(0) < dMin || zs(0) == 0 ? 9999. : ds(0);
-          ds(1) = ds(1) < dMin || zs(1) == 0 ? 9999. : ds(1);
-          ds(2) = ds(2) < dMin || zs(2) == 0 ? 9999. : ds(2);
-          ds(3) = ds(3) < dMin || zs(3) == 0 ? 9999. : ds(3);
-          int32_t id = 0;
-          float minD = ds.minCoeff(&id);
-          z1(u,v) = minD > dMax ? 0 : zs(id);
-          if (z1(u,v) > 0) {
-            mask1(u,v) = 255;
-            ids[lvl]->push_back(z1(u,v)-1);
-          } else {
-            mask1(u,v) = 0;
-          }
-        }
-      }
-    }
+    tdp::FillInHigherPyramidLevels(pyrPc, dMin, dMax, maxLvl, pyrZ,
+        pyrMask, ids);
   }
 
   /// adds depth-based occlusion reasoning to filter data associations
@@ -0,0 +1,309 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <math.h>
+#include <string.h>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <Eigen/Dense>
+#include <tdp/cuda/cuda.h>
+#include <tdp/data/circular_buffer.h>
+#include <tdp/data/image.h>
+#include <tdp/data/pyramid.h>
+#include <tdp/eigen/dense.h>
+#include <tdp/manifold/SE3.h>
+#include <tdp/preproc/plane.h>
+#include <tdp/utils/batch.h>
+
+namespace tdp {
+
+/// Propagate the associations z (surfel id + 1, 0 if none) of level 0
+/// up the pyramid: every pixel of level lvl takes the association of
+/// the closest of its four children at level lvl-1.
+template<int LEVELS>
+void FillInHigherPyramidLevels(
+    const tdp::Pyramid<tdp::Vector3fda,LEVELS>& pyrPc,
+    float dMin,
+    float dMax,
+    int maxLvl,
+    tdp::Pyramid<uint32_t,LEVELS>& pyrZ,
+    tdp::Pyramid<uint8_t ,LEVELS>& pyrMask,
+    std::vector<std::vector<uint32_t>*>& ids
+    ) {
+  for (size_t lvl=1; lvl < std::min(maxLvl,LEVELS); ++lvl) {
+    tdp::Image<tdp::Vector3fda> pc0 = pyrPc.GetConstImage(lvl-1);
+    tdp::Image<uint32_t> z0 = pyrZ.GetImage(lvl-1);
+    tdp::Image<tdp::Vector3fda> pc1 = pyrPc.GetConstImage(lvl);
+    tdp::Image<uint32_t> z1 = pyrZ.GetImage(lvl);
+    tdp::Image<uint8_t> mask1 = pyrMask.GetImage(lvl);
+    tdp::Vector4ida zs;
+    tdp::Vector4fda ds;
+    for (size_t v=0; v<pc1.h_; ++v)  {
+      for (size_t u=0; u<pc1.w_; ++u)  {
+        zs(0) = z0(2*u,2*v);
+        zs(1) = z0(2*u,2*v+1);
+        zs(2) = z0(2*u+1,2*v);
+        zs(3) = z0(2*u+1,2*v+1);
+        ds(0) = pc0(2*u,2*v)(2);
+        ds(1) = pc0(2*u,2*v+1)(2);
+        ds(2) = pc0(2*u+1,2*v)(2);
+        ds(3) = pc0(2*u+1,2*v+1)(2);
+        ds(0) = ds(0) < dMin || zs(0) == 0 ? 9999. : ds(0);
+        ds(1) = ds(1) < dMin || zs(1) == 0 ? 9999. : ds(1);
+        ds(2) = ds(2) < dMin || zs(2) == 0 ? 9999. : ds(2);
+        ds(3) = ds(3) < dMin || zs(3) == 0 ? 9999. : ds(3);
+        int32_t id = 0;
+        float minD = ds.minCoeff(&id);
+        z1(u,v) = minD > dMax ? 0 : zs(id);
+        if (z1(u,v) > 0) {
+          mask1(u,v) = 255;
+          ids[lvl]->push_back(z1(u,v)-1);
+        } else {
+          mask1(u,v) = 0;
+        }
+      }
+    }
+  }
+}
+
+/// CPU counterpart of ProjectiveAssociation that needs no OpenGL
+/// context. Surfels are splatted as single pixels into a z-buffer of
+/// (depth, id) pairs on multiple threads; the closest surfel wins and
+/// ties go to the lower id, as with the GL depth test.
+///
+/// Surfel ids are offsets from the read index of the surfel buffers,
+/// the same ids the GL path renders after UploadToRead(). The surfel
+/// depth is kept with every association so the occlusion tests do not
+/// need to look the surfels up again.
+template<class CameraT>
+class ProjectiveRasterizer {
+ public:
+  ProjectiveRasterizer(const CameraT& cam, size_t w, size_t h)
+    : w_(w), h_(h), cam_(cam), numThreads_(0),
+    zbuf_(new std::atomic<uint64_t>[w*h]) {
+    Clear();
+  }
+  ~ProjectiveRasterizer() {}
+
+  /// Splat the first numElems surfels with positions pc_w, normals n_w
+  /// and last observation times t. Only surfels within [dMin, dMax] in
+  /// front of the camera, facing it and observed after tMin are drawn.
+  template<typename TimeT>
+  void Associate(const CircularBuffer<Vector3fda>& pc_w,
+      const CircularBuffer<Vector3fda>& n_w,
+      const CircularBuffer<TimeT>& t,
+      SE3f T_cw, float dMin, float dMax,
+      int32_t tMin, uint32_t numElems) {
+    Clear();
+    const Eigen::Matrix3f R_cw = T_cw.rotation().matrix();
+    const Eigen::Vector3f t_cw = T_cw.translation();
+    ForEachBlock(numElems, 4096, numThreads_, [&](size_t i0, size_t i1) {
+        for (size_t i=i0; i<i1; ++i) {
+          const size_t j = (pc_w.iRead_+i)%pc_w.w_;
+          if ((int32_t)t[j] <= tMin) continue;
+          const Vector3fda& p = pc_w[j];
+          if (!IsValidData(p)) continue;
+          const Eigen::Vector3f p_c = R_cw*p + t_cw;
+          // back facing surfels are not drawn
+          if (!(p_c.dot(R_cw*n_w[j]) < 0.f)) continue;
+          Splat(p_c, i, dMin, dMax);
+        }
+      }, 4096);
+  }
+
+  /// Splat the first numElems points pc_w without any culling.
+  void Associate(const Image<Vector3fda>& pc_w,
+      SE3f T_cw, float dMin, float dMax, uint32_t numElems) {
+    Clear();
+    const Eigen::Matrix3f R_cw = T_cw.rotation().matrix();
+    const Eigen::Vector3f t_cw = T_cw.translation();
+    ForEachBlock(numElems, 4096, numThreads_, [&](size_t i0, size_t i1) {
+        for (size_t i=i0; i<i1; ++i) {
+          if (!IsValidData(pc_w[i])) continue;
+          Splat(R_cw*pc_w[i] + t_cw, i, dMin, dMax);
+        }
+      }, 4096);
+  }
+
+  /// z_i == 0 means not associated; z_i > 0 means associated to z_i-1
+  void GetAssoc(tdp::Image<uint32_t>& z) const {
+    for (size_t i=0; i<z.Area(); ++i) {
+      z[i] = Id(zbuf_[i].load(std::memory_order_relaxed));
+    }
+  }
+  /// Depth of the associated surfel in the camera frame; NAN if none.
+  void GetDepth(tdp::Image<float>& d) const {
+    for (size_t i=0; i<d.Area(); ++i) {
+      d[i] = Depth(zbuf_[i].load(std::memory_order_relaxed));
+    }
+  }
+
+  /// adds depth-based occlusion reasoning to filter data associations
+  void GetAssocOcclusion(
+      const tdp::Image<tdp::Vector3fda>& pc_c,
+      float occlusionDepthThr,
+      tdp::Image<uint32_t>& z,
+      tdp::Image<uint8_t>& mask, std::vector<uint32_t>& ids) const {
+    GetAssoc(z);
+    for (size_t i=0; i<z.Area(); ++i) {
+      if (z[i]>0) {
+        float d_w_in_c = Depth(zbuf_[i]);
+        float d_c = pc_c[i](2);
+        if (fabs(d_w_in_c - d_c) < occlusionDepthThr) {
+          mask[i] = 255;
+          ids.push_back(z[i]-1);
+        } else {
+          mask[i] = 0;
+        }
+      }
+    }
+  }
+
+  /// adds depth-based occlusion reasoning to filter data associations
+  template<int LEVELS>
+  void GetAssocOcclusion(
+      const tdp::Pyramid<tdp::Vector3fda,LEVELS>& pyrPc,
+      float occlusionDepthThr,
+      float dMin,
+      float dMax,
+      int maxLvl,
+      tdp::Pyramid<uint32_t,LEVELS>& pyrZ,
+      tdp::Pyramid<uint8_t ,LEVELS>& pyrMask,
+      std::vector<std::vector<uint32_t>*>& ids
+      ) const {
+    tdp::Image<uint32_t> z0 = pyrZ.GetImage(0);
+    tdp::Image<uint8_t> mask0 = pyrMask.GetImage(0);
+    GetAssocOcclusion(pyrPc.GetConstImage(0), occlusionDepthThr, z0, mask0,
+        *ids[0]);
+    FillInHigherPyramidLevels(pyrPc, dMin, dMax, maxLvl, pyrZ, pyrMask, ids);
+  }
+
+  /// adds depth-variance-based occlusion reasoning to filter data
+  /// associations; surfels of pl_w in front of an associated surface
+  /// are removed if freeSpaceCarving is set.
+  void GetAssocOcclusion(
+      tdp::Image<tdp::Plane>& pl_w,
+      const tdp::Image<tdp::Vector3fda>& pc_c,
+      const tdp::Image<tdp::Vector3fda>& ray,
+      const Eigen::Matrix<float,6,6>& Sigma_wc,
+      float numSigmaOclusion,
+      bool freeSpaceCarving,
+      tdp::Image<uint32_t>& z,
+      tdp::Image<uint8_t>& mask,
+      std::vector<uint32_t>& ids) const {
+    GetAssoc(z);
+    const Eigen::Matrix3f Sigma_t = Sigma_wc.bottomRightCorner<3,3>();
+    for (size_t i=0; i<z.Area(); ++i) {
+      if (z[i]>0) {
+        float d_w_in_c = Depth(zbuf_[i]);
+        float d_c = pc_c[i](2);
+        // use only axial noise from Nguyen model and
+        // add only translational noise from camera uncertainty
+        float nguyenSigmaAxial = 0.0012 + 0.0019*(d_c-0.4)*(d_c-0.4);
+        float threeSigma_d = numSigmaOclusion*(nguyenSigmaAxial
+            + sqrtf(ray[i].dot(Sigma_t*ray[i])));
+        if (fabs(d_w_in_c - d_c) < threeSigma_d) {
+          if (freeSpaceCarving) {
+            int32_t u0 = i%pc_c.w_;
+            int32_t v0 = i/pc_c.w_;
+            if (0 < u0 && u0 < (int32_t)pc_c.w_-1
+                && 0 < v0 && v0 < (int32_t)pc_c.h_-1) {
+              for (int32_t u=u0-1; u <= u0+1; ++u)
+                for (int32_t v=v0-1; v <= v0+1; ++v)
+                  if (u!=u0 && v!=v0 && z(u,v)>0) {
+                    float d_w_in_ci = Depth(zbuf_[u+v*w_]);
+                    if (d_w_in_ci < d_c - threeSigma_d) {
+                      // found a point in front of the surface that is
+                      // already assocaited
+                      pl_w[z(u,v)-1].valid_ = false;
+                      pl_w[z(u,v)-1].p_ = tdp::Vector3fda(NAN,NAN,NAN);
+                      pl_w[z(u,v)-1].n_ = tdp::Vector3fda(NAN,NAN,NAN);
+                      z(u,v) = 0;
+                      mask(u,v) = 0;
+                    }
+                  }
+            }
+          }
+          mask[i] = 255;
+          ids.push_back(z[i]-1);
+        } else {
+          mask[i] = 0;
+        }
+      }
+    }
+  }
+
+  /// adds depth and variance-based occlusion reasoning to filter data
+  /// associations
+  template<int LEVELS>
+  void GetAssocOcclusion(
+      tdp::Image<tdp::Plane>& pl_w,
+      const tdp::Pyramid<tdp::Vector3fda,LEVELS>& pyrPc,
+      const tdp::Pyramid<tdp::Vector3fda,LEVELS>& pyrRay,
+      const Eigen::Matrix<float,6,6>& Sigma_wc,
+      float numSigmaOclusion,
+      float dMin,
+      float dMax,
+      int maxLvl,
+      bool freeSpaceCarving,
+      tdp::Pyramid<uint32_t,LEVELS>& pyrZ,
+      tdp::Pyramid<uint8_t ,LEVELS>& pyrMask,
+      std::vector<std::vector<uint32_t>*>& ids
+      ) const {
+    tdp::Image<uint32_t> z0 = pyrZ.GetImage(0);
+    tdp::Image<uint8_t> mask0 = pyrMask.GetImage(0);
+    GetAssocOcclusion(pl_w, pyrPc.GetConstImage(0), pyrRay.GetConstImage(0),
+        Sigma_wc, numSigmaOclusion, freeSpaceCarving, z0, mask0, *ids[0]);
+    FillInHigherPyramidLevels(pyrPc, dMin, dMax, maxLvl, pyrZ, pyrMask, ids);
+  }
+
+  size_t w_, h_;
+  CameraT cam_;
+  size_t numThreads_; // 0 uses all cores
+
+ private:
+  /// Depth and id packed such that the closest surfel compares lowest;
+  /// positive floats order like their bit patterns.
+  static uint64_t Key(float d, uint32_t id) {
+    uint32_t bits;
+    memcpy(&bits, &d, sizeof(float));
+    return ((uint64_t)bits << 32) | id;
+  }
+  static uint32_t Id(uint64_t key) {
+    return key == kEmpty ? 0 : (uint32_t)(key & 0xFFFFFFFF) + 1;
+  }
+  static float Depth(uint64_t key) {
+    if (key == kEmpty) return NAN;
+    const uint32_t bits = key >> 32;
+    float d;
+    memcpy(&d, &bits, sizeof(float));
+    return d;
+  }
+
+  void Clear() {
+    for (size_t i=0; i<w_*h_; ++i)
+      zbuf_[i].store(kEmpty, std::memory_order_relaxed);
+  }
+
+  void Splat(const Eigen::Vector3f& p_c, uint32_t id, float dMin,
+      float dMax) {
+    if (!(dMin <= p_c(2) && p_c(2) <= dMax)) return;
+    const Eigen::Vector2f x = cam_.Project(p_c);
+    const int32_t u = floor(x(0)+0.5f);
+    const int32_t v = floor(x(1)+0.5f);
+    if (u < 0 || u >= (int32_t)w_ || v < 0 || v >= (int32_t)h_) return;
+    const uint64_t key = Key(p_c(2), id);
+    std::atomic<uint64_t>& cur = zbuf_[u+v*w_];
+    uint64_t prev = cur.load(std::memory_order_relaxed);
+    while (key < prev && !cur.compare_exchange_weak(prev, key,
+          std::memory_order_relaxed)) {}
+  }
+
+  static const uint64_t kEmpty = ~(uint64_t)0;
+  std::unique_ptr<std::atomic<uint64_t>[]> zbuf_;
+};
+
+}
@@ -9,7 +9,7 @@ namespace tdp {
 template<int D, typename Derived>
 void ComputeCameraRays(
     const CameraBase<float,D,Derived>& cam,
-    Image<Vector3fda>& ray 
+    Image<Vector3fda>& ray
     );
 
 template<int D, typename Derived, int LEVELS>
@@ -24,6 +24,20 @@ void ComputeCameraRays(
   }
 }
 
+/// CPU version of ComputeCameraRays; rays are unprojections at z=1 so
+/// that a point at depth d is ray*d.
+template<int D, typename Derived>
+void ComputeCameraRaysCpu(
+    const CameraBase<float,D,Derived>& cam,
+    Image<Vector3fda>& ray
+    ) {
+  for (size_t v=0; v<ray.h_; ++v) {
+    Vector3fda* row = ray.RowPtr(v);
+    for (size_t u=0; u<ray.w_; ++u)
+      row[u] = cam.Unproject(u,v,1.);
+  }
+}
+
 template <typename T, int Option = Eigen::ColMajor>
 struct Ray {
   typedef Eigen::Matrix<T,3,1,Option> Point3;
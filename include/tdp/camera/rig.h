@@ -13,6 +13,7 @@
 #include <pangolin/gl/gldraw.h>
 
 #include <tdp/camera/camera.h>
+#include <tdp/camera/ray.h>
 #include <tdp/cuda/cuda.h>
 #include <tdp/data/allocator.h>
 #include <tdp/data/image.h>
@@ -78,6 +79,7 @@ struct Rig {
         if (file_json.size() > 0) {
           std::cout << "found " << file_json.size() << " elements" << std::endl ;
           cuDepthScales_.reserve(file_json.size());
+          depthScales_.reserve(file_json.size());
           for (size_t i=0; i<file_json.size(); ++i) {
             if (file_json[i].contains("camera")) {
               // serial number
@@ -109,6 +111,8 @@ struct Rig {
                   cuDepthScales_.emplace_back(w,h);
                   std::cout << cuDepthScales_[cuDepthScales_.size()-1].Description() << std::endl;
                   cuDepthScales_[cuDepthScales_.size()-1].CopyFrom(scaleWrap);
+                  depthScales_.emplace_back(w,h);
+                  depthScales_[depthScales_.size()-1].CopyFrom(scaleWrap);
                   std::cout << "found and loaded depth scale file"
                     << " " 
                     <<  cuDepthScales_[cuDepthScales_.size()-1].ptr_ << std::endl;
@@ -184,6 +188,12 @@ struct Rig {
   void ComputeNormals(Image<float>& cuD, bool useRgbCamParasForDepth, 
     Image<Vector3fda>& cuN);
 
+  /// Back projection of the stacked host images: the point of pixel i
+  /// at depth d is ray[i]*d + origin[i] in rig coordinates. Pixels not
+  /// covered by a stream get NaN rays.
+  void ComputeRaysCpu(bool useRgbCamParasForDepth,
+    Image<Vector3fda>& ray, Image<Vector3fda>& origin) const;
+
   template<int LEVELS>
   void ComputeNormals(Image<float>& cuD, bool useRgbCamParasForDepth, 
       Pyramid<Vector3fda,LEVELS>& cuPyrN);
@@ -227,6 +237,11 @@ struct Rig {
   size_t NumStreams() { return rgbdStream2cam_.size()*2; }
   size_t NumCams() { return rgbdStream2cam_.size(); }
 
+  /// Set the size of the individual streams and derive the geometry of
+  /// the stacked images (padding to %64 == 0 and the ROI offsets). Called
+  /// once from CorrespondOpenniStreams2Cams.
+  void SetStreamGeometry(size_t w, size_t h);
+
 #ifndef __CUDACC__
   void Render3D(const SE3f& T_mr, float scale=1.);
 #endif
@@ -234,22 +249,18 @@ struct Rig {
   template <typename T>
   Image<T> GetStreamRoi(const Image<T>& I, size_t streamId, float
       scale=1.) const {
-    size_t camMin = *std::min_element(rgbdStream2cam_.begin(),
-        rgbdStream2cam_.end());
     int w = floor(wSingle*scale);
     int h = floor(hSingle*scale);
-    return I.GetRoi(0, (rgbdStream2cam_[streamId]-camMin)*h, w, h);
+    return I.GetRoi(0, (rgbdStream2cam_[streamId]-camMin_)*h, w, h);
   }
 
   template <typename T>
   Image<T> GetStreamRoiOrigSize(const Image<T>& I, size_t streamId,
       float scale=1.) const {
-    size_t camMin = *std::min_element(rgbdStream2cam_.begin(),
-        rgbdStream2cam_.end());
     int w = floor(wOrig*scale);
     int h = floor(hOrig*scale);
     int hS = floor(hSingle*scale);
-    return I.GetRoi(0, (rgbdStream2cam_[streamId]-camMin)*hS, w, h);
+    return I.GetRoi(0, (rgbdStream2cam_[streamId]-camMin_)*hS, w, h);
   }
 
   // imu to rig transformations
@@ -262,7 +273,7 @@ struct Rig {
   std::vector<float> depthSensorUniformScale_;
   // depth scale calibration images
   std::vector<std::string> depthScalePaths_;
-//  std::vector<Image<float>> depthScales_;
+  std::vector<ManagedHostImage<float>> depthScales_;
   std::vector<ManagedDeviceImage<float>> cuDepthScales_;
   // depth scale scaling model as a function of depth
   eigen_vector<Eigen::Vector2f> scaleVsDepths_;
@@ -271,10 +282,11 @@ struct Rig {
   std::vector<int32_t> dStream2cam_;
   std::vector<int32_t> rgbdStream2cam_;
 
-  size_t wOrig; // original size of stream
-  size_t hOrig;
-  size_t wSingle; // original size + additional size to get %64 == 0
-  size_t hSingle; // for convolution
+  size_t wOrig = 0; // original size of stream
+  size_t hOrig = 0;
+  size_t wSingle = 0; // original size + additional size to get %64 == 0
+  size_t hSingle = 0; // for convolution
+  int32_t camMin_ = 0; // smallest rgbd camera id; row offset of the ROIs
 
   // camera serial IDs
   std::vector<std::string> serials_;
@@ -308,6 +320,9 @@ bool Rig<CamT>::CorrespondOpenniStreams2Cams(
       dStream2cam_.push_back(2*camId+1); // ir/depth
       rgbdStream2cam_.push_back(camId); // rgbd
     }
+    if (streams[0]->Streams().size() > 0)
+      SetStreamGeometry(streams[0]->Streams()[0].Width(),
+          streams[0]->Streams()[0].Height());
     return false;
   }
   pangolin::json::value jsDevices = devProps[devType]["devices"];
@@ -349,21 +364,30 @@ bool Rig<CamT>::CorrespondOpenniStreams2Cams(
   std::cout << "Found " << NumStreams()
     << " stream paired them with " << NumCams()
     << " cams" << std::endl;
+  if (streams[0]->Streams().size() > 0)
+    SetStreamGeometry(streams[0]->Streams()[0].Width(),
+        streams[0]->Streams()[0].Height());
   return true;
 }
 
+template<class CamT>
+void Rig<CamT>::SetStreamGeometry(size_t w, size_t h) {
+  wOrig = w;
+  hOrig = h;
+  wSingle = w+w%64;
+  hSingle = h+h%64;
+  camMin_ = rgbdStream2cam_.size() > 0 ? *std::min_element(
+      rgbdStream2cam_.begin(), rgbdStream2cam_.end()) : 0;
+}
+
 template<class CamT>
 void Rig<CamT>::CollectRGB(const GuiBase& gui,
     Image<Vector3bda>& rgb) {
   for (size_t sId=0; sId < rgbdStream2cam_.size(); sId++) {
     Image<Vector3bda> rgbStream;
     if (!gui.ImageRGB(rgbStream, sId)) continue;
-    // TODO: this is a bit hackie; should get the w and h somehow else
-    // beforehand
-    wOrig = rgbStream.w_;
-    hOrig = rgbStream.h_;
-    wSingle = rgbStream.w_+rgbStream.w_%64;
-    hSingle = rgbStream.h_+rgbStream.h_%64;
+    // geometry is normally set in CorrespondOpenniStreams2Cams
+    if (wSingle == 0) SetStreamGeometry(rgbStream.w_, rgbStream.h_);
     Image<Vector3bda> rgb_i = GetStreamRoi(rgb, sId);
     rgb_i.CopyFrom(rgbStream);
   }
@@ -380,15 +404,11 @@ void Rig<CamT>::CollectD(const GuiBase& gui,
     tdp::Image<uint16_t> dStream;
     int64_t t_host_us_di = 0;
     if (!gui.ImageD(dStream, sId, &t_host_us_di)) continue;
-    // TODO: this is a bit hackie; should get the w and h somehow else
-    // beforehand
     t_host_us_d += t_host_us_di;
     numStreams ++;
     int32_t cId = rgbdStream2cam_[sId]; 
-    wOrig = dStream.w_;
-    hOrig = dStream.h_;
-    wSingle = dStream.w_+dStream.w_%64;
-    hSingle = dStream.h_+dStream.h_%64;
+    // geometry is normally set in CorrespondOpenniStreams2Cams
+    if (wSingle == 0) SetStreamGeometry(dStream.w_, dStream.h_);
     tdp::Image<uint16_t> cuDraw_i = GetStreamRoi(cuDraw, sId);
     cudaMemset(cuDraw_i.ptr_, 0, cuDraw_i.SizeBytes());
     cuDraw_i.CopyFrom(dStream);
@@ -406,7 +426,7 @@ void Rig<CamT>::CollectD(const GuiBase& gui,
        std::cout << "Warning no scale information found" << std::endl;
     }
   }
-  t_host_us_d /= numStreams;  
+  if (numStreams > 0) t_host_us_d /= numStreams;
 
 }
 
@@ -463,6 +483,31 @@ void Rig<CamT>::ComputePc(Image<float>& cuD,
   }
 }
 
+template<class CamT>
+void Rig<CamT>::ComputeRaysCpu(bool useRgbCamParasForDepth,
+    Image<Vector3fda>& ray, Image<Vector3fda>& origin) const {
+  ray.Fill(Vector3fda(NAN,NAN,NAN));
+  origin.Fill(Vector3fda::Zero());
+  for (size_t sId=0; sId < dStream2cam_.size(); sId++) {
+    int32_t cId;
+    if (useRgbCamParasForDepth) {
+      cId = rgbStream2cam_[sId]; 
+    } else {
+      cId = dStream2cam_[sId]; 
+    }
+    const Eigen::Matrix3f R_rc = T_rcs_[cId].rotation().matrix();
+    const Vector3fda t_rc = T_rcs_[cId].translation();
+    Image<Vector3fda> ray_i = GetStreamRoi(ray, sId);
+    Image<Vector3fda> origin_i = GetStreamRoi(origin, sId);
+    ComputeCameraRaysCpu(cams_[cId], ray_i);
+    for (size_t v=0; v<ray_i.h_; ++v)
+      for (size_t u=0; u<ray_i.w_; ++u) {
+        ray_i(u,v) = R_rc*ray_i(u,v);
+        origin_i(u,v) = t_rc;
+      }
+  }
+}
+
 template<class CamT>
 template<int LEVELS>
 void Rig<CamT>::ComputePc(Image<float>& cuD, 
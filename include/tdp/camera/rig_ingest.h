@@ -0,0 +1,273 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <tdp/camera/ray.h>
+#include <tdp/camera/rig.h>
+#include <tdp/data/image.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/eigen/dense.h>
+#include <tdp/gui/gui_base.hpp>
+#include <tdp/preproc/depth.h>
+
+namespace tdp {
+
+/// Multi-camera ingestion for a Rig. Every rgbd stream has its own
+/// worker thread which converts the raw depth, unprojects it into rig
+/// coordinates and copies the rgb image into that stream's ROI of
+/// preallocated stacked host images. Collection time hence is that of
+/// the slowest stream instead of the sum over all streams.
+///
+/// Camera rays are precomputed once per stream in rig coordinates from
+/// the stream geometry set up when the rig was loaded
+/// (Rig::SetStreamGeometry). Frames are synchronized on t_host_us: a
+/// stream lagging more than maxSkewUs_ behind the newest stream is
+/// considered stale and its ROI is filled with NaNs.
+template<class CamT>
+class RigIngest {
+ public:
+  RigIngest(const Rig<CamT>& rig, int64_t maxSkewUs=10000);
+  ~RigIngest();
+
+  /// Collect the current frames of gui into the stacked host images d,
+  /// pc (rig coordinates) and optionally rgb; all have to be at least
+  /// wSingle x NumCams()*hSingle. t_host_us is the mean timestamp of
+  /// the synchronized streams. Returns the number of synchronized
+  /// streams.
+  size_t Collect(const GuiBase& gui, float dMin, float dMax,
+      bool useRgbCamParasForDepth,
+      Image<float>& d, Image<Vector3fda>& pc,
+      Image<Vector3bda>* rgb, int64_t& t_host_us);
+
+  /// As above for given per-stream raw depth and rgb frames with their
+  /// t_host_us timestamps; streams whose depth image is empty
+  /// (ptr_ == nullptr) have no frame and rgbStreams may be empty.
+  size_t Collect(const std::vector<Image<uint16_t>>& dStreams,
+      const std::vector<Image<Vector3bda>>& rgbStreams,
+      const std::vector<int64_t>& ts, float dMin, float dMax,
+      bool useRgbCamParasForDepth,
+      Image<float>& d, Image<Vector3fda>& pc,
+      Image<Vector3bda>* rgb, int64_t& t_host_us);
+
+  size_t NumStreams() const { return workers_.size(); }
+
+  // maximum allowed lag of a stream behind the newest stream
+  int64_t maxSkewUs_;
+  // per stream: was it part of the last collected frame
+  std::vector<bool> synced_;
+
+ private:
+  void Worker(size_t sId);
+  void Process(size_t sId);
+  void ComputeRays(int32_t cId, ManagedHostImage<Vector3fda>& ray,
+      Vector3fda& t_rc);
+
+  const Rig<CamT>& rig_;
+  // camera rays rotated into the rig frame and camera offsets for
+  // rgb and depth camera parameters
+  std::vector<ManagedHostImage<Vector3fda>> raysRgb_;
+  std::vector<ManagedHostImage<Vector3fda>> raysD_;
+  std::vector<Vector3fda> tRgb_;
+  std::vector<Vector3fda> tD_;
+
+  // current job
+  std::vector<Image<uint16_t>> dStreams_;
+  std::vector<Image<Vector3bda>> rgbStreams_;
+  std::vector<bool> haveRgb_;
+  float dMin_;
+  float dMax_;
+  bool useRgbCamParasForDepth_;
+  Image<float>* d_;
+  Image<Vector3fda>* pc_;
+  Image<Vector3bda>* rgb_;
+
+  size_t frame_;
+  size_t numDone_;
+  bool stop_;
+  std::mutex mut_;
+  std::condition_variable cvWork_;
+  std::condition_variable cvDone_;
+  std::vector<std::thread> workers_;
+};
+
+template<class CamT>
+RigIngest<CamT>::RigIngest(const Rig<CamT>& rig, int64_t maxSkewUs)
+  : maxSkewUs_(maxSkewUs), rig_(rig), dMin_(0.), dMax_(0.),
+  useRgbCamParasForDepth_(true), d_(nullptr), pc_(nullptr),
+  rgb_(nullptr), frame_(0), numDone_(0), stop_(false) {
+  const size_t numStreams = rig_.rgbdStream2cam_.size();
+  synced_.resize(numStreams, false);
+  dStreams_.resize(numStreams);
+  rgbStreams_.resize(numStreams);
+  haveRgb_.resize(numStreams, false);
+  tRgb_.resize(numStreams, Vector3fda::Zero());
+  tD_.resize(numStreams, Vector3fda::Zero());
+  for (size_t sId=0; sId<numStreams; ++sId) {
+    raysRgb_.emplace_back(rig_.wSingle, rig_.hSingle);
+    raysD_.emplace_back(rig_.wSingle, rig_.hSingle);
+    ComputeRays(rig_.rgbStream2cam_[sId], raysRgb_[sId], tRgb_[sId]);
+    ComputeRays(rig_.dStream2cam_[sId], raysD_[sId], tD_[sId]);
+  }
+  for (size_t sId=0; sId<numStreams; ++sId)
+    workers_.push_back(std::thread(&RigIngest<CamT>::Worker, this, sId));
+}
+
+template<class CamT>
+RigIngest<CamT>::~RigIngest() {
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    stop_ = true;
+  }
+  cvWork_.notify_all();
+  for (auto& worker : workers_) worker.join();
+}
+
+template<class CamT>
+void RigIngest<CamT>::ComputeRays(int32_t cId,
+    ManagedHostImage<Vector3fda>& ray, Vector3fda& t_rc) {
+  if (cId < 0 || cId >= (int32_t)rig_.cams_.size()
+      || cId >= (int32_t)rig_.T_rcs_.size()) {
+    ray.Fill(Vector3fda(NAN,NAN,NAN));
+    return;
+  }
+  ComputeCameraRaysCpu(rig_.cams_[cId], ray);
+  const Eigen::Matrix3f R_rc = rig_.T_rcs_[cId].rotation().matrix();
+  for (size_t i=0; i<ray.Area(); ++i)
+    ray[i] = R_rc*ray[i];
+  t_rc = rig_.T_rcs_[cId].translation();
+}
+
+template<class CamT>
+size_t RigIngest<CamT>::Collect(const GuiBase& gui, float dMin,
+    float dMax, bool useRgbCamParasForDepth,
+    Image<float>& d, Image<Vector3fda>& pc,
+    Image<Vector3bda>* rgb, int64_t& t_host_us) {
+  const size_t numStreams = workers_.size();
+  std::vector<Image<uint16_t>> dStreams(numStreams);
+  std::vector<Image<Vector3bda>> rgbStreams(numStreams);
+  std::vector<int64_t> ts(numStreams, 0);
+  for (size_t sId=0; sId<numStreams; ++sId) {
+    if (!gui.ImageD(dStreams[sId], sId, &ts[sId]))
+      dStreams[sId] = Image<uint16_t>();
+    if (!rgb || !gui.ImageRGB(rgbStreams[sId], sId))
+      rgbStreams[sId] = Image<Vector3bda>();
+  }
+  return Collect(dStreams, rgbStreams, ts, dMin, dMax,
+      useRgbCamParasForDepth, d, pc, rgb, t_host_us);
+}
+
+template<class CamT>
+size_t RigIngest<CamT>::Collect(
+    const std::vector<Image<uint16_t>>& dStreams,
+    const std::vector<Image<Vector3bda>>& rgbStreams,
+    const std::vector<int64_t>& ts, float dMin, float dMax,
+    bool useRgbCamParasForDepth,
+    Image<float>& d, Image<Vector3fda>& pc,
+    Image<Vector3bda>* rgb, int64_t& t_host_us) {
+  const size_t numStreams = workers_.size();
+  int64_t tNewest = std::numeric_limits<int64_t>::min();
+  for (size_t sId=0; sId<numStreams; ++sId) {
+    dStreams_[sId] = dStreams[sId];
+    synced_[sId] = dStreams[sId].ptr_ != nullptr;
+    haveRgb_[sId] = rgb && sId < rgbStreams.size()
+      && rgbStreams[sId].ptr_ != nullptr;
+    if (haveRgb_[sId]) rgbStreams_[sId] = rgbStreams[sId];
+    if (synced_[sId]) tNewest = std::max(tNewest, ts[sId]);
+  }
+  size_t numSynced = 0;
+  t_host_us = 0;
+  for (size_t sId=0; sId<numStreams; ++sId) {
+    if (synced_[sId] && tNewest - ts[sId] > maxSkewUs_)
+      synced_[sId] = false;
+    if (synced_[sId]) {
+      t_host_us += ts[sId];
+      numSynced ++;
+    }
+  }
+  if (numSynced > 0) t_host_us /= (int64_t)numSynced;
+
+  std::unique_lock<std::mutex> lock(mut_);
+  dMin_ = dMin;
+  dMax_ = dMax;
+  useRgbCamParasForDepth_ = useRgbCamParasForDepth;
+  d_ = &d;
+  pc_ = &pc;
+  rgb_ = rgb;
+  numDone_ = 0;
+  frame_ ++;
+  cvWork_.notify_all();
+  cvDone_.wait(lock, [&]{ return numDone_ == numStreams; });
+  return numSynced;
+}
+
+template<class CamT>
+void RigIngest<CamT>::Worker(size_t sId) {
+  size_t frame = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mut_);
+      cvWork_.wait(lock, [&]{ return stop_ || frame_ != frame; });
+      if (stop_) return;
+      frame = frame_;
+    }
+    Process(sId);
+    {
+      std::lock_guard<std::mutex> lock(mut_);
+      numDone_ ++;
+    }
+    cvDone_.notify_one();
+  }
+}
+
+template<class CamT>
+void RigIngest<CamT>::Process(size_t sId) {
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  Image<float> d_i = rig_.GetStreamRoi(*d_, sId);
+  Image<Vector3fda> pc_i = rig_.GetStreamRoi(*pc_, sId);
+  const int32_t cId = rig_.rgbdStream2cam_[sId];
+  if (!synced_[sId]) {
+    d_i.Fill(nan);
+  } else if (rig_.depthScales_.size() > (size_t)cId
+      && rig_.scaleVsDepths_.size() > (size_t)cId) {
+    ConvertDepth(dStreams_[sId], d_i, rig_.depthScales_[cId],
+        rig_.scaleVsDepths_[cId](0), rig_.scaleVsDepths_[cId](1),
+        dMin_, dMax_);
+  } else if (rig_.depthSensorUniformScale_.size() > (size_t)cId) {
+    ConvertDepth(dStreams_[sId], d_i,
+        rig_.depthSensorUniformScale_[cId], dMin_, dMax_);
+  } else {
+    d_i.Fill(nan);
+  }
+  // unproject into the rig frame via the precomputed rays
+  const Image<Vector3fda>& ray = useRgbCamParasForDepth_ ?
+    raysRgb_[sId] : raysD_[sId];
+  const Vector3fda& t_rc = useRgbCamParasForDepth_ ?
+    tRgb_[sId] : tD_[sId];
+  for (size_t v=0; v<pc_i.h_; ++v) {
+    const float* dRow = d_i.RowPtr(v);
+    const Vector3fda* rayRow = ray.RowPtr(v);
+    Vector3fda* pcRow = pc_i.RowPtr(v);
+    for (size_t u=0; u<pc_i.w_; ++u)
+      pcRow[u] = rayRow[u]*dRow[u] + t_rc;
+  }
+  if (rgb_) {
+    Image<Vector3bda> rgb_i = rig_.GetStreamRoi(*rgb_, sId);
+    if (haveRgb_[sId] && synced_[sId]) {
+      const Image<Vector3bda>& rgbStream = rgbStreams_[sId];
+      const size_t w = std::min(rgb_i.w_, rgbStream.w_);
+      for (size_t v=0; v<std::min(rgb_i.h_, rgbStream.h_); ++v)
+        memcpy(static_cast<void*>(rgb_i.RowPtr(v)), rgbStream.RowPtr(v),
+            w*sizeof(Vector3bda));
+    } else {
+      rgb_i.Fill(Vector3bda::Zero());
+    }
+  }
+}
+
+}
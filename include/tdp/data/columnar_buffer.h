@@ -0,0 +1,127 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <tuple>
+#include <type_traits>
+#include <tdp/data/circular_buffer.h>
+#include <tdp/data/allocator.h>
+
+namespace tdp {
+
+/// Set of circular buffers (columns) of types Ts that share their
+/// insertion and read indices; entry i of the container is entry i of
+/// every column. Each column is a ManagedCircularBuffer so it can be
+/// handed to code that expects a single circular buffer, and sweeps
+/// over the container only stream the columns they read.
+///
+/// Insert() and MarkRead() keep the indices of all columns in sync.
+/// After modifying the indices of single columns directly, call
+/// SyncIndices() to copy those of the first column to all others.
+template<template<class> class Alloc, typename... Ts>
+class ColumnarCircularBuffer {
+ public:
+  static const size_t NumColumns = sizeof...(Ts);
+  template<size_t I>
+  using ColumnType = typename std::tuple_element<I, std::tuple<Ts...>>::type;
+  template<size_t I>
+  using Column = ManagedCircularBuffer<ColumnType<I>, Alloc<ColumnType<I>>>;
+
+  ColumnarCircularBuffer() {}
+  ColumnarCircularBuffer(size_t size) { Reinitialise(size); }
+
+  void Reinitialise(size_t size) {
+    ReinitialiseOp op = {size};
+    ForEachColumn(op);
+  }
+
+  template<size_t I>
+  Column<I>& Get() { return std::get<I>(columns_); }
+  template<size_t I>
+  const Column<I>& Get() const { return std::get<I>(columns_); }
+
+  /// Insert one entry given as one value per column.
+  void Insert(const Ts&... values) { InsertImpl<0>(values...); }
+
+  /// Fill every column with its value.
+  void Fill(const Ts&... values) { FillImpl<0>(values...); }
+
+  void MarkRead(int32_t num = -1) {
+    MarkReadOp op = {num};
+    ForEachColumn(op);
+  }
+
+  void SyncIndices() {
+    SyncOp op = {Get<0>().iInsert_, Get<0>().iRead_};
+    ForEachColumn(op);
+  }
+
+  int32_t iInsert() const { return Get<0>().iInsert_; }
+  int32_t iRead() const { return Get<0>().iRead_; }
+  size_t SizeToRead() const { return Get<0>().SizeToRead(); }
+  size_t SizeToRead(int32_t iRead) const {
+    return Get<0>().SizeToRead(iRead);
+  }
+  size_t Capacity() const { return Get<0>().w_; }
+
+  /// Bytes of one entry over all columns.
+  static size_t EntryBytes() { return EntryBytesImpl<Ts...>(); }
+  size_t SizeBytes() const { return Capacity()*EntryBytes(); }
+
+  /// Call f(column) for every column; F needs a templated operator().
+  template<class F, size_t I = 0>
+  typename std::enable_if<(I < sizeof...(Ts))>::type ForEachColumn(F& f) {
+    f(std::get<I>(columns_));
+    ForEachColumn<F,I+1>(f);
+  }
+  template<class F, size_t I = 0>
+  typename std::enable_if<(I == sizeof...(Ts))>::type ForEachColumn(F&) {}
+
+ private:
+  struct ReinitialiseOp {
+    size_t size;
+    template<class C> void operator()(C& c) { c.Reinitialise(size); }
+  };
+  struct MarkReadOp {
+    int32_t num;
+    template<class C> void operator()(C& c) { c.MarkRead(num); }
+  };
+  struct SyncOp {
+    int32_t iInsert;
+    int32_t iRead;
+    template<class C> void operator()(C& c) {
+      c.iInsert_ = iInsert;
+      c.iRead_ = iRead;
+    }
+  };
+
+  template<size_t I, typename T0, typename... Rest>
+  void InsertImpl(const T0& value, const Rest&... rest) {
+    std::get<I>(columns_).Insert(value);
+    InsertImpl<I+1>(rest...);
+  }
+  template<size_t I>
+  void InsertImpl() {}
+
+  template<size_t I, typename T0, typename... Rest>
+  void FillImpl(const T0& value, const Rest&... rest) {
+    std::get<I>(columns_).Fill(value);
+    FillImpl<I+1>(rest...);
+  }
+  template<size_t I>
+  void FillImpl() {}
+
+  template<typename T0, typename... Rest>
+  static typename std::enable_if<(sizeof...(Rest) > 0), size_t>::type
+  EntryBytesImpl() { return sizeof(T0) + EntryBytesImpl<Rest...>(); }
+  template<typename T0, typename... Rest>
+  static typename std::enable_if<(sizeof...(Rest) == 0), size_t>::type
+  EntryBytesImpl() { return sizeof(T0); }
+
+  std::tuple<ManagedCircularBuffer<Ts, Alloc<Ts>>...> columns_;
+};
+
+template <typename... Ts>
+using ManagedHostColumnarBuffer = ColumnarCircularBuffer<CpuAllocator, Ts...>;
+
+}
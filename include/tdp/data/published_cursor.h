@@ -0,0 +1,146 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace tdp {
+
+/// Insert index of a CircularBuffer (or of a set of parallel buffers)
+/// that one producer appends to while several consumers read the
+/// entries before it.
+///
+/// The producer writes the new entries and then Publish()es the insert
+/// index with release semantics; a consumer that Acquire()s that index
+/// sees all entries before it without taking a lock. Consumers that ran
+/// out of work block in WaitChange() instead of spinning; waiting uses
+/// a condition variable (a futex on Linux) that Publish() only touches
+/// if somebody waits.
+class PublishedCursor {
+ public:
+  PublishedCursor(int32_t i = 0) : i_(i), numWaiting_(0), closed_(false) {}
+
+  /// Make the entries before i visible to the consumers and wake them.
+  /// The store is sequentially consistent so that it cannot pass the
+  /// check for waiting consumers.
+  void Publish(int32_t i) {
+    i_.store(i);
+    Notify();
+  }
+  int32_t Acquire() const { return i_.load(std::memory_order_acquire); }
+
+  /// Block until the published index differs from seen or the cursor
+  /// was closed; returns the published index.
+  int32_t WaitChange(int32_t seen) {
+    if (Acquire() != seen || closed_) return Acquire();
+    std::unique_lock<std::mutex> lock(mut_);
+    numWaiting_ ++;
+    cv_.wait(lock, [&]{ return i_.load() != seen || closed_; });
+    numWaiting_ --;
+    return Acquire();
+  }
+  /// As above but returns after timeout at the latest.
+  template<class Rep, class Period>
+  int32_t WaitChange(int32_t seen,
+      const std::chrono::duration<Rep,Period>& timeout) {
+    if (Acquire() != seen || closed_) return Acquire();
+    std::unique_lock<std::mutex> lock(mut_);
+    numWaiting_ ++;
+    cv_.wait_for(lock, timeout,
+        [&]{ return i_.load() != seen || closed_; });
+    numWaiting_ --;
+    return Acquire();
+  }
+
+  /// Wake all waiting consumers for good, e.g. on shutdown.
+  void Close() {
+    closed_ = true;
+    std::lock_guard<std::mutex> lock(mut_);
+    cv_.notify_all();
+  }
+  bool Closed() const { return closed_; }
+
+ private:
+  void Notify() {
+    if (numWaiting_.load() == 0) return;
+    std::lock_guard<std::mutex> lock(mut_);
+    cv_.notify_all();
+  }
+
+  std::atomic<int32_t> i_;
+  std::atomic<int32_t> numWaiting_;
+  std::atomic<bool> closed_;
+  std::mutex mut_;
+  std::condition_variable cv_;
+};
+
+/// Epoch based protection of buffer entries that get overwritten (such
+/// as by compaction or once a circular buffer wraps around) against the
+/// threads still reading them.
+///
+/// Readers hold a Guard while they access the entries:
+///   ReadEpoch::Guard guard(epoch);
+/// The writer calls Synchronize() before it overwrites entries; it
+/// returns once every reader that entered before the call has left.
+/// Readers that enter afterwards have to see the writer's intent (e.g.
+/// a flag set before Synchronize()) and stay away. Entering and leaving
+/// only touch an atomic counter.
+class ReadEpoch {
+ public:
+  ReadEpoch() : epoch_(0), numWaiting_(0) {
+    numActive_[0] = 0;
+    numActive_[1] = 0;
+  }
+
+  class Guard {
+   public:
+    explicit Guard(ReadEpoch& epoch) : epoch_(epoch), e_(epoch.Enter()) {}
+    ~Guard() { epoch_.Leave(e_); }
+   private:
+    Guard(const Guard&);
+    Guard& operator=(const Guard&);
+    ReadEpoch& epoch_;
+    uint32_t e_;
+  };
+
+  /// Wait until all readers that entered before have left. Calls are
+  /// serialized.
+  void Synchronize() {
+    std::lock_guard<std::mutex> syncLock(syncMut_);
+    const uint32_t e = epoch_.fetch_add(1);
+    std::unique_lock<std::mutex> lock(mut_);
+    numWaiting_ ++;
+    cv_.wait(lock, [&]{ return numActive_[e&1].load() == 0; });
+    numWaiting_ --;
+  }
+
+ private:
+  uint32_t Enter() {
+    while (true) {
+      const uint32_t e = epoch_.load();
+      numActive_[e&1] ++;
+      // the epoch moved on in between; enter the new one
+      if (epoch_.load() == e) return e;
+      Leave(e);
+    }
+  }
+  void Leave(uint32_t e) {
+    if (--numActive_[e&1] == 0 && numWaiting_.load() > 0) {
+      std::lock_guard<std::mutex> lock(mut_);
+      cv_.notify_all();
+    }
+  }
+
+  std::atomic<uint32_t> epoch_;
+  std::atomic<int32_t> numActive_[2];
+  std::atomic<int32_t> numWaiting_;
+  std::mutex syncMut_;
+  std::mutex mut_;
+  std::condition_variable cv_;
+};
+
+}
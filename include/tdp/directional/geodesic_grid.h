@@ -2,6 +2,8 @@
 
 #include <Eigen/Dense>
 #include <tdp/eigen/dense.h>
+#include <tdp/eigen/std_vector.h>
+#include <tdp/directional/geodesic_grid_locate.h>
 #include <pangolin/gl/gl.h>
 #include <pangolin/gl/glvbo.h>
 
@@ -19,11 +21,18 @@ class GeodesicGrid {
     return tri_lvls_[tri_lvls_.size()-1] - tri_lvls_[tri_lvls_.size()-2]; 
   }
 
+  /// Index of the leaf triangle containing direction n in O(D).
+  uint32_t Locate(const Vector3fda& n) const {
+    return LocateInGeodesicGrid(n, &tri_edges_[0], D);
+  }
+
   eigen_vector<Vector3fda> pts_;
   eigen_vector<Vector3uda> tri_;
   eigen_vector<Vector3fda> tri_centers_;
   std::vector<float> tri_areas_;
   std::vector<size_t> tri_lvls_;
+  // 3 inward facing edge normals per triangle of all levels
+  eigen_vector<Vector3fda> tri_edges_;
 
  private:
   pangolin::GlBuffer vbo_;
@@ -31,6 +40,7 @@ class GeodesicGrid {
   pangolin::GlBuffer vboc_;
   void SubdivideOnce();
   void RefreshCenters();
+  void RefreshEdges();
 };
 
 template<uint32_t D>
@@ -83,6 +93,7 @@ GeodesicGrid<D>::GeodesicGrid() {
   std::cout << ")"
     << " # pts: " << pts_.size() << std::endl;
   RefreshCenters();
+  RefreshEdges();
 }
 
 template<uint32_t D>
@@ -134,6 +145,21 @@ void GeodesicGrid<D>::RefreshCenters() {
   }
 }
 
+template<uint32_t D>
+void GeodesicGrid<D>::RefreshEdges() {
+  tri_edges_.clear();
+  tri_edges_.reserve(tri_.size()*3);
+  for (size_t i=0; i<tri_.size(); ++i) {
+    for (size_t j=0; j<3; ++j) {
+      const Vector3fda& a = pts_[tri_[i](j)];
+      const Vector3fda& b = pts_[tri_[i]((j+1)%3)];
+      const Vector3fda& c = pts_[tri_[i]((j+2)%3)];
+      Vector3fda e = a.cross(b).normalized();
+      tri_edges_.push_back(e.dot(c) < 0. ? Vector3fda(-e) : e);
+    }
+  }
+}
+
 template<uint32_t D>
 void GeodesicGrid<D>::Render3D(void) {
   size_t N = NTri();
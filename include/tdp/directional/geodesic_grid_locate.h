@@ -0,0 +1,63 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <tdp/config.h>
+#include <tdp/eigen/dense.h>
+
+namespace tdp {
+
+/// Signed distance of n to the closest edge plane of a spherical
+/// triangle given by its three inward facing unit edge normals. Positive
+/// if n lies inside the triangle.
+TDP_HOST_DEVICE
+inline float GeodesicTriScore(const Vector3fda& n, const Vector3fda* e) {
+  float s = e[0].dot(n);
+  float s1 = e[1].dot(n);
+  float s2 = e[2].dot(n);
+  s = s1 < s ? s1 : s;
+  return s2 < s ? s2 : s;
+}
+
+/// Locate the leaf triangle of a geodesic grid of depth D containing the
+/// direction n by descending the subdivision hierarchy: 20 icosahedron
+/// faces followed by 4 children per level. triEdges holds 3 inward edge
+/// normals per triangle for all levels in the order of
+/// GeodesicGrid::tri_. Returns the index among the leaf triangles (i.e.
+/// into GeodesicGrid::tri_centers_). n does not need to be normalized.
+TDP_HOST_DEVICE
+inline uint32_t LocateInGeodesicGrid(const Vector3fda& n,
+    const Vector3fda* triEdges, uint32_t D) {
+  uint32_t id = 0;
+  float best = GeodesicTriScore(n, triEdges);
+  for (uint32_t i=1; i<20; ++i) {
+    float score = GeodesicTriScore(n, triEdges+3*i);
+    if (score > best) {
+      best = score;
+      id = i;
+    }
+  }
+  uint32_t lvlStart = 0;
+  uint32_t lvlSize = 20;
+  for (uint32_t d=1; d<D; ++d) {
+    // children of triangle id are contiguous in the next level
+    const Vector3fda* children = triEdges+3*(lvlStart+lvlSize+4*id);
+    uint32_t k = 0;
+    best = GeodesicTriScore(n, children);
+    for (uint32_t j=1; j<4; ++j) {
+      float score = GeodesicTriScore(n, children+3*j);
+      if (score > best) {
+        best = score;
+        k = j;
+      }
+    }
+    id = 4*id+k;
+    lvlStart += lvlSize;
+    lvlSize *= 4;
+  }
+  return id;
+}
+
+}
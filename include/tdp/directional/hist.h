@@ -21,6 +21,26 @@ void ComputeCentroidBasedGeoidesicHist(
     Image<tdp::Vector3fda>& tri_centers,
     Image<uint32_t>& hist);
 
+/// Accumulate the normals n into the histogram over the leaf triangles
+/// of a geodesic grid of depth D using the hierarchical descent of
+/// LocateInGeodesicGrid. triEdges are the edge normals
+/// (GeodesicGrid::tri_edges_) of all levels. Every thread uses its own
+/// histogram which are merged at the end; numThreads=0 uses all cores.
+void ComputeGeodesicHist(
+    const Image<tdp::Vector3fda>& n,
+    const Image<tdp::Vector3fda>& triEdges,
+    uint32_t D,
+    Image<uint32_t>& hist,
+    size_t numThreads=0);
+
+/// GPU version of ComputeGeodesicHist; per-block histograms are kept in
+/// shared memory if they fit and merged into hist.
+void ComputeGeodesicHistGpu(
+    const Image<tdp::Vector3fda>& cuN,
+    const Image<tdp::Vector3fda>& cuTriEdges,
+    uint32_t D,
+    Image<uint32_t>& cuHist);
+
 template<uint32_t D>
 class GeodesicHist {
  public:
@@ -31,12 +51,18 @@ class GeodesicHist {
   void Render2D(float scale, bool logScale,
       bool showEmpty);
 
-  void Reset() { cudaMemset(cuHist_.ptr_,0,cuHist_.SizeBytes()); }
+  void Reset() { 
+    cudaMemset(cuHist_.ptr_,0,cuHist_.SizeBytes()); 
+    hist_.Fill(0);
+  }
   void ComputeGpu(Image<tdp::Vector3fda>& cuN);
+  /// Accumulate the normals n into the histogram on the CPU.
+  void Compute(const Image<tdp::Vector3fda>& n, size_t numThreads=0);
 
   GeodesicGrid<D> geoGrid_;
  private:
   ManagedDeviceImage<tdp::Vector3fda> cuTriCenters_;
+  ManagedDeviceImage<tdp::Vector3fda> cuTriEdges_;
   ManagedDeviceImage<uint32_t> cuHist_;
 
   eigen_vector<Vector3fda> lines_;
@@ -50,17 +76,21 @@ class GeodesicHist {
 
 template<uint32_t D>
 GeodesicHist<D>::GeodesicHist() : cuTriCenters_(geoGrid_.NTri(),1), 
+  cuTriEdges_(geoGrid_.tri_edges_.size(),1),
   cuHist_(geoGrid_.NTri(),1),
   hist_(geoGrid_.NTri(),1)
 {
   cudaMemcpy(cuTriCenters_.ptr_, &(geoGrid_.tri_centers_[0]), 
       geoGrid_.NTri()*sizeof(tdp::Vector3fda), cudaMemcpyHostToDevice);
+  cudaMemcpy(cuTriEdges_.ptr_, &(geoGrid_.tri_edges_[0]), 
+      geoGrid_.tri_edges_.size()*sizeof(tdp::Vector3fda),
+      cudaMemcpyHostToDevice);
   Reset();
 }
 
 template<uint32_t D>
 void GeodesicHist<D>::ComputeGpu(Image<tdp::Vector3fda>& cuN) {
-  ComputeCentroidBasedGeoidesicHist(cuN,cuTriCenters_,cuHist_);
+  ComputeGeodesicHistGpu(cuN,cuTriEdges_,D,cuHist_);
   hist_.CopyFrom(cuHist_, cudaMemcpyDeviceToHost);
 //  for (size_t i=0; i<hist_.Area(); ++i) 
 //    if (hist_[i] == 0) {
@@ -71,6 +101,14 @@ void GeodesicHist<D>::ComputeGpu(Image<tdp::Vector3fda>& cuN) {
 //    }
 }
 
+template<uint32_t D>
+void GeodesicHist<D>::Compute(const Image<tdp::Vector3fda>& n,
+    size_t numThreads) {
+  Image<tdp::Vector3fda> triEdges(geoGrid_.tri_edges_.size(), 1,
+      &(geoGrid_.tri_edges_[0]), Storage::Cpu);
+  ComputeGeodesicHist(n, triEdges, D, hist_, numThreads);
+}
+
 template<uint32_t D>
 void GeodesicHist<D>::RefreshLines(float scale, bool logScale) {
   float sum  =0.;
@@ -1,4 +1,9 @@
 #pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <pangolin/log/packetstream.h>
 #include <tdp/inertial/imu_interface.h>
 
@@ -13,14 +18,31 @@ class ImuPango : public ImuInterface {
   virtual bool GrabNext(ImuObs& obs);
   virtual bool GrabNewest(ImuObs& obs);
 
+  /// Start reading packets in a thread of their own (paced by the
+  /// reader in realtime mode) into a bounded queue; every packet is
+  /// announced via NotifyObs(). Without it GrabNext() reads on demand.
   virtual void Start();
   virtual void Stop();
 
+  /// Starts the reader thread if necessary and blocks until it queued
+  /// a packet or timeout_us passed.
+  virtual bool WaitForObs(int64_t timeout_us);
+
   virtual pangolin::json::value GetProperties() const;
   virtual pangolin::json::value GetFrameProperties() const;
  private:
 
   void HandlePipeClosed();
+  bool GrabNextPacket(ImuObs& obs);
+  void ReadPackets();
+
+  // packets read ahead by the reader thread
+  const static size_t kMaxQueued = 1024;
+  std::deque<ImuObs> queue_;
+  std::mutex queueMut_;
+  std::condition_variable queueCv_;
+  std::atomic<bool> running_;
+  std::thread readerThread_;
 
   pangolin::PacketStreamReader reader;
   size_t size_bytes;
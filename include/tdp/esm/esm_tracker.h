@@ -0,0 +1,128 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <iostream>
+#include <vector>
+#include <Eigen/Dense>
+#include <tdp/data/image.h>
+#include <tdp/data/pyramid.h>
+#include <tdp/manifold/SL3.h>
+
+namespace tdp {
+
+/// Coarse to fine ESM homography tracker against a fixed template.
+/// In contrast to ESM::EstimateHomography the template gradients are
+/// turned into Jacobians once per pyramid level in SetTemplate. Images
+/// are traversed row by row, and the normal equations are reduced over
+/// fixed row blocks on the global ThreadPool (ParallelReduce), so the
+/// result does not depend on the number of threads. Each level is
+/// left early once the update falls below minStep_. An optional region
+/// of interest mask restricts the template pixels used.
+class ESMTracker {
+ public:
+  /// numThreads=0 uses ThreadPool::MaxConcurrency().
+  ESMTracker(size_t numThreads=0);
+
+  /// Set the template pyramid and its gradients. Only pixels with
+  /// mask(u<<lvl, v<<lvl) != 0 are used at level lvl if mask is given.
+  template<int LEVELS>
+  void SetTemplate(
+    const Pyramid<float,LEVELS>& gray_m,
+    const Pyramid<float,LEVELS>& gradDu_m,
+    const Pyramid<float,LEVELS>& gradDv_m,
+    const Image<uint8_t>* mask=nullptr);
+
+  /// Estimate H such that gray_c(H*x) matches gray_m(x) starting from
+  /// the given H; H is in pixel coordinates of the finest level and
+  /// is transferred to every coarser level as S_l H S_l^-1 with
+  /// S_l = diag(2^-l, 2^-l, 1). Returns the mean absolute residual of
+  /// the finest level.
+  template<int LEVELS>
+  float Track(
+    const Pyramid<float,LEVELS>& gray_c,
+    const Pyramid<float,LEVELS>& gradDu_c,
+    const Pyramid<float,LEVELS>& gradDv_c,
+    const std::vector<size_t>& maxIt,
+    SL3<float>& H);
+
+  /// One ESM step at level lvl of the template; updates H, which is in
+  /// pixel coordinates of that level, and returns the norm of the update
+  /// in the Lie algebra. F is the mean absolute residual.
+  float Step(size_t lvl,
+    const Image<float>& gray_c,
+    const Image<float>& gradDu_c,
+    const Image<float>& gradDv_c,
+    SL3<float>& H, float& F);
+
+  size_t NumLevels() const { return lvls_.size(); }
+
+  float minStep_; // convergence threshold on the update per level
+  bool verbose_;
+
+ private:
+  /// Template pixels of one pyramid level in row major order.
+  struct Level {
+    std::vector<float> u;
+    std::vector<float> v;
+    std::vector<float> gray;
+    // template part of the ESM Jacobian before multiplication with the
+    // SL3 generators; 9 floats per pixel
+    std::vector<float> Jm;
+    // offset of the first pixel of each row; h+1 entries
+    std::vector<size_t> rowStart;
+  };
+
+  void SetTemplateLevel(size_t lvl,
+    const Image<float>& gray_m,
+    const Image<float>& gradDu_m,
+    const Image<float>& gradDv_m,
+    const Image<uint8_t>* mask);
+
+  std::vector<Level> lvls_;
+  Eigen::Matrix<float,9,8> J_g_;
+
+  size_t numThreads_;
+};
+
+template<int LEVELS>
+void ESMTracker::SetTemplate(
+    const Pyramid<float,LEVELS>& gray_m,
+    const Pyramid<float,LEVELS>& gradDu_m,
+    const Pyramid<float,LEVELS>& gradDv_m,
+    const Image<uint8_t>* mask) {
+  lvls_.resize(LEVELS);
+  for (int lvl=0; lvl<LEVELS; ++lvl)
+    SetTemplateLevel(lvl, gray_m.GetConstImage(lvl),
+        gradDu_m.GetConstImage(lvl), gradDv_m.GetConstImage(lvl), mask);
+}
+
+template<int LEVELS>
+float ESMTracker::Track(
+    const Pyramid<float,LEVELS>& gray_c,
+    const Pyramid<float,LEVELS>& gradDu_c,
+    const Pyramid<float,LEVELS>& gradDv_c,
+    const std::vector<size_t>& maxIt,
+    SL3<float>& H) {
+  float F = 0.;
+  for (int lvl=std::min<int>(LEVELS,lvls_.size())-1; lvl >= 0; --lvl) {
+    const float scale = 1.f/(1 << lvl);
+    const Eigen::Matrix3f S = Eigen::Vector3f(scale, scale, 1.f).asDiagonal();
+    const Eigen::Matrix3f Sinv =
+      Eigen::Vector3f(1.f/scale, 1.f/scale, 1.f).asDiagonal();
+    SL3<float> H_l(S*H.matrix()*Sinv);
+    size_t it = 0;
+    for (; it<maxIt[lvl]; ++it) {
+      float dx = Step(lvl, gray_c.GetConstImage(lvl),
+          gradDu_c.GetConstImage(lvl), gradDv_c.GetConstImage(lvl), H_l, F);
+      if (dx < minStep_) break;
+    }
+    H = SL3<float>(Sinv*H_l.matrix()*S);
+    if (verbose_)
+      std::cout << "ESM lvl " << lvl << ": " << it << " its, F=" << F
+        << std::endl;
+  }
+  return F;
+}
+
+}
@@ -40,6 +40,13 @@ struct BinaryKF {
     lsh.Insert(feats);
   }
 
+  /// Free the image pyramids once features are extracted; matching
+  /// only needs feats and lsh.
+  void ReleaseImages() {
+    pyrGrey_.Reinitialise(0,0);
+    pyrPc_.Reinitialise(0,0);
+  }
+
   ManagedHostPyramid<uint8_t,3> pyrGrey_;
   ManagedHostPyramid<Vector3fda,3> pyrPc_;
   ManagedLshForest<14> lsh;
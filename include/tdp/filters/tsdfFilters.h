@@ -18,5 +18,35 @@ struct TSDFFilters {
     Volume<TSDFval>& outputTsdf
   );
 
+  /// CPU median of f over the (2*radius+1)^3 neighbourhood of every
+  /// voxel. As in medianFilter voxels outside the volume count as 1.
+  /// Voxels with weight below wThr are copied unchanged and do not
+  /// contribute to the median of their neighbours; wThr=0 and radius=2
+  /// reproduce medianFilter. radius can be 1, 2 or 3. z-slabs are
+  /// processed by numThreads threads (0 uses all cores). Input and
+  /// output must not alias.
+  static void medianFilterCpu(
+    const Volume<TSDFval>& inputTsdf,
+    Volume<TSDFval>& outputTsdf,
+    float wThr = 0.f,
+    int radius = 2,
+    size_t numThreads = 0
+  );
+
+  /// CPU bilateral filter of f computed as three separable passes along
+  /// x, y and z with a spatial Gaussian of std sigmaSpatial [voxels] and
+  /// a range Gaussian of std sigmaRange on the difference in f. Voxels
+  /// with weight below wThr are neither changed nor used as neighbours.
+  /// Input and output must not alias.
+  static void bilateralFilterCpu(
+    const Volume<TSDFval>& inputTsdf,
+    Volume<TSDFval>& outputTsdf,
+    float sigmaSpatial = 1.f,
+    float sigmaRange = 0.1f,
+    float wThr = 0.f,
+    int radius = 2,
+    size_t numThreads = 0
+  );
+
 };
 }
@@ -0,0 +1,29 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <pangolin/gl/gl.h>
+#include <tdp/data/circular_buffer.h>
+
+namespace tdp {
+
+/// Upload the entries [i0, iInsert_) of a host circular buffer (all
+/// entries to read if i0 < 0) to the same offsets of the GL buffer bo.
+/// A range that wraps around is uploaded in two parts. Use it per
+/// column of a ColumnarCircularBuffer to upload only what is rendered.
+template<typename T>
+void UploadToRead(pangolin::GlBuffer& bo, const CircularBuffer<T>& buf,
+    int32_t i0 = -1) {
+  if (i0 < 0) i0 = buf.iRead_;
+  const int32_t i1 = buf.iInsert_;
+  if (i0 <= i1) {
+    if (i0 < i1)
+      bo.Upload(buf.ptr_+i0, (i1-i0)*sizeof(T), i0*sizeof(T));
+  } else {
+    bo.Upload(buf.ptr_+i0, (buf.w_-i0)*sizeof(T), i0*sizeof(T));
+    if (i1 > 0)
+      bo.Upload(buf.ptr_, i1*sizeof(T), 0);
+  }
+}
+
+}
@@ -3,7 +3,9 @@
 #include <vector>
 #include <tdp/eigen/dense.h>
 #include <tdp/data/image.h>
+#include <tdp/data/managed_image.h>
 #include <tdp/data/pyramid.h>
+#include <tdp/manifold/batch.h>
 #include <tdp/camera/camera.h>
 #include <tdp/camera/camera_base.h>
 #include <tdp/camera/camera_poly.h>
@@ -31,13 +33,16 @@ int AssociateANN(
   Eigen::VectorXi nnIds(k);
   Eigen::VectorXf dists(k);
 
+  ManagedHostImage<Vector3fda> pc_m_in_o(pc_m.w_, pc_m.h_);
+  TransformBatch(T_om, pc_m, pc_m_in_o);
+
   int Nassoc = 0;
 //#pragma omp parallel for
   for (size_t j=0; j<pc_m.Area(); j+=100) {
     for (size_t i=j; i<std::min(j+100,pc_m.Area()); ++i) {
 //    for (size_t i=0; i<pc_m.Area(); ++i) {
       if (i%stride == 0) {
-        Vector3fda p_m_in_o = T_om*pc_m[i];
+        const Vector3fda& p_m_in_o = pc_m_in_o[i];
         if (IsValidData(p_m_in_o)) {
           ann.Search(p_m_in_o, k, 0., nnIds, dists);
           assoc_om[i] = nnIds(0);
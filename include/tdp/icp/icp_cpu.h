@@ -0,0 +1,119 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <math.h>
+#include <tdp/eigen/dense.h>
+#include <tdp/cuda/cuda.h>
+#include <tdp/data/image.h>
+#include <tdp/camera/camera_base.h>
+#include <tdp/icp/normal_equations.h>
+#include <tdp/manifold/SE3.h>
+#include <tdp/manifold/SO3.h>
+#include <tdp/utils/parallel_for.h>
+
+namespace tdp {
+
+/// Host version of AssociateModelIntoCurrent() in icp.cuh: pixel (u,v)
+/// of the current frame that model point (x,y) projects to; returns 0 if
+/// there is one.
+template<int D, class Derived>
+inline int AssociateModelIntoCurrentCpu(int x, int y,
+    const Image<Vector3fda>& pc_m, const SE3f& T_mo, const SE3f& T_co,
+    const CameraBase<float,D,Derived>& cam, int& u, int& v) {
+  if (x >= (int)pc_m.w_ || y >= (int)pc_m.h_) return 3;
+  const Vector3fda& pc_mi = pc_m(x,y);
+  if (!IsValidData(pc_mi)) return 2;
+  const Vector3fda pc_m_in_o = T_mo.InverseTransform(pc_mi);
+  const Vector2fda x_m_in_o = cam.Project(T_co*pc_m_in_o);
+  u = floor(x_m_in_o(0)+0.5f);
+  v = floor(x_m_in_o(1)+0.5f);
+  if (0 <= u && u < (int)pc_m.w_ && 0 <= v && v < (int)pc_m.h_
+      && pc_m_in_o(2) > 0. && IsValidData(pc_m_in_o))
+    return 0;
+  return 1;
+}
+
+/// CPU counterparts of the alignment kernels in src/icp/*.cu with the
+/// same arguments and outputs. The ComputeProjective() drivers pick
+/// them for pyramids that are not in GPU memory. They run on up to
+/// numThreads threads (0 uses all cores); the results do not depend on
+/// numThreads.
+
+/// See SO3TextureStep() in photoSO3.h.
+template<int D, typename Derived>
+void SO3TextureStepCpu(
+    Image<float> grey_p,
+    Image<float> grey_c,
+    Image<Vector2fda> gradGrey_c,
+    Image<Vector3fda> rays,
+    SO3f R_cp,
+    const CameraBase<float,D,Derived>& cam,
+    Eigen::Matrix<float,3,3,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,3,1,Eigen::DontAlign>& ATb,
+    float& error,
+    float& count,
+    size_t numThreads = 0
+    );
+
+/// See ICPStepRotation() in icpRot.h.
+template<int D, typename Derived>
+void ICPStepRotationCpu(
+    Image<Vector3fda> n_m,
+    Image<Vector3fda> n_o,
+    Image<Vector3fda> pc_o,
+    const SE3f& T_mo,
+    const SE3f& T_cm,
+    const CameraBase<float,D,Derived>& cam,
+    float dotThr,
+    Eigen::Matrix<float,3,3,Eigen::DontAlign>& N,
+    float& count,
+    size_t numThreads = 0
+    );
+
+/// See ICPStep() in icpTexture.h.
+template<int D, typename Derived>
+void ICPStepCpu(
+    Image<Vector3fda> pc_m,
+    Image<Vector3fda> n_m,
+    Image<Vector2fda> gradGrey_m,
+    Image<float> grey_m,
+    Image<Vector3fda> pc_o,
+    Image<Vector3fda> n_o,
+    Image<Vector2fda> gradGrey_o,
+    Image<float> grey_o,
+    const SE3f& T_mo,
+    const SE3f& T_cm,
+    const CameraBase<float,D,Derived>& cam,
+    float dotThr,
+    float distThr,
+    float lambda,
+    Eigen::Matrix<float,6,6,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,6,1,Eigen::DontAlign>& ATb,
+    float& error,
+    float& count,
+    size_t numThreads = 0
+    );
+
+/// See ICPStep() in icpGrad3d.h.
+template<int D, typename Derived>
+void ICPStepCpu(
+    Image<Vector3fda> pc_m,
+    Image<Vector3fda> n_m,
+    Image<Vector3fda> g_m,
+    Image<Vector3fda> pc_o,
+    Image<Vector3fda> n_o,
+    Image<Vector3fda> g_o,
+    const SE3f& T_mo,
+    const SE3f& T_mc,
+    const CameraBase<float,D,Derived>& cam,
+    float dotThr,
+    float distThr,
+    Eigen::Matrix<float,6,6,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,6,1,Eigen::DontAlign>& ATb,
+    float& error,
+    float& count,
+    size_t numThreads = 0
+    );
+
+}
@@ -0,0 +1,91 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <math.h>
+#include <limits>
+#include <tdp/eigen/dense.h>
+#include <tdp/data/image.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/manifold/SE3.h>
+#include <tdp/nn/kdtree.h>
+
+namespace tdp {
+
+/// Point-to-plane ICP with nearest neighbor data association on the
+/// CPU; the counterpart of ICP::ComputeANN() for loop closures and
+/// other alignments without projective association or a GPU.
+///
+/// The kd-tree over the target cloud pc_o is built once by SetTarget()
+/// and reused by every iteration and every Compute() call. Source
+/// points are associated in parallel within the distance threshold and
+/// the normal equations are accumulated by ReduceNormalEquations(), so
+/// results do not depend on the number of threads. Residuals can be
+/// reweighted robustly.
+///
+/// Conventions are those of ICPStep(): T_mo maps target into source
+/// (model) coordinates and assoc_om(i) is the target id associated with
+/// source point i or std::numeric_limits<int>::max().
+class KdTreeICP {
+ public:
+  enum RobustLoss { L2 = 0, HUBER, TUKEY };
+
+  KdTreeICP() : loss_(L2), lossScale_(0.01f), numThreads_(0) {}
+
+  /// Build the kd-tree over every stride-th valid point of pc_o. pc_o
+  /// and n_o are referenced, not copied, and have to stay valid while
+  /// the target is used.
+  void SetTarget(const Image<Vector3fda>& pc_o, const Image<Vector3fda>& n_o,
+      size_t stride = 1) {
+    pc_o_ = pc_o;
+    n_o_ = n_o;
+    tree_.Build(pc_o, stride);
+  }
+  const KdTree& Tree() const { return tree_; }
+
+  /// Associate every stride-th valid point of pc_m with its nearest
+  /// target point closer than distThr; returns the number of
+  /// associations.
+  size_t Associate(const Image<Vector3fda>& pc_m, const SE3f& T_mo,
+      float distThr, size_t stride, Image<int>& assoc_om) const;
+
+  /// Accumulate the (robustly weighted) point-to-plane normal equations
+  /// over the associations like ICPStep(): error is the weighted sum of
+  /// squared residuals and count the number of inliers.
+  void Step(const Image<Vector3fda>& pc_m, const Image<Vector3fda>& n_m,
+      const Image<int>& assoc_om, const SE3f& T_mo, float dotThr,
+      float distThr, Matrix6fda& ATA, Vector6fda& ATb, float& error,
+      float& count) const;
+
+  /// Alternate association and Gauss-Newton steps starting from T_mo
+  /// for at most maxIt iterations. err is the mean squared residual and
+  /// count the number of inliers of the last step.
+  void Compute(const Image<Vector3fda>& pc_m, const Image<Vector3fda>& n_m,
+      SE3f& T_mo, size_t maxIt, float angleThr_deg, float distThr,
+      size_t stride, bool verbose, float& err, float& count);
+
+  /// Weight of residual r under loss_ with scale lossScale_.
+  float Weight(float r) const {
+    const float a = fabs(r);
+    if (loss_ == HUBER) {
+      return a <= lossScale_ ? 1.f : lossScale_/a;
+    } else if (loss_ == TUKEY) {
+      if (a >= lossScale_) return 0.f;
+      const float s = 1.f - (r/lossScale_)*(r/lossScale_);
+      return s*s;
+    }
+    return 1.f;
+  }
+
+  RobustLoss loss_;
+  float lossScale_;  // Huber/Tukey threshold in meters
+  size_t numThreads_; // 0 uses ThreadPool::MaxConcurrency()
+
+ private:
+  KdTree tree_;
+  Image<Vector3fda> pc_o_;
+  Image<Vector3fda> n_o_;
+  ManagedHostImage<int> assoc_om_;
+};
+
+}
@@ -0,0 +1,78 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <algorithm>
+#include <tdp/eigen/dense.h>
+#include <tdp/utils/batch.h>
+#include <tdp/utils/parallel_for.h>
+
+namespace tdp {
+
+/// Normal equations of the CPU alignment steps: every item i of
+/// [0,numItems) contributes up to R rows [a b] (a in R^N) through
+/// f(i, ab) which returns false if the item is no inlier; ab is zeroed
+/// before. The sums of the outer products give A^T A, A^T b, the sum
+/// of the squared b (error) and the number of inliers (count).
+///
+/// Rows are gathered for kBatchBlock items at a time into one array per
+/// entry and the products are summed over fixed trip counts so they
+/// vectorize; the partial sums of blocks of items are combined in order
+/// (ParallelReduce), so the result does not depend on numThreads.
+template<int N, int R, class F>
+void ReduceNormalEquations(size_t numItems, const F& f,
+    Eigen::Matrix<float,N,N,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,N,1,Eigen::DontAlign>& ATb,
+    float& error, float& count, size_t numThreads = 0) {
+  const int M = N+1;
+  const int numProducts = M*(M+1)/2;
+  typedef Eigen::Matrix<float,numProducts+1,1,Eigen::DontAlign> Sums;
+  const Sums sums = ParallelReduce<Sums>(numItems, 4096, Sums::Zero(),
+    [&](size_t i0, size_t i1, Sums& s) {
+      float rows[R*M][kBatchBlock];
+      float ab[R][M];
+      for (size_t b0=i0; b0<i1; b0+=kBatchBlock) {
+        const size_t n = std::min(kBatchBlock, i1-b0);
+        float numInliers = 0.f;
+        for (int j=0; j<R*M; ++j)
+          for (size_t l=0; l<kBatchBlock; ++l) rows[j][l] = 0.f;
+        for (size_t l=0; l<n; ++l) {
+          for (int r=0; r<R; ++r)
+            for (int j=0; j<M; ++j) ab[r][j] = 0.f;
+          if (!f(b0+l, ab)) continue;
+          for (int r=0; r<R; ++r)
+            for (int j=0; j<M; ++j) rows[r*M+j][l] = ab[r][j];
+          numInliers ++;
+        }
+        int k = 0;
+        for (int i=0; i<M; ++i) {
+          for (int j=i; j<M; ++j) {
+            float sum = 0.f;
+            for (int r=0; r<R; ++r)
+              for (size_t l=0; l<kBatchBlock; ++l)
+                sum += rows[r*M+i][l]*rows[r*M+j][l];
+            s(k++) += sum;
+          }
+        }
+        s(numProducts) += numInliers;
+      }
+    },
+    [](Sums& a, const Sums& b) { a += b; }, numThreads);
+  int k = 0;
+  for (int i=0; i<M; ++i) {
+    for (int j=i; j<M; ++j) {
+      const float val = sums(k++);
+      if (i == N) {
+        error = val;
+      } else if (j == N) {
+        ATb(i) = val;
+      } else {
+        ATA(i,j) = val;
+        ATA(j,i) = val;
+      }
+    }
+  }
+  count = sums(numProducts);
+}
+
+}
@@ -0,0 +1,515 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <math.h>
+#include <algorithm>
+#include <iostream>
+#include <utility>
+#include <vector>
+#include <Eigen/Dense>
+#include <tdp/camera/ray.h>
+#include <tdp/cuda/cuda.h>
+#include <tdp/data/circular_buffer.h>
+#include <tdp/data/image.h>
+#include <tdp/eigen/dense.h>
+#include <tdp/manifold/SE3.h>
+#include <tdp/manifold/SO3.h>
+#include <tdp/preproc/plane.h>
+#include <tdp/utils/batch.h>
+
+namespace tdp {
+
+/// Check whether the information A of a Gauss-Newton step is enough to
+/// stop associating data: the entropy H (sum of the negative log
+/// eigenvalues) is either below HThr or did not decrease by more than
+/// condEntropyThr since Hprev, and all negative log eigenvalues are
+/// below negLogEvThr.
+template<int D>
+bool CheckEntropyTermination(const Eigen::Matrix<float,D,D>& A,
+    float Hprev,
+    float HThr, float condEntropyThr, float negLogEvThr,
+    float& H, bool verbose) {
+
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix<float,D,D>> eig(A);
+  Eigen::Matrix<float,D,1> negLogEv = -eig.eigenvalues().real().array().log();
+  H = negLogEv.sum();
+  if ((H < HThr || Hprev - H < condEntropyThr)
+      && (negLogEv.array() < negLogEvThr).all()) {
+    if (verbose)
+      std::cout <<  " H " << H << " cond H " << (Hprev-H)
+        << " neg log evs: " << negLogEv.transpose() << std::endl;
+    return true;
+  }
+  return false;
+}
+
+/// Current frame at one pyramid level as seen by the residuals of
+/// SparseSurfelIcp.
+template<class CameraT>
+struct SparseIcpFrame {
+  CameraT cam;
+  Image<float> d;             // depth used for the occlusion test
+  Image<Vector3fda> pc;
+  Image<Vector3fda> n;        // invalid until extracted on demand
+  Image<Vector3fda> ray;
+  Image<float> grey;
+  Image<Vector2fda> gradGrey;
+  SE3f T_wc;
+  SE3f T_cw;
+  Eigen::Matrix3f Sigma_t;    // covariance of the translation of T_wc
+  float p2plThr;
+  float dotThr;
+};
+
+/// Point to plane residual.
+struct P2PlResidual {
+  template<class CameraT>
+  bool operator()(const Plane& pl, uint32_t i,
+      const SparseIcpFrame<CameraT>& f, int32_t u, int32_t v,
+      const Eigen::Vector2f& x, Eigen::Matrix<float,6,6>& A,
+      Eigen::Matrix<float,6,1>& b, float& err) const {
+    const Vector3fda& pc_ci = f.pc(u,v);
+    const tdp::Vector3fda& n_w =  pl.n_;
+    const tdp::Vector3fda& pc_w = pl.p_;
+    Eigen::Vector3f n_w_in_c = f.T_cw.rotation()*n_w;
+    if (n_w_in_c.dot(f.n(u,v)) > f.dotThr) {
+      float p2pl = n_w.dot(pc_w - f.T_wc*pc_ci);
+      if (fabs(p2pl) < f.p2plThr) {
+        Eigen::Matrix<float,6,1> Ai;
+        Ai.topRows<3>() = pc_ci.cross(n_w_in_c);
+        Ai.bottomRows<3>() = n_w_in_c;
+        A += Ai * Ai.transpose();
+        b += Ai * p2pl;
+        err += p2pl;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+/// Point to plane and intensity residuals weighted by their square
+/// root information. If the per surfel variances p2plVar and imVar are
+/// given (indexed like pl_w) they are used instead of sigmaPl.
+struct P2PlIntensityResidual {
+  P2PlIntensityResidual(float lambdaP2Pl, float lambdaTex, float sigmaPl,
+      const CircularBuffer<float>* p2plVar = nullptr,
+      const CircularBuffer<float>* imVar = nullptr)
+    : lambdaP2Pl_(lambdaP2Pl), lambdaTex_(lambdaTex), sigmaPl_(sigmaPl),
+    p2plVar_(p2plVar), imVar_(imVar) {}
+
+  template<class CameraT>
+  bool operator()(const Plane& pl, uint32_t i,
+      const SparseIcpFrame<CameraT>& f, int32_t u, int32_t v,
+      const Eigen::Vector2f& x, Eigen::Matrix<float,6,6>& A,
+      Eigen::Matrix<float,6,1>& b, float& err) const {
+    const float sqrtInfoP2Pl = p2plVar_ ? lambdaP2Pl_/sqrtf((*p2plVar_)[i])
+      : 1./sigmaPl_;
+    const float sqrtInfoIm = imVar_ ? lambdaTex_/sqrtf((*imVar_)[i])
+      : lambdaTex_/sigmaPl_;
+    const Vector3fda& pc_ci = f.pc(u,v);
+    const tdp::Vector3fda& n_w =  pl.n_;
+    const tdp::Vector3fda& pc_w = pl.p_;
+    Eigen::Vector3f n_w_in_c = f.T_cw.rotation()*n_w;
+    if (n_w_in_c.dot(f.n(u,v)) > f.dotThr) {
+      float p2pl = n_w.dot(pc_w - f.T_wc*pc_ci);
+      if (fabs(p2pl) < f.p2plThr) {
+        // p2pl
+        Eigen::Matrix<float,6,1> Ai;
+        Ai.topRows<3>() = pc_ci.cross(n_w_in_c);
+        Ai.bottomRows<3>() = n_w_in_c;
+        A += sqrtInfoP2Pl*(Ai * Ai.transpose());
+        b += sqrtInfoP2Pl*(Ai * p2pl);
+        err += sqrtInfoP2Pl*p2pl;
+        // texture inverse transform verified Jse3
+        Eigen::Matrix<float,2,3> Jpi = f.cam.Jproject(f.T_cw*pc_w);
+        Eigen::Matrix<float,3,6> Jse3;
+        Jse3 << SO3mat<float>::invVee(
+            f.T_cw.rotation()*(pc_w-f.T_wc.translation())),
+             -Eigen::Matrix3f::Identity();
+        Ai = Jse3.transpose() * Jpi.transpose() * f.gradGrey(u,v);
+        const float bi = - f.grey(u,v) + pl.grey_;
+        A += sqrtInfoIm*(Ai * Ai.transpose());
+        b += sqrtInfoIm*(Ai * bi);
+        err += sqrtInfoIm*bi;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  float lambdaP2Pl_;
+  float lambdaTex_;
+  float sigmaPl_;
+  const CircularBuffer<float>* p2plVar_;
+  const CircularBuffer<float>* imVar_;
+};
+
+/// Point to plane residual plus the intensity difference along the
+/// image gradient lifted onto the observed tangent plane.
+struct P2Pl3DGradResidual {
+  P2Pl3DGradResidual(float lambda) : lambda_(lambda) {}
+
+  template<class CameraT>
+  bool operator()(const Plane& pl, uint32_t i,
+      const SparseIcpFrame<CameraT>& f, int32_t u, int32_t v,
+      const Eigen::Vector2f& x, Eigen::Matrix<float,6,6>& A,
+      Eigen::Matrix<float,6,1>& b, float& err) const {
+    const Vector3fda& pc_ci = f.pc(u,v);
+    const Vector3fda& n_ci = f.n(u,v);
+    const Vector2fda& gradGrey_ci = f.gradGrey(u,v);
+    const tdp::Vector3fda& n_w =  pl.n_;
+    const tdp::Vector3fda& pc_w = pl.p_;
+    Eigen::Vector3f n_w_in_c = f.T_cw.rotation()*n_w;
+    if (n_w_in_c.dot(n_ci) > f.dotThr) {
+      float p2pl = n_w.dot(pc_w - f.T_wc*pc_ci);
+      if (fabs(p2pl) < f.p2plThr) {
+        // p2pl
+        Eigen::Matrix<float,6,1> Ai;
+        Ai.topRows<3>() = pc_ci.cross(n_w_in_c);
+        Ai.bottomRows<3>() = n_w_in_c;
+        A += Ai * Ai.transpose();
+        b += Ai * p2pl;
+        err += p2pl;
+        tdp::Rayfda ray(tdp::Vector3fda::Zero(),
+            f.cam.Unproject(x(0) + gradGrey_ci(0),x(1) + gradGrey_ci(1),1.));
+        tdp::Vector3fda grad3d = ray.IntersectPlane(pc_ci,n_ci)-pc_ci;
+        // texture inverse transform verified Jse3
+        Eigen::Matrix<float,3,6> Jse3;
+        Jse3 << SO3mat<float>::invVee(
+            f.T_cw.rotation()*(pc_w-f.T_wc.translation())),
+             -Eigen::Matrix3f::Identity();
+        Ai = Jse3.transpose() * grad3d;
+        const float bi = - f.grey(u,v) + pl.grey_;
+        A += lambda_*(Ai * Ai.transpose());
+        b += lambda_*(Ai * bi);
+        err += lambda_*bi;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  float lambda_;
+};
+
+/// Normals of the surfels used by the normal residuals: either the
+/// surfel normals or the means of the vMF clusters the surfels are
+/// assigned to (Plane::z_). The means are copied once per iteration
+/// by SnapshotMeans() so the residuals do not need the cluster lock.
+struct SurfelNormalSource {
+  SurfelNormalSource(bool useMeans) : useMeans_(useMeans) {}
+
+  /// Copy the means mu_ of the clusters [begin, end).
+  template<class It>
+  void SnapshotMeans(It begin, It end) {
+    mu_.clear();
+    for (It it=begin; it!=end; ++it) mu_.push_back(it->mu_);
+  }
+
+  const Vector3fda& Normal(const Plane& pl) const {
+    return useMeans_ && pl.z_ < mu_.size() ? mu_[pl.z_] : pl.n_;
+  }
+
+  bool useMeans_;
+  std::vector<Vector3fda> mu_;
+};
+
+/// Point to plane and normal alignment residuals.
+struct P2PlNormalResidual : public SurfelNormalSource {
+  P2PlNormalResidual(float gamma, bool useMeans)
+    : SurfelNormalSource(useMeans), gamma_(gamma) {}
+
+  template<class CameraT>
+  bool operator()(const Plane& pl, uint32_t i,
+      const SparseIcpFrame<CameraT>& f, int32_t u, int32_t v,
+      const Eigen::Vector2f& x, Eigen::Matrix<float,6,6>& A,
+      Eigen::Matrix<float,6,1>& b, float& err) const {
+    const Vector3fda& pc_ci = f.pc(u,v);
+    const Vector3fda& n_ci = f.n(u,v);
+    const tdp::Vector3fda& n_w = Normal(pl);
+    const tdp::Vector3fda& pc_w = pl.p_;
+    Eigen::Vector3f n_w_in_c = f.T_cw.rotation()*n_w;
+    if (n_w_in_c.dot(n_ci) > f.dotThr) {
+      float p2pl = n_w.dot(pc_w - f.T_wc*pc_ci);
+      if (fabs(p2pl) < f.p2plThr) {
+        // p2pl
+        Eigen::Matrix<float,6,1> Ai;
+        Ai.topRows<3>() = pc_ci.cross(n_w_in_c);
+        Ai.bottomRows<3>() = n_w_in_c;
+        A += Ai * Ai.transpose();
+        b += Ai * p2pl;
+        err += p2pl;
+        // normal
+        Ai.topRows<3>() = -n_ci.cross(n_w_in_c);
+        Ai.bottomRows<3>().fill(0.);
+        const float bi = n_ci.dot(n_w_in_c) - 1.;
+        A += gamma_*(Ai * Ai.transpose());
+        b += gamma_*(Ai * bi);
+        err += gamma_*bi;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  float gamma_;
+};
+
+/// Point to plane, normal and intensity residuals.
+struct P2PlIntensityNormalsResidual : public SurfelNormalSource {
+  P2PlIntensityNormalsResidual(float gamma, float lambda, bool useMeans)
+    : SurfelNormalSource(useMeans), gamma_(gamma), lambda_(lambda) {}
+
+  template<class CameraT>
+  bool operator()(const Plane& pl, uint32_t i,
+      const SparseIcpFrame<CameraT>& f, int32_t u, int32_t v,
+      const Eigen::Vector2f& x, Eigen::Matrix<float,6,6>& A,
+      Eigen::Matrix<float,6,1>& b, float& err) const {
+    const Vector3fda& pc_ci = f.pc(u,v);
+    const Vector3fda& n_ci = f.n(u,v);
+    const tdp::Vector3fda& n_w = Normal(pl);
+    const tdp::Vector3fda& pc_w = pl.p_;
+    Eigen::Vector3f n_w_in_c = f.T_cw.rotation()*n_w;
+    if (n_w_in_c.dot(n_ci) > f.dotThr) {
+      float p2pl = n_w.dot(pc_w - f.T_wc*pc_ci);
+      if (fabs(p2pl) < f.p2plThr) {
+        // p2pl
+        Eigen::Matrix<float,6,1> Ai;
+        Ai.topRows<3>() = pc_ci.cross(n_w_in_c);
+        Ai.bottomRows<3>() = n_w_in_c;
+        A += Ai * Ai.transpose();
+        b += Ai * p2pl;
+        err += p2pl;
+        // normal
+        Eigen::Matrix3f Asi = -f.T_wc.rotation().matrix()
+          *tdp::SO3fda::invVee(n_ci);
+        Eigen::Vector3f bsi = -(f.T_wc.rotation()*n_ci - n_w);
+        A.topLeftCorner<3,3>() += gamma_*(Asi*Asi.transpose());
+        b.topRows<3>() += gamma_*(Asi.transpose() * bsi);
+        err += gamma_*bsi.norm();
+        // texture inverse transform verified Jse3
+        Eigen::Matrix<float,2,3> Jpi = f.cam.Jproject(f.T_cw*pc_w);
+        Eigen::Matrix<float,3,6> Jse3;
+        Jse3 << SO3mat<float>::invVee(
+            f.T_cw.rotation()*(pc_w-f.T_wc.translation())),
+             -Eigen::Matrix3f::Identity();
+        Ai = Jse3.transpose() * Jpi.transpose() * f.gradGrey(u,v);
+        const float bi = -f.grey(u,v) + pl.grey_;
+        A += lambda_*(Ai * Ai.transpose());
+        b += lambda_*(Ai * bi);
+        err += lambda_*bi;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  float gamma_;
+  float lambda_;
+};
+
+/// Sparse ICP of a surfel map against the current frame.
+///
+/// SetCandidates() fixes the order in which surfels are tried: the
+/// buckets of an inverse index (e.g. of surfel normal directions) are
+/// interleaved so that every prefix of the order covers all buckets.
+/// Step() walks that order in chunks of chunkSize_ candidates which
+/// are evaluated in parallel into per chunk 6x6 normal equations.
+/// Chunks are merged in order and after every chunk the information
+/// based termination (CheckEntropyTermination) and maxObs_ are tested;
+/// the remaining chunks are discarded once either triggers. Results do
+/// not depend on the number of threads.
+///
+/// The residual functor is called as
+///   res(pl, i, frame, u, v, x, A, b, err)
+/// for surfel i projected to pixel (u,v) (subpixel x) that passed the
+/// occlusion test and returns whether it added to A, b and err; see
+/// P2PlResidual. ensureNormal(u,v) extracts the normal of the frame at
+/// (u,v) if needed. It is called from the calling thread only, in
+/// candidate order and between the parallel projection and residual
+/// passes of a wave, so it may write the frame images and any scratch
+/// (e.g. dpc of NormalViaVoting) while the residuals only read them.
+class SparseSurfelIcp {
+ public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+  SparseSurfelIcp()
+    : maxObs_(3000), chunkSize_(256), numThreads_(0), HThr_(-12.),
+    condEntropyThr_(0.1), negLogEvThr_(-1.), sigmaOcclusion_(false),
+    numSigmaOcclusion_(3.), occlusionDepthThr_(0.1), verbose_(false),
+    err_(0.), H_(1e10), Hprev_(1e10), numProjected_(0) {}
+
+  /// Interleave the surfel ids of the buckets into the candidate order.
+  void SetCandidates(const std::vector<std::vector<uint32_t>>& buckets) {
+    order_.clear();
+    size_t maxSize = 0;
+    for (const auto& bucket : buckets) {
+      maxSize = std::max(maxSize, bucket.size());
+    }
+    for (size_t j=0; j<maxSize; ++j)
+      for (const auto& bucket : buckets)
+        if (j < bucket.size()) order_.push_back(bucket[j]);
+  }
+
+  /// Accumulate the normal equations A_ x = b_ of one Gauss-Newton step
+  /// at the pose f.T_wc. Returns the number of associations.
+  template<class CameraT, class Residual, class EnsureNormal>
+  size_t Step(CircularBuffer<Plane>& pl_w, const SparseIcpFrame<CameraT>& f,
+      const Residual& res, const EnsureNormal& ensureNormal) {
+    A_.setZero();
+    b_.setZero();
+    err_ = 0.;
+    H_ = 1e10;
+    Hprev_ = 1e10;
+    numProjected_ = 0;
+    assoc_.clear();
+    const size_t numChunks = (order_.size()+chunkSize_-1)/chunkSize_;
+    const size_t numThreads = numThreads_ > 0 ? numThreads_
+      : ThreadPool::MaxConcurrency();
+    // chunks are evaluated speculatively in waves of a few per thread
+    const size_t waveSize = 4*numThreads;
+    chunks_.resize(std::min(numChunks, waveSize));
+    bool done = false;
+    for (size_t c0=0; c0<numChunks && !done; c0+=waveSize) {
+      const size_t c1 = std::min(numChunks, c0+waveSize);
+      ForEachBlock(c1-c0, 1, numThreads, [&](size_t j0, size_t j1) {
+          for (size_t j=j0; j<j1; ++j)
+            ProjectChunk(pl_w, f, c0+j, chunks_[j]);
+        }, 2);
+      for (size_t j=0; j<c1-c0; ++j)
+        for (Candidate& cand : chunks_[j].cands)
+          cand.hasNormal = ensureNormal(cand.u, cand.v);
+      ForEachBlock(c1-c0, 1, numThreads, [&](size_t j0, size_t j1) {
+          for (size_t j=j0; j<j1; ++j)
+            EvalChunk(pl_w, f, res, chunks_[j]);
+        }, 2);
+      for (size_t j=0; j<c1-c0 && !done; ++j) {
+        const Chunk& chunk = chunks_[j];
+        A_ += chunk.A;
+        b_ += chunk.b;
+        err_ += chunk.err;
+        numProjected_ += chunk.numProjected;
+        assoc_.insert(assoc_.end(), chunk.assoc.begin(), chunk.assoc.end());
+        if (assoc_.size() >= maxObs_) {
+          done = true;
+        } else if (CheckEntropyTermination(A_, Hprev_, HThr_,
+              condEntropyThr_, negLogEvThr_, H_, verbose_)) {
+          done = true;
+        } else {
+          Hprev_ = H_;
+        }
+      }
+    }
+    return assoc_.size();
+  }
+
+  /// Number of candidate surfels per Step().
+  size_t NumCandidates() const { return order_.size(); }
+
+  // association
+  size_t maxObs_;            // stop after this many associations
+  size_t chunkSize_;         // candidates per chunk
+  size_t numThreads_;        // 0 uses all cores
+  // information based termination; see CheckEntropyTermination
+  float HThr_;
+  float condEntropyThr_;
+  float negLogEvThr_;
+  // occlusion test against the depth of the frame
+  bool sigmaOcclusion_;      // use the sensor and pose noise ...
+  float numSigmaOcclusion_;  // ... times this instead of ...
+  float occlusionDepthThr_;  // ... a fixed threshold [m]
+  bool verbose_;
+
+  // results of the last Step()
+  Eigen::Matrix<float,6,6> A_;
+  Eigen::Matrix<float,6,1> b_;
+  float err_;
+  float H_;
+  float Hprev_;
+  size_t numProjected_;
+  /// surfel id and pixel index u+v*f.pc.w_ of all associations
+  std::vector<std::pair<size_t,size_t>> assoc_;
+
+ private:
+  /// Surfel i that projects to pixel (u,v) (subpixel x) of the frame
+  /// and passed the occlusion test.
+  struct Candidate {
+    uint32_t i;
+    int32_t u, v;
+    Eigen::Vector2f x;
+    bool hasNormal;
+  };
+
+  struct Chunk {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    Eigen::Matrix<float,6,6> A;
+    Eigen::Matrix<float,6,1> b;
+    float err;
+    size_t numProjected;
+    std::vector<Candidate> cands;
+    std::vector<std::pair<size_t,size_t>> assoc;
+  };
+
+  /// Collect the candidates of chunk c that project into the frame and
+  /// are not occluded; only reads the frame.
+  template<class CameraT>
+  void ProjectChunk(CircularBuffer<Plane>& pl_w,
+      const SparseIcpFrame<CameraT>& f, size_t c, Chunk& chunk) {
+    chunk.cands.clear();
+    const size_t i1 = std::min(order_.size(), (c+1)*chunkSize_);
+    for (size_t j=c*chunkSize_; j<i1; ++j) {
+      const uint32_t i = order_[j];
+      const Plane& pl = pl_w.GetCircular(i);
+      if (!pl.valid_)
+        continue;
+      tdp::Vector3fda pc_w_in_c = f.T_cw*pl.p_;
+      Eigen::Vector2f x = f.cam.Project(pc_w_in_c);
+      if (!f.d.Inside(x))
+        continue;
+      int32_t u = floor(x(0)+0.5f);
+      int32_t v = floor(x(1)+0.5f);
+      float d_c = f.d.GetBilinear(x(0),x(1));
+      if (d_c != d_c)
+        continue;
+      if (sigmaOcclusion_) {
+        const Vector3fda& ray = f.ray(u,v);
+        float nguyenSigmaAxial = 0.0012 + 0.0019*(d_c-0.4)*(d_c-0.4);
+        float threeSigma_d = numSigmaOcclusion_*(nguyenSigmaAxial
+            + sqrtf(ray.dot(f.Sigma_t*ray)));
+        if (fabs(d_c-pc_w_in_c(2)) > threeSigma_d)
+          continue;
+      } else if (fabs(d_c-pc_w_in_c(2)) > occlusionDepthThr_) {
+        continue;
+      }
+      chunk.cands.push_back({i, u, v, x, false});
+    }
+  }
+
+  /// Evaluate the residuals of the candidates of a chunk that have a
+  /// normal; only reads the frame.
+  template<class CameraT, class Residual>
+  void EvalChunk(CircularBuffer<Plane>& pl_w,
+      const SparseIcpFrame<CameraT>& f, const Residual& res, Chunk& chunk) {
+    chunk.A.setZero();
+    chunk.b.setZero();
+    chunk.err = 0.;
+    chunk.numProjected = chunk.cands.size();
+    chunk.assoc.clear();
+    for (const Candidate& cand : chunk.cands) {
+      if (!cand.hasNormal)
+        continue;
+      const Plane& pl = pl_w.GetCircular(cand.i);
+      if (!res(pl, cand.i, f, cand.u, cand.v, cand.x, chunk.A, chunk.b,
+            chunk.err))
+        continue;
+      chunk.assoc.emplace_back(cand.i, cand.u+cand.v*f.pc.w_);
+    }
+  }
+
+  std::vector<uint32_t> order_;
+  std::vector<Chunk, Eigen::aligned_allocator<Chunk>> chunks_;
+};
+
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
 #include <tdp/inertial/imu_obs.h>
 #include <pangolin/utils/picojson.h>
 
@@ -7,7 +11,7 @@ namespace tdp {
 
 class ImuInterface {
  public:
-  ImuInterface() {}
+  ImuInterface() : obsPending_(false) {}
   virtual ~ImuInterface() {}
 
   virtual bool GrabNext(ImuObs& obs) = 0;
@@ -16,10 +20,34 @@ class ImuInterface {
   virtual void Start() = 0;
   virtual void Stop() = 0;
 
+  /// Block until new observations were announced via NotifyObs() or
+  /// timeout_us passed. Returns true if there are observations to grab.
+  virtual bool WaitForObs(int64_t timeout_us) {
+    std::unique_lock<std::mutex> lock(obsMut_);
+    bool pending = obsCv_.wait_for(lock,
+        std::chrono::microseconds(timeout_us),
+        [&]{ return obsPending_; });
+    obsPending_ = false;
+    return pending;
+  }
+
   virtual pangolin::json::value GetProperties() const = 0;
 
- private:
+ protected:
+  /// Drivers receiving in their own thread call this after every new
+  /// observation to wake up WaitForObs().
+  void NotifyObs() {
+    {
+      std::lock_guard<std::mutex> lock(obsMut_);
+      obsPending_ = true;
+    }
+    obsCv_.notify_all();
+  }
 
+ private:
+  bool obsPending_;
+  std::mutex obsMut_;
+  std::condition_variable obsCv_;
 };
 
 }
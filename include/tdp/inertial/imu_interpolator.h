@@ -3,9 +3,13 @@
  */
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <thread>
 #include <tdp/inertial/imu_interface.h>
 #include <tdp/inertial/imu_outstream.h>
+#include <tdp/inertial/imu_preintegration.h>
 #include <tdp/inertial/pose_interpolator.h>
 #include <tdp/utils/threadedValue.hpp>
 
@@ -17,7 +21,7 @@ class ImuInterpolator {
     : gravity0_(Eigen::Vector3f::Zero()),
       gyro_bias_(Eigen::Vector3f::Zero()),
       imu_(imu), out_(out), receiveImu_(false), numReceived_(0),
-      calibrated_(false)
+      calibrated_(false), tPreint_(-1), haveObsPreint_(false)
   {}            
   ~ImuInterpolator()
   {}
@@ -27,11 +31,26 @@ class ImuInterpolator {
 
   void StartRecording() { if (!record_.Get()) record_.Set(true); }
   void StopRecording()  { if (record_.Get()) record_.Set(false); }
+
+  /// Preintegrated IMU delta from the t_host of the previous call (or
+  /// the end of the calibration) to the frame timestamp t_host (ns).
+  /// Waits up to timeout_us for the IMU to catch up with the frame.
+  /// Every measurement is integrated exactly once so one call per frame
+  /// costs only the measurements received since the last frame. Returns
+  /// false if the IMU is not calibrated yet.
+  bool GetPreintegration(int64_t t_host, ImuPreintegration& delta,
+      int64_t timeout_us = 10000);
   
   tdp::PoseInterpolator Ts_wi_;
   Eigen::Vector3f gravity0_;
   Eigen::Vector3f gyro_bias_;
  private:
+  void Receive(tdp::ImuObs& imuObs, tdp::ImuObs& imuObsPrev,
+      int& numCalib);
+  /// Integrate the held measurement up to obs and hold obs instead;
+  /// requires preintMut_.
+  void IntegrateObs(const tdp::ImuObs& obs);
+
   tdp::ImuInterface* imu_;
   tdp::ImuOutStream* out_;
   tdp::ThreadedValue<bool> record_;
@@ -40,6 +59,18 @@ class ImuInterpolator {
   std::thread receiverThread_;
 
   bool calibrated_;
+
+  // calibrated measurements not yet preintegrated (raw omega); beyond
+  // kMaxObsPreint (seconds of data) the oldest ones are integrated
+  // right away so the queue stays bounded without a consumer.
+  const static size_t kMaxObsPreint = 2048;
+  std::deque<tdp::ImuObs> obsPreint_;
+  std::mutex preintMut_;
+  std::condition_variable preintCv_;
+  ImuPreintegration preint_;
+  int64_t tPreint_; // time up to which preint_ has integrated in ns
+  tdp::ImuObs lastObsPreint_; // measurement held since tPreint_
+  bool haveObsPreint_;
 };
 
 }
@@ -0,0 +1,79 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <Eigen/Dense>
+#include <tdp/manifold/SO3.h>
+
+namespace tdp {
+
+/// On-manifold preintegration of gyro and accelerometer measurements
+/// between two frames (Forster et al., "On-Manifold Preintegration for
+/// Real-Time Visual-Inertial Odometry", 2016). The relative rotation,
+/// velocity and position deltas are expressed in the IMU frame at the
+/// start of the interval and do not depend on the absolute state.
+/// Jacobians with respect to the gyro and accelerometer biases allow a
+/// first order correction of the deltas when the bias estimate changes
+/// without reintegrating the measurements.
+class ImuPreintegration {
+ public:
+  ImuPreintegration(
+      const Eigen::Vector3f& bg = Eigen::Vector3f::Zero(),
+      const Eigen::Vector3f& ba = Eigen::Vector3f::Zero());
+
+  /// Reset the deltas to identity keeping the biases and noise
+  /// parameters. t0 is the start of the new interval in ns.
+  void Reset(int64_t t0 = 0);
+  /// Reset and change the biases used for integration.
+  void Reset(const Eigen::Vector3f& bg, const Eigen::Vector3f& ba,
+      int64_t t0 = 0);
+
+  /// Integrate a measurement held constant over dt seconds.
+  void Integrate(const Eigen::Vector3f& acc, const Eigen::Vector3f& omega,
+      float dt);
+
+  /// Bias corrected deltas to first order for new bias estimates.
+  SO3f DeltaR(const Eigen::Vector3f& bg) const;
+  Eigen::Vector3f DeltaV(const Eigen::Vector3f& bg,
+      const Eigen::Vector3f& ba) const;
+  Eigen::Vector3f DeltaP(const Eigen::Vector3f& bg,
+      const Eigen::Vector3f& ba) const;
+
+  /// Propagate the state R_wi, v_wi, p_wi at the start of the interval
+  /// to its end given gravity g_w in world coordinates.
+  void Predict(const SO3f& R_wi, const Eigen::Vector3f& v_wi,
+      const Eigen::Vector3f& p_wi, const Eigen::Vector3f& g_w,
+      SO3f& R_wj, Eigen::Vector3f& v_wj, Eigen::Vector3f& p_wj) const;
+
+  /// Right Jacobian of SO3.
+  static Eigen::Matrix3f Jr(const Eigen::Vector3f& phi);
+
+  Eigen::Matrix3f dR_;
+  Eigen::Vector3f dv_;
+  Eigen::Vector3f dp_;
+  float dt_; // integrated time in s
+
+  Eigen::Matrix3f dR_dbg_;
+  Eigen::Matrix3f dv_dbg_;
+  Eigen::Matrix3f dv_dba_;
+  Eigen::Matrix3f dp_dbg_;
+  Eigen::Matrix3f dp_dba_;
+  // covariance of the deltas ordered (rotation, velocity, position)
+  Eigen::Matrix<float,9,9> cov_;
+
+  // biases the measurements were integrated with
+  Eigen::Vector3f bg_;
+  Eigen::Vector3f ba_;
+  // continuous time white noise densities of gyro [rad/s/sqrt(Hz)] and
+  // accelerometer [m/s^2/sqrt(Hz)]
+  float sigmaGyro_;
+  float sigmaAcc_;
+
+  int64_t t0_; // start of the interval in ns
+  int64_t t1_; // end of the interval in ns
+  size_t numMeas_;
+};
+
+}
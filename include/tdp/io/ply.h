@@ -0,0 +1,98 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <tdp/data/image.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/eigen/dense.h>
+
+namespace tdp {
+
+/// Streaming binary little-endian PLY IO for large point clouds and
+/// meshes. The writers filter NaN points on the fly and emit the
+/// payload in fixed-size chunks directly from the Images without
+/// staging copies. The readers parse the header and mmap the payload
+/// to copy the requested properties directly (or strided) into the
+/// ManagedHostImages.
+
+struct PlyPropertyDesc {
+  std::string name;
+  uint8_t type;       // one of PlyType
+  bool isList;
+  uint8_t countType;  // type of the list length if isList
+  size_t offset;      // byte offset within a fixed-size element record
+};
+
+struct PlyElementDesc {
+  std::string name;
+  size_t size;
+  std::vector<PlyPropertyDesc> properties;
+  /// size in bytes of one record; 0 if the element contains lists
+  size_t stride;
+
+  int32_t Find(const std::string& name) const;
+};
+
+struct PlyHeader {
+  bool binaryLittleEndian;
+  std::vector<std::string> comments;
+  std::vector<PlyElementDesc> elements;
+  /// byte offset of the payload from the beginning of the file
+  size_t payloadOffset;
+
+  int32_t Find(const std::string& name) const;
+};
+
+enum PlyType {
+  PLY_INVALID = 0,
+  PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16,
+  PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64
+};
+
+/// Parse the ascii PLY header from the given buffer; returns false if
+/// the buffer does not hold a complete and valid header.
+bool ParsePlyHeader(const char* data, size_t size, PlyHeader& header);
+
+/// Number of bytes written per chunk by the streaming writers.
+const size_t PLY_STREAM_CHUNK_BYTES = 4*1024*1024;
+
+bool SavePointCloudStreamed(
+    const std::string& path,
+    const Image<Vector3fda>& verts,
+    const Image<Vector3fda>& ns,
+    std::vector<std::string> comments = std::vector<std::string>());
+
+bool SavePointCloudStreamed(
+    const std::string& path,
+    const Image<Vector3fda>& verts,
+    const Image<Vector3fda>& ns,
+    const Image<Vector3bda>& rgb,
+    std::vector<std::string> comments = std::vector<std::string>());
+
+/// Invalid vertices are dropped and the triangle indices remapped
+/// accordingly; triangles referencing dropped vertices are dropped.
+bool SaveMeshStreamed(
+    const std::string& path,
+    const Image<Vector3fda>& verts,
+    const Image<Vector3uda>& tris,
+    std::vector<std::string> comments = std::vector<std::string>());
+
+/// Load vertices (and optionally normals and colors) from a binary
+/// little-endian PLY file via mmap. Returns false if the file can not
+/// be mapped, is not binary little-endian or lacks any of the requested
+/// properties; in that case the outputs are left untouched.
+bool LoadPointCloudMapped(
+    const std::string& path,
+    ManagedHostImage<Vector3fda>& verts,
+    ManagedHostImage<Vector3fda>* ns = nullptr,
+    ManagedHostImage<Vector3bda>* rgb = nullptr);
+
+bool LoadMeshMapped(
+    const std::string& path,
+    ManagedHostImage<Vector3fda>& verts,
+    ManagedHostImage<Vector3uda>& tris);
+
+}
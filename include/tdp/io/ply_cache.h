@@ -0,0 +1,92 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <tdp/data/managed_image.h>
+#include <tdp/eigen/dense.h>
+
+namespace tdp {
+
+/// Point cloud with normals as decoded from a PLY file.
+struct PlyAsset {
+  ManagedHostImage<Vector3fda> pc;
+  ManagedHostImage<Vector3fda> n;
+
+  size_t SizeBytes() const { return pc.SizeBytes() + n.SizeBytes(); }
+};
+
+/// Asynchronous cache of PLY point clouds for browsing large sets of
+/// scans. A pool of loader threads decodes files in the order given by
+/// Schedule() (visible files first, then ahead in the direction of
+/// travel) into an LRU of host buffers bounded by a byte budget.
+/// Finished loads are queued so the render thread can pick them up via
+/// PopLoaded() and do the GL upload itself.
+class PlyCache {
+ public:
+  PlyCache(const std::vector<std::string>& paths, size_t maxBytes,
+      size_t numThreads=2);
+  ~PlyCache();
+
+  /// Schedule loading of the visible files [i0, i0+n) and of numAhead
+  /// files beyond them in direction dir (+1 or -1) followed by numAhead
+  /// files on the other side. Replaces all previously scheduled loads
+  /// that have not started yet. Visible files are never evicted.
+  void Schedule(size_t i0, size_t n, int dir, size_t numAhead);
+
+  /// Returns the asset for file i or nullptr if it is not loaded yet.
+  /// Marks the asset as most recently used.
+  std::shared_ptr<PlyAsset> Get(size_t i);
+
+  /// Pop the next asset that finished loading; returns false if there
+  /// is none. Intended to be polled from the render thread.
+  bool PopLoaded(size_t& i, std::shared_ptr<PlyAsset>& asset);
+
+  size_t SizeBytes();
+  size_t NumFiles() const { return paths_.size(); }
+
+ private:
+  struct Entry {
+    std::shared_ptr<PlyAsset> asset;
+    std::list<size_t>::iterator lruIt;
+  };
+
+  void Worker();
+  /// position of file i in the current schedule; unscheduled files rank
+  /// last. Requires mut_ to be held as do the functions below.
+  size_t Rank(size_t i) const;
+  /// find a cached entry ranked worse than rank that may be evicted.
+  bool FindVictim(size_t rank, size_t& victim) const;
+  /// evict the worst ranked, least recently used entries outside the
+  /// visible range until the byte budget is met.
+  void Evict();
+
+  std::vector<std::string> paths_;
+  size_t maxBytes_;
+  size_t bytes_;
+  size_t visible0_;
+  size_t visibleN_;
+
+  std::map<size_t, Entry> cache_;
+  std::list<size_t> lru_;  // front is most recently used
+  std::deque<size_t> queue_;
+  std::set<size_t> loading_;
+  std::map<size_t, size_t> rank_;
+  std::deque<size_t> loaded_;
+
+  bool stop_;
+  std::mutex mut_;
+  std::condition_variable cv_;
+  std::vector<std::thread> workers_;
+};
+
+}
@@ -0,0 +1,125 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <algorithm>
+#include <Eigen/Dense>
+#include <tdp/data/image.h>
+#include <tdp/manifold/SE3.h>
+#include <tdp/manifold/SO3.h>
+#include <tdp/utils/batch.h>
+
+/// Host side batch versions of the SE3 and SO3 operations. They are
+/// kept out of SE3.h and SO3.h so that CUDA translation units do not
+/// pull in the thread pool.
+
+namespace tdp {
+
+/// y[i] = R*x[i] + t for n <= kBatchBlock points; y may alias x. NaN
+/// points stay NaN since every output depends on all input coordinates.
+template<typename T>
+inline void TransformBlock(const T* R, const T* t,
+    const Eigen::Matrix<T,3,1,Eigen::DontAlign>* x,
+    Eigen::Matrix<T,3,1,Eigen::DontAlign>* y, size_t n) {
+  // the tail of a partial block is zero so that the fixed trip count
+  // loop below does not read uninitialized values
+  T xs[kBatchBlock] = {}, ys[kBatchBlock] = {}, zs[kBatchBlock] = {};
+  for (size_t i=0; i<n; ++i) {
+    xs[i] = x[i](0);
+    ys[i] = x[i](1);
+    zs[i] = x[i](2);
+  }
+  T xo[kBatchBlock], yo[kBatchBlock], zo[kBatchBlock];
+  // R is column major
+  for (size_t i=0; i<kBatchBlock; ++i) {
+    xo[i] = R[0]*xs[i] + R[3]*ys[i] + R[6]*zs[i] + t[0];
+    yo[i] = R[1]*xs[i] + R[4]*ys[i] + R[7]*zs[i] + t[1];
+    zo[i] = R[2]*xs[i] + R[5]*ys[i] + R[8]*zs[i] + t[2];
+  }
+  for (size_t i=0; i<n; ++i) {
+    y[i](0) = xo[i];
+    y[i](1) = yo[i];
+    y[i](2) = zo[i];
+  }
+}
+
+/// y = R*x + t for all points of the image x. y may be x. Rows are
+/// distributed over numThreads threads for large images.
+template<typename T>
+void TransformPoints(const Eigen::Matrix<T,3,3>& R,
+    const Eigen::Matrix<T,3,1>& t,
+    const Image<Eigen::Matrix<T,3,1,Eigen::DontAlign>>& x,
+    Image<Eigen::Matrix<T,3,1,Eigen::DontAlign>>& y,
+    size_t numThreads = 0) {
+  ForEachRowChunk(std::min(x.w_, y.w_), std::min(x.h_, y.h_), numThreads,
+    [&](size_t v, size_t u0, size_t u1) {
+      const Eigen::Matrix<T,3,1,Eigen::DontAlign>* xRow = x.RowPtr(v);
+      Eigen::Matrix<T,3,1,Eigen::DontAlign>* yRow = y.RowPtr(v);
+      for (size_t u=u0; u<u1; u+=kBatchBlock)
+        TransformBlock(R.data(), t.data(), xRow+u, yRow+u,
+            std::min(kBatchBlock, u1-u));
+    });
+}
+
+/// Transform all points of x by T_ba into y; y may be x. NaN points
+/// stay NaN. Large images are processed on numThreads threads (0: all
+/// cores).
+template<typename T, int Options>
+void TransformBatch(const SE3<T,Options>& T_ba,
+    const Image<Eigen::Matrix<T,3,1,Eigen::DontAlign>>& x,
+    Image<Eigen::Matrix<T,3,1,Eigen::DontAlign>>& y,
+    size_t numThreads = 0) {
+  TransformPoints<T>(T_ba.rotation().matrix(), T_ba.translation(), x, y,
+      numThreads);
+}
+
+/// Batch version of SE3::InverseTransform.
+template<typename T, int Options>
+void InverseTransformBatch(const SE3<T,Options>& T_ab,
+    const Image<Eigen::Matrix<T,3,1,Eigen::DontAlign>>& x,
+    Image<Eigen::Matrix<T,3,1,Eigen::DontAlign>>& y,
+    size_t numThreads = 0) {
+  const Eigen::Matrix<T,3,3> Rinv = T_ab.rotation().matrix().transpose();
+  const Eigen::Matrix<T,3,1> t = T_ab.translation();
+  TransformPoints<T>(Rinv, -Rinv*t, x, y, numThreads);
+}
+
+/// Rotate all points of x by R_ba into y; y may be x.
+template<typename T, int Options>
+void TransformBatch(const SO3<T,Options>& R_ba,
+    const Image<Eigen::Matrix<T,3,1,Eigen::DontAlign>>& x,
+    Image<Eigen::Matrix<T,3,1,Eigen::DontAlign>>& y,
+    size_t numThreads = 0) {
+  TransformPoints<T>(R_ba.matrix(), Eigen::Matrix<T,3,1>::Zero(), x, y,
+      numThreads);
+}
+
+/// SE3::Exp_ and SE3::Log_ over arrays of N elements.
+template<typename T, int Options>
+void ExpBatch(const Eigen::Matrix<T,6,1>* w, size_t N,
+    SE3<T,Options>* Ts, size_t numThreads = 0) {
+  MapBatch(w, Ts, N, [](const Eigen::Matrix<T,6,1>& wi) {
+      return SE3<T,Options>::Exp_(wi); }, numThreads);
+}
+template<typename T, int Options>
+void LogBatch(const SE3<T,Options>* Ts, size_t N,
+    Eigen::Matrix<T,6,1>* w, size_t numThreads = 0) {
+  MapBatch(Ts, w, N, [](const SE3<T,Options>& Ti) {
+      return SE3<T,Options>::Log_(Ti); }, numThreads);
+}
+
+/// SO3::Exp_ and SO3::Log_ over arrays of N elements.
+template<typename T, int Options>
+void ExpBatch(const Eigen::Matrix<T,3,1,Options>* w, size_t N,
+    SO3<T,Options>* R, size_t numThreads = 0) {
+  MapBatch(w, R, N, [](const Eigen::Matrix<T,3,1,Options>& wi) {
+      return SO3<T,Options>::Exp_(wi); }, numThreads);
+}
+template<typename T, int Options>
+void LogBatch(const SO3<T,Options>* R, size_t N,
+    Eigen::Matrix<T,3,1,Options>* w, size_t numThreads = 0) {
+  MapBatch(R, w, N, [](const SO3<T,Options>& Ri) {
+      return SO3<T,Options>::Log_(Ri); }, numThreads);
+}
+
+}
@@ -3,6 +3,7 @@
 #include <tdp/tsdf/tsdf.h>
 #include <tdp/eigen/dense.h>
 #include <tdp/data/managed_image.h>
+#include <tdp/manifold/batch.h>
 #include <tdp/marching_cubes/CIsoSurface.h>
 #include <pangolin/gl/glvbo.h>
 
@@ -41,8 +42,9 @@ bool ComputeMesh(
 
   std::cout << "Mesh Vol: " << surface.getVolume() << std::endl;
 
-  for (size_t i=0; i<vertexStore.Area(); ++i)
-    vertexStore[i] = T_wg*(vertexStore[i] + grid0);
+  // T_wg*(v + grid0) in one batch transform
+  TransformBatch(SE3f(T_wg.rotation(), T_wg*grid0), vertexStore,
+      vertexStore);
 
   vbo.Reinitialise(pangolin::GlArrayBuffer, nVertices,  GL_FLOAT,
       3, GL_DYNAMIC_DRAW);
@@ -0,0 +1,161 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <tdp/eigen/dense.h>
+#include <tdp/data/image.h>
+#include <tdp/cuda/cuda.h>
+
+namespace tdp {
+
+/// Static kd-tree over the valid points of a point cloud for exact
+/// nearest neighbor queries within a maximum distance. Unlike the ANN
+/// wrapper queries do not touch shared state, so any number of threads
+/// may search the same tree concurrently. Points are copied in leaf
+/// order into separate x, y and z arrays so that leaves are scanned
+/// without gathers.
+class KdTree {
+ public:
+  KdTree() {}
+
+  /// Build over every stride-th valid point of pc; ids returned by
+  /// Nearest() are indices into pc.
+  void Build(const Image<Vector3fda>& pc, size_t stride = 1,
+      size_t leafSize = 16) {
+    nodes_.clear();
+    pts_.clear();
+    ids_.clear();
+    stride = std::max<size_t>(1, stride);
+    for (size_t i=0; i<pc.Area(); i+=stride) {
+      if (IsValidData(pc[i])) {
+        pts_.push_back(pc[i]);
+        ids_.push_back(i);
+      }
+    }
+    if (ids_.size() > 0)
+      BuildNode(0, ids_.size(), std::max<size_t>(1, leafSize), 0);
+    const size_t N = ids_.size();
+    x_.resize(N);
+    y_.resize(N);
+    z_.resize(N);
+    for (size_t i=0; i<N; ++i) {
+      x_[i] = pts_[i](0);
+      y_[i] = pts_[i](1);
+      z_[i] = pts_[i](2);
+    }
+    pts_.clear();
+    pts_.shrink_to_fit();
+  }
+
+  size_t Size() const { return ids_.size(); }
+
+  /// Id of the nearest point to q that is closer than sqrt(maxDist2);
+  /// -1 if there is none. dist2 is set to the squared distance.
+  int Nearest(const Vector3fda& q, float maxDist2, float& dist2) const {
+    int best = -1;
+    dist2 = maxDist2;
+    if (nodes_.empty()) return best;
+    struct Entry { uint32_t node; float d2; };
+    Entry stack[2*kMaxDepth+2];
+    size_t n = 0;
+    stack[n++] = {0, 0.f};
+    while (n > 0) {
+      const Entry e = stack[--n];
+      if (e.d2 >= dist2) continue;
+      const Node& node = nodes_[e.node];
+      if (node.axis == kLeaf) {
+        for (uint32_t i=node.i0; i<node.i1; ++i) {
+          const float dx = x_[i]-q(0);
+          const float dy = y_[i]-q(1);
+          const float dz = z_[i]-q(2);
+          const float d2 = dx*dx+dy*dy+dz*dz;
+          if (d2 < dist2) {
+            dist2 = d2;
+            best = ids_[i];
+          }
+        }
+        continue;
+      }
+      const float diff = q(node.axis) - node.split;
+      const uint32_t near = diff < 0.f ? e.node+1 : node.right;
+      const uint32_t far = diff < 0.f ? node.right : e.node+1;
+      // the far side is at least |diff| away
+      stack[n++] = {far, std::max(e.d2, diff*diff)};
+      stack[n++] = {near, e.d2};
+    }
+    return best;
+  }
+
+ private:
+  enum : uint32_t { kLeaf = 3, kMaxDepth = 48 };
+  // inner nodes have their left child right after them
+  struct Node {
+    float split;
+    uint32_t axis;
+    uint32_t right;
+    uint32_t i0, i1;
+  };
+
+  void BuildNode(size_t i0, size_t i1, size_t leafSize, size_t depth) {
+    const size_t id = nodes_.size();
+    nodes_.push_back(Node());
+    Node node;
+    node.i0 = i0;
+    node.i1 = i1;
+    node.right = 0;
+    node.split = 0.f;
+    node.axis = kLeaf;
+    if (i1-i0 > leafSize && depth < kMaxDepth) {
+      Eigen::Vector3f lo = pts_[i0], hi = pts_[i0];
+      for (size_t i=i0+1; i<i1; ++i) {
+        lo = lo.cwiseMin(Eigen::Vector3f(pts_[i]));
+        hi = hi.cwiseMax(Eigen::Vector3f(pts_[i]));
+      }
+      int axis = 0;
+      (hi-lo).maxCoeff(&axis);
+      if (hi(axis) > lo(axis)) {
+        const size_t mid = (i0+i1)/2;
+        SplitAt(i0, i1, mid, axis);
+        node.axis = axis;
+        node.split = pts_[mid](axis);
+        BuildNode(i0, mid, leafSize, depth+1);
+        node.right = nodes_.size();
+        BuildNode(mid, i1, leafSize, depth+1);
+      }
+    }
+    nodes_[id] = node;
+  }
+
+  /// Reorder [i0,i1) so that element mid is in its sorted position
+  /// along axis; points and ids are kept in sync.
+  void SplitAt(size_t i0, size_t i1, size_t mid, int axis) {
+    perm_.resize(i1-i0);
+    for (size_t i=i0; i<i1; ++i) perm_[i-i0] = i;
+    std::nth_element(perm_.begin(), perm_.begin()+(mid-i0), perm_.end(),
+        [&](uint32_t a, uint32_t b) {
+          return pts_[a](axis) < pts_[b](axis);
+        });
+    tmpPts_.resize(i1-i0);
+    tmpIds_.resize(i1-i0);
+    for (size_t i=0; i<i1-i0; ++i) {
+      tmpPts_[i] = pts_[perm_[i]];
+      tmpIds_[i] = ids_[perm_[i]];
+    }
+    std::copy(tmpPts_.begin(), tmpPts_.end(), pts_.begin()+i0);
+    std::copy(tmpIds_.begin(), tmpIds_.end(), ids_.begin()+i0);
+  }
+
+  std::vector<Node> nodes_;
+  std::vector<float> x_, y_, z_;
+  std::vector<int> ids_;
+  // only used while building
+  std::vector<Vector3fda> pts_;
+  std::vector<Vector3fda> tmpPts_;
+  std::vector<int> tmpIds_;
+  std::vector<uint32_t> perm_;
+};
+
+}
@@ -51,4 +51,45 @@ void ConvertDepth(const Image<uint16_t>& dRaw,
     float dMax
     );
 
+/// CPU counterpart of ConvertDepthGpu with per-pixel scale image and
+/// the depth dependent scale model d *= aScaleVsDist*d + bScaleVsDist.
+void ConvertDepth(const Image<uint16_t>& dRaw,
+    Image<float>& d,
+    const Image<float>& scale,
+    float aScaleVsDist, float bScaleVsDist,
+    float dMin, 
+    float dMax
+    );
+
+/// Fused CPU preprocessing of a raw depth image: conversion to float
+/// depth with min/max clamping and NaN fill, unprojection via the
+/// precomputed camera rays (see ComputeCameraRaysCpu) and construction
+/// of all pyramid levels of depth and point cloud. Row blocks are
+/// processed in one cache-resident pass each and distributed over
+/// numThreads threads (0 uses all cores).
+template<int LEVELS>
+void ConvertDepthToPc(const Image<uint16_t>& dRaw,
+    float scale,
+    float dMin, 
+    float dMax,
+    const Image<Vector3fda>& ray,
+    Pyramid<float,LEVELS>& pyrD,
+    Pyramid<Vector3fda,LEVELS>& pyrPc,
+    size_t numThreads=0
+    );
+
+/// As above using a per-pixel scale image and the depth dependent scale
+/// model d *= aScaleVsDist*d + bScaleVsDist.
+template<int LEVELS>
+void ConvertDepthToPc(const Image<uint16_t>& dRaw,
+    const Image<float>& scale,
+    float aScaleVsDist, float bScaleVsDist,
+    float dMin, 
+    float dMax,
+    const Image<Vector3fda>& ray,
+    Pyramid<float,LEVELS>& pyrD,
+    Pyramid<Vector3fda,LEVELS>& pyrPc,
+    size_t numThreads=0
+    );
+
 }
@@ -1,7 +1,9 @@
 #pragma once
 #include <random>
 #include <tdp/camera/camera_base.h>
+#include <tdp/cuda/cuda.h>
 #include <tdp/data/image.h>
+#include <tdp/data/pyramid.h>
 #include <tdp/eigen/dense.h>
 
 namespace tdp {
@@ -0,0 +1,71 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <tdp/data/image.h>
+#include <tdp/eigen/dense.h>
+
+namespace tdp {
+
+/// Walker/Vose alias table over n weights: after Build() every Sample()
+/// costs O(1) irrespective of n.
+class AliasTable {
+ public:
+  /// Weights w have to be non negative with a positive sum.
+  void Build(const float* w, size_t n, float sum);
+  /// Index distributed according to the weights for u0, u1 uniform in
+  /// [0,1).
+  uint32_t Sample(float u0, float u1) const {
+    const uint32_t i = std::min<uint32_t>(u0*prob_.size(), prob_.size()-1);
+    return u1 < prob_[i] ? i : alias_[i];
+  }
+  size_t Size() const { return prob_.size(); }
+
+ private:
+  std::vector<float> prob_;
+  std::vector<uint32_t> alias_;
+  std::vector<uint32_t> small_;
+  std::vector<uint32_t> large_;
+};
+
+/// Chooses the pixels where new surfels are extracted, in the same way
+/// as GradientNormBiasedResampleEmptyPartsOfMask(): the mask is cleared
+/// and the I x J blocks of the w x h image that had no pixel set get new
+/// ones; each pixel with probability prob*(pUniform/(I*J) +
+/// (1-pUniform)*g/sum(g)) where g is the grey gradient norm and prob
+/// grows with the squared average depth of the block.
+///
+/// Instead of one coin flip per pixel a block draws a Poisson number of
+/// pixels with replacement from an alias table over the rates
+/// -log(1-p) of its pixels and sets every pixel drawn at least once,
+/// which sets each pixel independently with probability p as above at
+/// a cost of O(1) per draw. Blocks are processed in parallel; every
+/// block draws from its own generator seeded by the block index and one
+/// draw from gen, so the result does not depend on the number of
+/// threads.
+class GradientMaskSampler {
+ public:
+  GradientMaskSampler() : numThreads_(0) {}
+
+  /// New pixels are set to 128 in mask and their ids (u+v*mask.w_) are
+  /// appended to idNew block by block.
+  void ResampleEmptyParts(const Image<Vector3fda>& pc, Image<uint8_t>& mask,
+      const Image<float>& greyGradNorm, float subsample, std::mt19937& gen,
+      size_t I, size_t J, size_t w, size_t h, float pUniform,
+      std::vector<uint32_t>& idNew);
+
+  size_t numThreads_; // 0 uses all cores
+
+ private:
+  struct Block {
+    AliasTable alias;
+    std::vector<float> lambda;
+    std::vector<uint32_t> ids;
+  };
+  std::vector<Block> blocks_;
+};
+
+}
@@ -1,10 +1,14 @@
 #pragma once
 
+#include <vector>
 #include <Eigen/Dense>
+#include <tdp/config.h>
+#include <tdp/cuda/cuda.h>
 #include <tdp/data/image.h>
 #include <tdp/data/managed_image.h>
 #include <tdp/eigen/dense.h>
 #include <tdp/reductions/vectorSum.h>
+#include <tdp/utils/parallel_for.h>
 
 namespace tdp {
 
@@ -21,11 +25,24 @@ template<int K>
 class vMFMMF {
  public:
    vMFMMF(float tauR) 
-    : t_(0), tauR_(tauR), cuMu_(6*K,1), cuPi_(6*K,1) 
+    : t_(0), tauR_(tauR), numValid_(0)
+#ifdef CUDA_FOUND
+      , cuMu_(6*K,1), cuPi_(6*K,1) 
+#endif
    {Reset();};
    ~vMFMMF() {};
 
+#ifdef CUDA_FOUND
    float Compute(const Image<Vector3fda>& cuN, size_t maxIt, bool verbose);
+#endif
+   /// CPU version of Compute. Association and accumulation of the
+   /// sufficient statistics of all MFs are fused into a single
+   /// multithreaded pass over n per iteration (numThreads=0 uses all
+   /// cores). Starts from the rotations Rs_ of the previous call. If
+   /// maxSamples > 0 the normals are subsampled with a stride adapted to
+   /// the number of valid normals of the previous frame.
+   float ComputeCpu(const Image<Vector3fda>& n, size_t maxIt,
+       bool verbose, size_t maxSamples=0, size_t numThreads=0);
    void Reset();
 
    std::vector<Eigen::Matrix3f> Rs_; // rotations of MFs
@@ -34,6 +51,21 @@ class vMFMMF {
    int64_t t_;
    float tauR_;
  private:
+   typedef std::vector<Eigen::Matrix<float,4,6>,
+           Eigen::aligned_allocator<Eigen::Matrix<float,4,6>>> SumsT;
+   float UpdateMF(const SumsT& nSums);
+   void Print(size_t it, float assocCost);
+
+   /// One pass over every stride'th normal of n: assigns each normal to
+   /// the closest MF axis and accumulates normal sums and counts per
+   /// axis into nSums. Returns the sum of the association costs; W is
+   /// the number of valid normals.
+   float AssociateAndSum(const Image<Vector3fda>& n, size_t stride,
+       size_t numThreads, SumsT& nSums, float& W);
+
+   size_t numValid_; // number of valid normals in the previous frame
+
+#ifdef CUDA_FOUND
    float UpdateMF(const Image<Vector3fda>& cuN);
    float UpdateAssociation(const Image<Vector3fda>& cuN);
 
@@ -42,6 +74,7 @@ class vMFMMF {
    ManagedDeviceImage<uint32_t> cuZ_;
    ManagedDeviceImage<Vector3fda> cuMu_;
    ManagedDeviceImage<float> cuPi_;
+#endif
 };
 
 template<int K>
@@ -53,8 +86,23 @@ void vMFMMF<K>::Reset() {
   Ns_.clear(); 
   Ns_.resize(K, 0.f);
   t_ = 0;
+  numValid_ = 0;
 }
 
+template<int K>
+void vMFMMF<K>::Print(size_t it, float assocCost) {
+  std::cout << "rtmf @" << it << ":\t" << assocCost << " costs: ";
+  for (size_t k=0; k<K; ++k) {
+    std::cout << "\t" << cs_[k];
+  }
+  std::cout << " Ns: ";
+  for (size_t k=0; k<K; ++k) {
+    std::cout << "\t" << Ns_[k];
+  }
+  std::cout << std::endl;
+}
+
+#ifdef CUDA_FOUND
 template<int K>
 float vMFMMF<K>::Compute(const Image<Vector3fda>& cuN, 
     size_t maxIt, bool verbose) {
@@ -66,15 +114,7 @@ float vMFMMF<K>::Compute(const Image<Vector3fda>& cuN,
     assocCost = UpdateAssociation(cuN);
     UpdateMF(cuN);
     if (verbose) {
-      std::cout << "rtmf @" << it << ":\t" << assocCost << " costs: ";
-      for (size_t k=0; k<K; ++k) {
-        std::cout << "\t" << cs_[k];
-      }
-      std::cout << " Ns: ";
-      for (size_t k=0; k<K; ++k) {
-        std::cout << "\t" << Ns_[k];
-      }
-      std::cout << std::endl;
+      Print(it, assocCost);
 //      std::cout << Rs_[0] << std::endl;
 //      std::cout << Rs_[0].determinant() << std::endl;
     }
@@ -88,6 +128,85 @@ float vMFMMF<K>::Compute(const Image<Vector3fda>& cuN,
 
 template<int K>
 float vMFMMF<K>::UpdateMF(const Image<Vector3fda>& cuN) {
+  SumsT nSums(K);
+  for (size_t k=0; k<K; ++k) 
+    nSums[k] = ComputeSums(cuN, k);
+  return UpdateMF(nSums);
+}
+#endif
+
+template<int K>
+float vMFMMF<K>::ComputeCpu(const Image<Vector3fda>& n, 
+    size_t maxIt, bool verbose, size_t maxSamples, size_t numThreads) {
+  if (numValid_ == 0) numValid_ = n.Area();
+  const size_t stride = maxSamples > 0 ? 
+    std::max<size_t>(1, (numValid_+maxSamples-1)/maxSamples) : 1;
+  float assocCost = 0;
+  Eigen::VectorXf csPrev(K);
+  csPrev.fill(1e16);
+  SumsT nSums(K);
+  for (size_t it=0; it<maxIt; ++it) {
+    float W = 0.;
+    float cost = AssociateAndSum(n, stride, numThreads, nSums, W);
+    assocCost = W > 0 ? cost/W + log(1./(6.*K)) : 0.;
+    if (it == 0) numValid_ = std::max<size_t>(1, W*stride);
+    UpdateMF(nSums);
+    if (verbose) Print(it, assocCost);
+    Eigen::Map<Eigen::VectorXf> cs(&cs_[0],K);
+    if (((cs - csPrev).array().abs() < 1e-6).all())
+      break;
+    csPrev = cs;
+  }
+  // the next frame is regularized towards the current estimate
+  t_ ++;
+  return assocCost;
+}
+
+template<int K>
+float vMFMMF<K>::AssociateAndSum(const Image<Vector3fda>& n,
+    size_t stride, size_t numThreads, SumsT& nSums, float& W) {
+  // stack all MF rotations so that one 3Kx3 product gives the dot
+  // products of a normal with all 3K axes; the sign selects between
+  // the two opposing directions of an axis.
+  Eigen::Matrix<float,3*K,3> RsT;
+  for (size_t k=0; k<K; ++k)
+    RsT.template middleRows<3>(3*k) = Rs_[k].transpose();
+
+  const size_t N = (n.Area()+stride-1)/stride;
+  const size_t blockSize = 4096;
+  // the cost is kept in an extra column of the per block sums
+  typedef Eigen::Matrix<float,4,6*K+1> BlockSums;
+  const BlockSums ssSum = ParallelReduce(N, blockSize,
+    BlockSums(BlockSums::Zero()),
+    [&](size_t i0, size_t i1, BlockSums& ss) {
+      for (size_t i=i0; i<i1; ++i) {
+        const Vector3fda& ni = n[i*stride];
+        if (!IsValidNormal(ni)) continue;
+        const Eigen::Matrix<float,3*K,1> dots = RsT*ni;
+        int jMax = 0;
+        float dotMax = fabs(dots(0));
+        for (int j=1; j<3*K; ++j) {
+          const float dot = fabs(dots(j));
+          if (dot > dotMax) {
+            dotMax = dot;
+            jMax = j;
+          }
+        }
+        const int z = 2*jMax + (dots(jMax) < 0.f ? 1 : 0);
+        ss.template block<3,1>(0,z) += ni;
+        ss(3,z) += 1.f;
+        ss(0,6*K) += dotMax;
+      }
+    },
+    [](BlockSums& a, const BlockSums& b) { a += b; }, numThreads);
+  for (size_t k=0; k<K; ++k)
+    nSums[k] = ssSum.template middleCols<6>(6*k);
+  W = ssSum.row(3).template head<6*K>().sum();
+  return ssSum(0,6*K);
+}
+
+template<int K>
+float vMFMMF<K>::UpdateMF(const SumsT& nSumsAll) {
   for (size_t k=0; k<K; ++k) {
     Ns_[k] = 0;
     Eigen::Matrix3f N = Eigen::Matrix3f::Zero();
@@ -95,7 +214,7 @@ float vMFMMF<K>::UpdateMF(const Image<Vector3fda>& cuN) {
     // frames to regularize solution in case data exists only on certain
     // axes
     if (t_ > 0) N += tauR_*Rs_[k].transpose();
-    Eigen::Matrix<float,4,6> nSums = ComputeSums(cuN, k);
+    const Eigen::Matrix<float,4,6>& nSums = nSumsAll[k];
 //    std::cout << nSums << std::endl;
     for (uint32_t j=0; j<6; ++j) { 
       Eigen::Vector3f m = Eigen::Vector3f::Zero();
@@ -116,6 +235,7 @@ float vMFMMF<K>::UpdateMF(const Image<Vector3fda>& cuN) {
   return C;
 }
 
+#ifdef CUDA_FOUND
 template<int K>
 Eigen::Matrix<float,4,6> vMFMMF<K>::ComputeSums(const
     Image<Vector3fda>& cuN, uint32_t k) {
@@ -157,6 +277,7 @@ float vMFMMF<K>::UpdateAssociation(const Image<Vector3fda>& cuN) {
   
   return cost/W;
 }
+#endif
 
 
 }
@@ -0,0 +1,376 @@
+/* Copyright (c) 2017, Julian Straub <jstraub@csail.mit.edu>
+ * Licensed under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <math.h>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <utility>
+#include <vector>
+#include <Eigen/Dense>
+#include <tdp/data/image.h>
+#include <tdp/eigen/dense.h>
+#include <tdp/utils/batch.h>
+
+#include "vmf.hpp"
+#include "vmfPrior.hpp"
+
+namespace tdp {
+
+/// Parallel Gibbs sweeps over the DP-vMF labels z of surfels whose
+/// labels are coupled to those of their D nearest neighbors by an MRF
+/// term lambdaMRF (the label sampler of sparseFusion).
+///
+/// The kNN graph is colored greedily such that no surfel shares its
+/// color with any of its neighbors; the colors are kept across sweeps
+/// and only repaired where the graph changed. Surfels of one color are
+/// conditionally independent and are sampled in parallel chunks.
+/// Surfels without a label yet are sampled sequentially beforehand. Label
+/// changes go into per chunk sufficient statistics that are merged
+/// after every color, and new clusters are created at that point too.
+/// Cluster log likelihoods are evaluated from per cluster constants
+/// as a dot product over the clusters in structure of arrays form.
+///
+/// Each chunk draws from its own generator seeded from the sweep,
+/// color and chunk, so results do not depend on the number of threads.
+template<int D>
+class DpvmfLabelSampler {
+ public:
+  typedef Eigen::Matrix<int32_t,D,1,Eigen::DontAlign> VectorNNida;
+
+  DpvmfLabelSampler(uint32_t seed = 0)
+    : chunkSize_(1024), numThreads_(0), seed_(seed),
+    numSweeps_(0), numColors_(0) {}
+
+  /// One sweep over the labels z of the first N surfels with normals n
+  /// and neighbors nn (-1 marks no neighbor). Only surfels for which
+  /// valid(i) holds are sampled. ss holds the sufficient statistics
+  /// (sum of normals, count) of every cluster and has to be consistent
+  /// with z on entry; it is kept consistent. New clusters are appended
+  /// to vmfs under vmfsLock.
+  template<class Valid>
+  void Sweep(size_t N, const Valid& valid,
+      const Image<Vector3fda>& n, const Image<VectorNNida>& nn,
+      Image<uint16_t>& z, std::vector<vMF<float,3>>& vmfs,
+      std::mutex& vmfsLock, const vMFprior<float>& base, float logAlpha,
+      float lambdaMRF, Image<Vector4fda>& ss) {
+    const size_t numThreads = numThreads_ > 0 ? numThreads_
+      : ThreadPool::MaxConcurrency();
+    size_t K = 0;
+    {
+      std::lock_guard<std::mutex> lock(vmfsLock);
+      K = vmfs.size();
+      CacheClusters(vmfs, ss, 0);
+    }
+    Color(N, valid, nn, z, K, numThreads);
+    moved_.clear();
+    for (uint32_t c=0; c<numColors_; ++c) {
+      const uint32_t i0 = colorBegin_[c];
+      const uint32_t i1 = colorBegin_[c+1];
+      const size_t numChunks = (i1-i0+chunkSize_-1)/chunkSize_;
+      if (chunks_.size() < numChunks) chunks_.resize(numChunks);
+      ForEachBlock(numChunks, 1, numThreads, [&](size_t k0, size_t k1) {
+          for (size_t k=k0; k<k1; ++k) {
+            Chunk& chunk = chunks_[k];
+            chunk.Reset(K);
+            std::mt19937 rnd(Seed(c, k));
+            const uint32_t j1 = std::min<uint32_t>(i1, i0+(k+1)*chunkSize_);
+            for (uint32_t j=i0+k*chunkSize_; j<j1; ++j)
+              SampleLabel(order_[j], K, n, nn, z, base, logAlpha, lambdaMRF,
+                  rnd, chunk);
+          }
+        }, 2);
+      // merge the label changes and create the new clusters
+      for (size_t k=0; k<numChunks; ++k) {
+        Chunk& chunk = chunks_[k];
+        moved_.insert(moved_.end(), chunk.moved.begin(), chunk.moved.end());
+        for (size_t l=0; l<K; ++l) {
+          ss[l] += chunk.dss[l];
+          if (chunk.dss[l](3) != 0.f) CacheCount(l, ss);
+        }
+        if (chunk.created.empty()) continue;
+        std::mt19937 rnd(Seed(c, k) ^ 0x9e3779b9);
+        std::lock_guard<std::mutex> lock(vmfsLock);
+        for (uint32_t i : chunk.created) {
+          if (vmfs.size() >= ss.Area()
+              || vmfs.size() >= std::numeric_limits<uint16_t>::max()) {
+            // no room for more clusters; keep the previous label
+            if (z[i] < K)
+              ss[z[i]] += Vector4fda(n[i](0), n[i](1), n[i](2), 1.f);
+            continue;
+          }
+          z[i] = vmfs.size();
+          vmfs.push_back(base.posterior(n[i],1).sample(rnd));
+          ss[z[i]] = Vector4fda(n[i](0), n[i](1), n[i](2), 1.f);
+        }
+      }
+      std::lock_guard<std::mutex> lock(vmfsLock);
+      CacheClusters(vmfs, ss, K);
+      K = vmfs.size();
+    }
+    numSweeps_ ++;
+  }
+
+  /// Number of groups sampled one after another in the last sweep:
+  /// the colors plus one per surfel sampled on its own.
+  uint32_t NumColors() const { return numColors_; }
+  /// Number of surfels sampled in the last sweep.
+  size_t NumSampled() const { return order_.size(); }
+  /// Surfels whose label changed in the last sweep.
+  const std::vector<uint32_t>& Moved() const { return moved_; }
+  /// Surfels sampled in the last sweep, group after group; group c
+  /// spans [GroupBegin(c), GroupBegin(c+1)) for c < NumColors().
+  const std::vector<uint32_t>& Order() const { return order_; }
+  uint32_t GroupBegin(uint32_t c) const { return colorBegin_[c]; }
+
+  /// Unnormalized log probabilities logPdfs[0..K] of the labels of
+  /// surfel i where label K opens a new cluster; uses the clusters and
+  /// counts cached by the last Sweep().
+  void LogProbs(uint32_t i, size_t K, const Image<Vector3fda>& n,
+      const Image<VectorNNida>& nn, const Image<uint16_t>& z,
+      const vMFprior<float>& base, float logAlpha, float lambdaMRF,
+      float* logPdfs) const {
+    const Vector3fda& ni = n[i];
+    const uint16_t zi = z[i];
+    const float x = ni(0), y = ni(1), w = ni(2);
+    const float mrf0 = -lambdaMRF*D;
+    for (size_t k=0; k<K; ++k) {
+      logPdfs[k] = mrf0 + logCount_[k] + logPdfC_[k]
+        + tauMuX_[k]*x + tauMuY_[k]*y + tauMuZ_[k]*w;
+    }
+    if (zi < K) {
+      logPdfs[zi] = mrf0 + logCountSelf_[zi] + logPdfC_[zi]
+        + tauMuX_[zi]*x + tauMuY_[zi]*y + tauMuZ_[zi]*w;
+    }
+    const VectorNNida& ids = nn[i];
+    for (int d=0; d<D; ++d) {
+      if (ids[d] > -1 && z[ids[d]] < K) logPdfs[z[ids[d]]] += lambdaMRF;
+    }
+    logPdfs[K] = logAlpha + base.logMarginal(ni);
+  }
+
+  size_t chunkSize_;       // surfels per chunk
+  size_t numThreads_;      // 0 uses all cores
+
+ private:
+  static const uint32_t kUncolored = 0xFFFFFFFF;
+
+  struct Chunk {
+    void Reset(size_t K) {
+      dss.assign(K, Vector4fda::Zero());
+      created.clear();
+      moved.clear();
+      if (logPdfs.size() < K+1) logPdfs.resize(K+1);
+    }
+    // changes to the sufficient statistics of every cluster
+    std::vector<Vector4fda> dss;
+    // surfels that sampled a new cluster
+    std::vector<uint32_t> created;
+    // surfels that changed their label
+    std::vector<uint32_t> moved;
+    std::vector<float> logPdfs;
+  };
+
+  uint32_t Seed(uint32_t c, size_t k) const {
+    std::seed_seq seq = {seed_, numSweeps_, c, (uint32_t)k};
+    uint32_t s;
+    seq.generate(&s, &s+1);
+    return s;
+  }
+
+  /// vMF<float,3>::logPdf(x) = logPdfC_[k] + tauMu_k.dot(x) with
+  /// logPdfC_[k] = vmfs[k].logPdf(0); the counts enter as log(count) and
+  /// log(count-1) for the own cluster. Clusters from k0 on are
+  /// (re)computed.
+  void CacheClusters(const std::vector<vMF<float,3>>& vmfs,
+      const Image<Vector4fda>& ss, size_t k0) {
+    const size_t K = vmfs.size();
+    logPdfC_.resize(K);
+    tauMuX_.resize(K);
+    tauMuY_.resize(K);
+    tauMuZ_.resize(K);
+    logCount_.resize(K);
+    logCountSelf_.resize(K);
+    for (size_t k=k0; k<K; ++k) {
+      const float tau = vmfs[k].tau_;
+      logPdfC_[k] = vmfs[k].logPdf(Eigen::Vector3f::Zero());
+      if (tau < 1e-9) {
+        tauMuX_[k] = tauMuY_[k] = tauMuZ_[k] = 0.f;
+      } else {
+        tauMuX_[k] = tau*vmfs[k].mu_(0);
+        tauMuY_[k] = tau*vmfs[k].mu_(1);
+        tauMuZ_[k] = tau*vmfs[k].mu_(2);
+      }
+      CacheCount(k, ss);
+    }
+  }
+
+  void CacheCount(size_t k, const Image<Vector4fda>& ss) {
+    const float count = k < ss.Area() ? ss[k](3) : 0.f;
+    logCount_[k] = log(count);
+    logCountSelf_[k] = log(count-1.f);
+  }
+
+  void SampleLabel(uint32_t i, size_t K, const Image<Vector3fda>& n,
+      const Image<VectorNNida>& nn, Image<uint16_t>& z,
+      const vMFprior<float>& base, float logAlpha, float lambdaMRF,
+      std::mt19937& rnd, Chunk& chunk) const {
+    const Vector3fda& ni = n[i];
+    const uint16_t zi = z[i];
+    float* logPdfs = chunk.logPdfs.data();
+    LogProbs(i, K, n, nn, z, base, logAlpha, lambdaMRF, logPdfs);
+    // sample from the normalized discrete distribution
+    float logMax = -std::numeric_limits<float>::infinity();
+    for (size_t k=0; k<=K; ++k) logMax = std::max(logMax, logPdfs[k]);
+    float sum = 0.f;
+    for (size_t k=0; k<=K; ++k) {
+      logPdfs[k] = exp(logPdfs[k]-logMax);
+      sum += logPdfs[k];
+    }
+    std::uniform_real_distribution<float> unif(0.,1.);
+    const float u = unif(rnd)*sum;
+    float cdf = 0.f;
+    size_t zNew = K;
+    for (size_t k=0; k<=K; ++k) {
+      cdf += logPdfs[k];
+      if (u <= cdf) {
+        zNew = k;
+        break;
+      }
+    }
+    if (zNew == zi) return;
+    chunk.moved.push_back(i);
+    const Vector4fda ssi(ni(0), ni(1), ni(2), 1.f);
+    if (zi < K) chunk.dss[zi] -= ssi;
+    if (zNew == K) {
+      // the label is set once the cluster exists
+      chunk.created.push_back(i);
+    } else {
+      chunk.dss[zNew] += ssi;
+      z[i] = zNew;
+    }
+  }
+
+  /// Greedy coloring of the kNN graph of the valid surfels among the
+  /// first N. Colors of the last sweep are kept where they are still
+  /// consistent; surfels that conflict with a neighbor are recolored.
+  template<class Valid>
+  void Color(size_t N, const Valid& valid, const Image<VectorNNida>& nn,
+      const Image<uint16_t>& z, size_t K, size_t numThreads) {
+    if (colors_.size() < N) colors_.resize(N, kUncolored);
+    active_.assign(N, 0);
+    for (size_t i=0; i<N; ++i) active_[i] = valid(i) ? 1 : 0;
+    // reverse edges so that recoloring sees neighbors in both directions
+    inBegin_.assign(N+1, 0);
+    for (size_t i=0; i<N; ++i)
+      for (int d=0; d<D; ++d)
+        if (IsEdge(i, nn[i][d], N)) inBegin_[nn[i][d]+1] ++;
+    for (size_t i=0; i<N; ++i) inBegin_[i+1] += inBegin_[i];
+    inIds_.resize(inBegin_[N]);
+    std::vector<uint32_t> inFill(inBegin_.begin(), inBegin_.end()-1);
+    for (size_t i=0; i<N; ++i)
+      for (int d=0; d<D; ++d)
+        if (IsEdge(i, nn[i][d], N)) inIds_[inFill[nn[i][d]]++] = i;
+    // an edge i->j conflicts if both ends share a color; then i is
+    // recolored with the smallest color none of its neighbors has.
+    std::vector<uint32_t> dirty;
+    std::mutex dirtyMut;
+    ForEachBlock(N, 4096, numThreads, [&](size_t i0, size_t i1) {
+        std::vector<uint32_t> dirtyLocal;
+        for (size_t i=i0; i<i1; ++i) {
+          if (active_[i] && Conflicts(i, N, nn)) dirtyLocal.push_back(i);
+        }
+        std::lock_guard<std::mutex> lock(dirtyMut);
+        dirty.insert(dirty.end(), dirtyLocal.begin(), dirtyLocal.end());
+      }, 1<<14);
+    std::sort(dirty.begin(), dirty.end());
+    for (uint32_t i : dirty) {
+      uint64_t used = 0;
+      for (int d=0; d<D; ++d) {
+        const int32_t j = nn[i][d];
+        if (IsEdge(i, j, N) && colors_[j] < 64)
+          used |= (uint64_t)1 << colors_[j];
+      }
+      for (uint32_t k=inBegin_[i]; k<inBegin_[i+1]; ++k) {
+        const uint32_t j = inIds_[k];
+        if (colors_[j] < 64) used |= (uint64_t)1 << colors_[j];
+      }
+      uint32_t c = 0;
+      while (c < 64 && (used & ((uint64_t)1 << c))) ++c;
+      // surfels with neighbors of all 64 colors are left uncolored
+      colors_[i] = c < 64 ? c : kUncolored;
+    }
+    // surfels without a label yet and uncolored ones are sampled first,
+    // one after another, so that they open as few new clusters as in a
+    // sequential sweep; then the surfels are grouped by color.
+    auto serial = [&](size_t i) {
+      return colors_[i] == kUncolored || z[i] >= K;
+    };
+    numColors_ = 0;
+    size_t numSerial = 0;
+    for (size_t i=0; i<N; ++i) {
+      if (!active_[i]) continue;
+      if (serial(i)) numSerial ++;
+      else numColors_ = std::max(numColors_, colors_[i]+1);
+    }
+    colorBegin_.assign(numSerial+numColors_+1, 0);
+    for (size_t s=0; s<numSerial; ++s) colorBegin_[s+1] = s+1;
+    for (size_t i=0; i<N; ++i)
+      if (active_[i] && !serial(i)) colorBegin_[numSerial+colors_[i]+1] ++;
+    for (size_t c=numSerial; c<numSerial+numColors_; ++c)
+      colorBegin_[c+1] += colorBegin_[c];
+    order_.resize(colorBegin_.back());
+    std::vector<uint32_t> fill(colorBegin_.begin()+numSerial,
+        colorBegin_.end()-1);
+    size_t s = 0;
+    for (size_t i=0; i<N; ++i) {
+      if (!active_[i]) continue;
+      if (serial(i)) order_[s++] = i;
+      else order_[fill[colors_[i]]++] = i;
+    }
+    numColors_ += numSerial;
+  }
+
+  /// True if i->j is an edge between two active surfels.
+  bool IsEdge(size_t i, int32_t j, size_t N) const {
+    return active_[i] && 0 <= j && (size_t)j < N && (size_t)j != i
+      && active_[j];
+  }
+
+  bool Conflicts(size_t i, size_t N, const Image<VectorNNida>& nn) const {
+    if (colors_[i] == kUncolored) return true;
+    for (int d=0; d<D; ++d) {
+      const int32_t j = nn[i][d];
+      if (IsEdge(i, j, N) && colors_[j] == colors_[i]) return true;
+    }
+    return false;
+  }
+
+  uint32_t seed_;
+  uint32_t numSweeps_;
+  uint32_t numColors_;
+  std::vector<uint32_t> colors_;
+  std::vector<uint8_t> active_;
+  // reverse kNN edges in CSR form
+  std::vector<uint32_t> inBegin_;
+  std::vector<uint32_t> inIds_;
+  std::vector<uint32_t> order_;
+  std::vector<uint32_t> colorBegin_;
+  std::vector<Chunk> chunks_;
+  std::vector<uint32_t> moved_;
+  // per cluster constants of the log likelihood
+  std::vector<float> logPdfC_;
+  std::vector<float> tauMuX_;
+  std::vector<float> tauMuY_;
+  std::vector<float> tauMuZ_;
+  std::vector<float> logCount_;
+  std::vector<float> logCountSelf_;
+};
+
+template<int D>
+const uint32_t DpvmfLabelSampler<D>::kUncolored;
+
+}
@@ -7,6 +7,7 @@
 #include <tdp/camera/camera_base.h>
 #include <tdp/camera/rig.h>
 #include <tdp/camera/photometric.h>
+#include <tdp/utils/batch.h>
 namespace tdp {
 
 /// KeyFrame
@@ -113,6 +114,38 @@ void Overlap(const KeyFrame& kfA, const KeyFrame& kfB,
   OverlapGpu(greyA, greyB, pcA, pcB, T_ab_, rig, overlap, rmse, errB); 
 }
 
+/// Loop closure hypothesis between keyframes idA and idB with relative
+/// pose T_ab, scored by OverlapCpu.
+struct OverlapHypothesis {
+  OverlapHypothesis(size_t idA, size_t idB, const SE3f& T_ab)
+    : idA(idA), idB(idB), T_ab(T_ab), overlap(0.f), rmse(0.f) {}
+  size_t idA;
+  size_t idB;
+  SE3f T_ab;
+  float overlap;
+  float rmse;
+};
 
+/// Photometric overlap and RMSE of all hypotheses at pyramid level lvl
+/// on the CPU. Hypotheses are distributed over numThreads threads (0:
+/// all cores). getKf(id) returns a pointer-like handle to keyframe id,
+/// e.g. KeyFrameStore::Get, and is called concurrently; hypotheses only
+/// overlap in time if it does not serialize the fetches.
+template <typename CamT, class KfGetter>
+void OverlapCpu(const KfGetter& getKf, const Rig<CamT>& rig, int lvl,
+    std::vector<OverlapHypothesis>& hyps, size_t numThreads=0) {
+  const float scale = pow(0.5,lvl);
+  ForEachBlock(hyps.size(), 1, numThreads, [&](size_t i0, size_t i1) {
+      for (size_t i=i0; i<i1; ++i) {
+        OverlapHypothesis& hyp = hyps[i];
+        auto kfA = getKf(hyp.idA);
+        auto kfB = getKf(hyp.idB);
+        OverlapCpu(kfA->pyrGrey_.GetConstImage(lvl),
+            kfB->pyrGrey_.GetConstImage(lvl),
+            kfA->pyrPc_.GetConstImage(lvl), kfB->pyrPc_.GetConstImage(lvl),
+            hyp.T_ab, rig, scale, hyp.overlap, hyp.rmse);
+      }
+    }, 2);
+}
 
 }
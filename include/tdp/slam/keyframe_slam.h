@@ -1,12 +1,17 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
 #pragma once
-#include <tdp/slam/keyframe.h>
-
-#include <isam/isam.h>
-#include <isam/Slam.h>
-#include <isam/robust.h>
+#include <vector>
+#include <Eigen/Dense>
+#include <tdp/manifold/SE3.h>
+#include <tdp/slam/pose_graph.h>
 
 namespace tdp {
 
+/// Keyframe pose graph SLAM backend on top of the in-tree PoseGraph.
+/// Covariances and information matrices are ordered as SE3::Log, i.e.
+/// rotation first.
 class KeyframeSLAM {
  public:
   KeyframeSLAM();
@@ -24,20 +29,17 @@ class KeyframeSLAM {
 
   void Optimize();
 
-  size_t size() { return T_wk_.size(); }
+  size_t size() { return graph_.NumPoses(); }
 
   SE3f GetPose(size_t i);
 
   std::vector<std::pair<int,int>> loopClosures_;
  private:
-  std::vector<isam::Pose3d_Node*> T_wk_;
+  PoseGraph graph_;
 
-  isam::Slam slam_;
-  isam::Noise noisePrior_;
-  isam::Noise noiseOdom_;
-  isam::Noise noiseLoopClosure_;
+  Eigen::Matrix<double,6,6> infoPrior_;
+  Eigen::Matrix<double,6,6> infoOdom_;
+  Eigen::Matrix<double,6,6> infoLoopClosure_;
 };
 
 }
-
-#include <tdp/slam/keyframe_slam_impl.hpp>
@@ -0,0 +1,119 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <tdp/data/image.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/eigen/dense.h>
+#include <tdp/manifold/SE3.h>
+#include <tdp/slam/keyframe.h>
+
+namespace tdp {
+
+/// Compact host representation of a keyframe from which the full
+/// KeyFrame can be recomputed: depth quantized to 16 bit, grey as 8 bit
+/// and the rgb image. About 6 bytes per pixel instead of the roughly
+/// 100 bytes per pixel of a KeyFrame with all its pyramids.
+struct CompactKeyFrame {
+  ManagedHostImage<uint16_t> d_; // depth in units of the store dScale_
+  ManagedHostImage<uint8_t> grey_;
+  ManagedHostImage<Vector3bda> rgb_;
+  // lossless compressed d_, grey_ and rgb_ of a cold keyframe
+  std::vector<uint8_t> blob_;
+  // file holding blob_ if the keyframe was spilled to disk
+  std::string path_;
+
+  size_t SizeBytes() const {
+    return d_.SizeBytes() + grey_.SizeBytes() + rgb_.SizeBytes()
+      + blob_.size();
+  }
+};
+
+/// Lossless compression of the images of a CompactKeyFrame into its
+/// blob_ using row-wise delta coding with zero run lengths and varints.
+/// The images are released afterwards.
+void CompressKeyFrame(CompactKeyFrame& ckf);
+/// Inverse of CompressKeyFrame; releases blob_.
+bool DecompressKeyFrame(CompactKeyFrame& ckf);
+
+/// Recompute the full KeyFrame with point cloud, normal, grey and grey
+/// gradient pyramids from its compact representation. The point of
+/// pixel i at depth d is ray[i]*d + origin[i].
+/// Normals are the cross product of central differences of the point
+/// cloud, oriented towards the viewpoint. They differ from the rig
+/// normals of the live frame (no smoothing window) and are NaN on the
+/// image border and next to missing depth.
+void DeriveKeyFrame(const CompactKeyFrame& ckf, float dScale,
+    const Image<Vector3fda>& ray, const Image<Vector3fda>* origin,
+    KeyFrame& kf);
+
+/// Storage for large numbers of keyframes. Keyframes are kept as
+/// CompactKeyFrame and the full KeyFrame is derived when fetched. The
+/// maxHot_ most recently used keyframes are held uncompressed together
+/// with their derived KeyFrame; colder keyframes are compressed and, if
+/// a spill directory is given, written to disk. Poses are always
+/// resident and are the reference for KeyFrame::T_wk_.
+class KeyFrameStore {
+ public:
+  /// ray and origin describe the back projection of the keyframe
+  /// images (see Rig::ComputeRaysCpu); origin may be nullptr for a
+  /// single camera. dScale is the depth quantization in m.
+  KeyFrameStore(const Image<Vector3fda>& ray,
+      const Image<Vector3fda>* origin = nullptr,
+      size_t maxHot = 32, bool compressCold = true,
+      const std::string& spillDir = "", float dScale = 1e-3);
+  ~KeyFrameStore();
+
+  /// Add a keyframe from host depth [m], grey [0,1] and rgb images.
+  /// Returns its id.
+  size_t Add(const Image<float>& d, const Image<float>& grey,
+      const Image<Vector3bda>& rgb, const SE3f& T_wk);
+
+  /// Full keyframe derived on demand; its T_wk_ is a copy of Pose(id).
+  /// The returned keyframe stays valid while it is held, also if it is
+  /// evicted from the hot set in the meantime.
+  /// Keyframes are derived outside the store lock, so concurrent calls
+  /// for different keyframes run in parallel.
+  std::shared_ptr<KeyFrame> Get(size_t id);
+
+  /// Poses are copied under the store lock since Add() may run
+  /// concurrently (e.g. from loop closure threads calling Get()).
+  SE3f Pose(size_t id) const;
+  void SetPose(size_t id, const SE3f& T_wk);
+
+  size_t size() const;
+  /// Host memory used by the compact keyframes and the hot set.
+  size_t MemoryBytes();
+
+  size_t maxHot_;
+  bool compressCold_;
+  std::string spillDir_;
+  float dScale_;
+
+ private:
+  void Touch(size_t id);
+  void MakeCold(size_t id);
+  bool MakeHot(size_t id);
+
+  ManagedHostImage<Vector3fda> ray_;
+  ManagedHostImage<Vector3fda> origin_;
+  bool haveOrigin_;
+
+  std::deque<SE3f> T_wks_;
+  std::vector<std::unique_ptr<CompactKeyFrame>> ckfs_;
+  // most recently used first
+  std::list<size_t> lru_;
+  std::unordered_map<size_t, std::pair<std::shared_ptr<KeyFrame>,
+    std::list<size_t>::iterator>> hot_;
+  mutable std::mutex mut_;
+};
+
+}
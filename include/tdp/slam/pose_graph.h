@@ -0,0 +1,113 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <vector>
+#include <Eigen/Dense>
+#include <Eigen/StdVector>
+#include <Eigen/Sparse>
+#include <Eigen/SparseCholesky>
+#include <tdp/manifold/SE3.h>
+
+namespace tdp {
+
+/// Sparse SE3 pose graph optimized by Gauss-Newton.
+///
+/// Poses are perturbed on the right as T <- T*SE3(Exp(dw), dt), with
+/// the rotation first as in SE3::Log. A relative pose factor between
+/// poses a and b with measurement T_ab has the residual
+///   r = Log_(T_ab^-1 * T_a^-1 * T_b)
+/// and analytic Jacobians with respect to both poses. The normal
+/// equations are assembled into a block sparse matrix of 6x6 blocks and
+/// solved with a sparse LDLT under AMD ordering.
+///
+/// Optimization is incremental: the symbolic factorization is only
+/// recomputed when poses or factors were added, and only factors
+/// attached to poses that moved by more than relinThr_ (or were added)
+/// since the last linearization are relinearized. Pose updates below
+/// relinThr_ are dropped.
+class PoseGraph {
+ public:
+  PoseGraph();
+
+  /// Add a pose and return its id.
+  size_t AddPose(const SE3d& T_wk);
+  /// Absolute pose prior on pose id with information matrix Omega.
+  void AddPrior(size_t id, const SE3d& T_wk,
+      const Eigen::Matrix<double,6,6>& Omega);
+  /// Relative pose measurement T_ab = T_wa^-1 * T_wb with information
+  /// matrix Omega.
+  void AddFactor(size_t idA, size_t idB, const SE3d& T_ab,
+      const Eigen::Matrix<double,6,6>& Omega);
+
+  /// Run at most maxIt Gauss-Newton iterations; returns the final chi2.
+  double Optimize(size_t maxIt = 10);
+
+  /// Sum of squared Mahalanobis residuals of all factors.
+  double Chi2() const;
+
+  const SE3d& GetPose(size_t id) const { return T_wk_[id]; }
+  SE3d& GetPose(size_t id) { return T_wk_[id]; }
+  size_t NumPoses() const { return T_wk_.size(); }
+  size_t NumFactors() const { return factors_.size(); }
+
+  /// Residual and Jacobians of a relative pose factor.
+  static Eigen::Matrix<double,6,1> Residual(const SE3d& T_wa,
+      const SE3d& T_wb, const SE3d& T_ab,
+      Eigen::Matrix<double,6,6>* J_a = nullptr,
+      Eigen::Matrix<double,6,6>* J_b = nullptr);
+
+  /// Inverse of the right Jacobian of SO3.
+  static Eigen::Matrix3d JrInv(const Eigen::Vector3d& phi);
+
+  double relinThr_; // update norm above which a pose is relinearized
+  double lambda_;   // diagonal damping of the normal equations
+  double epsilon_;  // convergence threshold on the largest update
+  bool verbose_;
+
+  struct Factor {
+    Factor(size_t idA, size_t idB, const SE3d& T_ab,
+        const Eigen::Matrix<double,6,6>& Omega)
+      : idA(idA), idB(idB), T_ab(T_ab), Omega(Omega), prior(false),
+      chi2(0.), dirty(true) {}
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    size_t idA;
+    size_t idB; // equal to idA for priors
+    SE3d T_ab;  // T_wk for priors
+    Eigen::Matrix<double,6,6> Omega;
+    bool prior;
+    // cached linearization
+    Eigen::Matrix<double,6,6> H_aa;
+    Eigen::Matrix<double,6,6> H_ab;
+    Eigen::Matrix<double,6,6> H_bb;
+    Eigen::Matrix<double,6,1> g_a;
+    Eigen::Matrix<double,6,1> g_b;
+    double chi2;
+    bool dirty;
+  };
+  typedef std::vector<Factor, Eigen::aligned_allocator<Factor>> Factors;
+  const Factors& GetFactors() const { return factors_; }
+
+ private:
+  void Linearize(Factor& f) const;
+  /// Rebuild the sparsity pattern and the block offsets into it.
+  void BuildStructure();
+  /// Offset of block (i,j), i >= j, within each column of block column j.
+  size_t BlockOffset(size_t i, size_t j) const;
+  void AddBlock(size_t i, size_t j, const Eigen::Matrix<double,6,6>& B);
+
+  std::vector<SE3d> T_wk_;
+  Factors factors_;
+  // poses changed since their factors were last linearized
+  std::vector<bool> poseDirty_;
+  bool structureDirty_;
+
+  Eigen::SparseMatrix<double> H_;
+  Eigen::VectorXd g_;
+  // sorted block rows i >= j of each block column j
+  std::vector<std::vector<size_t>> blockRows_;
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>, Eigen::Lower,
+    Eigen::AMDOrdering<int>> ldlt_;
+};
+
+}
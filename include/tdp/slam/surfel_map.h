@@ -0,0 +1,272 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <Eigen/Dense>
+#include <tdp/data/circular_buffer.h>
+#include <tdp/data/columnar_buffer.h>
+#include <tdp/data/image.h>
+#include <tdp/eigen/dense.h>
+#include <tdp/manifold/SE3.h>
+#include <tdp/preproc/plane.h>
+
+namespace tdp {
+
+/// Columns of the fields of Plane that the map sweeps read; see
+/// SurfelColumns.
+enum SurfelField {
+  kSurfelP = 0, // Plane::p_
+  kSurfelN,     // Plane::n_
+  kSurfelRgb,   // Plane::rgb_
+  kSurfelGrad,  // Plane::grad_
+  kSurfelR,     // Plane::r_
+  kSurfelT,     // Plane::lastFrame_
+  kSurfelP0,    // center at insertion; only stored here
+};
+
+/// Columnar store of the hot surfel fields kept in parallel to the
+/// full Plane records, e.g. surfels.Get<kSurfelP>() are the centers.
+/// The initial centers used for the kNN sweep live only in the
+/// kSurfelP0 column.
+typedef ManagedHostColumnarBuffer<Vector3fda, Vector3fda, Vector3bda,
+        Vector3fda, float, uint16_t, Vector3fda> SurfelColumns;
+
+/// Append the hot fields of pl to the columns; its current center
+/// becomes the initial center.
+inline void InsertColumns(const Plane& pl, SurfelColumns& surfels) {
+  surfels.Insert(pl.p_, pl.n_, pl.rgb_, pl.grad_, pl.r_, pl.lastFrame_,
+      pl.p_);
+}
+
+/// Spatial hash of surfel centers on a regular grid with cells of size
+/// cellSize. The ids of all surfels of a cell are stored contiguously.
+class SurfelHash {
+ public:
+  SurfelHash(float cellSize = 0.05) : cellSize_(cellSize) {}
+
+  /// Hash the surfels with centers pr[i].head<3>() and radii pr[i](3)
+  /// into the cells their discs overlap; entries with a NaN center are
+  /// skipped. Ids are indices into pr.
+  void Build(const std::vector<Vector4fda>& pr);
+  void Clear() { cells_.clear(); ids_.clear(); pr_.clear(); }
+
+  /// Call f(id, pr) for all surfels in cell key where pr holds the
+  /// surfel center and radius as of the last Build().
+  template<class F>
+  void ForEachInCell(uint64_t key, const F& f) const {
+    auto it = cells_.find(key);
+    if (it == cells_.end()) return;
+    for (uint32_t i=it->second.first; i<it->second.second; ++i)
+      f(ids_[i], pr_[i]);
+  }
+
+  Eigen::Vector3i Cell(const Vector3fda& p) const {
+    return Eigen::Vector3i(floorf(p(0)/cellSize_), floorf(p(1)/cellSize_),
+        floorf(p(2)/cellSize_));
+  }
+  /// Cell coordinates are packed into 21 bits each.
+  static uint64_t Key(const Eigen::Vector3i& c) {
+    const uint64_t mask = (1<<21)-1;
+    return (((uint64_t)(c(0)+(1<<20)) & mask) << 42)
+      | (((uint64_t)(c(1)+(1<<20)) & mask) << 21)
+      | ((uint64_t)(c(2)+(1<<20)) & mask);
+  }
+  uint64_t Key(const Vector3fda& p) const { return Key(Cell(p)); }
+
+  float CellSize() const { return cellSize_; }
+  size_t NumCells() const { return cells_.size(); }
+  size_t NumEntries() const { return ids_.size(); }
+
+ private:
+  float cellSize_;
+  // range of each cell in ids_
+  std::unordered_map<uint64_t, std::pair<uint32_t,uint32_t>> cells_;
+  std::vector<uint32_t> ids_;
+  std::vector<Vector4fda> pr_;
+};
+
+/// Maintenance of a surfel map that is stored as a set of parallel
+/// circular buffers indexed like pl_w (the sparseFusion layout).
+///
+/// A background thread, woken by Update(), batch prunes surfels that
+/// have not been observed for survivalTime_ frames and are still
+/// uncertain, and rebuilds the spatial hash of the surfel centers. It
+/// holds workMut_ only while it prunes and copies the centers and radii
+/// of the valid surfels; the hash is built from that copy and dropped
+/// if the map was compacted meanwhile.
+/// CarveFreeSpace() casts the rays of the current depth frame through
+/// that hash and invalidates surfels which were seen in front of the
+/// measured surface in carveVotesThr_ frames. The rays only read the
+/// hash; the votes are applied while holding workMut_.
+///
+/// Invalid surfels are only flagged (Plane::valid_). Once more than
+/// compactFraction_ of the map is invalid, CompactionPending() turns
+/// true and the owner compacts all per surfel buffers while no other
+/// thread touches them:
+///   maint.BeginCompaction();
+///   maint.Compact(pc_w, Vector3fda(NAN,NAN,NAN)); // every buffer
+///   maint.RemapIds(nn);                           // every id buffer
+///   maint.EndCompaction();
+/// Surfel ids are offsets from the read index of the buffers.
+class SurfelMapMaintenance {
+ public:
+  SurfelMapMaintenance(CircularBuffer<Plane>& pl_w, float cellSize = 0.05);
+  ~SurfelMapMaintenance();
+
+  /// Wake the background thread to prune and rehash the map as of
+  /// frame. Returns immediately; calls while it is busy are merged.
+  void Update(int32_t frame);
+
+  /// Cast every stride-th ray of the camera frame point cloud pc_c
+  /// from the camera center through the spatial hash. Valid surfels
+  /// that lie on a ray closer than dMin or in front of the measured
+  /// depth minus the sensor noise collect a vote; surfels observed in
+  /// frame are reset. Returns the number of surfels carved.
+  size_t CarveFreeSpace(const Image<Vector3fda>& pc_c, const SE3f& T_wc,
+      int32_t frame, float dMin, size_t stride = 8,
+      size_t numThreads = 0);
+
+  /// True once enough of the map is invalid to warrant compaction.
+  bool CompactionPending();
+
+  /// Pause the background thread, compute the new ids of all live
+  /// surfels and compact pl_w. Returns the number of live surfels.
+  size_t BeginCompaction();
+  void EndCompaction();
+
+  /// Move the live entries of buf to their new ids and reset the freed
+  /// tail to fill (the value buf was initialized with). The insert
+  /// index is moved to the new end of the entries buf had.
+  template<typename T, typename F>
+  void Compact(CircularBuffer<T>& buf, const F& fill) const {
+    const int32_t N = std::min<int32_t>(remap_.size(), buf.w_);
+    for (int32_t i=firstDead_; i<N; ++i)
+      if (remap_[i] >= 0)
+        At(buf, remap_[i]) = At(buf, i);
+    const int32_t numLive = RemapCount(N);
+    for (int32_t i=numLive; i<N; ++i)
+      At(buf, i) = fill;
+    buf.iInsert_ = (buf.iRead_ + RemapCount(buf.SizeToRead())) % buf.w_;
+  }
+
+  /// Compact all columns of cols; fills holds one value per column.
+  template<template<class> class Alloc, typename... Ts, typename... Fs>
+  void Compact(ColumnarCircularBuffer<Alloc,Ts...>& cols,
+      const Fs&... fills) const {
+    static_assert(sizeof...(Ts) == sizeof...(Fs),
+        "one fill value per column is needed");
+    CompactColumns<0>(cols, fills...);
+    cols.SyncIndices();
+  }
+
+  /// Compact a buffer of surfel id vectors (such as kNN lists) and map
+  /// the ids it holds; ids of removed surfels become -1.
+  template<int D>
+  void RemapIds(
+      CircularBuffer<Eigen::Matrix<int32_t,D,1,Eigen::DontAlign>>& ids) const {
+    Compact(ids, Eigen::Matrix<int32_t,D,1,Eigen::DontAlign>::Constant(-1));
+    const int32_t numLive = RemapCount(remap_.size());
+    for (int32_t i=0; i<numLive; ++i) {
+      Eigen::Matrix<int32_t,D,1,Eigen::DontAlign>& id = At(ids, i);
+      for (int d=0; d<D; ++d) id(d) = Remap(id(d));
+    }
+  }
+
+  /// Compact and remap a list of id pairs holding stride entries per
+  /// surfel. The size is kept and freed entries are set to (-1,-1).
+  void RemapPairs(std::vector<std::pair<int32_t,int32_t>>& pairs,
+      size_t stride) const;
+
+  /// New id of surfel id or -1 if it was removed.
+  int32_t Remap(int32_t id) const {
+    return 0 <= id && id < (int32_t)remap_.size() ? remap_[id] : -1;
+  }
+  /// Number of live surfels among the first n.
+  int32_t RemapCount(int32_t n) const;
+
+  /// Totals since construction; safe to read from any thread.
+  size_t NumPruned() const { return numPruned_; }
+  size_t NumCarved() const { return numCarved_; }
+  size_t NumCompactions() const { return numCompactions_; }
+  /// Changes whenever surfels were invalidated or moved. The counters
+  /// are bumped only after the surfels are marked invalid (or moved),
+  /// so a reader that takes this value before a full pass over the map
+  /// and finds it unchanged later has seen every removal since.
+  size_t NumRemovals() const {
+    return numPruned_ + numCarved_ + numCompactions_;
+  }
+  /// Number of map entries covered by the current spatial hash.
+  size_t NumHashed() {
+    std::lock_guard<std::mutex> lock(hashMut_);
+    return numHashed_;
+  }
+
+  // batch pruning
+  int32_t survivalTime_;   // frames without observation before pruning
+  float pruneHThr_;        // prune if the entropy Hp_ is above
+  uint16_t pruneNumObsThr_;// and fewer observations than this
+  bool prune_;
+  // free space carving
+  float carveNumSigma_;    // margin in front of the surface in sigmas
+  float carveMargin_;      // additional constant margin [m]
+  uint8_t carveVotesThr_;  // votes needed to carve a surfel
+  // compaction
+  float compactFraction_;  // fraction of invalid surfels to compact
+  size_t compactMin_;      // minimum number of invalid surfels
+
+ private:
+  template<typename T>
+  static T& At(CircularBuffer<T>& buf, int32_t i) {
+    return buf.ptr_[(buf.iRead_+i)%buf.w_];
+  }
+
+  template<size_t I, class C, typename F0, typename... Fs>
+  void CompactColumns(C& cols, const F0& fill, const Fs&... fills) const {
+    Compact(cols.template Get<I>(), fill);
+    CompactColumns<I+1>(cols, fills...);
+  }
+  template<size_t I, class C>
+  void CompactColumns(C&) const {}
+
+  void Worker();
+  /// Prune and count invalid surfels among the first N.
+  void Prune(size_t N, int32_t frame);
+
+  CircularBuffer<Plane>& pl_w_;
+  std::vector<uint8_t> votes_;
+
+  std::mutex hashMut_;
+  SurfelHash hash_;
+  float cellSize_;
+
+  // new id of every surfel and number of live ones before each
+  std::vector<int32_t> remap_;
+  std::vector<int32_t> liveBefore_;
+  int32_t firstDead_;
+
+  std::atomic<size_t> numPruned_;
+  std::atomic<size_t> numCarved_;
+  std::atomic<size_t> numCompactions_;
+  size_t numDead_;
+  size_t numHashed_;
+
+  int32_t frame_;
+  bool update_;
+  bool stop_;
+  // held by whoever reads or writes the surfel flags: the worker while
+  // it prunes, CarveFreeSpace while it votes and the compaction
+  std::mutex workMut_;
+  std::mutex mut_;
+  std::condition_variable cv_;
+  std::thread worker_;
+};
+
+}
@@ -0,0 +1,293 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <Eigen/Dense>
+#include <tdp/data/image.h>
+#include <tdp/eigen/dense.h>
+#include <tdp/utils/batch.h>
+
+namespace tdp {
+
+/// Sufficient statistics of 3D data (such as surfel normals) per label:
+/// the count, the sum and optionally the sum of outer products, stored
+/// as one column per entry so that sweeps over the labels vectorize.
+///
+/// Besides plain Add/Remove/Move deltas the statistics can track the
+/// contribution (label and value) of every item i, e.g. every surfel of
+/// the map. Set() then replaces the old contribution of an item by its
+/// new one, so that the statistics follow label and value changes at a
+/// cost of O(changes) instead of a full pass over all items. Threads
+/// that change items can Touch() them and the owner applies all pending
+/// changes at once with SyncTouched(). Accumulate() rebuilds everything
+/// from scratch in parallel, e.g. after the items were compacted.
+///
+/// Apart from Touch() the statistics are not synchronized.
+class LabelSufficientStats {
+ public:
+  enum : uint32_t { kNone = 0xFFFFFFFF };
+
+  /// Statistics for K labels and up to numItems tracked items.
+  LabelSufficientStats(size_t K, size_t numItems, bool secondOrder = false)
+    : numCols_(secondOrder ? kNumCols : kXX), K_(0),
+    itemLabel_(numItems, kNone), itemX_(numItems, Vector3fda::Zero()),
+    touched_(numItems, 0) {
+    Resize(K);
+  }
+
+  size_t K() const { return K_; }
+  size_t NumItems() const { return itemLabel_.size(); }
+  bool SecondOrder() const { return numCols_ == kNumCols; }
+
+  /// Change the number of labels; new labels start out empty.
+  void Resize(size_t K) {
+    for (size_t c=0; c<numCols_; ++c) cols_[c].resize(K, 0.f);
+    K_ = K;
+  }
+
+  /// Zero all statistics and forget all item contributions.
+  void Reset() {
+    for (size_t c=0; c<numCols_; ++c)
+      std::fill(cols_[c].begin(), cols_[c].end(), 0.f);
+    std::fill(itemLabel_.begin(), itemLabel_.end(), kNone);
+  }
+
+  /// Add x with weight w to label k; labels out of range are ignored.
+  void Add(uint32_t k, const Vector3fda& x, float w = 1.f) {
+    if (k >= K_) return;
+    Add(k, x, w, cols_);
+  }
+  void Remove(uint32_t k, const Vector3fda& x) { Add(k, x, -1.f); }
+  void Move(uint32_t from, uint32_t to, const Vector3fda& x) {
+    if (from == to) return;
+    Remove(from, x);
+    Add(to, x);
+  }
+
+  /// Replace the contribution of item i by x with label k; kNone (or
+  /// any label out of range) removes it. Returns true if it changed.
+  bool Set(uint32_t i, uint32_t k, const Vector3fda& x) {
+    if (k >= K_) k = kNone;
+    uint32_t& ki = itemLabel_[i];
+    Vector3fda& xi = itemX_[i];
+    if (ki == k && (k == kNone || xi == x)) return false;
+    Remove(ki, xi);
+    Add(k, x);
+    ki = k;
+    xi = x;
+    return true;
+  }
+  /// Label item i currently contributes to or kNone.
+  uint32_t Label(uint32_t i) const { return itemLabel_[i]; }
+
+  /// Mark item i as changed; may be called from any thread.
+  void Touch(uint32_t i) {
+    if (i >= touched_.size()) return;
+    std::lock_guard<std::mutex> lock(touchMut_);
+    if (touched_[i]) return;
+    touched_[i] = 1;
+    touchedIds_.push_back(i);
+  }
+
+  /// Apply the current state of all touched items: get(i, k, x)
+  /// returns false if item i does not contribute and otherwise sets
+  /// its label k and value x. Returns the number of touched items.
+  template<class F>
+  size_t SyncTouched(const F& get) {
+    {
+      std::lock_guard<std::mutex> lock(touchMut_);
+      syncIds_.swap(touchedIds_);
+      for (uint32_t i : syncIds_) touched_[i] = 0;
+    }
+    for (uint32_t i : syncIds_) {
+      uint32_t k = kNone;
+      Vector3fda x = Vector3fda::Zero();
+      if (!get(i, k, x)) k = kNone;
+      Set(i, k, x);
+    }
+    const size_t numSynced = syncIds_.size();
+    syncIds_.clear();
+    return numSynced;
+  }
+
+  /// Rebuild the statistics from the first N items (see SyncTouched()
+  /// for get); items from N on are forgotten. Fixed size blocks of
+  /// items are summed into partials which are merged in order, so the
+  /// result does not depend on numThreads.
+  template<class F>
+  void Accumulate(size_t N, const F& get, size_t numThreads = 0) {
+    N = std::min(N, NumItems());
+    const size_t numBlocks = (N+kBlockSize-1)/kBlockSize;
+    if (partials_.size() < numBlocks) partials_.resize(numBlocks);
+    ForEachBlock(numBlocks, 1, numThreads, [&](size_t b0, size_t b1) {
+        for (size_t b=b0; b<b1; ++b) {
+          Columns& part = partials_[b];
+          for (size_t c=0; c<numCols_; ++c) part[c].assign(K_, 0.f);
+          const size_t i1 = std::min(N, (b+1)*kBlockSize);
+          for (size_t i=b*kBlockSize; i<i1; ++i) {
+            uint32_t k = kNone;
+            Vector3fda x = Vector3fda::Zero();
+            if (!get(i, k, x) || k >= K_) k = kNone;
+            itemLabel_[i] = k;
+            itemX_[i] = x;
+            if (k != kNone) Add(k, x, 1.f, part);
+          }
+        }
+      }, 2);
+    for (size_t c=0; c<numCols_; ++c) {
+      float* col = cols_[c].data();
+      std::fill(col, col+K_, 0.f);
+      for (size_t b=0; b<numBlocks; ++b) {
+        const float* part = partials_[b][c].data();
+        for (size_t k=0; k<K_; ++k) col[k] += part[k];
+      }
+    }
+    std::fill(itemLabel_.begin()+N, itemLabel_.end(), kNone);
+  }
+
+  /// Map every label k to labelMap[k] (as when empty labels are
+  /// removed) and change the number of labels to K. Statistics of
+  /// labels mapped onto the same label are summed; labels mapped to K
+  /// or beyond are dropped with the contributions of their items.
+  void Relabel(const std::vector<uint32_t>& labelMap, size_t K,
+      size_t numThreads = 0) {
+    const size_t Kprev = std::min(K_, labelMap.size());
+    for (size_t c=0; c<numCols_; ++c) {
+      std::vector<float>& col = cols_[c];
+      std::vector<float>& tmp = relabelTmp_;
+      tmp.assign(K, 0.f);
+      for (size_t k=0; k<Kprev; ++k)
+        if (labelMap[k] < K) tmp[labelMap[k]] += col[k];
+      col.swap(tmp);
+    }
+    K_ = K;
+    ForEachBlock(NumItems(), kBlockSize, numThreads,
+      [&](size_t i0, size_t i1) {
+        for (size_t i=i0; i<i1; ++i) {
+          uint32_t& k = itemLabel_[i];
+          if (k == kNone) continue;
+          k = k < Kprev && labelMap[k] < K ? labelMap[k] : kNone;
+        }
+      });
+  }
+
+  float Count(uint32_t k) const { return cols_[kCount][k]; }
+  Vector3fda Sum(uint32_t k) const {
+    return Vector3fda(cols_[kX][k], cols_[kY][k], cols_[kZ][k]);
+  }
+  /// Sum and count as used by vMFprior::posterior().
+  Vector4fda FirstOrder(uint32_t k) const {
+    return Vector4fda(cols_[kX][k], cols_[kY][k], cols_[kZ][k],
+        cols_[kCount][k]);
+  }
+  /// Sum of the outer products; only with secondOrder.
+  Matrix3fda Outer(uint32_t k) const {
+    Matrix3fda xx;
+    xx << cols_[kXX][k], cols_[kXY][k], cols_[kXZ][k],
+       cols_[kXY][k], cols_[kYY][k], cols_[kYZ][k],
+       cols_[kXZ][k], cols_[kYZ][k], cols_[kZZ][k];
+    return xx;
+  }
+  Vector3fda Mean(uint32_t k) const { return Sum(k)/Count(k); }
+  /// Sample covariance; only with secondOrder.
+  Matrix3fda Cov(uint32_t k) const {
+    const Vector3fda xSum = Sum(k);
+    return (Outer(k) - xSum*xSum.transpose()/Count(k))/Count(k);
+  }
+
+  /// Copy the first order statistics of the first ss.Area() labels
+  /// into ss in the layout of FirstOrder(); the rest of ss is zeroed.
+  void CopyFirstOrder(Image<Vector4fda>& ss) const {
+    const size_t K = std::min(K_, ss.Area());
+    for (size_t k=0; k<K; ++k) ss[k] = FirstOrder(k);
+    for (size_t k=K; k<ss.Area(); ++k) ss[k] = Vector4fda::Zero();
+  }
+
+ private:
+  enum Column {
+    kCount = 0, kX, kY, kZ, kXX, kXY, kXZ, kYY, kYZ, kZZ, kNumCols
+  };
+  static const size_t kBlockSize = 1<<16;
+  typedef std::array<std::vector<float>,kNumCols> Columns;
+
+  void Add(uint32_t k, const Vector3fda& x, float w, Columns& cols) const {
+    cols[kCount][k] += w;
+    cols[kX][k] += w*x(0);
+    cols[kY][k] += w*x(1);
+    cols[kZ][k] += w*x(2);
+    if (numCols_ == kXX) return;
+    cols[kXX][k] += w*x(0)*x(0);
+    cols[kXY][k] += w*x(0)*x(1);
+    cols[kXZ][k] += w*x(0)*x(2);
+    cols[kYY][k] += w*x(1)*x(1);
+    cols[kYZ][k] += w*x(1)*x(2);
+    cols[kZZ][k] += w*x(2)*x(2);
+  }
+
+  size_t numCols_;
+  size_t K_;
+  Columns cols_;
+  // label and value every item contributes
+  std::vector<uint32_t> itemLabel_;
+  std::vector<Vector3fda> itemX_;
+  // items changed since the last SyncTouched()
+  std::mutex touchMut_;
+  std::vector<uint8_t> touched_;
+  std::vector<uint32_t> touchedIds_;
+  std::vector<uint32_t> syncIds_;
+  // per block partials of Accumulate()
+  std::vector<Columns> partials_;
+  std::vector<float> relabelTmp_;
+};
+
+/// Add x to the running Gaussian sufficient statistics of one item.
+inline void AccumulateGaussianSS(const Vector3fda& x, Vector3fda& xSum,
+    Matrix3fda& xOuter, float& xCount) {
+  xSum += x;
+  xOuter += x*x.transpose();
+  xCount ++;
+}
+
+/// Running average form of AccumulateGaussianSS() that weighs at most
+/// the last xCountMax samples.
+inline void RunningAvgGaussianSS(const Vector3fda& x, float xCountMax,
+    Vector3fda& xSum, Matrix3fda& xOuter, float& xCount) {
+  xSum = (xSum*xCount + x)/(xCount+1);
+  xOuter = (xOuter*xCount + x*x.transpose())/(xCount+1);
+  xCount = std::min(xCountMax, xCount+1);
+}
+
+inline void ComputeSampleCov(const Vector3fda& xSum,
+    const Matrix3fda& xOuter, const float xCount, Matrix3fda& cov) {
+  cov = (xOuter - xSum*xSum.transpose()/xCount)/xCount;
+}
+
+inline void ComputeSampleCovFromRunAvg(const Vector3fda& xMean,
+    const Matrix3fda& xMeanOuter, Matrix3fda& cov) {
+  cov = xMeanOuter - xMean*xMean.transpose();
+}
+
+inline void ComputeSampleMean(const Vector3fda& xSum, const float xCount,
+    Vector3fda& mean) {
+  mean = xSum/xCount;
+}
+
+/// Add x to the vMF sufficient statistics of one item.
+inline void AccumulatevMFSS(const Vector3fda& x, Vector3fda& xSum,
+    uint32_t& xCount) {
+  xSum += x;
+  xCount ++;
+}
+
+inline void RunningAvgvMFSS(const Vector3fda& x, float xCountMax,
+    Vector3fda& xSum, float& xCount) {
+  xSum = (xSum*xCount + x)/(xCount+1);
+  xCount = std::min(xCountMax, xCount+1);
+}
+
+}
@@ -86,10 +86,27 @@ struct TSDF {
 
   }
 
+  /// Save in the brick-compressed snapshot format (see
+  /// tdp/tsdf/tsdf_snapshot.h); LoadTSDF reads both formats.
+  static bool SaveTSDFSnapshot(const Volume<TSDFval>& tsdf, 
+        Vector3fda grid0, Vector3fda dGrid, 
+        const SE3f& T_wG,
+        const std::string& path);
+
+  static bool LoadTSDFSnapshot(const std::string& path,
+      ManagedHostVolume<TSDFval>& tsdf, 
+      SE3f& T_wG,
+      Vector3fda& grid0, Vector3fda& dGrid);
+
+  static bool IsTSDFSnapshot(const std::string& path);
+
   static bool LoadTSDF(const std::string& path,
       ManagedHostVolume<TSDFval>& tsdf, 
       SE3f& T_wG,
       Vector3fda& grid0, Vector3fda& dGrid) {
+    if (IsTSDFSnapshot(path))
+      return LoadTSDFSnapshot(path, tsdf, T_wG, grid0, dGrid);
+
     std::ifstream in;
     in.open(path, std::ios::in | std::ios::binary);
     if (!in.is_open())
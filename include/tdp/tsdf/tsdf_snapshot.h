@@ -0,0 +1,83 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <tdp/data/volume.h>
+#include <tdp/data/managed_volume.h>
+#include <tdp/eigen/dense.h>
+#include <tdp/manifold/SE3.h>
+#include <tdp/tsdf/tsdf.h>
+
+namespace tdp {
+
+/// Entry of the brick index at the end of a TSDF snapshot file.
+struct TSDFBrickIndex {
+  uint32_t bx, by, bz; // brick coordinates
+  uint32_t codec;      // 0: shuffled raw bytes; 1: shuffled + RLE
+  uint64_t offset;     // byte offset of the brick payload in the file
+  uint64_t bytes;      // size of the brick payload in bytes
+};
+
+/// Versioned on-disk format for TSDF volumes. The volume is split into
+/// bricks of BrickSize^3 voxels; unobserved bricks (all weights zero)
+/// are not stored. Voxels are serialized field by field so the layout
+/// does not depend on struct padding. Every brick is byte-shuffled and
+/// run-length encoded on its own, and a brick index at the end of the
+/// file allows decoding bricks lazily and in parallel from an mmap.
+///
+/// The codec is in-tree because the build has no LZ4 or zstd. Shuffling
+/// puts the constant bytes of a fused TSDF (weights, colors, the
+/// exponent bytes of f and the truncated f=+-1 regions) into long runs,
+/// which RLE captures; only the low mantissa bytes of f near surfaces
+/// stay incompressible. The codec id of every brick allows adding
+/// another codec without changing the format version.
+class TSDFSnapshot {
+ public:
+  const static uint32_t Version = 1;
+  const static uint32_t BrickSize = 32;
+
+  TSDFSnapshot();
+  ~TSDFSnapshot();
+
+  /// mmap the file and parse header and brick index.
+  bool Open(const std::string& path);
+  void Close();
+  bool IsOpen() const { return data_ != nullptr; }
+
+  /// Decode brick i of the index into its region of tsdf.
+  bool LoadBrick(size_t i, Volume<TSDFval>& tsdf) const;
+
+  /// Decode the whole volume using numThreads threads (0 uses all
+  /// cores); voxels of bricks that are not stored are set to TSDFval().
+  bool Load(ManagedHostVolume<TSDFval>& tsdf, size_t numThreads=0) const;
+
+  /// Compress and write tsdf using numThreads threads (0 uses all cores).
+  static bool Save(const std::string& path,
+      const Volume<TSDFval>& tsdf,
+      const Vector3fda& grid0, const Vector3fda& dGrid,
+      const SE3f& T_wG, size_t numThreads=0);
+
+  /// Check for the snapshot magic at the beginning of the file.
+  static bool IsSnapshot(const std::string& path);
+
+  size_t w_;
+  size_t h_;
+  size_t d_;
+  Vector3fda grid0_;
+  Vector3fda dGrid_;
+  SE3f T_wG_;
+  std::vector<TSDFBrickIndex> bricks_;
+
+ private:
+  int fd_;
+  const uint8_t* data_;
+  size_t size_;
+
+  TSDFSnapshot(const TSDFSnapshot&);
+  TSDFSnapshot& operator=(const TSDFSnapshot&);
+};
+
+}
@@ -0,0 +1,56 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <algorithm>
+#include <tdp/utils/parallel_for.h>
+
+namespace tdp {
+
+/// Number of points processed together in structure of arrays form by
+/// the batch kernels. The fixed trip count lets the compiler vectorize
+/// the inner loops for whatever SIMD width the build targets.
+const size_t kBatchBlock = 64;
+/// Inputs below this number of elements are processed on the calling
+/// thread only.
+const size_t kBatchMinParallel = 1 << 15;
+
+/// Run f(i0,i1) over the blocks [i0,i1) of [0,N) on up to numThreads
+/// threads of the global ThreadPool (0 uses
+/// ThreadPool::MaxConcurrency()). Blocks are handed out dynamically.
+/// Only the calling thread is used if N < minParallel.
+template<class F>
+void ForEachBlock(size_t N, size_t blockSize, size_t numThreads,
+    const F& f, size_t minParallel = kBatchMinParallel) {
+  ParallelFor(N, blockSize, f, numThreads, minParallel);
+}
+
+/// Run f(v,u0,u1) over the pixels [u0,u1) of row v for all rows of a
+/// w x h image. Rows are split into chunks of up to 4096 pixels so that
+/// single row images are parallelized as well.
+template<class F>
+void ForEachRowChunk(size_t w, size_t h, size_t numThreads, const F& f) {
+  if (w == 0) return;
+  const size_t chunk = 4096;
+  const size_t chunksPerRow = (w+chunk-1)/chunk;
+  const size_t chunksPerBlock = std::max<size_t>(1, chunk/w);
+  ForEachBlock(h*chunksPerRow, chunksPerBlock, numThreads,
+    [&](size_t c0, size_t c1) {
+      for (size_t c=c0; c<c1; ++c) {
+        const size_t u0 = (c%chunksPerRow)*chunk;
+        f(c/chunksPerRow, u0, std::min(w, u0+chunk));
+      }
+    }, kBatchMinParallel/std::min(w,chunk));
+}
+
+/// out[i] = f(in[i]) for arrays of N elements; used for batch Exp and
+/// Log over arrays of tangent vectors or poses.
+template<typename In, typename Out, class F>
+void MapBatch(const In* in, Out* out, size_t N, const F& f,
+    size_t numThreads = 0) {
+  ForEachBlock(N, 256, numThreads, [&](size_t i0, size_t i1) {
+      for (size_t i=i0; i<i1; ++i) out[i] = f(in[i]);
+    }, 1024);
+}
+
+}
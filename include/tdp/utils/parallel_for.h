@@ -0,0 +1,112 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <Eigen/Core>
+#include <tdp/data/image.h>
+#include <tdp/data/volume.h>
+#include <tdp/utils/thread_pool.h>
+
+namespace tdp {
+
+/// Run f(i0,i1) over the blocks [i0,i1) of [0,N) of grain elements on
+/// up to maxThreads threads of the global pool (0 uses
+/// ThreadPool::MaxConcurrency()), the calling thread included. Blocks
+/// are handed out dynamically. Only the calling thread is used if N <
+/// minParallel. Calls may be nested.
+template<class F>
+void ParallelFor(size_t N, size_t grain, const F& f, size_t maxThreads = 0,
+    size_t minParallel = 0) {
+  if (N == 0) return;
+  grain = std::max<size_t>(1, grain);
+  const size_t numBlocks = (N+grain-1)/grain;
+  if (maxThreads == 0) maxThreads = ThreadPool::MaxConcurrency();
+  size_t numThreads = std::min(maxThreads, numBlocks);
+  if (N < minParallel) numThreads = 1;
+  if (numThreads <= 1) {
+    for (size_t b=0; b<numBlocks; ++b)
+      f(b*grain, std::min(N, (b+1)*grain));
+    return;
+  }
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (size_t b=next++; b<numBlocks; b=next++)
+      f(b*grain, std::min(N, (b+1)*grain));
+  };
+  TaskGroup group;
+  for (size_t t=1; t<numThreads; ++t) group.Run(work);
+  work();
+  group.Wait();
+}
+
+/// Run f(u0,u1,v0,v1) over the tileW x tileH tiles of a w x h domain.
+template<class F>
+void ParallelForTiles(size_t w, size_t h, size_t tileW, size_t tileH,
+    const F& f, size_t maxThreads = 0) {
+  const size_t I = (w+tileW-1)/tileW;
+  const size_t J = (h+tileH-1)/tileH;
+  ParallelFor(I*J, 1, [&](size_t t0, size_t t1) {
+      for (size_t t=t0; t<t1; ++t) {
+        const size_t u0 = (t%I)*tileW, v0 = (t/I)*tileH;
+        f(u0, std::min(w, u0+tileW), v0, std::min(h, v0+tileH));
+      }
+    }, maxThreads);
+}
+template<class T, class F>
+void ParallelForTiles(const Image<T>& I, size_t tileW, size_t tileH,
+    const F& f, size_t maxThreads = 0) {
+  ParallelForTiles(I.w_, I.h_, tileW, tileH, f, maxThreads);
+}
+
+/// Run f(u0,u1,v0,v1,d0,d1) over the tileW x tileH x tileD tiles of a
+/// w x h x d domain.
+template<class F>
+void ParallelForTiles(size_t w, size_t h, size_t d, size_t tileW,
+    size_t tileH, size_t tileD, const F& f, size_t maxThreads = 0) {
+  const size_t I = (w+tileW-1)/tileW;
+  const size_t J = (h+tileH-1)/tileH;
+  const size_t K = (d+tileD-1)/tileD;
+  ParallelFor(I*J*K, 1, [&](size_t t0, size_t t1) {
+      for (size_t t=t0; t<t1; ++t) {
+        const size_t u0 = (t%I)*tileW;
+        const size_t v0 = ((t/I)%J)*tileH;
+        const size_t d0 = (t/(I*J))*tileD;
+        f(u0, std::min(w, u0+tileW), v0, std::min(h, v0+tileH),
+          d0, std::min(d, d0+tileD));
+      }
+    }, maxThreads);
+}
+template<class T, class F>
+void ParallelForTiles(const Volume<T>& V, size_t tileW, size_t tileH,
+    size_t tileD, const F& f, size_t maxThreads = 0) {
+  ParallelForTiles(V.w_, V.h_, V.d_, tileW, tileH, tileD, f, maxThreads);
+}
+
+/// Reduce [0,N) in blocks of grain elements: map(i0,i1,acc) adds the
+/// elements of a block to acc, which starts out as identity, and
+/// combine(a,b) adds b to a. The partial results of the blocks are
+/// combined in block order, so the result does not depend on the number
+/// of threads. E.g. the normal equations of a 6 DoF alignment:
+///   typedef Eigen::Matrix<float,6,7> Ab;
+///   Ab sys = ParallelReduce<Ab>(N, 4096, Ab::Zero(),
+///     [&](size_t i0, size_t i1, Ab& s) { ... s += J*[J r] ... },
+///     [](Ab& a, const Ab& b) { a += b; });
+template<class T, class Map, class Combine>
+T ParallelReduce(size_t N, size_t grain, const T& identity, const Map& map,
+    const Combine& combine, size_t maxThreads = 0) {
+  grain = std::max<size_t>(1, grain);
+  const size_t numBlocks = (N+grain-1)/grain;
+  std::vector<T, Eigen::aligned_allocator<T>> partials(numBlocks, identity);
+  ParallelFor(numBlocks, 1, [&](size_t b0, size_t b1) {
+      for (size_t b=b0; b<b1; ++b)
+        map(b*grain, std::min(N, (b+1)*grain), partials[b]);
+    }, maxThreads);
+  T result = identity;
+  for (size_t b=0; b<numBlocks; ++b) combine(result, partials[b]);
+  return result;
+}
+
+}
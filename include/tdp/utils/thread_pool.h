@@ -0,0 +1,170 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tdp {
+
+/// Work stealing thread pool shared by the CPU kernels of tdp.
+///
+/// Every worker owns a deque: tasks submitted from a worker go to the
+/// back of its own deque and are run LIFO, idle workers steal from the
+/// front of the others. Tasks submitted from other threads go to a
+/// shared queue. Threads that wait for tasks (TaskGroup::Wait()) run
+/// pending tasks meanwhile, so nested parallel loops do not deadlock.
+///
+/// All kernels use the Global() pool whose size is bounded by
+/// MaxConcurrency(). Set it (or the environment variable
+/// TDP_NUM_THREADS) below the number of cores to leave room for other
+/// thread pools in the process such as the one of GTSAM.
+class ThreadPool {
+ public:
+  typedef std::function<void()> Task;
+
+  /// Pool with numWorkers threads; with pin every worker is bound to
+  /// one of the cores the process may run on, filling one socket after
+  /// the other.
+  explicit ThreadPool(size_t numWorkers, bool pin = false);
+  ~ThreadPool();
+
+  /// The process wide pool with MaxConcurrency()-1 workers (the thread
+  /// that waits is the last one); created on first use.
+  static ThreadPool& Global();
+  /// Number of threads all kernels use together, callers included.
+  /// Only takes effect if set before the first use of Global().
+  static void SetMaxConcurrency(size_t numThreads);
+  static size_t MaxConcurrency();
+  /// Pin the workers of Global(); only before its first use.
+  static void SetPinning(bool pin);
+
+  size_t NumWorkers() const { return workers_.size(); }
+
+  void Submit(Task task);
+  /// Run one pending task on the calling thread; false if there was
+  /// none.
+  bool RunOne();
+  /// Run pending tasks until done() holds; sleeps while there are none.
+  /// Whoever makes done() true has to call Notify().
+  template<class F>
+  void WaitUntil(const F& done) {
+    while (!done()) {
+      if (RunOne()) continue;
+      std::unique_lock<std::mutex> lock(sleepMut_);
+      sleepCv_.wait(lock, [&]{ return done() || numPending_.load() > 0; });
+    }
+  }
+  void Notify() {
+    std::lock_guard<std::mutex> lock(sleepMut_);
+    sleepCv_.notify_all();
+  }
+
+ private:
+  struct Queue {
+    std::mutex mut;
+    std::deque<Task> tasks;
+  };
+
+  void Worker(size_t id, bool pin);
+  bool Pop(size_t id, Task& task);
+  bool PopBack(Queue& q, Task& task);
+  bool PopFront(Queue& q, Task& task);
+
+  // one queue per worker and the shared queue last
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> numPending_;
+  std::atomic<bool> stop_;
+  std::mutex sleepMut_;
+  std::condition_variable sleepCv_;
+};
+
+/// Tasks run on a pool that can be waited for together.
+///   TaskGroup group;
+///   group.Run([&]{ ... });
+///   group.Wait();
+class TaskGroup {
+ public:
+  explicit TaskGroup(ThreadPool& pool = ThreadPool::Global())
+    : pool_(pool), numPending_(0) {}
+  ~TaskGroup() { Wait(); }
+
+  void Run(ThreadPool::Task task) {
+    numPending_ ++;
+    // the group may be gone once numPending_ hits 0; only the pool is
+    // touched after that
+    ThreadPool& pool = pool_;
+    pool_.Submit([this, &pool, task]() {
+        task();
+        if (--numPending_ == 0) pool.Notify();
+      });
+  }
+  /// Block until all tasks ran; the calling thread helps.
+  void Wait() {
+    pool_.WaitUntil([this]{ return numPending_.load() == 0; });
+  }
+
+ private:
+  TaskGroup(const TaskGroup&);
+  TaskGroup& operator=(const TaskGroup&);
+  ThreadPool& pool_;
+  std::atomic<size_t> numPending_;
+};
+
+/// Tasks with dependencies; a task runs once all its predecessors ran.
+///   TaskGraph graph;
+///   size_t a = graph.Add([&]{ ... });
+///   size_t b = graph.Add([&]{ ... });
+///   graph.Precede(a, b);
+///   graph.Run();
+class TaskGraph {
+ public:
+  size_t Add(ThreadPool::Task task) {
+    nodes_.emplace_back(new Node(task));
+    return nodes_.size()-1;
+  }
+  /// before has to finish before after starts.
+  void Precede(size_t before, size_t after) {
+    nodes_[before]->successors.push_back(after);
+    nodes_[after]->numPredecessors ++;
+  }
+  /// Run all tasks and block until they are done. The graph can be run
+  /// again.
+  void Run(ThreadPool& pool = ThreadPool::Global()) {
+    TaskGroup group(pool);
+    for (auto& node : nodes_) node->remaining = node->numPredecessors;
+    for (size_t i=0; i<nodes_.size(); ++i)
+      if (nodes_[i]->numPredecessors == 0) Schedule(i, group);
+    group.Wait();
+  }
+  size_t Size() const { return nodes_.size(); }
+
+ private:
+  struct Node {
+    Node(const ThreadPool::Task& task)
+      : task(task), numPredecessors(0), remaining(0) {}
+    ThreadPool::Task task;
+    std::vector<size_t> successors;
+    size_t numPredecessors;
+    std::atomic<size_t> remaining;
+  };
+
+  void Schedule(size_t i, TaskGroup& group) {
+    group.Run([this, i, &group]() {
+        nodes_[i]->task();
+        for (size_t j : nodes_[i]->successors)
+          if (--nodes_[j]->remaining == 0) Schedule(j, group);
+      });
+  }
+
+  std::vector<std::unique_ptr<Node>> nodes_;
+};
+
+}
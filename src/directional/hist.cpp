@@ -0,0 +1,41 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <algorithm>
+#include <vector>
+#include <tdp/data/image.h>
+#include <tdp/cuda/cuda.h>
+#include <tdp/eigen/dense.h>
+#include <tdp/directional/geodesic_grid_locate.h>
+#include <tdp/utils/parallel_for.h>
+
+namespace tdp {
+
+void ComputeGeodesicHist(
+    const Image<tdp::Vector3fda>& n,
+    const Image<tdp::Vector3fda>& triEdges,
+    uint32_t D,
+    Image<uint32_t>& hist,
+    size_t numThreads) {
+  // rows are summed into one histogram per block of rows; few blocks
+  // keep the partial histograms small
+  const size_t rowsPerBlock = std::max<size_t>(8, (n.h_+15)/16);
+  const std::vector<uint32_t> sum = ParallelReduce(n.h_, rowsPerBlock,
+    std::vector<uint32_t>(hist.Area(), 0),
+    [&](size_t v0, size_t v1, std::vector<uint32_t>& h) {
+      for (size_t v=v0; v<v1; ++v) {
+        const Vector3fda* row = n.RowPtr(v);
+        for (size_t u=0; u<n.w_; ++u) {
+          if (!IsValidData(row[u])) continue;
+          h[LocateInGeodesicGrid(row[u], triEdges.ptr_, D)] ++;
+        }
+      }
+    },
+    [](std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+      for (size_t i=0; i<a.size(); ++i) a[i] += b[i];
+    }, numThreads);
+  for (size_t i=0; i<hist.Area(); ++i)
+    hist[i] += sum[i];
+}
+
+}
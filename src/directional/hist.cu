@@ -4,6 +4,7 @@
 #include <tdp/data/image.h>
 #include <tdp/cuda/cuda.h>
 #include <tdp/nvidia/helper_cuda.h>
+#include <tdp/directional/geodesic_grid_locate.h>
 
 namespace tdp {
 
@@ -44,4 +45,59 @@ void ComputeCentroidBasedGeoidesicHist(
   checkCudaErrors(cudaDeviceSynchronize());
 }
 
+// per-block histograms in shared memory up to this many bins (D <= 5)
+#define GEODESIC_HIST_SHARED_BINS 5120
+
+template<bool SHARED>
+__global__
+void KernelComputeGeodesicHist(
+    Image<tdp::Vector3fda> n,
+    Image<tdp::Vector3fda> triEdges,
+    uint32_t D,
+    Image<uint32_t> hist
+    ) {
+  __shared__ uint32_t histS[SHARED ? GEODESIC_HIST_SHARED_BINS : 1];
+  const int tid = threadIdx.x + blockDim.x * threadIdx.y;
+  const int numThreads = blockDim.x * blockDim.y;
+  const int idx = threadIdx.x + blockDim.x * blockIdx.x;
+  const int idy = threadIdx.y + blockDim.y * blockIdx.y;
+  if (SHARED) {
+    for (int i=tid; i<hist.w_; i+=numThreads) histS[i] = 0;
+    __syncthreads();
+  }
+  if (idx < n.w_ && idy < n.h_) {
+    tdp::Vector3fda ni = n(idx,idy);
+    if (IsValidData(ni)) {
+      uint32_t id = LocateInGeodesicGrid(ni, triEdges.ptr_, D);
+      if (SHARED) 
+        atomicAdd(&histS[id], 1);
+      else
+        atomicAdd(&hist[id], 1);
+    }
+  }
+  if (SHARED) {
+    __syncthreads();
+    for (int i=tid; i<hist.w_; i+=numThreads) 
+      if (histS[i] > 0) atomicAdd(&hist[i], histS[i]);
+  }
+}
+
+void ComputeGeodesicHistGpu(
+    const Image<tdp::Vector3fda>& cuN,
+    const Image<tdp::Vector3fda>& cuTriEdges,
+    uint32_t D,
+    Image<uint32_t>& cuHist
+    ) {
+  dim3 threads, blocks;
+  ComputeKernelParamsForImage(blocks,threads,cuN,32,32);
+  if (cuHist.w_ <= GEODESIC_HIST_SHARED_BINS) {
+    KernelComputeGeodesicHist<true><<<blocks,threads>>>(cuN,cuTriEdges,D,
+        cuHist);
+  } else {
+    KernelComputeGeodesicHist<false><<<blocks,threads>>>(cuN,cuTriEdges,D,
+        cuHist);
+  }
+  checkCudaErrors(cudaDeviceSynchronize());
+}
+
 }
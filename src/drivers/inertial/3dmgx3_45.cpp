@@ -105,6 +105,7 @@ void Imu3DMGX3_45::Start() {
             std::lock_guard<std::mutex> lock(circBufMutex_);
             circBuf_.Insert(imuObs);
           }
+          NotifyObs();
         }
       });
 }
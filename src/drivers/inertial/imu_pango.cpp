@@ -4,6 +4,8 @@
 
 #include <pangolin/utils/file_utils.h>
 #include <pangolin/compat/bind.h>
+#include <chrono>
+#include <thread>
 
 #ifndef _WIN_
 #  include <unistd.h>
@@ -15,7 +17,8 @@ ImuPango::ImuPango(const std::string& filename, bool realtime)
   : reader(filename, realtime), filename(filename), realtime(realtime),
   is_pipe(pangolin::IsPipe(filename)),
   is_pipe_open(true),
-  pipe_fd(-1)
+  pipe_fd(-1),
+  running_(false)
 {
   // N.B. is_pipe_open can default to true since the reader opens the file and
   // reads header information from it, which means the pipe must be open and
@@ -27,6 +30,7 @@ ImuPango::ImuPango(const std::string& filename, bool realtime)
 
 ImuPango::~ImuPango()
 {
+  Stop();
 #ifndef _WIN_
     if (pipe_fd != -1) {
       close(pipe_fd);
@@ -35,6 +39,49 @@ ImuPango::~ImuPango()
 }
 
 bool ImuPango::GrabNext(ImuObs& obs) {
+  if (!running_) return GrabNextPacket(obs);
+  {
+    std::lock_guard<std::mutex> lock(queueMut_);
+    if (queue_.empty()) return false;
+    obs = queue_.front();
+    queue_.pop_front();
+  }
+  queueCv_.notify_one();
+  return true;
+}
+
+bool ImuPango::WaitForObs(int64_t timeout_us) {
+  if (!running_) Start();
+  {
+    std::lock_guard<std::mutex> lock(queueMut_);
+    if (!queue_.empty()) return true;
+  }
+  return ImuInterface::WaitForObs(timeout_us);
+}
+
+void ImuPango::ReadPackets() {
+  ImuObs obs;
+  while (running_) {
+    {
+      std::unique_lock<std::mutex> lock(queueMut_);
+      queueCv_.wait(lock, [&]{
+          return !running_ || queue_.size() < kMaxQueued; });
+    }
+    if (!running_) break;
+    if (!GrabNextPacket(obs)) {
+      // end of the log or closed pipe; nothing new to expect for a while
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(queueMut_);
+      queue_.push_back(obs);
+    }
+    NotifyObs();
+  }
+}
+
+bool ImuPango::GrabNextPacket(ImuObs& obs) {
 #ifndef _WIN_
     if (is_pipe && !is_pipe_open) {
         if (pipe_fd == -1) {
@@ -85,9 +132,19 @@ bool ImuPango::GrabNewest(ImuObs& obs) {
 }
 
 void ImuPango::Stop() {
+  if (!running_) return;
+  {
+    std::lock_guard<std::mutex> lock(queueMut_);
+    running_ = false;
+  }
+  queueCv_.notify_all();
+  readerThread_.join();
 }
 
 void ImuPango::Start() {
+  bool stopped = false;
+  if (!running_.compare_exchange_strong(stopped, true)) return;
+  readerThread_ = std::thread(&ImuPango::ReadPackets, this);
 }
 
 pangolin::json::value ImuPango::GetProperties() const {
@@ -0,0 +1,172 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <algorithm>
+#include <iostream>
+#include <math.h>
+#include <tdp/esm/esm_tracker.h>
+#include <tdp/utils/parallel_for.h>
+
+namespace tdp {
+
+namespace {
+
+/// The ESM Jacobian of a pixel before multiplication with the SL3
+/// generators is (g_c+g_m)^T J_w(u,v)/2 with J_w as in ESM::J_w. For a
+/// gradient g = (gu,gv) the product g^T J_w(u,v) is the 9-vector below.
+inline void GradTimesJw(float gu, float gv, float u, float v, float* J) {
+  const float s = gu*u + gv*v;
+  J[0] = gu*u;
+  J[1] = gu*v;
+  J[2] = gu;
+  J[3] = gv*u;
+  J[4] = gv*v;
+  J[5] = gv;
+  J[6] = -s*u;
+  J[7] = -s*v;
+  J[8] = -s;
+}
+
+}
+
+ESMTracker::ESMTracker(size_t numThreads)
+  : minStep_(1e-6), verbose_(false), numThreads_(numThreads) {
+  for (size_t i=0; i<8; ++i) {
+    for (size_t j=0; j<9; ++j) {
+      J_g_(j,i) = SL3<float>::G(i)(j/3,j%3);
+    }
+  }
+}
+
+void ESMTracker::SetTemplateLevel(size_t lvl,
+    const Image<float>& gray_m,
+    const Image<float>& gradDu_m,
+    const Image<float>& gradDv_m,
+    const Image<uint8_t>* mask) {
+  Level& L = lvls_[lvl];
+  L.u.clear();
+  L.v.clear();
+  L.gray.clear();
+  L.Jm.clear();
+  L.rowStart.assign(1, 0);
+  const int w = gray_m.w_;
+  const int h = gray_m.h_;
+  // skip the border as in ESM::EstimateHomography
+  for (int v=1; v<h-1; ++v) {
+    const float* grayRow = gray_m.RowPtr(v);
+    const float* duRow = gradDu_m.RowPtr(v);
+    const float* dvRow = gradDv_m.RowPtr(v);
+    for (int u=1; u<w-1; ++u) {
+      if (mask) {
+        const size_t uM = u << lvl;
+        const size_t vM = v << lvl;
+        if (uM >= mask->w_ || vM >= mask->h_ || !(*mask)(uM,vM))
+          continue;
+      }
+      L.u.push_back(u);
+      L.v.push_back(v);
+      L.gray.push_back(grayRow[u]);
+      float J[9];
+      GradTimesJw(duRow[u], dvRow[u], u, v, J);
+      L.Jm.insert(L.Jm.end(), J, J+9);
+    }
+    L.rowStart.push_back(L.u.size());
+  }
+}
+
+float ESMTracker::Step(size_t lvl,
+    const Image<float>& gray_c,
+    const Image<float>& gradDu_c,
+    const Image<float>& gradDv_c,
+    SL3<float>& H, float& F) {
+  const Level& L = lvls_[lvl];
+  const Eigen::Matrix3f Hcur = H.matrix();
+  const size_t numRows = L.rowStart.size()-1;
+  const size_t rowsPerBlock = 4;
+  // the normal equations are accumulated before multiplication with the
+  // constant generator Jacobian J_g: JTJ = J_g^T A J_g, JTy = J_g^T b
+  typedef Eigen::Matrix<float,9,9> Mat9;
+  typedef Eigen::Matrix<float,9,1> Vec9;
+  typedef Eigen::Matrix<double,9,9> Mat9d;
+  typedef Eigen::Matrix<double,9,1> Vec9d;
+  struct Sums {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    Mat9d A;
+    Vec9d b;
+    double F;
+    size_t N;
+  };
+  Sums zero;
+  zero.A.setZero();
+  zero.b.setZero();
+  zero.F = 0.;
+  zero.N = 0;
+
+  const float wMax = (float)gray_c.w_-1;
+  const float hMax = (float)gray_c.h_-1;
+  const Sums sums = ParallelReduce<Sums>(numRows, rowsPerBlock, zero,
+    [&](size_t r0, size_t r1, Sums& s) {
+      // accumulate in float within a block and in double across blocks
+      Mat9 A = Mat9::Zero();
+      Vec9 b = Vec9::Zero();
+      const size_t i0 = L.rowStart[r0];
+      const size_t i1 = L.rowStart[r1];
+      for (size_t i=i0; i<i1; ++i) {
+        const float u = L.u[i];
+        const float v = L.v[i];
+        const float z = Hcur(2,0)*u + Hcur(2,1)*v + Hcur(2,2);
+        const float x = (Hcur(0,0)*u + Hcur(0,1)*v + Hcur(0,2))/z;
+        const float y = (Hcur(1,0)*u + Hcur(1,1)*v + Hcur(1,2))/z;
+        if (!(0.f <= x && x < wMax && 0.f <= y && y < hMax)) continue;
+        // bilinear weights shared between the three lookups
+        const int xl = (int)x;
+        const int yu = (int)y;
+        const float ax = x - xl;
+        const float ay = y - yu;
+        const float w00 = (1.f-ax)*(1.f-ay);
+        const float w10 = ax*(1.f-ay);
+        const float w01 = (1.f-ax)*ay;
+        const float w11 = ax*ay;
+        const float* g0 = &gray_c.RowPtr(yu)[xl];
+        const float* g1 = &gray_c.RowPtr(yu+1)[xl];
+        const float* du0 = &gradDu_c.RowPtr(yu)[xl];
+        const float* du1 = &gradDu_c.RowPtr(yu+1)[xl];
+        const float* dv0 = &gradDv_c.RowPtr(yu)[xl];
+        const float* dv1 = &gradDv_c.RowPtr(yu+1)[xl];
+        const float gray = w00*g0[0] + w10*g0[1] + w01*g1[0] + w11*g1[1];
+        const float gu = w00*du0[0] + w10*du0[1] + w01*du1[0] + w11*du1[1];
+        const float gv = w00*dv0[0] + w10*dv0[1] + w01*dv1[0] + w11*dv1[1];
+        Vec9 J;
+        GradTimesJw(gu, gv, u, v, J.data());
+        J = 0.5f*(J + Eigen::Map<const Vec9>(&L.Jm[9*i]));
+        const float f = gray - L.gray[i];
+        A.noalias() += J*J.transpose();
+        b += J*f;
+        s.F += fabs(f);
+        s.N ++;
+      }
+      s.A += A.cast<double>();
+      s.b += b.cast<double>();
+    },
+    [](Sums& a, const Sums& b) {
+      a.A += b.A;
+      a.b += b.b;
+      a.F += b.F;
+      a.N += b.N;
+    }, numThreads_);
+
+  const Mat9d& A = sums.A;
+  const Vec9d& b = sums.b;
+  const double Fsum = sums.F;
+  const size_t N = sums.N;
+  F = N > 0 ? Fsum/N : 0.;
+  if (N < 8) return 0.;
+  const Eigen::Matrix<double,9,8> J_g = J_g_.cast<double>();
+  Eigen::Matrix<double,8,8> JTJ = J_g.transpose()*A*J_g;
+  Eigen::Matrix<double,8,1> JTy = J_g.transpose()*b;
+  Eigen::Matrix<double,8,1> dx = -JTJ.ldlt().solve(JTy);
+  H = H * SL3<float>(SL3f::Exp_(dx.cast<float>()));
+  return dx.norm();
+}
+
+}
@@ -0,0 +1,222 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <vector>
+#include <math.h>
+#include <tdp/filters/tsdfFilters.h>
+#include <tdp/utils/parallel_for.h>
+
+namespace tdp {
+
+namespace {
+
+/// Run f(z0,z1) over slabs of slabDepth slices of a volume with depth
+/// d on up to numThreads threads.
+void ForEachSlab(size_t d, size_t numThreads,
+    const std::function<void(size_t,size_t)>& f) {
+  const size_t slabDepth = 2;
+  ParallelFor(d, slabDepth, f, numThreads);
+}
+
+bool SameSize(const Volume<TSDFval>& a, const Volume<TSDFval>& b) {
+  return a.w_ == b.w_ && a.h_ == b.h_ && a.d_ == b.d_;
+}
+
+/// One pass of the separable bilateral filter along the axis with
+/// voxel stride (dx,dy,dz) in {(1,0,0),(0,1,0),(0,0,1)}.
+void BilateralPass(const Volume<TSDFval>& in, Volume<TSDFval>& out,
+    int dx, int dy, int dz, const std::vector<float>& gs,
+    float sigmaRange, float wThr, size_t numThreads) {
+  const int r = (int)gs.size()/2;
+  const float invTwoSigmaR2 = 1.f/(2.f*sigmaRange*sigmaRange);
+  const int w = in.w_;
+  const int h = in.h_;
+  const int d = in.d_;
+  ForEachSlab(in.d_, numThreads, [&](size_t z0, size_t z1) {
+    std::vector<const TSDFval*> rows(gs.size());
+    for (int z=z0; z<(int)z1; ++z)
+      for (int y=0; y<h; ++y) {
+        // rows of the neighbours along y or z; nullptr outside
+        for (int k=-r; k<=r; ++k) {
+          const int yk = y+k*dy;
+          const int zk = z+k*dz;
+          rows[k+r] = (0<=yk && yk<h && 0<=zk && zk<d) ?
+            in.RowPtr(yk,zk) : nullptr;
+        }
+        const TSDFval* inRow = in.RowPtr(y,z);
+        TSDFval* outRow = out.RowPtr(y,z);
+        for (int x=0; x<w; ++x) {
+          outRow[x] = inRow[x];
+          const float fc = inRow[x].f;
+          if (inRow[x].w < wThr) continue;
+          float sumW = 0.f;
+          float sumF = 0.f;
+          for (int k=-r; k<=r; ++k) {
+            const int xk = x+k*dx;
+            if (!rows[k+r] || xk < 0 || xk >= w) continue;
+            const TSDFval& v = rows[k+r][xk];
+            if (v.w < wThr) continue;
+            const float df = v.f - fc;
+            const float wk = gs[k+r]*expf(-df*df*invTwoSigmaR2);
+            sumW += wk;
+            sumF += wk*v.f;
+          }
+          outRow[x].f = sumF/sumW;
+        }
+      }
+  });
+}
+
+/// Median filter of the z-slices [z0,z1) with a kernel of side length
+/// KD. The values of the (y,z) cross section of the neighbourhood at
+/// every x of a tile are sorted once into a column and shared by the
+/// KD voxels covering it; the median is then found by merging KD sorted
+/// columns up to the middle.
+template<int KD>
+void MedianSlab(const Volume<TSDFval>& in, Volume<TSDFval>& out,
+    float wThr, size_t z0, size_t z1) {
+  const int radius = KD/2;
+  const int colSize = KD*KD;
+  const int w = in.w_;
+  const int h = in.h_;
+  const int d = in.d_;
+  const float inf = std::numeric_limits<float>::infinity();
+  // x extent of a tile; keeps the KD^2 rows touched for a tile row in L1
+  const int tileW = 64;
+  // columns are padded with +inf for voxels below wThr so that they can
+  // be sorted by a fixed branch free network; the +inf after the valid
+  // entries also terminates the merge
+  const int colStride = colSize+1;
+  std::vector<float> cols((tileW+2*radius)*colStride, inf);
+  std::vector<int> colCount(tileW+2*radius);
+  const TSDFval* rows[colSize];
+  for (int x0=0; x0<w; x0+=tileW)
+    for (int z=z0; z<(int)z1; ++z)
+      for (int y=0; y<h; ++y) {
+        for (int k=0; k<KD; ++k)
+          for (int j=0; j<KD; ++j) {
+            const int zk = z+k-radius;
+            const int yj = y+j-radius;
+            rows[k*KD+j] = (0<=zk && zk<d && 0<=yj && yj<h) ?
+              in.RowPtr(yj,zk) : nullptr;
+          }
+        const int x1 = std::min(w, x0+tileW);
+        for (int x=x0-radius; x<x1+radius; ++x) {
+          float* col = &cols[(x-x0+radius)*colStride];
+          int n = 0;
+          for (int i=0; i<colSize; ++i) {
+            float f = 1.0f;
+            if (rows[i] && 0 <= x && x < w) {
+              f = rows[i][x].w < wThr ? inf : rows[i][x].f;
+            }
+            col[i] = f;
+            n += f < inf;
+          }
+          // odd-even transposition sort
+          for (int r=0; r<colSize; ++r)
+            for (int i=r&1; i+1<colSize; i+=2) {
+              const float a = col[i];
+              const float b = col[i+1];
+              col[i] = std::min(a,b);
+              col[i+1] = std::max(a,b);
+            }
+          colCount[x-x0+radius] = n;
+        }
+        const TSDFval* inRow = in.RowPtr(y,z);
+        TSDFval* outRow = out.RowPtr(y,z);
+        for (int x=x0; x<x1; ++x) {
+          outRow[x] = inRow[x];
+          if (inRow[x].w < wThr) continue;
+          const float* col0 = &cols[(x-x0)*colStride];
+          int heads[KD];
+          int n = 0;
+          for (int i=0; i<KD; ++i) {
+            heads[i] = i*colStride;
+            n += colCount[x-x0+i];
+          }
+          float prev = 0.f;
+          float cur = 0.f;
+          for (int s=0; s<=n/2; ++s) {
+            float best = col0[heads[0]];
+            int iBest = 0;
+            for (int i=1; i<KD; ++i) {
+              const float v = col0[heads[i]];
+              const bool lt = v < best;
+              best = lt ? v : best;
+              iBest = lt ? i : iBest;
+            }
+            // constant indices keep heads in registers
+            for (int i=0; i<KD; ++i) heads[i] += i == iBest;
+            prev = cur;
+            cur = best;
+          }
+          // mean of the middle two for even n
+          outRow[x].f = n%2 == 0 ? 0.5f*(prev+cur) : cur;
+        }
+      }
+}
+
+}
+
+void TSDFFilters::medianFilterCpu(
+    const Volume<TSDFval>& inputTsdf,
+    Volume<TSDFval>& outputTsdf,
+    float wThr,
+    int radius,
+    size_t numThreads) {
+  if (!SameSize(inputTsdf, outputTsdf)) {
+    std::cerr << "Median Filter Error: Mismatch input output" << std::endl;
+    return;
+  }
+  std::function<void(size_t,size_t)> slab;
+  switch (radius) {
+    case 1:
+      slab = [&](size_t z0, size_t z1) {
+        MedianSlab<3>(inputTsdf, outputTsdf, wThr, z0, z1); };
+      break;
+    case 2:
+      slab = [&](size_t z0, size_t z1) {
+        MedianSlab<5>(inputTsdf, outputTsdf, wThr, z0, z1); };
+      break;
+    case 3:
+      slab = [&](size_t z0, size_t z1) {
+        MedianSlab<7>(inputTsdf, outputTsdf, wThr, z0, z1); };
+      break;
+    default:
+      std::cerr << "Median Filter Error: radius " << radius
+        << " not supported; use 1, 2 or 3" << std::endl;
+      return;
+  }
+  ForEachSlab(inputTsdf.d_, numThreads, slab);
+}
+
+void TSDFFilters::bilateralFilterCpu(
+    const Volume<TSDFval>& inputTsdf,
+    Volume<TSDFval>& outputTsdf,
+    float sigmaSpatial,
+    float sigmaRange,
+    float wThr,
+    int radius,
+    size_t numThreads) {
+  if (!SameSize(inputTsdf, outputTsdf)) {
+    std::cerr << "Bilateral Filter Error: Mismatch input output" << std::endl;
+    return;
+  }
+  std::vector<float> gs(2*radius+1);
+  for (int k=-radius; k<=radius; ++k)
+    gs[k+radius] = expf(-0.5f*k*k/(sigmaSpatial*sigmaSpatial));
+  ManagedHostVolume<TSDFval> tmp(inputTsdf.w_, inputTsdf.h_,
+      inputTsdf.d_);
+  BilateralPass(inputTsdf, outputTsdf, 1, 0, 0, gs, sigmaRange, wThr,
+      numThreads);
+  BilateralPass(outputTsdf, tmp, 0, 1, 0, gs, sigmaRange, wThr,
+      numThreads);
+  BilateralPass(tmp, outputTsdf, 0, 0, 1, gs, sigmaRange, wThr,
+      numThreads);
+}
+
+}
@@ -1,5 +1,6 @@
 
 #include <tdp/icp/icpGrad3d.h>
+#include <tdp/icp/icp_cpu.h>
 
 namespace tdp {
 
@@ -26,14 +27,21 @@ void IcpGrad3d::ComputeProjective(
     float error = 0.f; 
     for (size_t it=0; it<maxIt[lvl]; ++it) {
       // Compute ATA and ATb from A x = b
-#ifdef CUDA_FOUND
       Image<Vector3fda> pc_m = pcs_m.GetImage(lvl);
-      ICPStep<D,Derived>(pc_m, ns_m.GetImage(lvl), gs_m.GetImage(lvl), 
+#ifdef CUDA_FOUND
+      if (pcs_m.storage_ == Storage::Gpu) {
+        ICPStep<D,Derived>(pc_m, ns_m.GetImage(lvl), gs_m.GetImage(lvl), 
+            pcs_o.GetImage(lvl), ns_o.GetImage(lvl), gs_o.GetImage(lvl), 
+            T_mo, T_cm, ScaleCamera<float>(cam,pow(0.5,lvl)),
+            cos(angleThr_deg*M_PI/180.),
+            distThr,ATA,ATb,error,count);
+      } else
+#endif
+      ICPStepCpu<D,Derived>(pc_m, ns_m.GetImage(lvl), gs_m.GetImage(lvl), 
           pcs_o.GetImage(lvl), ns_o.GetImage(lvl), gs_o.GetImage(lvl), 
           T_mo, T_cm, ScaleCamera<float>(cam,pow(0.5,lvl)),
           cos(angleThr_deg*M_PI/180.),
           distThr,ATA,ATb,error,count);
-#endif
       if (count < 1000) {
         std::cout << "# inliers " << count 
           << " in pyramid level " << lvl
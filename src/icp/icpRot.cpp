@@ -1,4 +1,5 @@
 #include <tdp/icp/icpRot.h>
+#include <tdp/icp/icp_cpu.h>
 #include <tdp/data/pyramid.h>
 #include <tdp/camera/camera.h>
 #include <tdp/camera/camera_poly.h>
@@ -26,13 +27,21 @@ void ComputeProjectiveRotation(
     for (size_t it=0; it<maxIt[lvl]; ++it) {
       // Compute ATA and ATb from A x = b
 #ifdef CUDA_FOUND
-      ICPStepRotation<D,Derived>(ns_m.GetImage(lvl), 
+      if (ns_m.storage_ == Storage::Gpu) {
+        ICPStepRotation<D,Derived>(ns_m.GetImage(lvl), 
+            ns_o.GetImage(lvl),
+            pcs_o.GetImage(lvl), 
+            T_mo, T_cm, ScaleCamera<float>(cam,pow(0.5,lvl)),
+            cos(angleThr_deg*M_PI/180.),
+            N,count);
+      } else
+#endif
+      ICPStepRotationCpu<D,Derived>(ns_m.GetImage(lvl), 
           ns_o.GetImage(lvl),
           pcs_o.GetImage(lvl), 
           T_mo, T_cm, ScaleCamera<float>(cam,pow(0.5,lvl)),
           cos(angleThr_deg*M_PI/180.),
           N,count);
-#endif
       if (count < 1000) {
         std::cout << "# inliers " << count << " to small " << std::endl;
         break;
@@ -1,5 +1,6 @@
 #include <iomanip>
 #include <tdp/icp/icpTexture.h> 
+#include <tdp/icp/icp_cpu.h>
 namespace tdp {
 
 template<typename CameraT>
@@ -70,7 +71,15 @@ void IcpTexture::ComputeProjective(
         float error_i = 0;
         float count_i = 0;
         // Compute ATA and ATb from A x = b
-        ICPStep(pc_mli, n_mli, gradGrey_mli, grey_mli, pc_oli, n_oli,
+#ifdef CUDA_FOUND
+        if (pcs_m.storage_ == Storage::Gpu) {
+          ICPStep(pc_mli, n_mli, gradGrey_mli, grey_mli, pc_oli, n_oli,
+              gradGrey_oli, grey_oli, T_mr, T_cr, cam,
+              cos(angleThr_deg*M_PI/180.),
+              distThr,lambda, ATA_i,ATb_i,error_i,count_i);
+        } else
+#endif
+        ICPStepCpu(pc_mli, n_mli, gradGrey_mli, grey_mli, pc_oli, n_oli,
             gradGrey_oli, grey_oli, T_mr, T_cr, cam,
             cos(angleThr_deg*M_PI/180.),
             distThr,lambda, ATA_i,ATb_i,error_i,count_i);
@@ -0,0 +1,266 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <tdp/icp/icp_cpu.h>
+#include <tdp/camera/camera.h>
+#include <tdp/camera/camera_poly.h>
+
+namespace tdp {
+
+template<int D, typename Derived>
+void SO3TextureStepCpu(
+    Image<float> grey_p,
+    Image<float> grey_c,
+    Image<Vector2fda> gradGrey_c,
+    Image<Vector3fda> rays,
+    SO3f R_cp,
+    const CameraBase<float,D,Derived>& cam,
+    Eigen::Matrix<float,3,3,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,3,1,Eigen::DontAlign>& ATb,
+    float& error,
+    float& count,
+    size_t numThreads
+    ) {
+  const Eigen::Matrix3f R = R_cp.matrix();
+  ReduceNormalEquations<3,1>(grey_p.Area(),
+    [&](size_t id, float (&ab)[1][4]) -> bool {
+      const int u = id%grey_p.w_;
+      const int v = id/grey_p.w_;
+      const Vector3fda ray_c = R_cp*rays(u,v);
+      const Vector2fda x = cam.Project(ray_c);
+      if (!grey_p.Inside(x)) return false;
+      Eigen::Map<Vector3fda> Ai(&(ab[0][0]));
+      Ai = -(R*SO3mat<float>::invVee(rays(u,v))).transpose()*
+        cam.Jproject(ray_c).transpose() * gradGrey_c.GetBilinear(x);
+      ab[0][3] = -grey_c.GetBilinear(x) + grey_p(u,v);
+      return true;
+    }, ATA, ATb, error, count, numThreads);
+  error /= count;
+}
+
+template<int D, typename Derived>
+void ICPStepRotationCpu(
+    Image<Vector3fda> n_m,
+    Image<Vector3fda> n_o,
+    Image<Vector3fda> pc_o,
+    const SE3f& T_mo,
+    const SE3f& T_cm,
+    const CameraBase<float,D,Derived>& cam,
+    float dotThr,
+    Eigen::Matrix<float,3,3,Eigen::DontAlign>& N,
+    float& count,
+    size_t numThreads
+    ) {
+  // N in row major order and the number of inliers
+  typedef Eigen::Matrix<float,10,1,Eigen::DontAlign> Sums;
+  const Sums sums = ParallelReduce<Sums>(pc_o.Area(), 4096, Sums::Zero(),
+    [&](size_t i0, size_t i1, Sums& s) {
+      for (size_t id=i0; id<i1; ++id) {
+        const int idx = id%pc_o.w_;
+        const int idy = id/pc_o.w_;
+        const Vector3fda& pc_oi = pc_o(idx,idy);
+        const Vector3fda pc_o_in_m = T_mo * pc_oi;
+        const Vector2fda x_o_in_m = cam.Project(T_cm * pc_o_in_m);
+        const int u = floor(x_o_in_m(0)+0.5f);
+        const int v = floor(x_o_in_m(1)+0.5f);
+        if (!(0 <= u && u < (int)pc_o.w_ && 0 <= v && v < (int)pc_o.h_
+            && pc_oi(2) > 0. && pc_o_in_m(2) > 0.
+            && IsValidData(pc_o_in_m)))
+          continue;
+        const Vector3fda& n_oi = n_o(idx,idy);
+        const Vector3fda& n_mi = n_m(u,v);
+        const float dot = n_mi.dot(T_mo.rotation() * n_oi);
+        if (!(dot > dotThr && IsValidData(n_mi))) continue;
+        for (int i=0; i<3; ++i)
+          for (int j=0; j<3; ++j)
+            s(i*3+j) += n_oi(i)*n_mi(j);
+        s(9) += 1.f;
+      }
+    },
+    [](Sums& a, const Sums& b) { a += b; }, numThreads);
+  for (int i=0; i<3; ++i)
+    for (int j=0; j<3; ++j)
+      N(i,j) = sums(i*3+j);
+  count = sums(9);
+}
+
+template<int D, typename Derived>
+void ICPStepCpu(
+    Image<Vector3fda> pc_m,
+    Image<Vector3fda> n_m,
+    Image<Vector2fda> gradGrey_m,
+    Image<float> grey_m,
+    Image<Vector3fda> pc_o,
+    Image<Vector3fda> n_o,
+    Image<Vector2fda> gradGrey_o,
+    Image<float> grey_o,
+    const SE3f& T_mo,
+    const SE3f& T_cm,
+    const CameraBase<float,D,Derived>& cam,
+    float dotThr,
+    float distThr,
+    float lambda,
+    Eigen::Matrix<float,6,6,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,6,1,Eigen::DontAlign>& ATb,
+    float& error,
+    float& count,
+    size_t numThreads
+    ) {
+  // the photometric row is scaled so that its products carry lambda
+  const float sqrtLambda = sqrt(std::max(0.f, lambda));
+  ReduceNormalEquations<6,2>(pc_m.Area(),
+    [&](size_t id, float (&ab)[2][7]) -> bool {
+      const int x = id%pc_o.w_;
+      const int y = id/pc_o.w_;
+      int u, v;
+      if (AssociateModelIntoCurrentCpu<D,Derived>(x, y, pc_m, T_mo, T_cm,
+            cam, u, v) != 0)
+        return false;
+      const Vector3fda n_o_in_m = T_mo.rotation()*n_o(u,v);
+      const Vector3fda& n_mi = n_m(x,y);
+      const Vector3fda& pc_mi = pc_m(x,y);
+      const Vector3fda& pc_oi = pc_o(u,v);
+      const Vector3fda pc_o_in_m = T_mo * pc_oi;
+      const float dot = n_mi.dot(n_o_in_m);
+      const float dist = (pc_mi-pc_o_in_m).norm();
+      if (!(dot > dotThr && dist < distThr && IsValidData(pc_mi)))
+        return false;
+      // photometric term with right multiplication as in the GPU kernel
+      Eigen::Map<Vector6fda> J(&(ab[1][0]));
+      const Eigen::Matrix<float,2,3> Jpi = cam.Jproject(pc_o_in_m);
+      Eigen::Matrix<float,3,6> Jse3;
+      Jse3 << -(T_mo.rotation().matrix()*SO3mat<float>::invVee(pc_oi)),
+           Eigen::Matrix3f::Identity();
+      J = sqrtLambda * Jse3.transpose() * Jpi.transpose() * gradGrey_m(x,y);
+      ab[1][6] = sqrtLambda * (-grey_m(x,y) + grey_o(u,v));
+      // point to plane
+      const Vector3fda n_mi_in_o = T_mo.rotation().InverseTransform(n_mi);
+      Eigen::Map<Vector3fda> top(&(ab[0][0]));
+      Eigen::Map<Vector3fda> bottom(&(ab[0][3]));
+      top = pc_oi.cross(n_mi_in_o);
+      bottom = n_mi_in_o;
+      ab[0][6] = n_mi.dot(pc_mi-pc_o_in_m);
+      return true;
+    }, ATA, ATb, error, count, numThreads);
+  error /= count;
+}
+
+template<int D, typename Derived>
+void ICPStepCpu(
+    Image<Vector3fda> pc_m,
+    Image<Vector3fda> n_m,
+    Image<Vector3fda> g_m,
+    Image<Vector3fda> pc_o,
+    Image<Vector3fda> n_o,
+    Image<Vector3fda> g_o,
+    const SE3f& T_mo,
+    const SE3f& T_mc,
+    const CameraBase<float,D,Derived>& cam,
+    float dotThr,
+    float distThr,
+    Eigen::Matrix<float,6,6,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,6,1,Eigen::DontAlign>& ATb,
+    float& error,
+    float& count,
+    size_t numThreads
+    ) {
+  ReduceNormalEquations<6,2>(pc_m.Area(),
+    [&](size_t id, float (&ab)[2][7]) -> bool {
+      const int x = id%pc_o.w_;
+      const int y = id/pc_o.w_;
+      int u, v;
+      if (AssociateModelIntoCurrentCpu<D,Derived>(x, y, pc_m, T_mo, T_mc,
+            cam, u, v) != 0)
+        return false;
+      const Vector3fda n_o_in_m = T_mo.rotation()*n_o(u,v);
+      const Vector3fda& n_mi = n_m(x,y);
+      const Vector3fda g_mi = g_m(x,y).normalized();
+      const Vector3fda& pc_mi = pc_m(x,y);
+      const Vector3fda pc_o_in_m = T_mo * pc_o(u,v);
+      const float dot = n_mi.dot(n_o_in_m);
+      const float dist = (pc_mi-pc_o_in_m).norm();
+      if (!(dot > dotThr && dist < distThr && IsValidData(pc_mi)))
+        return false;
+      // surface normal
+      Eigen::Map<Vector3fda> top(&(ab[0][0]));
+      Eigen::Map<Vector3fda> bottom(&(ab[0][3]));
+      top = pc_o_in_m.cross(n_mi);
+      bottom = n_mi;
+      ab[0][6] = n_mi.dot(pc_mi-pc_o_in_m);
+      // 3D gradient; the row stays zero without one
+      if (IsValidData(g_mi)) {
+        Eigen::Map<Vector3fda> topg(&(ab[1][0]));
+        Eigen::Map<Vector3fda> bottomg(&(ab[1][3]));
+        topg = pc_o_in_m.cross(g_mi);
+        bottomg = g_mi;
+        ab[1][6] = g_mi.dot(pc_mi-pc_o_in_m);
+      }
+      return true;
+    }, ATA, ATb, error, count, numThreads);
+  error /= count;
+}
+
+// explicit instantiation
+template void SO3TextureStepCpu(
+    Image<float> grey_p, Image<float> grey_c, Image<Vector2fda> gradGrey_c,
+    Image<Vector3fda> rays, SO3f R_cp, const BaseCameraf& cam,
+    Eigen::Matrix<float,3,3,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,3,1,Eigen::DontAlign>& ATb,
+    float& error, float& count, size_t numThreads);
+template void SO3TextureStepCpu(
+    Image<float> grey_p, Image<float> grey_c, Image<Vector2fda> gradGrey_c,
+    Image<Vector3fda> rays, SO3f R_cp, const BaseCameraPoly3f& cam,
+    Eigen::Matrix<float,3,3,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,3,1,Eigen::DontAlign>& ATb,
+    float& error, float& count, size_t numThreads);
+
+template void ICPStepRotationCpu(
+    Image<Vector3fda> n_m, Image<Vector3fda> n_o, Image<Vector3fda> pc_o,
+    const SE3f& T_mo, const SE3f& T_cm, const BaseCameraf& cam,
+    float dotThr, Eigen::Matrix<float,3,3,Eigen::DontAlign>& N,
+    float& count, size_t numThreads);
+template void ICPStepRotationCpu(
+    Image<Vector3fda> n_m, Image<Vector3fda> n_o, Image<Vector3fda> pc_o,
+    const SE3f& T_mo, const SE3f& T_cm, const BaseCameraPoly3f& cam,
+    float dotThr, Eigen::Matrix<float,3,3,Eigen::DontAlign>& N,
+    float& count, size_t numThreads);
+
+template void ICPStepCpu(
+    Image<Vector3fda> pc_m, Image<Vector3fda> n_m,
+    Image<Vector2fda> gradGrey_m, Image<float> grey_m,
+    Image<Vector3fda> pc_o, Image<Vector3fda> n_o,
+    Image<Vector2fda> gradGrey_o, Image<float> grey_o,
+    const SE3f& T_mo, const SE3f& T_cm, const BaseCameraf& cam,
+    float dotThr, float distThr, float lambda,
+    Eigen::Matrix<float,6,6,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,6,1,Eigen::DontAlign>& ATb,
+    float& error, float& count, size_t numThreads);
+template void ICPStepCpu(
+    Image<Vector3fda> pc_m, Image<Vector3fda> n_m,
+    Image<Vector2fda> gradGrey_m, Image<float> grey_m,
+    Image<Vector3fda> pc_o, Image<Vector3fda> n_o,
+    Image<Vector2fda> gradGrey_o, Image<float> grey_o,
+    const SE3f& T_mo, const SE3f& T_cm, const BaseCameraPoly3f& cam,
+    float dotThr, float distThr, float lambda,
+    Eigen::Matrix<float,6,6,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,6,1,Eigen::DontAlign>& ATb,
+    float& error, float& count, size_t numThreads);
+
+template void ICPStepCpu(
+    Image<Vector3fda> pc_m, Image<Vector3fda> n_m, Image<Vector3fda> g_m,
+    Image<Vector3fda> pc_o, Image<Vector3fda> n_o, Image<Vector3fda> g_o,
+    const SE3f& T_mo, const SE3f& T_mc, const BaseCameraf& cam,
+    float dotThr, float distThr,
+    Eigen::Matrix<float,6,6,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,6,1,Eigen::DontAlign>& ATb,
+    float& error, float& count, size_t numThreads);
+template void ICPStepCpu(
+    Image<Vector3fda> pc_m, Image<Vector3fda> n_m, Image<Vector3fda> g_m,
+    Image<Vector3fda> pc_o, Image<Vector3fda> n_o, Image<Vector3fda> g_o,
+    const SE3f& T_mo, const SE3f& T_mc, const BaseCameraPoly3f& cam,
+    float dotThr, float distThr,
+    Eigen::Matrix<float,6,6,Eigen::DontAlign>& ATA,
+    Eigen::Matrix<float,6,1,Eigen::DontAlign>& ATb,
+    float& error, float& count, size_t numThreads);
+
+}
@@ -0,0 +1,97 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <iostream>
+#include <tdp/icp/kdtree_icp.h>
+#include <tdp/icp/normal_equations.h>
+#include <tdp/utils/parallel_for.h>
+
+namespace tdp {
+
+size_t KdTreeICP::Associate(const Image<Vector3fda>& pc_m, const SE3f& T_mo,
+    float distThr, size_t stride, Image<int>& assoc_om) const {
+  const SE3f T_om = T_mo.Inverse();
+  const float maxDist2 = distThr*distThr;
+  stride = std::max<size_t>(1, stride);
+  return ParallelReduce<size_t>(pc_m.Area(), 1024, 0,
+    [&](size_t i0, size_t i1, size_t& numAssoc) {
+      for (size_t i=i0; i<i1; ++i) {
+        assoc_om[i] = std::numeric_limits<int>::max();
+        if (i%stride != 0 || !IsValidData(pc_m[i])) continue;
+        float dist2;
+        const int id = tree_.Nearest(T_om*pc_m[i], maxDist2, dist2);
+        if (id < 0) continue;
+        assoc_om[i] = id;
+        numAssoc ++;
+      }
+    },
+    [](size_t& a, const size_t& b) { a += b; }, numThreads_);
+}
+
+void KdTreeICP::Step(const Image<Vector3fda>& pc_m,
+    const Image<Vector3fda>& n_m, const Image<int>& assoc_om,
+    const SE3f& T_mo, float dotThr, float distThr, Matrix6fda& ATA,
+    Vector6fda& ATb, float& error, float& count) const {
+  ReduceNormalEquations<6,1>(pc_m.Area(),
+    [&](size_t i, float (&ab)[1][7]) -> bool {
+      const int id_o = assoc_om[i];
+      if (id_o < 0 || (size_t)id_o >= pc_o_.Area()) return false;
+      const size_t u = id_o%pc_o_.w_;
+      const size_t v = id_o/pc_o_.w_;
+      const Vector3fda& pc_mi = pc_m[i];
+      const Vector3fda& n_mi = n_m[i];
+      const Vector3fda pc_o_in_m = T_mo*pc_o_(u,v);
+      const Vector3fda n_o_in_m = T_mo.rotation()*n_o_(u,v);
+      if (!IsValidData(pc_mi) || !(n_mi.dot(n_o_in_m) > dotThr)
+          || !((pc_mi-pc_o_in_m).norm() < distThr))
+        return false;
+      // the row is scaled so that its products carry the robust weight
+      const float r = n_mi.dot(pc_mi-pc_o_in_m);
+      const float sqrtW = sqrt(Weight(r));
+      Eigen::Map<Vector3fda> top(&(ab[0][0]));
+      Eigen::Map<Vector3fda> bottom(&(ab[0][3]));
+      top = sqrtW*pc_o_in_m.cross(n_mi);
+      bottom = sqrtW*n_mi;
+      ab[0][6] = sqrtW*r;
+      return true;
+    }, ATA, ATb, error, count, numThreads_);
+}
+
+void KdTreeICP::Compute(const Image<Vector3fda>& pc_m,
+    const Image<Vector3fda>& n_m, SE3f& T_mo, size_t maxIt,
+    float angleThr_deg, float distThr, size_t stride, bool verbose,
+    float& err, float& count) {
+  const float dotThr = cos(angleThr_deg*M_PI/180.);
+  assoc_om_.Reinitialise(pc_m.w_, pc_m.h_);
+  Matrix6fda ATA;
+  Vector6fda ATb;
+  float errPrev = 0.f;
+  err = 0.f;
+  count = 0.f;
+  for (size_t it=0; it<maxIt; ++it) {
+    const size_t numAssoc = Associate(pc_m, T_mo, distThr, stride,
+        assoc_om_);
+    float error = 0.f;
+    Step(pc_m, n_m, assoc_om_, T_mo, dotThr, distThr, ATA, ATb, error,
+        count);
+    // too few inliers to constrain all 6 DoF
+    if (count < std::max<float>(6.f, numAssoc/50)) break;
+    err = error/count;
+    Eigen::Matrix<float,6,1> x = ((ATA/count).cast<double>().ldlt()
+        .solve((ATb/count).cast<double>())).cast<float>();
+    T_mo = SE3f::Exp_(x) * T_mo;
+    if (verbose) {
+      std::cout << " it " << it
+        << ": err=" << err << "\tdErr/err=" << fabs(err-errPrev)/err
+        << " # inliers: " << count << " of " << numAssoc
+        << " |x|: " << x.topRows(3).norm()*180./M_PI
+        << " " << x.bottomRows(3).norm()
+        << std::endl;
+    }
+    if (it>0 && fabs(err-errPrev) <= 1e-5*err) break;
+    if (x.squaredNorm() < 1e-14) break;
+    errPrev = err;
+  }
+}
+
+}
@@ -1,5 +1,6 @@
 #include <iomanip>
 #include <tdp/icp/photoSO3.h> 
+#include <tdp/icp/icp_cpu.h>
 namespace tdp {
 
 template<int D, typename Derived, int LEVELS>
@@ -33,7 +34,13 @@ void PhotometricSO3::ComputeProjective(
       CameraBase<float,D,Derived> camLvl = cam.Scale(scale);
 
       // Compute ATA and ATb from A x = b
-      SO3TextureStep(grey_pl, grey_cl, gradGrey_cl, rays_l, R_cp,
+#ifdef CUDA_FOUND
+      if (grey_pl.storage_ == Storage::Gpu) {
+        SO3TextureStep(grey_pl, grey_cl, gradGrey_cl, rays_l, R_cp,
+            camLvl, ATA,ATb,error,count);
+      } else
+#endif
+      SO3TextureStepCpu(grey_pl, grey_cl, gradGrey_cl, rays_l, R_cp,
           camLvl, ATA,ATb,error,count);
       if (count < 4) {
         std::cout << "# inliers " << count << " to small " << std::endl;
@@ -13,44 +13,100 @@ void ImuInterpolator::Start() {
       tdp::ImuObs imuObsPrev;
       int numCalib = 0;
       while(receiveImu_.Get()) {
-        if (imu_ && imu_->GrabNext(imuObs)) {
-          if (out_ && record_.Get()) out_->WriteStream(imuObs);
-
-          if (!calibrated_ && numReceived_.Get() > 10 
-            && imuObs.omega.norm() < 2./180.*M_PI) {
-            gyro_bias_ += imuObs.omega;
-            gravity0_ += imuObs.acc;
-            numCalib ++;
-            std::cout << "rotVel: " 
-              << std::setprecision(3) << imuObs.omega.norm()*180./M_PI 
-              << "\tacc: " 
-              << std::setprecision(3) << imuObs.acc.norm() << std::endl;
-          } else if (!calibrated_ && numReceived_.Get() > 10) {
-            calibrated_ = true;
-            gyro_bias_ /= numCalib;
-            gravity0_ /= numCalib;
-            std::cout << "IMU calibrated. gyro " << gyro_bias_.transpose() 
-              << " gravity: " << gravity0_.transpose()
-              << std::endl;
-          } else {
-            imuObs.omega -= gyro_bias_;
-          }
-
-          Eigen::Matrix<float,6,1> se3 = Eigen::Matrix<float,6,1>::Zero();
-          se3.topRows(3) = imuObs.omega;
-          if (numReceived_.Get() == 0) {
-            Ts_wi_.Add(imuObs.t_host, tdp::SE3f());
-          } else {
-            int64_t dt_ns = imuObs.t_device - imuObsPrev.t_device;
-            Ts_wi_.Add(imuObs.t_host, se3, dt_ns);
-          }
-          imuObsPrev = imuObs;
-          numReceived_.Increment();
-        }
-        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        // sleep until the driver announces new measurements and drain
+        // all of them
+        if (!imu_ || !imu_->WaitForObs(10000)) continue;
+        while (receiveImu_.Get() && imu_->GrabNext(imuObs))
+          Receive(imuObs, imuObsPrev, numCalib);
       }
     });
 }
+
+void ImuInterpolator::Receive(tdp::ImuObs& imuObs,
+    tdp::ImuObs& imuObsPrev, int& numCalib) {
+  if (out_ && record_.Get()) out_->WriteStream(imuObs);
+
+  if (!calibrated_ && numReceived_.Get() > 10 
+    && imuObs.omega.norm() < 2./180.*M_PI) {
+    gyro_bias_ += imuObs.omega;
+    gravity0_ += imuObs.acc;
+    numCalib ++;
+    std::cout << "rotVel: " 
+      << std::setprecision(3) << imuObs.omega.norm()*180./M_PI 
+      << "\tacc: " 
+      << std::setprecision(3) << imuObs.acc.norm() << std::endl;
+  } else if (!calibrated_ && numReceived_.Get() > 10) {
+    gyro_bias_ /= numCalib;
+    gravity0_ /= numCalib;
+    std::cout << "IMU calibrated. gyro " << gyro_bias_.transpose() 
+      << " gravity: " << gravity0_.transpose()
+      << std::endl;
+    {
+      std::lock_guard<std::mutex> lock(preintMut_);
+      preint_.Reset(gyro_bias_, Eigen::Vector3f::Zero(), imuObs.t_host);
+      calibrated_ = true;
+    }
+  } else if (calibrated_) {
+    {
+      std::lock_guard<std::mutex> lock(preintMut_);
+      obsPreint_.push_back(imuObs);
+      while (obsPreint_.size() > kMaxObsPreint) {
+        IntegrateObs(obsPreint_.front());
+        obsPreint_.pop_front();
+      }
+    }
+    preintCv_.notify_all();
+    imuObs.omega -= gyro_bias_;
+  }
+
+  Eigen::Matrix<float,6,1> se3 = Eigen::Matrix<float,6,1>::Zero();
+  se3.topRows(3) = imuObs.omega;
+  if (numReceived_.Get() == 0) {
+    Ts_wi_.Add(imuObs.t_host, tdp::SE3f());
+  } else {
+    int64_t dt_ns = imuObs.t_device - imuObsPrev.t_device;
+    Ts_wi_.Add(imuObs.t_host, se3, dt_ns);
+  }
+  imuObsPrev = imuObs;
+  numReceived_.Increment();
+}
+
+bool ImuInterpolator::GetPreintegration(int64_t t_host,
+    ImuPreintegration& delta, int64_t timeout_us) {
+  std::unique_lock<std::mutex> lock(preintMut_);
+  if (!calibrated_) return false;
+  // wait for a measurement past the frame so that the held measurement
+  // covering the frame time is known
+  preintCv_.wait_for(lock, std::chrono::microseconds(timeout_us), [&]{
+      return !obsPreint_.empty() && obsPreint_.back().t_host >= t_host;
+    });
+  if (tPreint_ < 0) tPreint_ = preint_.t0_;
+  while (!obsPreint_.empty() && obsPreint_.front().t_host <= t_host) {
+    IntegrateObs(obsPreint_.front());
+    obsPreint_.pop_front();
+  }
+  // hold the last measurement up to the frame time
+  if (haveObsPreint_ && t_host > tPreint_) {
+    preint_.Integrate(lastObsPreint_.acc, lastObsPreint_.omega,
+        (t_host - tPreint_)*1e-9);
+    tPreint_ = t_host;
+  }
+  preint_.t1_ = tPreint_;
+  delta = preint_;
+  preint_.Reset(tPreint_);
+  return true;
+}
+
+void ImuInterpolator::IntegrateObs(const tdp::ImuObs& obs) {
+  if (tPreint_ < 0) tPreint_ = preint_.t0_;
+  if (haveObsPreint_)
+    preint_.Integrate(lastObsPreint_.acc, lastObsPreint_.omega,
+        (obs.t_host - tPreint_)*1e-9);
+  tPreint_ = std::max(tPreint_, obs.t_host);
+  lastObsPreint_ = obs;
+  haveObsPreint_ = true;
+}
+
 void ImuInterpolator::Stop() {
   receiveImu_.Set(false);
   receiverThread_.join();
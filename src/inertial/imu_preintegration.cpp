@@ -0,0 +1,110 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <math.h>
+#include <tdp/inertial/imu_preintegration.h>
+
+namespace tdp {
+
+ImuPreintegration::ImuPreintegration(const Eigen::Vector3f& bg,
+    const Eigen::Vector3f& ba)
+  : bg_(bg), ba_(ba), sigmaGyro_(1.7e-4), sigmaAcc_(2.0e-3) {
+  Reset();
+}
+
+void ImuPreintegration::Reset(int64_t t0) {
+  dR_.setIdentity();
+  dv_.setZero();
+  dp_.setZero();
+  dt_ = 0.;
+  dR_dbg_.setZero();
+  dv_dbg_.setZero();
+  dv_dba_.setZero();
+  dp_dbg_.setZero();
+  dp_dba_.setZero();
+  cov_.setZero();
+  t0_ = t0;
+  t1_ = t0;
+  numMeas_ = 0;
+}
+
+void ImuPreintegration::Reset(const Eigen::Vector3f& bg,
+    const Eigen::Vector3f& ba, int64_t t0) {
+  bg_ = bg;
+  ba_ = ba;
+  Reset(t0);
+}
+
+Eigen::Matrix3f ImuPreintegration::Jr(const Eigen::Vector3f& phi) {
+  const float theta = phi.norm();
+  const Eigen::Matrix3f W = SO3f::invVee(phi);
+  if (theta < 1e-5)
+    return Eigen::Matrix3f::Identity() - 0.5*W;
+  const float theta2 = theta*theta;
+  return Eigen::Matrix3f::Identity() - (1.-cos(theta))/theta2*W
+    + (theta-sin(theta))/(theta2*theta)*W*W;
+}
+
+void ImuPreintegration::Integrate(const Eigen::Vector3f& acc,
+    const Eigen::Vector3f& omega, float dt) {
+  if (dt <= 0.) return;
+  const Eigen::Vector3f a = acc - ba_;
+  const Eigen::Vector3f phi = (omega - bg_)*dt;
+  const Eigen::Matrix3f dRinc = SO3f::Exp_(phi).matrix();
+  const Eigen::Matrix3f Jrinc = Jr(phi);
+  const Eigen::Matrix3f dRa = dR_*SO3f::invVee(a);
+  const float dt2 = dt*dt;
+
+  // noise propagation uses the state before the update
+  Eigen::Matrix<float,9,9> A = Eigen::Matrix<float,9,9>::Identity();
+  A.block<3,3>(0,0) = dRinc.transpose();
+  A.block<3,3>(3,0) = -dRa*dt;
+  A.block<3,3>(6,0) = -0.5*dRa*dt2;
+  A.block<3,3>(6,3) = Eigen::Matrix3f::Identity()*dt;
+  Eigen::Matrix<float,9,3> Bg = Eigen::Matrix<float,9,3>::Zero();
+  Bg.block<3,3>(0,0) = Jrinc*dt;
+  Eigen::Matrix<float,9,3> Ba = Eigen::Matrix<float,9,3>::Zero();
+  Ba.block<3,3>(3,0) = dR_*dt;
+  Ba.block<3,3>(6,0) = 0.5*dR_*dt2;
+  cov_ = A*cov_*A.transpose()
+    + (sigmaGyro_*sigmaGyro_/dt)*Bg*Bg.transpose()
+    + (sigmaAcc_*sigmaAcc_/dt)*Ba*Ba.transpose();
+
+  // bias Jacobians; position before velocity before rotation
+  dp_dba_ += dv_dba_*dt - 0.5*dR_*dt2;
+  dp_dbg_ += dv_dbg_*dt - 0.5*dRa*dR_dbg_*dt2;
+  dv_dba_ -= dR_*dt;
+  dv_dbg_ -= dRa*dR_dbg_*dt;
+  dR_dbg_ = dRinc.transpose()*dR_dbg_ - Jrinc*dt;
+
+  dp_ += dv_*dt + 0.5*dR_*a*dt2;
+  dv_ += dR_*a*dt;
+  dR_ = dR_*dRinc;
+  dt_ += dt;
+  numMeas_ ++;
+}
+
+SO3f ImuPreintegration::DeltaR(const Eigen::Vector3f& bg) const {
+  return SO3f(dR_)*SO3f::Exp_(dR_dbg_*(bg-bg_));
+}
+
+Eigen::Vector3f ImuPreintegration::DeltaV(const Eigen::Vector3f& bg,
+    const Eigen::Vector3f& ba) const {
+  return dv_ + dv_dbg_*(bg-bg_) + dv_dba_*(ba-ba_);
+}
+
+Eigen::Vector3f ImuPreintegration::DeltaP(const Eigen::Vector3f& bg,
+    const Eigen::Vector3f& ba) const {
+  return dp_ + dp_dbg_*(bg-bg_) + dp_dba_*(ba-ba_);
+}
+
+void ImuPreintegration::Predict(const SO3f& R_wi,
+    const Eigen::Vector3f& v_wi, const Eigen::Vector3f& p_wi,
+    const Eigen::Vector3f& g_w, SO3f& R_wj, Eigen::Vector3f& v_wj,
+    Eigen::Vector3f& p_wj) const {
+  R_wj = R_wi*SO3f(dR_);
+  v_wj = v_wi + g_w*dt_ + R_wi*dv_;
+  p_wj = p_wi + v_wi*dt_ + 0.5*g_w*dt_*dt_ + R_wi*dp_;
+}
+
+}
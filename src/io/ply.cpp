@@ -0,0 +1,500 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <tdp/io/ply.h>
+#include <tdp/cuda/cuda.h>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace tdp {
+
+namespace {
+
+size_t PlyTypeSize(uint8_t type) {
+  switch (type) {
+    case PLY_INT8: case PLY_UINT8: return 1;
+    case PLY_INT16: case PLY_UINT16: return 2;
+    case PLY_INT32: case PLY_UINT32: case PLY_FLOAT32: return 4;
+    case PLY_FLOAT64: return 8;
+  }
+  return 0;
+}
+
+uint8_t ParsePlyType(const std::string& str) {
+  if (str == "char" || str == "int8") return PLY_INT8;
+  if (str == "uchar" || str == "uint8") return PLY_UINT8;
+  if (str == "short" || str == "int16") return PLY_INT16;
+  if (str == "ushort" || str == "uint16") return PLY_UINT16;
+  if (str == "int" || str == "int32") return PLY_INT32;
+  if (str == "uint" || str == "uint32") return PLY_UINT32;
+  if (str == "float" || str == "float32") return PLY_FLOAT32;
+  if (str == "double" || str == "float64") return PLY_FLOAT64;
+  return PLY_INVALID;
+}
+
+bool IsLittleEndian() {
+  const uint16_t x = 1;
+  return *reinterpret_cast<const uint8_t*>(&x) == 1;
+}
+
+template<typename T>
+inline T ReadPlyAs(const uint8_t* p, uint8_t type) {
+  switch (type) {
+    case PLY_INT8: { int8_t v; std::memcpy(&v,p,1); return T(v); }
+    case PLY_UINT8: { uint8_t v; std::memcpy(&v,p,1); return T(v); }
+    case PLY_INT16: { int16_t v; std::memcpy(&v,p,2); return T(v); }
+    case PLY_UINT16: { uint16_t v; std::memcpy(&v,p,2); return T(v); }
+    case PLY_INT32: { int32_t v; std::memcpy(&v,p,4); return T(v); }
+    case PLY_UINT32: { uint32_t v; std::memcpy(&v,p,4); return T(v); }
+    case PLY_FLOAT32: { float v; std::memcpy(&v,p,4); return T(v); }
+    case PLY_FLOAT64: { double v; std::memcpy(&v,p,8); return T(v); }
+  }
+  return T(0);
+}
+
+template<typename T> uint8_t PlyTypeOf();
+template<> uint8_t PlyTypeOf<float>() { return PLY_FLOAT32; }
+template<> uint8_t PlyTypeOf<uint8_t>() { return PLY_UINT8; }
+
+/// Read-only memory mapping of a whole file.
+class MappedFile {
+ public:
+  MappedFile(const std::string& path) : data_(nullptr), size_(0), fd_(-1) {
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) return;
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || st.st_size == 0) return;
+    size_ = st.st_size;
+    void* ptr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (ptr == MAP_FAILED) {
+      size_ = 0;
+      return;
+    }
+    madvise(ptr, size_, MADV_SEQUENTIAL);
+    data_ = static_cast<const uint8_t*>(ptr);
+  }
+  ~MappedFile() {
+    if (data_) munmap(const_cast<uint8_t*>(data_), size_);
+    if (fd_ >= 0) close(fd_);
+  }
+  bool IsValid() const { return data_ != nullptr; }
+
+  const uint8_t* data_;
+  size_t size_;
+ private:
+  int fd_;
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+};
+
+/// Buffers output in fixed-size chunks so that writing never needs
+/// more memory than one chunk independent of the cloud size.
+class ChunkedWriter {
+ public:
+  ChunkedWriter(std::ofstream& out, size_t chunkBytes)
+    : out_(out), buf_(chunkBytes), n_(0) {}
+  ~ChunkedWriter() { Flush(); }
+
+  inline void Put(const void* data, size_t bytes) {
+    if (n_+bytes > buf_.size()) Flush();
+    std::memcpy(&buf_[n_], data, bytes);
+    n_ += bytes;
+  }
+  void Flush() {
+    if (n_ > 0) out_.write(&buf_[0], n_);
+    n_ = 0;
+  }
+ private:
+  std::ofstream& out_;
+  std::vector<char> buf_;
+  size_t n_;
+};
+
+void WritePlyHeader(std::ofstream& out,
+    const std::vector<std::string>& comments,
+    size_t numVerts, bool normals, bool colors, size_t numFaces) {
+  out << "ply\nformat binary_little_endian 1.0\n";
+  for (auto& comment : comments)
+    out << "comment " << comment << "\n";
+  out << "element vertex " << numVerts << "\n"
+    << "property float x\nproperty float y\nproperty float z\n";
+  if (normals)
+    out << "property float nx\nproperty float ny\nproperty float nz\n";
+  if (colors)
+    out << "property uchar red\nproperty uchar green\nproperty uchar blue\n";
+  if (numFaces > 0)
+    out << "element face " << numFaces << "\n"
+      << "property list uchar uint vertex_indices\n";
+  out << "end_header\n";
+}
+
+bool SavePointCloudStreamedImpl(
+    const std::string& path,
+    const Image<Vector3fda>& pc,
+    const Image<Vector3fda>& n,
+    const Image<Vector3bda>* rgb,
+    const std::vector<std::string>& comments) {
+  if (!IsLittleEndian()) {
+    std::cerr << "streamed PLY writer requires a little-endian host"
+      << std::endl;
+    return false;
+  }
+  // first pass only counts so the header can be written up front.
+  size_t numValid = 0;
+  for (size_t v=0; v<pc.h_; ++v) {
+    const Vector3fda* pcRow = pc.RowPtr(v);
+    const Vector3fda* nRow = n.RowPtr(v);
+    for (size_t u=0; u<pc.w_; ++u)
+      if (IsValidData(pcRow[u]) && IsValidNormal(nRow[u]))
+        ++numValid;
+  }
+  std::ofstream out(path, std::ios::out | std::ios::binary);
+  if (!out.is_open()) return false;
+  WritePlyHeader(out, comments, numValid, true, rgb != nullptr, 0);
+  ChunkedWriter writer(out, PLY_STREAM_CHUNK_BYTES);
+  for (size_t v=0; v<pc.h_; ++v) {
+    const Vector3fda* pcRow = pc.RowPtr(v);
+    const Vector3fda* nRow = n.RowPtr(v);
+    const Vector3bda* rgbRow = rgb ? rgb->RowPtr(v) : nullptr;
+    for (size_t u=0; u<pc.w_; ++u) {
+      if (IsValidData(pcRow[u]) && IsValidNormal(nRow[u])) {
+        writer.Put(pcRow[u].data(), 3*sizeof(float));
+        writer.Put(nRow[u].data(), 3*sizeof(float));
+        if (rgbRow) writer.Put(rgbRow[u].data(), 3*sizeof(uint8_t));
+      }
+    }
+  }
+  writer.Flush();
+  out.close();
+  return !out.fail();
+}
+
+/// Copies three properties of every record of a fixed-size element into
+/// out. Falls back to per-value conversion if the on-disk types do not
+/// match T.
+template<typename T, typename Vec>
+void CopyPlyVec3(const uint8_t* data, const PlyElementDesc& elem,
+    const int32_t* ids, ManagedHostImage<Vec>& out) {
+  const size_t N = elem.size;
+  const size_t stride = elem.stride;
+  const PlyPropertyDesc* p[3] = {&elem.properties[ids[0]],
+    &elem.properties[ids[1]], &elem.properties[ids[2]]};
+  out.Reinitialise(N,1);
+  const bool native = p[0]->type == PlyTypeOf<T>()
+    && p[1]->type == PlyTypeOf<T>() && p[2]->type == PlyTypeOf<T>()
+    && p[1]->offset == p[0]->offset+sizeof(T)
+    && p[2]->offset == p[0]->offset+2*sizeof(T);
+  if (native && stride == 3*sizeof(T)) {
+    std::memcpy(static_cast<void*>(out.ptr_), data, N*stride);
+  } else if (native) {
+    const uint8_t* src = data + p[0]->offset;
+    for (size_t i=0; i<N; ++i, src += stride)
+      std::memcpy(out[i].data(), src, 3*sizeof(T));
+  } else {
+    const uint8_t* src = data;
+    for (size_t i=0; i<N; ++i, src += stride)
+      for (size_t j=0; j<3; ++j)
+        out[i](j) = ReadPlyAs<T>(src+p[j]->offset, p[j]->type);
+  }
+}
+
+/// Locate the payload of element id; all preceding elements need to
+/// have fixed-size records.
+const uint8_t* PlyElementData(const MappedFile& file,
+    const PlyHeader& header, int32_t id) {
+  size_t offset = header.payloadOffset;
+  for (int32_t i=0; i<id; ++i) {
+    if (header.elements[i].stride == 0) return nullptr;
+    offset += header.elements[i].size * header.elements[i].stride;
+  }
+  return offset <= file.size_ ? file.data_+offset : nullptr;
+}
+
+bool FindVec3(const PlyElementDesc& elem, const char* a, const char* b,
+    const char* c, int32_t* ids) {
+  ids[0] = elem.Find(a);
+  ids[1] = elem.Find(b);
+  ids[2] = elem.Find(c);
+  return ids[0] >= 0 && ids[1] >= 0 && ids[2] >= 0;
+}
+
+bool MapPly(const MappedFile& file, PlyHeader& header) {
+  if (!file.IsValid() || !IsLittleEndian())
+    return false;
+  return ParsePlyHeader(reinterpret_cast<const char*>(file.data_),
+      file.size_, header) && header.binaryLittleEndian;
+}
+
+}
+
+int32_t PlyElementDesc::Find(const std::string& name) const {
+  for (size_t i=0; i<properties.size(); ++i)
+    if (properties[i].name == name) return i;
+  return -1;
+}
+
+int32_t PlyHeader::Find(const std::string& name) const {
+  for (size_t i=0; i<elements.size(); ++i)
+    if (elements[i].name == name) return i;
+  return -1;
+}
+
+bool ParsePlyHeader(const char* data, size_t size, PlyHeader& header) {
+  const char* endTag = "end_header";
+  const size_t endTagLen = std::strlen(endTag);
+  if (size < 4 || std::strncmp(data, "ply", 3) != 0)
+    return false;
+  // locate the end of the header without assuming null termination.
+  size_t end = 0;
+  for (size_t i=0; i+endTagLen <= size; ++i) {
+    if ((i == 0 || data[i-1] == '\n')
+        && std::strncmp(data+i, endTag, endTagLen) == 0) {
+      end = i+endTagLen;
+      while (end < size && data[end] != '\n') ++end;
+      if (end == size) return false;
+      ++end;
+      break;
+    }
+  }
+  if (end == 0) return false;
+
+  header = PlyHeader();
+  header.binaryLittleEndian = false;
+  header.payloadOffset = end;
+  std::istringstream in(std::string(data, end));
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream ls(line);
+    std::string key;
+    ls >> key;
+    if (key == "format") {
+      std::string fmt;
+      ls >> fmt;
+      header.binaryLittleEndian = fmt == "binary_little_endian";
+    } else if (key == "comment") {
+      std::string comment;
+      std::getline(ls, comment);
+      if (!comment.empty() && comment[0] == ' ') comment.erase(0,1);
+      header.comments.push_back(comment);
+    } else if (key == "element") {
+      PlyElementDesc elem;
+      ls >> elem.name >> elem.size;
+      elem.stride = 0;
+      header.elements.push_back(elem);
+    } else if (key == "property") {
+      if (header.elements.empty()) return false;
+      PlyElementDesc& elem = header.elements.back();
+      PlyPropertyDesc prop;
+      std::string type;
+      ls >> type;
+      prop.isList = type == "list";
+      prop.countType = PLY_INVALID;
+      if (prop.isList) {
+        std::string countType;
+        ls >> countType >> type;
+        prop.countType = ParsePlyType(countType);
+        if (prop.countType == PLY_INVALID) return false;
+      }
+      prop.type = ParsePlyType(type);
+      if (prop.type == PLY_INVALID) return false;
+      ls >> prop.name;
+      prop.offset = 0;
+      elem.properties.push_back(prop);
+    } else if (key == "end_header") {
+      break;
+    }
+  }
+  // record offsets and sizes are only defined for elements without lists
+  for (auto& elem : header.elements) {
+    for (auto& prop : elem.properties) {
+      if (prop.isList) {
+        elem.stride = 0;
+        break;
+      }
+      prop.offset = elem.stride;
+      elem.stride += PlyTypeSize(prop.type);
+    }
+  }
+  return true;
+}
+
+bool SavePointCloudStreamed(
+    const std::string& path,
+    const Image<Vector3fda>& verts,
+    const Image<Vector3fda>& ns,
+    std::vector<std::string> comments) {
+  return SavePointCloudStreamedImpl(path, verts, ns, nullptr, comments);
+}
+
+bool SavePointCloudStreamed(
+    const std::string& path,
+    const Image<Vector3fda>& verts,
+    const Image<Vector3fda>& ns,
+    const Image<Vector3bda>& rgb,
+    std::vector<std::string> comments) {
+  return SavePointCloudStreamedImpl(path, verts, ns, &rgb, comments);
+}
+
+bool SaveMeshStreamed(
+    const std::string& path,
+    const Image<Vector3fda>& pc,
+    const Image<Vector3uda>& tri,
+    std::vector<std::string> comments) {
+  if (!IsLittleEndian()) {
+    std::cerr << "streamed PLY writer requires a little-endian host"
+      << std::endl;
+    return false;
+  }
+  // remap from input vertex ids to the ids of the written vertices;
+  // invalid vertices map to max uint32.
+  const uint32_t invalid = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> remap(pc.Area(), invalid);
+  size_t numVerts = 0;
+  for (size_t v=0; v<pc.h_; ++v) {
+    const Vector3fda* row = pc.RowPtr(v);
+    for (size_t u=0; u<pc.w_; ++u)
+      if (IsValidData(row[u]))
+        remap[v*pc.w_+u] = numVerts++;
+  }
+  if (numVerts < pc.Area())
+    std::cerr << "warning " << pc.Area()-numVerts
+      << " invalid pc data dropped" << std::endl;
+  size_t numFaces = 0;
+  for (size_t i=0; i<tri.Area(); ++i) {
+    const Vector3uda& t = tri[i];
+    if (t(0) < remap.size() && t(1) < remap.size() && t(2) < remap.size()
+        && remap[t(0)] != invalid && remap[t(1)] != invalid
+        && remap[t(2)] != invalid)
+      ++numFaces;
+  }
+  std::ofstream out(path, std::ios::out | std::ios::binary);
+  if (!out.is_open()) return false;
+  WritePlyHeader(out, comments, numVerts, false, false, numFaces);
+  ChunkedWriter writer(out, PLY_STREAM_CHUNK_BYTES);
+  for (size_t v=0; v<pc.h_; ++v) {
+    const Vector3fda* row = pc.RowPtr(v);
+    for (size_t u=0; u<pc.w_; ++u)
+      if (IsValidData(row[u]))
+        writer.Put(row[u].data(), 3*sizeof(float));
+  }
+  const uint8_t three = 3;
+  for (size_t i=0; i<tri.Area(); ++i) {
+    const Vector3uda& t = tri[i];
+    if (t(0) < remap.size() && t(1) < remap.size() && t(2) < remap.size()
+        && remap[t(0)] != invalid && remap[t(1)] != invalid
+        && remap[t(2)] != invalid) {
+      uint32_t ids[3] = {remap[t(0)], remap[t(1)], remap[t(2)]};
+      writer.Put(&three, 1);
+      writer.Put(ids, 3*sizeof(uint32_t));
+    }
+  }
+  writer.Flush();
+  out.close();
+  return !out.fail();
+}
+
+bool LoadPointCloudMapped(
+    const std::string& path,
+    ManagedHostImage<Vector3fda>& verts,
+    ManagedHostImage<Vector3fda>* ns,
+    ManagedHostImage<Vector3bda>* rgb) {
+  MappedFile file(path);
+  PlyHeader header;
+  if (!MapPly(file, header))
+    return false;
+  int32_t id = header.Find("vertex");
+  if (id < 0 || header.elements[id].stride == 0)
+    return false;
+  const PlyElementDesc& elem = header.elements[id];
+  const uint8_t* data = PlyElementData(file, header, id);
+  if (!data || data + elem.size*elem.stride > file.data_+file.size_)
+    return false;
+  int32_t idsX[3], idsN[3], idsRgb[3];
+  if (!FindVec3(elem, "x", "y", "z", idsX)
+      || (ns && !FindVec3(elem, "nx", "ny", "nz", idsN))
+      || (rgb && !FindVec3(elem, "red", "green", "blue", idsRgb)))
+    return false;
+  CopyPlyVec3<float>(data, elem, idsX, verts);
+  if (ns) CopyPlyVec3<float>(data, elem, idsN, *ns);
+  if (rgb) CopyPlyVec3<uint8_t>(data, elem, idsRgb, *rgb);
+  return true;
+}
+
+bool LoadMeshMapped(
+    const std::string& path,
+    ManagedHostImage<Vector3fda>& verts,
+    ManagedHostImage<Vector3uda>& tris) {
+  MappedFile file(path);
+  PlyHeader header;
+  if (!MapPly(file, header))
+    return false;
+  int32_t idV = header.Find("vertex");
+  int32_t idF = header.Find("face");
+  if (idV < 0 || idF < 0 || idF < idV || header.elements[idV].stride == 0)
+    return false;
+  const PlyElementDesc& elemV = header.elements[idV];
+  const PlyElementDesc& elemF = header.elements[idF];
+  int32_t idsX[3];
+  int32_t idI = elemF.Find("vertex_indices");
+  if (idI < 0) idI = elemF.Find("vertex_index");
+  if (!FindVec3(elemV, "x", "y", "z", idsX) || idI < 0
+      || !elemF.properties[idI].isList)
+    return false;
+  const uint8_t* dataV = PlyElementData(file, header, idV);
+  const uint8_t* dataF = PlyElementData(file, header, idF);
+  const uint8_t* end = file.data_+file.size_;
+  if (!dataV || !dataF || dataV + elemV.size*elemV.stride > end)
+    return false;
+
+  // faces contain lists; validate all records are triangles before
+  // touching the outputs.
+  const uint8_t* p = dataF;
+  for (size_t i=0; i<elemF.size; ++i) {
+    for (size_t j=0; j<elemF.properties.size(); ++j) {
+      const PlyPropertyDesc& prop = elemF.properties[j];
+      if (prop.isList) {
+        size_t cSize = PlyTypeSize(prop.countType);
+        if (p+cSize > end) return false;
+        size_t count = ReadPlyAs<size_t>(p, prop.countType);
+        if ((int32_t)j == idI && count != 3) return false;
+        p += cSize + count*PlyTypeSize(prop.type);
+      } else {
+        p += PlyTypeSize(prop.type);
+      }
+      if (p > end) return false;
+    }
+  }
+
+  CopyPlyVec3<float>(dataV, elemV, idsX, verts);
+  tris.Reinitialise(elemF.size,1);
+  const PlyPropertyDesc& propI = elemF.properties[idI];
+  const size_t iSize = PlyTypeSize(propI.type);
+  p = dataF;
+  for (size_t i=0; i<elemF.size; ++i) {
+    for (size_t j=0; j<elemF.properties.size(); ++j) {
+      const PlyPropertyDesc& prop = elemF.properties[j];
+      if (prop.isList) {
+        size_t cSize = PlyTypeSize(prop.countType);
+        size_t count = ReadPlyAs<size_t>(p, prop.countType);
+        p += cSize;
+        if ((int32_t)j == idI) {
+          for (size_t k=0; k<3; ++k)
+            tris[i](k) = ReadPlyAs<uint32_t>(p+k*iSize, prop.type);
+        }
+        p += count*PlyTypeSize(prop.type);
+      } else {
+        p += PlyTypeSize(prop.type);
+      }
+    }
+  }
+  return true;
+}
+
+}
@@ -0,0 +1,151 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <tdp/io/ply_cache.h>
+#include <tdp/io/tinyply.h>
+
+namespace tdp {
+
+PlyCache::PlyCache(const std::vector<std::string>& paths,
+    size_t maxBytes, size_t numThreads)
+  : paths_(paths), maxBytes_(maxBytes), bytes_(0), visible0_(0),
+  visibleN_(0), stop_(false) {
+  for (size_t t=0; t<std::max<size_t>(1,numThreads); ++t)
+    workers_.push_back(std::thread(&PlyCache::Worker, this));
+}
+
+PlyCache::~PlyCache() {
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    stop_ = true;
+    queue_.clear();
+  }
+  cv_.notify_all();
+  for (auto& worker : workers_) worker.join();
+}
+
+void PlyCache::Schedule(size_t i0, size_t n, int dir, size_t numAhead) {
+  const int N = paths_.size();
+  std::vector<int> order;
+  for (int i=i0; i<(int)(i0+n); ++i)
+    order.push_back(i);
+  const int ahead0 = dir >= 0 ? i0+n : (int)i0-1;
+  const int behind0 = dir >= 0 ? (int)i0-1 : i0+n;
+  const int step = dir >= 0 ? 1 : -1;
+  for (int k=0; k<(int)numAhead; ++k)
+    order.push_back(ahead0+step*k);
+  for (int k=0; k<(int)numAhead; ++k)
+    order.push_back(behind0-step*k);
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    visible0_ = i0;
+    visibleN_ = n;
+    queue_.clear();
+    rank_.clear();
+    for (int i : order) {
+      if (i < 0 || i >= N || rank_.count(i)) continue;
+      // operator[] inserts before size() would be read
+      const size_t r = rank_.size();
+      rank_[i] = r;
+      if (cache_.count(i) || loading_.count(i)) continue;
+      queue_.push_back(i);
+    }
+  }
+  cv_.notify_all();
+}
+
+std::shared_ptr<PlyAsset> PlyCache::Get(size_t i) {
+  std::lock_guard<std::mutex> lock(mut_);
+  auto it = cache_.find(i);
+  if (it == cache_.end())
+    return nullptr;
+  lru_.splice(lru_.begin(), lru_, it->second.lruIt);
+  return it->second.asset;
+}
+
+bool PlyCache::PopLoaded(size_t& i,
+    std::shared_ptr<PlyAsset>& asset) {
+  std::lock_guard<std::mutex> lock(mut_);
+  while (!loaded_.empty()) {
+    i = loaded_.front();
+    loaded_.pop_front();
+    // skip loads that have been evicted again in the meantime
+    auto it = cache_.find(i);
+    if (it != cache_.end()) {
+      asset = it->second.asset;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t PlyCache::SizeBytes() {
+  std::lock_guard<std::mutex> lock(mut_);
+  return bytes_;
+}
+
+size_t PlyCache::Rank(size_t i) const {
+  auto it = rank_.find(i);
+  return it == rank_.end() ? paths_.size() : it->second;
+}
+
+bool PlyCache::FindVictim(size_t rank, size_t& victim) const {
+  // least recently used among the worst ranked entries; visible files
+  // (rank < visibleN_) are never evicted.
+  size_t worst = std::max(rank, visibleN_);
+  bool found = false;
+  for (auto it = lru_.rbegin(); it != lru_.rend(); ++it) {
+    size_t r = Rank(*it);
+    if (r > worst || (r == worst && !found && r > rank)) {
+      worst = r;
+      victim = *it;
+      found = true;
+    }
+  }
+  return found;
+}
+
+void PlyCache::Evict() {
+  size_t victim;
+  while (bytes_ > maxBytes_ && FindVictim(0, victim)) {
+    auto entry = cache_.find(victim);
+    bytes_ -= entry->second.asset->SizeBytes();
+    lru_.erase(entry->second.lruIt);
+    cache_.erase(entry);
+  }
+}
+
+void PlyCache::Worker() {
+  while (true) {
+    size_t i;
+    {
+      std::unique_lock<std::mutex> lock(mut_);
+      cv_.wait(lock, [&]{ return stop_ || !queue_.empty(); });
+      if (stop_) return;
+      i = queue_.front();
+      queue_.pop_front();
+      // the budget is used up by files that are more important
+      size_t victim;
+      if (bytes_ >= maxBytes_ && !FindVictim(Rank(i), victim))
+        continue;
+      loading_.insert(i);
+    }
+    // decode without holding the lock
+    std::shared_ptr<PlyAsset> asset = std::make_shared<PlyAsset>();
+    LoadPointCloud(paths_[i], asset->pc, asset->n);
+    {
+      std::lock_guard<std::mutex> lock(mut_);
+      loading_.erase(i);
+      lru_.push_front(i);
+      Entry entry;
+      entry.asset = asset;
+      entry.lruIt = lru_.begin();
+      cache_[i] = entry;
+      bytes_ += asset->SizeBytes();
+      loaded_.push_back(i);
+      Evict();
+    }
+  }
+}
+
+}
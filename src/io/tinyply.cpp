@@ -6,6 +6,7 @@
 
 #include <cstring>
 #include <tdp/io/tinyply.h>
+#include <tdp/io/ply.h>
 #include <tdp/cuda/cuda.h>
 
 namespace tdp {
@@ -14,6 +15,10 @@ void LoadPointCloud(
     const std::string& path,
     ManagedHostImage<Vector3fda>& verts) {
 
+  if (LoadPointCloudMapped(path, verts)) {
+    std::cout << "loaded ply file: " << verts.Area() << std::endl;
+    return;
+  }
   std::vector<float> vertices;
   std::ifstream in(path, std::ios::binary);
   tinyply::PlyFile ply(in);
@@ -40,6 +45,11 @@ void LoadPointCloud(
     ManagedHostImage<Vector3fda>& verts,
     ManagedHostImage<Vector3fda>& ns, bool verbose) {
 
+  if (LoadPointCloudMapped(path, verts, &ns)) {
+    std::cout << "loaded ply file: " << verts.Area()
+      << " normals: " << ns.Area() << std::endl;
+    return;
+  }
   std::vector<float> vertices;
   std::vector<float> normals;
   std::ifstream in(path, std::ios::binary);
@@ -109,6 +119,12 @@ void LoadPointCloud(
     ManagedHostImage<Vector3bda>& rgb, 
     bool verbose) {
 
+  if (LoadPointCloudMapped(path, verts, &ns, &rgb)) {
+    std::cout << "loaded ply file: " << verts.Area()
+      << " normals: " << ns.Area()
+      << " colors: " << rgb.Area() << std::endl;
+    return;
+  }
   std::vector<float> vertices;
   std::vector<float> normals;
   std::vector<uint8_t> rgbs;
@@ -155,6 +171,11 @@ void LoadMesh(
     ManagedHostImage<Vector3fda>& verts,
     ManagedHostImage<Vector3uda>& tris) {
 
+  if (LoadMeshMapped(path, verts, tris)) {
+    std::cout << "loaded ply file: " << verts.Area() << " "
+      << tris.Area() << std::endl;
+    return;
+  }
   std::vector<float> vertices;
   std::vector<uint32_t> triangles;
   std::ifstream in(path);
@@ -186,6 +207,8 @@ void SavePointCloud(
     const Image<Vector3fda>& n,
     bool binary,
     std::vector<std::string> comments) {
+  if (binary && SavePointCloudStreamed(path, pc, n, comments))
+    return;
   std::vector<float> verts;
   std::vector<float> norms;
   verts.reserve(pc.Area()*3);
@@ -220,6 +243,8 @@ void SavePointCloud(
     const Image<Vector3bda>& rgb,
     bool binary,
     std::vector<std::string> comments) {
+  if (binary && SavePointCloudStreamed(path, pc, n, rgb, comments))
+    return;
   std::vector<float> verts;
   std::vector<float> norms;
   std::vector<uint8_t> rgbs;
@@ -259,6 +284,8 @@ void SaveMesh(
     const Image<Vector3uda>& tri,
     bool binary,
     std::vector<std::string> comments) {
+  if (binary && SaveMeshStreamed(path, pc, tri, comments))
+    return;
   std::vector<float> verts;
   std::vector<uint32_t> tris;
   verts.reserve(pc.Area()*3);
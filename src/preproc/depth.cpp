@@ -3,31 +3,232 @@
  */
 #include <tdp/preproc/depth.h>
 #include <tdp/data/image.h>
+#include <tdp/cuda/cuda.h>
+#include <tdp/utils/parallel_for.h>
+#include <algorithm>
 #include <iostream>
+#include <limits>
+#include <vector>
 #include <math.h>
 
 namespace tdp {
 
-void ConvertDepth(const Image<uint16_t>& dRaw, 
-    Image<float>& d, 
+namespace {
+
+struct UniformDepthScale {
+  UniformDepthScale(float scale) : scale_(scale) {}
+  void SetRow(size_t v) {}
+  float operator()(uint16_t raw, size_t u) const {
+    return ((float)raw)*scale_;
+  }
+  float scale_;
+};
+
+struct ModelDepthScale {
+  ModelDepthScale(const Image<float>& scale, float a, float b)
+    : scale_(scale), row_(nullptr), a_(a), b_(b) {}
+  void SetRow(size_t v) { row_ = scale_.RowPtr(v); }
+  float operator()(uint16_t raw, size_t u) const {
+    float di = ((float)raw)*row_[u];
+    return di*(a_*di + b_);
+  }
+  const Image<float>& scale_;
+  const float* row_;
+  float a_;
+  float b_;
+};
+
+/// Convert rows [v0,v1) of dRaw into d. The inner loop is branch free
+/// so that it can be vectorized by the compiler.
+template<class Scale>
+void ConvertDepthRows(const Image<uint16_t>& dRaw, Image<float>& d,
+    Scale scale, float dMin, float dMax, size_t v0, size_t v1) {
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const size_t wValid = std::min(d.w_, dRaw.w_);
+  for (size_t v=v0; v<v1; ++v) {
+    float* dst = d.RowPtr(v);
+    if (v >= dRaw.h_) {
+      std::fill(dst, dst+d.w_, nan);
+      continue;
+    }
+    const uint16_t* src = dRaw.RowPtr(v);
+    scale.SetRow(v);
+    for (size_t u=0; u<wValid; ++u) {
+      const float di = scale(src[u], u);
+      dst[u] = (dMin < di && di < dMax) ? di : nan;
+    }
+    std::fill(dst+wValid, dst+d.w_, nan);
+  }
+}
+
+void UnprojectRows(const Image<float>& d, const Image<Vector3fda>& ray,
+    Image<Vector3fda>& pc, size_t v0, size_t v1) {
+  for (size_t v=v0; v<v1; ++v) {
+    const float* dRow = d.RowPtr(v);
+    const Vector3fda* rayRow = ray.RowPtr(v);
+    Vector3fda* pcRow = pc.RowPtr(v);
+    for (size_t u=0; u<pc.w_; ++u)
+      pcRow[u] = rayRow[u]*dRow[u];
+  }
+}
+
+/// NaN aware 2x2 averaging as in KernelPyrDown for rows [v0,v1) of the
+/// output image.
+void PyrDownRows(const Image<float>& Iin, Image<float>& Iout,
+    size_t v0, size_t v1) {
+  for (size_t v=v0; v<v1; ++v) {
+    const float* in0 = Iin.RowPtr(2*v);
+    const float* in1 = Iin.RowPtr(2*v+1);
+    float* out = Iout.RowPtr(v);
+    for (size_t u=0; u<Iout.w_; ++u) {
+      float val = 0.f;
+      float num = 0.f;
+      const float vals[4] = {in0[2*u], in0[2*u+1], in1[2*u], in1[2*u+1]};
+      for (size_t k=0; k<4; ++k) {
+        const bool valid = vals[k] == vals[k];
+        val += valid ? vals[k] : 0.f;
+        num += valid ? 1.f : 0.f;
+      }
+      out[u] = val/num;
+    }
+  }
+}
+
+void PyrDownRows(const Image<Vector3fda>& Iin, Image<Vector3fda>& Iout,
+    size_t v0, size_t v1) {
+  for (size_t v=v0; v<v1; ++v) {
+    const Vector3fda* in0 = Iin.RowPtr(2*v);
+    const Vector3fda* in1 = Iin.RowPtr(2*v+1);
+    Vector3fda* out = Iout.RowPtr(v);
+    for (size_t u=0; u<Iout.w_; ++u) {
+      Vector3fda val(0.f,0.f,0.f);
+      float num = 0.f;
+      const Vector3fda* vals[4] = {&in0[2*u], &in0[2*u+1], &in1[2*u],
+        &in1[2*u+1]};
+      for (size_t k=0; k<4; ++k) {
+        if (!isNan(*vals[k])) {
+          val += *vals[k];
+          num ++;
+        }
+      }
+      out[u] = val/num;
+    }
+  }
+}
+
+template<int LEVELS, class Scale>
+void ConvertDepthToPcImpl(const Image<uint16_t>& dRaw,
+    Scale scale, float dMin, float dMax,
+    const Image<Vector3fda>& ray,
+    Pyramid<float,LEVELS>& pyrD,
+    Pyramid<Vector3fda,LEVELS>& pyrPc,
+    size_t numThreads) {
+  const size_t h = pyrD.Height(0);
+  // row blocks are a multiple of the coarsest level's footprint so
+  // that all levels of a block only depend on rows of the same block.
+  const size_t rowsPerBlock = std::max<size_t>(16, 1<<(LEVELS-1));
+  const size_t numBlocks = (h+rowsPerBlock-1)/rowsPerBlock;
+  ParallelFor(numBlocks, 1, [&](size_t b0, size_t b1) {
+    for (size_t b=b0; b<b1; ++b) {
+      const size_t v0 = b*rowsPerBlock;
+      const size_t v1 = std::min(h, v0+rowsPerBlock);
+      Image<float> d = pyrD.GetImage(0);
+      Image<Vector3fda> pc = pyrPc.GetImage(0);
+      ConvertDepthRows(dRaw, d, scale, dMin, dMax, v0, v1);
+      UnprojectRows(d, ray, pc, v0, v1);
+      for (int lvl=1; lvl<LEVELS; ++lvl) {
+        Image<float> dIn = pyrD.GetImage(lvl-1);
+        Image<float> dOut = pyrD.GetImage(lvl);
+        Image<Vector3fda> pcIn = pyrPc.GetImage(lvl-1);
+        Image<Vector3fda> pcOut = pyrPc.GetImage(lvl);
+        const size_t vl0 = v0 >> lvl;
+        const size_t vl1 = std::min(dOut.h_, v1 >> lvl);
+        PyrDownRows(dIn, dOut, vl0, vl1);
+        PyrDownRows(pcIn, pcOut, vl0, vl1);
+      }
+    }
+  }, numThreads);
+}
+
+}
+
+void ConvertDepth(const Image<uint16_t>& dRaw,
+    Image<float>& d,
     float scale,
-    float dMin, 
+    float dMin,
     float dMax
     ) {
-  for (size_t v=0; v<d.h_; ++v)
-    for (size_t u=0; u<d.w_; ++u) 
-      if (u<dRaw.w_ && v<dRaw.h_) {
-        float di = ((float)dRaw(u,v))*scale;
-        if (dMin < di && di < dMax) {
-          d(u,v) = di;
-        } else {
-          d(u,v) = NAN;
-        }
-      } else {
-        d(u,v) = NAN;
-      }
+  ConvertDepthRows(dRaw, d, UniformDepthScale(scale), dMin, dMax, 0, d.h_);
 }
 
+void ConvertDepth(const Image<uint16_t>& dRaw,
+    Image<float>& d,
+    const Image<float>& scale,
+    float aScaleVsDist, float bScaleVsDist,
+    float dMin,
+    float dMax
+    ) {
+  ConvertDepthRows(dRaw, d,
+      ModelDepthScale(scale, aScaleVsDist, bScaleVsDist),
+      dMin, dMax, 0, d.h_);
+}
+
+template<int LEVELS>
+void ConvertDepthToPc(const Image<uint16_t>& dRaw,
+    float scale,
+    float dMin,
+    float dMax,
+    const Image<Vector3fda>& ray,
+    Pyramid<float,LEVELS>& pyrD,
+    Pyramid<Vector3fda,LEVELS>& pyrPc,
+    size_t numThreads
+    ) {
+  ConvertDepthToPcImpl(dRaw, UniformDepthScale(scale), dMin, dMax,
+      ray, pyrD, pyrPc, numThreads);
+}
+
+template<int LEVELS>
+void ConvertDepthToPc(const Image<uint16_t>& dRaw,
+    const Image<float>& scale,
+    float aScaleVsDist, float bScaleVsDist,
+    float dMin,
+    float dMax,
+    const Image<Vector3fda>& ray,
+    Pyramid<float,LEVELS>& pyrD,
+    Pyramid<Vector3fda,LEVELS>& pyrPc,
+    size_t numThreads
+    ) {
+  ConvertDepthToPcImpl(dRaw,
+      ModelDepthScale(scale, aScaleVsDist, bScaleVsDist), dMin, dMax,
+      ray, pyrD, pyrPc, numThreads);
+}
 
+template void ConvertDepthToPc(const Image<uint16_t>& dRaw,
+    float scale, float dMin, float dMax, const Image<Vector3fda>& ray,
+    Pyramid<float,3>& pyrD, Pyramid<Vector3fda,3>& pyrPc,
+    size_t numThreads);
+template void ConvertDepthToPc(const Image<uint16_t>& dRaw,
+    const Image<float>& scale, float aScaleVsDist, float bScaleVsDist,
+    float dMin, float dMax, const Image<Vector3fda>& ray,
+    Pyramid<float,3>& pyrD, Pyramid<Vector3fda,3>& pyrPc,
+    size_t numThreads);
+template void ConvertDepthToPc(const Image<uint16_t>& dRaw,
+    float scale, float dMin, float dMax, const Image<Vector3fda>& ray,
+    Pyramid<float,4>& pyrD, Pyramid<Vector3fda,4>& pyrPc,
+    size_t numThreads);
+template void ConvertDepthToPc(const Image<uint16_t>& dRaw,
+    const Image<float>& scale, float aScaleVsDist, float bScaleVsDist,
+    float dMin, float dMax, const Image<Vector3fda>& ray,
+    Pyramid<float,4>& pyrD, Pyramid<Vector3fda,4>& pyrPc,
+    size_t numThreads);
+template void ConvertDepthToPc(const Image<uint16_t>& dRaw,
+    float scale, float dMin, float dMax, const Image<Vector3fda>& ray,
+    Pyramid<float,5>& pyrD, Pyramid<Vector3fda,5>& pyrPc,
+    size_t numThreads);
+template void ConvertDepthToPc(const Image<uint16_t>& dRaw,
+    const Image<float>& scale, float aScaleVsDist, float bScaleVsDist,
+    float dMin, float dMax, const Image<Vector3fda>& ray,
+    Pyramid<float,5>& pyrD, Pyramid<Vector3fda,5>& pyrPc,
+    size_t numThreads);
 
 }
@@ -0,0 +1,163 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <math.h>
+#include <algorithm>
+#include <tdp/utils/batch.h>
+#include <tdp/preproc/mask_sampler.h>
+
+namespace tdp {
+
+namespace {
+
+/// Small generator that is cheap to seed per block (splitmix64).
+class BlockRandom {
+ public:
+  BlockRandom(uint64_t seed, uint64_t block)
+    : s_(seed ^ (block+1)*0x9e3779b97f4a7c15ull) {}
+  uint64_t operator()() {
+    uint64_t z = (s_ += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+  /// uniform in [0,1)
+  float Uniform() { return ((*this)() >> 40) * (1.f/16777216.f); }
+  /// Poisson distributed with mean lambda (Knuth); O(lambda) draws.
+  size_t Poisson(double lambda) {
+    size_t k = 0;
+    // split large means so that exp(-lambda) does not underflow
+    for (; lambda > 256.; lambda -= 256.) k += Poisson(256.);
+    const double L = exp(-lambda);
+    double p = 1.;
+    while (true) {
+      p *= ((*this)() >> 11) * (1./9007199254740992.);
+      if (p <= L) return k;
+      k ++;
+    }
+  }
+ private:
+  uint64_t s_;
+};
+
+}
+
+void AliasTable::Build(const float* w, size_t n, float sum) {
+  prob_.resize(n);
+  alias_.resize(n);
+  small_.clear();
+  large_.clear();
+  const float scale = n/sum;
+  for (size_t i=0; i<n; ++i) {
+    prob_[i] = w[i]*scale;
+    alias_[i] = i;
+    if (prob_[i] < 1.f) small_.push_back(i);
+    else large_.push_back(i);
+  }
+  while (!small_.empty() && !large_.empty()) {
+    const uint32_t s = small_.back();
+    const uint32_t l = large_.back();
+    small_.pop_back();
+    alias_[s] = l;
+    prob_[l] -= 1.f-prob_[s];
+    if (prob_[l] < 1.f) {
+      large_.pop_back();
+      small_.push_back(l);
+    }
+  }
+  // whatever is left is 1 up to rounding
+  for (uint32_t i : small_) prob_[i] = 1.f;
+  for (uint32_t i : large_) prob_[i] = 1.f;
+}
+
+void GradientMaskSampler::ResampleEmptyParts(const Image<Vector3fda>& pc,
+    Image<uint8_t>& mask, const Image<float>& greyGradNorm,
+    float subsample, std::mt19937& gen, size_t I, size_t J, size_t w,
+    size_t h, float pUniform, std::vector<uint32_t>& idNew) {
+  const uint64_t seed = ((uint64_t)gen() << 32) | gen();
+  const float A = I*J;
+  if (blocks_.size() < I*J) blocks_.resize(I*J);
+  ForEachBlock(I*J, 1, numThreads_, [&](size_t b0, size_t b1) {
+    for (size_t b=b0; b<b1; ++b) {
+      const size_t i = b/J, j = b%J;
+      const size_t u0 = i*w/I, u1 = (i+1)*w/I;
+      const size_t v0 = j*h/J, v1 = (j+1)*h/J;
+      const size_t bw = u1-u0;
+      Block& block = blocks_[b];
+      block.ids.clear();
+      // clear the mask and see whether the block had any pixel set
+      bool empty = true;
+      for (size_t v=v0; v<v1; ++v) {
+        uint8_t* m = &mask(u0,v);
+        uint8_t any = 0;
+        for (size_t u=0; u<bw; ++u) any |= m[u];
+        if (any) {
+          empty = false;
+          std::fill(m, m+bw, 0);
+        }
+      }
+      if (!empty || bw == 0 || v1 == v0) continue;
+      const size_t n = bw*(v1-v0);
+      float sumGradNorm = 0.f, dSum = 0.f, numD = 0.f;
+      for (size_t v=v0; v<v1; ++v) {
+        const float* g = &greyGradNorm(u0,v);
+        for (size_t u=0; u<bw; ++u) sumGradNorm += g[u];
+        const Vector3fda* p = &pc(u0,v);
+        for (size_t u=0; u<bw; ++u) {
+          const float z = p[u](2);
+          if (z == z) {
+            dSum += z;
+            numD ++;
+          }
+        }
+      }
+      const float avgD = dSum/numD;
+      const float prob = subsample*avgD*avgD;
+      if (!(prob > 0.f)) continue;
+      // pixel probabilities p = probUnif + pGradNorm*g
+      const float probUnif = prob*pUniform/A;
+      const float pGradNorm = sumGradNorm > 0.f
+        ? prob*(1.f-pUniform)/sumGradNorm : 0.f;
+      // Pixels with p >= 1 are set right away. For the others the rates
+      // lambda = -log(1-p) go into the alias table; the pixels hit by
+      // Poisson(sum lambda) draws with replacement are then set
+      // independently with probability 1-exp(-lambda) = p.
+      block.lambda.resize(n);
+      float sumLambda = 0.f;
+      for (size_t v=v0; v<v1; ++v) {
+        const float* g = &greyGradNorm(u0,v);
+        float* lambda = &block.lambda[(v-v0)*bw];
+        for (size_t u=0; u<bw; ++u) {
+          const float p = probUnif + pGradNorm*g[u];
+          if (p >= 1.f) {
+            lambda[u] = 0.f;
+            mask(u0+u,v) = 128;
+            block.ids.push_back(u0+u+v*mask.w_);
+          } else {
+            lambda[u] = -log1pf(-p);
+            sumLambda += lambda[u];
+          }
+        }
+      }
+      if (!(sumLambda > 0.f)) continue;
+      BlockRandom rnd(seed, b);
+      const size_t numDraws = rnd.Poisson(sumLambda);
+      if (numDraws == 0) continue;
+      block.alias.Build(block.lambda.data(), n, sumLambda);
+      for (size_t s=0; s<numDraws; ++s) {
+        const float u0s = rnd.Uniform();
+        const float u1s = rnd.Uniform();
+        const uint32_t k = block.alias.Sample(u0s, u1s);
+        const size_t u = u0 + k%bw;
+        const size_t v = v0 + k/bw;
+        if (mask(u,v)) continue;
+        mask(u,v) = 128;
+        block.ids.push_back(u+v*mask.w_);
+      }
+    }
+  }, 2);
+  for (size_t b=0; b<I*J; ++b)
+    idNew.insert(idNew.end(), blocks_[b].ids.begin(), blocks_[b].ids.end());
+}
+
+}
@@ -0,0 +1,84 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <iostream>
+#include <tdp/slam/keyframe_slam.h>
+
+namespace tdp {
+
+KeyframeSLAM::KeyframeSLAM() :
+  infoPrior_(10000.*Eigen::Matrix<double,6,6>::Identity()),
+  infoOdom_(100.*Eigen::Matrix<double,6,6>::Identity()),
+  infoLoopClosure_(100.*Eigen::Matrix<double,6,6>::Identity())
+{ }
+
+KeyframeSLAM::~KeyframeSLAM()
+{}
+
+void KeyframeSLAM::AddOrigin(const SE3f& T_wk) {
+  SE3d origin(T_wk.matrix().cast<double>());
+  size_t id = graph_.AddPose(origin);
+  graph_.AddPrior(id, origin, infoPrior_);
+}
+
+void KeyframeSLAM::AddPose(const SE3f& T_wk) {
+  graph_.AddPose(SE3d(T_wk.matrix().cast<double>()));
+}
+
+void KeyframeSLAM::AddIcpOdometry(int idA, int idB, const SE3f& T_ab) {
+  SE3d T_abd(T_ab.matrix().cast<double>());
+  // the new pose is initialized from the odometry
+  graph_.AddPose(graph_.GetPose(idA)*T_abd);
+  graph_.AddFactor(idA, idB, T_abd, infoOdom_);
+  loopClosures_.emplace_back(idA, idB);
+}
+
+void KeyframeSLAM::AddLoopClosure(int idA, int idB, const SE3f& T_ab,
+    const Eigen::Matrix<float,6,6>& Sigma_ab) {
+  Eigen::Matrix<double,6,6> info = Sigma_ab.cast<double>().inverse();
+  if (!info.allFinite()) {
+    std::cerr << "KeyframeSLAM: singular loop closure covariance "
+      << idA << " to " << idB << "; using default noise" << std::endl;
+    info = infoLoopClosure_;
+  }
+  graph_.AddFactor(idA, idB, SE3d(T_ab.matrix().cast<double>()), info);
+  loopClosures_.emplace_back(idA, idB);
+}
+
+void KeyframeSLAM::AddLoopClosure(int idA, int idB, const SE3f& T_ab) {
+  graph_.AddFactor(idA, idB, SE3d(T_ab.matrix().cast<double>()),
+      infoLoopClosure_);
+  loopClosures_.emplace_back(idA, idB);
+}
+
+void KeyframeSLAM::PrintValues() {
+  for (size_t i=0; i<graph_.NumPoses(); ++i) {
+    std::cout << graph_.GetPose(i) << std::endl;
+  }
+}
+
+void KeyframeSLAM::PrintGraph() {
+  for (const auto& f : graph_.GetFactors()) {
+    if (f.prior)
+      std::cout << "prior " << f.idA << std::endl;
+    else
+      std::cout << "relative " << f.idA << " -> " << f.idB << std::endl;
+    std::cout << f.T_ab << std::endl;
+  }
+}
+
+void KeyframeSLAM::Optimize() {
+  std::cout << "pose graph optimization" << std::endl;
+  std::cout << graph_.Chi2() << std::endl;
+  std::cout << graph_.Optimize() << std::endl;
+}
+
+SE3f KeyframeSLAM::GetPose(size_t i) {
+  if (i<size()) {
+    Eigen::Matrix<float,4,4> T = graph_.GetPose(i).matrix().cast<float>();
+    return SE3f(T);
+  }
+  return SE3f();
+}
+
+}
@@ -0,0 +1,445 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string.h>
+#include <tdp/slam/keyframe_store.h>
+
+namespace tdp {
+
+namespace {
+
+void PutVarint(uint32_t x, std::vector<uint8_t>& out) {
+  while (x >= 0x80) {
+    out.push_back(static_cast<uint8_t>(x | 0x80));
+    x >>= 7;
+  }
+  out.push_back(static_cast<uint8_t>(x));
+}
+
+bool GetVarint(const std::vector<uint8_t>& in, size_t& i, uint32_t& x) {
+  x = 0;
+  for (int shift=0; shift<35 && i<in.size(); shift+=7) {
+    const uint8_t b = in[i++];
+    x |= static_cast<uint32_t>(b & 0x7f) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+/// Encode a plane of w x h values spaced by stride elements. Each value
+/// is coded as the zigzag mapped difference to its left neighbour (the
+/// first of a row to the one above); a run of zero differences is
+/// coded as a 0 followed by the run length.
+template<typename T>
+void EncodePlane(const T* data, size_t w, size_t h, size_t rowStride,
+    size_t stride, std::vector<uint8_t>& out) {
+  uint32_t run = 0;
+  for (size_t v=0; v<h; ++v) {
+    const T* row = data + v*rowStride;
+    for (size_t u=0; u<w; ++u) {
+      const int32_t pred = u > 0 ? row[(u-1)*stride]
+        : (v > 0 ? row[-(int64_t)rowStride] : 0);
+      const int32_t diff = static_cast<int32_t>(row[u*stride]) - pred;
+      if (diff == 0) {
+        run ++;
+        continue;
+      }
+      if (run > 0) {
+        PutVarint(0, out);
+        PutVarint(run, out);
+        run = 0;
+      }
+      PutVarint((diff << 1) ^ (diff >> 31), out);
+    }
+  }
+  if (run > 0) {
+    PutVarint(0, out);
+    PutVarint(run, out);
+  }
+}
+
+template<typename T>
+bool DecodePlane(const std::vector<uint8_t>& in, size_t& i, T* data,
+    size_t w, size_t h, size_t rowStride, size_t stride) {
+  uint32_t run = 0;
+  for (size_t v=0; v<h; ++v) {
+    T* row = data + v*rowStride;
+    for (size_t u=0; u<w; ++u) {
+      const int32_t pred = u > 0 ? row[(u-1)*stride]
+        : (v > 0 ? row[-(int64_t)rowStride] : 0);
+      int32_t diff = 0;
+      if (run > 0) {
+        run --;
+      } else {
+        uint32_t code;
+        if (!GetVarint(in, i, code)) return false;
+        if (code == 0) {
+          if (!GetVarint(in, i, run) || run == 0) return false;
+          run --;
+        } else {
+          diff = static_cast<int32_t>(code >> 1)
+            ^ -static_cast<int32_t>(code & 1);
+        }
+      }
+      row[u*stride] = static_cast<T>(pred + diff);
+    }
+  }
+  return run == 0;
+}
+
+template<typename T>
+void CopyImage(const Image<T>& src, ManagedHostImage<T>& dst) {
+  dst.Reinitialise(src.w_, src.h_);
+  for (size_t v=0; v<src.h_; ++v)
+    memcpy(static_cast<void*>(dst.RowPtr(v)), src.RowPtr(v),
+        src.w_*sizeof(T));
+}
+
+template<typename T> T Zero() { return T::Zero(); }
+template<> float Zero<float>() { return 0.f; }
+
+/// NaN aware 2x2 average as in PyrDown.
+template<typename T>
+void PyrDownCpu(const Image<T>& Iin, Image<T>& Iout) {
+  for (size_t v=0; v<Iout.h_; ++v) {
+    const T* in0 = Iin.RowPtr(2*v);
+    const T* in1 = Iin.RowPtr(2*v+1);
+    T* out = Iout.RowPtr(v);
+    for (size_t u=0; u<Iout.w_; ++u) {
+      const T vals[4] = {in0[2*u], in0[2*u+1], in1[2*u], in1[2*u+1]};
+      T sum = Zero<T>();
+      float num = 0.f;
+      for (int k=0; k<4; ++k) {
+        if (vals[k] == vals[k]) {
+          sum += vals[k];
+          num ++;
+        }
+      }
+      out[u] = num > 0.f ? T(sum/num) : T(Zero<T>()*NAN);
+    }
+  }
+}
+
+template<typename T, int LEVELS>
+void CompletePyramidCpu(Pyramid<T,LEVELS>& P) {
+  for (int lvl=1; lvl<LEVELS; ++lvl) {
+    Image<T> Isrc = P.GetImage(lvl-1);
+    Image<T> Idst = P.GetImage(lvl);
+    PyrDownCpu(Isrc, Idst);
+  }
+}
+
+}
+
+void CompressKeyFrame(CompactKeyFrame& ckf) {
+  const uint32_t w = ckf.d_.w_;
+  const uint32_t h = ckf.d_.h_;
+  std::vector<uint8_t>& out = ckf.blob_;
+  out.clear();
+  out.reserve(ckf.d_.SizeBytes()/2);
+  PutVarint(w, out);
+  PutVarint(h, out);
+  EncodePlane(ckf.d_.ptr_, w, h, ckf.d_.pitch_/sizeof(uint16_t), 1, out);
+  EncodePlane(ckf.grey_.ptr_, w, h, ckf.grey_.pitch_, 1, out);
+  const uint8_t* rgb = reinterpret_cast<const uint8_t*>(ckf.rgb_.ptr_);
+  for (size_t c=0; c<3; ++c)
+    EncodePlane(rgb+c, w, h, ckf.rgb_.pitch_, 3, out);
+  out.shrink_to_fit();
+  ckf.d_.Reinitialise(0,0);
+  ckf.grey_.Reinitialise(0,0);
+  ckf.rgb_.Reinitialise(0,0);
+}
+
+bool DecompressKeyFrame(CompactKeyFrame& ckf) {
+  const std::vector<uint8_t>& in = ckf.blob_;
+  size_t i = 0;
+  uint32_t w, h;
+  if (!GetVarint(in, i, w) || !GetVarint(in, i, h)) return false;
+  ckf.d_.Reinitialise(w,h);
+  ckf.grey_.Reinitialise(w,h);
+  ckf.rgb_.Reinitialise(w,h);
+  bool ok = DecodePlane(in, i, ckf.d_.ptr_, w, h,
+      ckf.d_.pitch_/sizeof(uint16_t), 1);
+  ok = ok && DecodePlane(in, i, ckf.grey_.ptr_, w, h, ckf.grey_.pitch_, 1);
+  uint8_t* rgb = reinterpret_cast<uint8_t*>(ckf.rgb_.ptr_);
+  for (size_t c=0; c<3; ++c)
+    ok = ok && DecodePlane(in, i, rgb+c, w, h, ckf.rgb_.pitch_, 3);
+  if (!ok) {
+    std::cerr << "DecompressKeyFrame: corrupt keyframe data" << std::endl;
+    return false;
+  }
+  ckf.blob_.clear();
+  ckf.blob_.shrink_to_fit();
+  return true;
+}
+
+void DeriveKeyFrame(const CompactKeyFrame& ckf, float dScale,
+    const Image<Vector3fda>& ray, const Image<Vector3fda>* origin,
+    KeyFrame& kf) {
+  const size_t w = ckf.d_.w_;
+  const size_t h = ckf.d_.h_;
+  kf.d_.Reinitialise(w,h);
+  kf.rgb_.Reinitialise(w,h);
+  kf.pyrPc_.Reinitialise(w,h);
+  kf.pyrN_.Reinitialise(w,h);
+  kf.pyrGrey_.Reinitialise(w,h);
+  kf.pyrGradGrey_.Reinitialise(w,h);
+  kf.pc_.Reinitialise(w,h);
+  kf.n_.Reinitialise(w,h);
+
+  Image<Vector3fda> pc = kf.pyrPc_.GetImage(0);
+  Image<float> grey = kf.pyrGrey_.GetImage(0);
+  for (size_t v=0; v<h; ++v) {
+    const uint16_t* d16 = ckf.d_.RowPtr(v);
+    const uint8_t* grey8 = ckf.grey_.RowPtr(v);
+    const Vector3fda* rayRow = ray.RowPtr(v);
+    float* dRow = kf.d_.RowPtr(v);
+    Vector3fda* pcRow = pc.RowPtr(v);
+    float* greyRow = grey.RowPtr(v);
+    for (size_t u=0; u<w; ++u) {
+      dRow[u] = d16[u] > 0 ? d16[u]*dScale : NAN;
+      pcRow[u] = rayRow[u]*dRow[u];
+      if (origin) pcRow[u] += (*origin)(u,v);
+      greyRow[u] = grey8[u]/255.f;
+    }
+    memcpy(static_cast<void*>(kf.rgb_.RowPtr(v)), ckf.rgb_.RowPtr(v),
+        w*sizeof(Vector3bda));
+  }
+
+  // normals from central differences oriented towards the viewpoint
+  Image<Vector3fda> n = kf.pyrN_.GetImage(0);
+  n.Fill(Vector3fda(NAN,NAN,NAN));
+  for (size_t v=1; v+1<h; ++v)
+    for (size_t u=1; u+1<w; ++u) {
+      const Vector3fda du = pc(u+1,v) - pc(u-1,v);
+      const Vector3fda dv = pc(u,v+1) - pc(u,v-1);
+      Vector3fda ni = du.cross(dv);
+      const float norm = ni.norm();
+      if (!(norm > 0.f)) continue;
+      ni /= norm;
+      Vector3fda view = pc(u,v);
+      if (origin) view -= (*origin)(u,v);
+      n(u,v) = ni.dot(view) > 0.f ? -ni : ni;
+    }
+
+  // Scharr gradient of the grey image as in GradientShar
+  Image<Vector2fda> grad = kf.pyrGradGrey_.GetImage(0);
+  grad.Fill(Vector2fda::Zero());
+  for (size_t v=1; v+1<h; ++v)
+    for (size_t u=1; u+1<w; ++u) {
+      const float Iu = 3.f*(grey(u+1,v-1) - grey(u-1,v-1))
+        + 10.f*(grey(u+1,v) - grey(u-1,v))
+        + 3.f*(grey(u+1,v+1) - grey(u-1,v+1));
+      const float Iv = 3.f*(grey(u-1,v+1) - grey(u-1,v-1))
+        + 10.f*(grey(u,v+1) - grey(u,v-1))
+        + 3.f*(grey(u+1,v+1) - grey(u+1,v-1));
+      grad(u,v) = Vector2fda(Iu*0.03125f, Iv*0.03125f);
+    }
+
+  CompletePyramidCpu(kf.pyrPc_);
+  CompletePyramidCpu(kf.pyrN_);
+  CompletePyramidCpu(kf.pyrGrey_);
+  CompletePyramidCpu(kf.pyrGradGrey_);
+  for (int lvl=1; lvl<3; ++lvl) {
+    Image<Vector3fda> nLvl = kf.pyrN_.GetImage(lvl);
+    for (size_t i=0; i<nLvl.Area(); ++i)
+      nLvl[i].normalize();
+  }
+  for (size_t v=0; v<h; ++v) {
+    memcpy(static_cast<void*>(kf.pc_.RowPtr(v)), pc.RowPtr(v),
+        w*sizeof(Vector3fda));
+    memcpy(static_cast<void*>(kf.n_.RowPtr(v)), n.RowPtr(v),
+        w*sizeof(Vector3fda));
+  }
+}
+
+KeyFrameStore::KeyFrameStore(const Image<Vector3fda>& ray,
+    const Image<Vector3fda>* origin, size_t maxHot, bool compressCold,
+    const std::string& spillDir, float dScale)
+  : maxHot_(std::max<size_t>(1,maxHot)), compressCold_(compressCold),
+  spillDir_(spillDir), dScale_(dScale), ray_(ray.w_, ray.h_),
+  origin_(ray.w_, ray.h_), haveOrigin_(origin != nullptr) {
+  for (size_t v=0; v<ray.h_; ++v) {
+    memcpy(static_cast<void*>(ray_.RowPtr(v)), ray.RowPtr(v),
+        ray.w_*sizeof(Vector3fda));
+    if (origin)
+      memcpy(static_cast<void*>(origin_.RowPtr(v)), origin->RowPtr(v),
+          ray.w_*sizeof(Vector3fda));
+  }
+}
+
+KeyFrameStore::~KeyFrameStore() {
+  for (auto& ckf : ckfs_)
+    if (!ckf->path_.empty())
+      std::remove(ckf->path_.c_str());
+}
+
+size_t KeyFrameStore::Add(const Image<float>& d, const Image<float>& grey,
+    const Image<Vector3bda>& rgb, const SE3f& T_wk) {
+  std::unique_ptr<CompactKeyFrame> ckf(new CompactKeyFrame);
+  ckf->d_.Reinitialise(d.w_, d.h_);
+  ckf->grey_.Reinitialise(d.w_, d.h_);
+  ckf->rgb_.Reinitialise(d.w_, d.h_);
+  const float maxD = 65535.f*dScale_;
+  for (size_t v=0; v<d.h_; ++v) {
+    const float* dRow = d.RowPtr(v);
+    const float* greyRow = grey.RowPtr(v);
+    uint16_t* d16 = ckf->d_.RowPtr(v);
+    uint8_t* grey8 = ckf->grey_.RowPtr(v);
+    for (size_t u=0; u<d.w_; ++u) {
+      const float di = dRow[u];
+      d16[u] = (di > 0.f && di < maxD) ?
+        std::max<uint16_t>(1, static_cast<uint16_t>(di/dScale_+0.5f)) : 0;
+      const float g = std::min(1.f, std::max(0.f, greyRow[u]));
+      grey8[u] = static_cast<uint8_t>(g*255.f+0.5f);
+    }
+    memcpy(static_cast<void*>(ckf->rgb_.RowPtr(v)), rgb.RowPtr(v),
+        d.w_*sizeof(Vector3bda));
+  }
+  std::lock_guard<std::mutex> lock(mut_);
+  const size_t id = ckfs_.size();
+  ckfs_.push_back(std::move(ckf));
+  T_wks_.push_back(T_wk);
+  lru_.push_front(id);
+  hot_[id] = std::make_pair(std::shared_ptr<KeyFrame>(), lru_.begin());
+  while (hot_.size() > maxHot_) {
+    MakeCold(lru_.back());
+  }
+  return id;
+}
+
+std::shared_ptr<KeyFrame> KeyFrameStore::Get(size_t id) {
+  CompactKeyFrame ckf;
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    if (id >= ckfs_.size()) return nullptr;
+    auto it = hot_.find(id);
+    if (it == hot_.end()) {
+      if (!MakeHot(id)) return nullptr;
+      it = hot_.find(id);
+    } else {
+      Touch(id);
+    }
+    std::shared_ptr<KeyFrame> kf = it->second.first;
+    if (kf) {
+      kf->T_wk_ = T_wks_[id];
+      return kf;
+    }
+    // the compact images of a hot keyframe are uncompressed; copy them
+    // since the keyframe may go cold while it is derived
+    CopyImage(ckfs_[id]->d_, ckf.d_);
+    CopyImage(ckfs_[id]->grey_, ckf.grey_);
+    CopyImage(ckfs_[id]->rgb_, ckf.rgb_);
+    while (hot_.size() > maxHot_) {
+      MakeCold(lru_.back());
+    }
+  }
+  // derive without holding mut_ so that concurrent calls for different
+  // keyframes run in parallel
+  std::shared_ptr<KeyFrame> kf = std::make_shared<KeyFrame>();
+  DeriveKeyFrame(ckf, dScale_, ray_, haveOrigin_ ? &origin_ : nullptr,
+      *kf);
+  std::lock_guard<std::mutex> lock(mut_);
+  auto it = hot_.find(id);
+  if (it != hot_.end()) {
+    // another call may have derived the keyframe in the meantime
+    if (it->second.first)
+      kf = it->second.first;
+    else
+      it->second.first = kf;
+  }
+  kf->T_wk_ = T_wks_[id];
+  return kf;
+}
+
+SE3f KeyFrameStore::Pose(size_t id) const {
+  std::lock_guard<std::mutex> lock(mut_);
+  return T_wks_[id];
+}
+
+void KeyFrameStore::SetPose(size_t id, const SE3f& T_wk) {
+  std::lock_guard<std::mutex> lock(mut_);
+  T_wks_[id] = T_wk;
+}
+
+size_t KeyFrameStore::size() const {
+  std::lock_guard<std::mutex> lock(mut_);
+  return T_wks_.size();
+}
+
+size_t KeyFrameStore::MemoryBytes() {
+  std::lock_guard<std::mutex> lock(mut_);
+  size_t bytes = ray_.SizeBytes() + origin_.SizeBytes();
+  for (auto& ckf : ckfs_)
+    bytes += ckf->SizeBytes();
+  for (auto& it : hot_) {
+    const std::shared_ptr<KeyFrame>& kf = it.second.first;
+    if (!kf) continue;
+    bytes += kf->pc_.SizeBytes() + kf->n_.SizeBytes()
+      + kf->rgb_.SizeBytes() + kf->d_.SizeBytes()
+      + kf->pyrPc_.SizeBytes() + kf->pyrN_.SizeBytes()
+      + kf->pyrGrey_.SizeBytes() + kf->pyrGradGrey_.SizeBytes();
+  }
+  return bytes;
+}
+
+void KeyFrameStore::Touch(size_t id) {
+  auto& entry = hot_[id];
+  lru_.erase(entry.second);
+  lru_.push_front(id);
+  entry.second = lru_.begin();
+}
+
+void KeyFrameStore::MakeCold(size_t id) {
+  auto it = hot_.find(id);
+  lru_.erase(it->second.second);
+  hot_.erase(it);
+  if (!compressCold_) return;
+  CompactKeyFrame& ckf = *ckfs_[id];
+  CompressKeyFrame(ckf);
+  if (spillDir_.empty()) return;
+  std::stringstream path;
+  path << spillDir_ << "/kf_" << id << ".bin";
+  std::ofstream out(path.str(), std::ios::out | std::ios::binary);
+  out.write(reinterpret_cast<const char*>(ckf.blob_.data()),
+      ckf.blob_.size());
+  if (!out.good()) {
+    std::cerr << "KeyFrameStore: could not spill keyframe to "
+      << path.str() << std::endl;
+    return;
+  }
+  ckf.path_ = path.str();
+  ckf.blob_.clear();
+  ckf.blob_.shrink_to_fit();
+}
+
+bool KeyFrameStore::MakeHot(size_t id) {
+  CompactKeyFrame& ckf = *ckfs_[id];
+  if (!ckf.path_.empty()) {
+    std::ifstream in(ckf.path_, std::ios::in | std::ios::binary
+        | std::ios::ate);
+    if (!in.is_open()) {
+      std::cerr << "KeyFrameStore: could not load keyframe from "
+        << ckf.path_ << std::endl;
+      return false;
+    }
+    ckf.blob_.resize(in.tellg());
+    in.seekg(0);
+    in.read(reinterpret_cast<char*>(ckf.blob_.data()), ckf.blob_.size());
+    in.close();
+    std::remove(ckf.path_.c_str());
+    ckf.path_.clear();
+  }
+  if (!ckf.blob_.empty() && !DecompressKeyFrame(ckf))
+    return false;
+  lru_.push_front(id);
+  hot_[id] = std::make_pair(std::shared_ptr<KeyFrame>(), lru_.begin());
+  return true;
+}
+
+}
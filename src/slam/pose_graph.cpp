@@ -0,0 +1,232 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <algorithm>
+#include <iostream>
+#include <math.h>
+#include <tdp/slam/pose_graph.h>
+
+namespace tdp {
+
+PoseGraph::PoseGraph()
+  : relinThr_(1e-6), lambda_(1e-9), epsilon_(1e-6), verbose_(false),
+  structureDirty_(true)
+{}
+
+size_t PoseGraph::AddPose(const SE3d& T_wk) {
+  T_wk_.push_back(T_wk);
+  poseDirty_.push_back(true);
+  structureDirty_ = true;
+  return T_wk_.size()-1;
+}
+
+void PoseGraph::AddPrior(size_t id, const SE3d& T_wk,
+    const Eigen::Matrix<double,6,6>& Omega) {
+  if (id >= T_wk_.size()) {
+    std::cerr << "PoseGraph: prior on unknown pose " << id << std::endl;
+    return;
+  }
+  factors_.emplace_back(id, id, T_wk, Omega);
+  factors_.back().prior = true;
+}
+
+void PoseGraph::AddFactor(size_t idA, size_t idB, const SE3d& T_ab,
+    const Eigen::Matrix<double,6,6>& Omega) {
+  if (idA >= T_wk_.size() || idB >= T_wk_.size() || idA == idB) {
+    std::cerr << "PoseGraph: invalid factor " << idA << " to " << idB
+      << std::endl;
+    return;
+  }
+  factors_.emplace_back(idA, idB, T_ab, Omega);
+  structureDirty_ = true;
+}
+
+Eigen::Matrix3d PoseGraph::JrInv(const Eigen::Vector3d& phi) {
+  const double theta = phi.norm();
+  const Eigen::Matrix3d W = SO3d::invVee(phi);
+  if (theta < 1e-5)
+    return Eigen::Matrix3d::Identity() + 0.5*W + W*W/12.;
+  return Eigen::Matrix3d::Identity() + 0.5*W
+    + (1./(theta*theta) - (1.+cos(theta))/(2.*theta*sin(theta)))*W*W;
+}
+
+Eigen::Matrix<double,6,1> PoseGraph::Residual(const SE3d& T_wa,
+    const SE3d& T_wb, const SE3d& T_ab,
+    Eigen::Matrix<double,6,6>* J_a,
+    Eigen::Matrix<double,6,6>* J_b) {
+  const Eigen::Matrix3d R_a = T_wa.rotation().matrix();
+  const Eigen::Matrix3d R_m = T_ab.rotation().matrix();
+  const Eigen::Matrix3d Q = R_a.transpose()*T_wb.rotation().matrix();
+  const Eigen::Matrix3d R_e = R_m.transpose()*Q;
+  const Eigen::Vector3d p = R_a.transpose()*(T_wb.translation()
+      - T_wa.translation());
+  Eigen::Matrix<double,6,1> r;
+  r.head<3>() = SO3d::Log_(SO3d(R_e));
+  r.tail<3>() = R_m.transpose()*(p - T_ab.translation());
+  if (J_a || J_b) {
+    const Eigen::Matrix3d JrInvE = JrInv(r.head<3>());
+    if (J_a) {
+      J_a->setZero();
+      J_a->topLeftCorner<3,3>() = -JrInvE*Q.transpose();
+      J_a->bottomLeftCorner<3,3>() = R_m.transpose()*SO3d::invVee(p);
+      J_a->bottomRightCorner<3,3>() = -R_m.transpose();
+    }
+    if (J_b) {
+      J_b->setZero();
+      J_b->topLeftCorner<3,3>() = JrInvE;
+      J_b->bottomRightCorner<3,3>() = R_e;
+    }
+  }
+  return r;
+}
+
+void PoseGraph::Linearize(Factor& f) const {
+  Eigen::Matrix<double,6,6> J_a, J_b;
+  Eigen::Matrix<double,6,1> r;
+  if (f.prior) {
+    r = Residual(f.T_ab, T_wk_[f.idA], SE3d(), nullptr, &J_a);
+  } else {
+    r = Residual(T_wk_[f.idA], T_wk_[f.idB], f.T_ab, &J_a, &J_b);
+  }
+  const Eigen::Matrix<double,6,6> JaTOmega = J_a.transpose()*f.Omega;
+  f.H_aa = JaTOmega*J_a;
+  f.g_a = JaTOmega*r;
+  if (!f.prior) {
+    const Eigen::Matrix<double,6,6> JbTOmega = J_b.transpose()*f.Omega;
+    f.H_ab = JaTOmega*J_b;
+    f.H_bb = JbTOmega*J_b;
+    f.g_b = JbTOmega*r;
+  }
+  f.chi2 = r.dot(f.Omega*r);
+}
+
+double PoseGraph::Chi2() const {
+  double chi2 = 0.;
+  for (const auto& f : factors_) {
+    Eigen::Matrix<double,6,1> r = f.prior
+      ? Residual(f.T_ab, T_wk_[f.idA], SE3d())
+      : Residual(T_wk_[f.idA], T_wk_[f.idB], f.T_ab);
+    chi2 += r.dot(f.Omega*r);
+  }
+  return chi2;
+}
+
+void PoseGraph::BuildStructure() {
+  const size_t N = T_wk_.size();
+  blockRows_.assign(N, std::vector<size_t>());
+  for (size_t j=0; j<N; ++j)
+    blockRows_[j].push_back(j);
+  for (const auto& f : factors_) {
+    if (f.prior) continue;
+    blockRows_[std::min(f.idA,f.idB)].push_back(std::max(f.idA,f.idB));
+  }
+  size_t nnz = 0;
+  for (auto& rows : blockRows_) {
+    std::sort(rows.begin(), rows.end());
+    rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+    nnz += 36*rows.size();
+  }
+  // every column of block column j has the same row pattern; the full
+  // diagonal block is stored but only the lower part is used
+  H_.resize(6*N, 6*N);
+  H_.resizeNonZeros(nnz);
+  int* outer = H_.outerIndexPtr();
+  int* inner = H_.innerIndexPtr();
+  size_t k = 0;
+  for (size_t j=0; j<N; ++j) {
+    for (size_t c=0; c<6; ++c) {
+      outer[6*j+c] = k;
+      for (size_t i : blockRows_[j])
+        for (size_t r=0; r<6; ++r)
+          inner[k++] = 6*i+r;
+    }
+  }
+  outer[6*N] = k;
+  g_.resize(6*N);
+  ldlt_.analyzePattern(H_);
+  structureDirty_ = false;
+}
+
+size_t PoseGraph::BlockOffset(size_t i, size_t j) const {
+  const std::vector<size_t>& rows = blockRows_[j];
+  return 6*(std::lower_bound(rows.begin(), rows.end(), i) - rows.begin());
+}
+
+void PoseGraph::AddBlock(size_t i, size_t j,
+    const Eigen::Matrix<double,6,6>& B) {
+  const size_t off = BlockOffset(i,j);
+  const int* outer = H_.outerIndexPtr();
+  double* val = H_.valuePtr();
+  for (size_t c=0; c<6; ++c) {
+    double* col = val + outer[6*j+c] + off;
+    for (size_t r=0; r<6; ++r)
+      col[r] += B(r,c);
+  }
+}
+
+double PoseGraph::Optimize(size_t maxIt) {
+  if (T_wk_.size() == 0) return 0.;
+  if (structureDirty_) BuildStructure();
+
+  for (size_t it=0; it<maxIt; ++it) {
+    size_t numRelin = 0;
+    for (auto& f : factors_) {
+      if (f.dirty || poseDirty_[f.idA] || poseDirty_[f.idB]) {
+        Linearize(f);
+        f.dirty = false;
+        numRelin ++;
+      }
+    }
+    std::fill(poseDirty_.begin(), poseDirty_.end(), false);
+
+    std::fill(H_.valuePtr(), H_.valuePtr()+H_.nonZeros(), 0.);
+    g_.setZero();
+    double chi2 = 0.;
+    for (const auto& f : factors_) {
+      AddBlock(f.idA, f.idA, f.H_aa);
+      g_.segment<6>(6*f.idA) += f.g_a;
+      chi2 += f.chi2;
+      if (f.prior) continue;
+      AddBlock(f.idB, f.idB, f.H_bb);
+      g_.segment<6>(6*f.idB) += f.g_b;
+      if (f.idA > f.idB)
+        AddBlock(f.idA, f.idB, f.H_ab);
+      else
+        AddBlock(f.idB, f.idA, f.H_ab.transpose());
+    }
+    for (size_t i=0; i<T_wk_.size(); ++i)
+      for (size_t c=0; c<6; ++c)
+        H_.valuePtr()[H_.outerIndexPtr()[6*i+c] + BlockOffset(i,i) + c]
+          += lambda_;
+
+    ldlt_.factorize(H_);
+    if (ldlt_.info() != Eigen::Success) {
+      std::cerr << "PoseGraph: factorization failed; "
+        << "is the gauge fixed by a prior?" << std::endl;
+      return chi2;
+    }
+    const Eigen::VectorXd dx = -ldlt_.solve(g_);
+
+    double dxMax = 0.;
+    size_t numUpdated = 0;
+    for (size_t i=0; i<T_wk_.size(); ++i) {
+      const Eigen::Matrix<double,6,1> dxi = dx.segment<6>(6*i);
+      const double dxNorm = dxi.norm();
+      dxMax = std::max(dxMax, dxNorm);
+      if (dxNorm <= relinThr_) continue;
+      T_wk_[i] = T_wk_[i]*SE3d(SO3d::Exp_(dxi.head<3>()),
+          Eigen::Vector3d(dxi.tail<3>()));
+      poseDirty_[i] = true;
+      numUpdated ++;
+    }
+    if (verbose_)
+      std::cout << "PoseGraph it " << it << ": chi2=" << chi2
+        << " relinearized " << numRelin << "/" << factors_.size()
+        << " updated " << numUpdated << "/" << T_wk_.size()
+        << " |dx|max=" << dxMax << std::endl;
+    if (dxMax < epsilon_ || numUpdated == 0) break;
+  }
+  return Chi2();
+}
+
+}
@@ -0,0 +1,295 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <math.h>
+#include <tdp/cuda/cuda.h>
+#include <tdp/utils/batch.h>
+#include <tdp/slam/surfel_map.h>
+
+namespace tdp {
+
+void SurfelHash::Build(const std::vector<Vector4fda>& pr) {
+  // counting sort of (cell, surfel) entries into contiguous cell ranges
+  std::vector<std::pair<uint64_t,uint32_t>> keys;
+  keys.reserve(pr.size()+pr.size()/2);
+  cells_.clear();
+  const float rMax = 0.5*cellSize_;
+  for (size_t i=0; i<pr.size(); ++i) {
+    const Vector3fda p = pr[i].head<3>();
+    if (!IsValidData(p)) continue;
+    // insert into all cells overlapped by the bounding box of the disc
+    // so that rays passing close to a cell corner still see the surfel
+    const float r = std::isfinite(pr[i](3)) ? std::min(pr[i](3), rMax)
+      : rMax;
+    const Eigen::Vector3i c0 = Cell(p - Vector3fda(r,r,r));
+    const Eigen::Vector3i c1 = Cell(p + Vector3fda(r,r,r));
+    for (int x=c0(0); x<=c1(0); ++x)
+      for (int y=c0(1); y<=c1(1); ++y)
+        for (int z=c0(2); z<=c1(2); ++z) {
+          const uint64_t key = Key(Eigen::Vector3i(x,y,z));
+          keys.emplace_back(key, i);
+          cells_[key].second ++;
+        }
+  }
+  uint32_t offset = 0;
+  for (auto& cell : cells_) {
+    cell.second.first = offset;
+    offset += cell.second.second;
+    cell.second.second = cell.second.first;
+  }
+  ids_.resize(keys.size());
+  pr_.resize(keys.size());
+  for (const auto& key : keys) {
+    const uint32_t j = cells_[key.first].second++;
+    const Vector4fda& pri = pr[key.second];
+    ids_[j] = key.second;
+    pr_[j] = Vector4fda(pri(0), pri(1), pri(2),
+        std::isfinite(pri(3)) && pri(3) > 0.f ? pri(3) : rMax);
+  }
+}
+
+SurfelMapMaintenance::SurfelMapMaintenance(CircularBuffer<Plane>& pl_w,
+    float cellSize)
+  : survivalTime_(100), pruneHThr_(-7.5), pruneNumObsThr_(10),
+  prune_(true), carveNumSigma_(3.), carveMargin_(0.02),
+  carveVotesThr_(3), compactFraction_(0.1), compactMin_(10000),
+  pl_w_(pl_w), votes_(pl_w.w_, 0), hash_(cellSize), cellSize_(cellSize),
+  firstDead_(0), numPruned_(0), numCarved_(0), numCompactions_(0),
+  numDead_(0), numHashed_(0), frame_(0), update_(false), stop_(false) {
+  worker_ = std::thread(&SurfelMapMaintenance::Worker, this);
+}
+
+SurfelMapMaintenance::~SurfelMapMaintenance() {
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+}
+
+void SurfelMapMaintenance::Update(int32_t frame) {
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    frame_ = frame;
+    update_ = true;
+  }
+  cv_.notify_all();
+}
+
+void SurfelMapMaintenance::Worker() {
+  while (true) {
+    int32_t frame = 0;
+    {
+      std::unique_lock<std::mutex> lock(mut_);
+      cv_.wait(lock, [&]{ return update_ || stop_; });
+      if (stop_) return;
+      update_ = false;
+      frame = frame_;
+    }
+    // snapshot of the valid surfels; the hash is built without holding
+    // workMut_
+    std::vector<Vector4fda> pr;
+    size_t N = 0;
+    size_t numCompactions = 0;
+    {
+      std::lock_guard<std::mutex> work(workMut_);
+      numCompactions = numCompactions_;
+      N = pl_w_.SizeToRead();
+      Prune(N, frame);
+      pr.resize(N);
+      for (size_t i=0; i<N; ++i) {
+        const Plane& pl = pl_w_.GetCircular(i);
+        pr[i] = pl.valid_ ? Vector4fda(pl.p_(0), pl.p_(1), pl.p_(2), pl.r_)
+          : Vector4fda(NAN,NAN,NAN,NAN);
+      }
+    }
+    SurfelHash hash(cellSize_);
+    hash.Build(pr);
+    std::lock_guard<std::mutex> lock(hashMut_);
+    // the ids of the snapshot are stale if the map was compacted in the
+    // meantime; EndCompaction() requested a new pass
+    if (numCompactions_ != numCompactions) continue;
+    std::swap(hash_, hash);
+    numHashed_ = N;
+  }
+}
+
+void SurfelMapMaintenance::Prune(size_t N, int32_t frame) {
+  size_t numDead = 0;
+  for (size_t i=0; i<N; ++i) {
+    Plane& pl = pl_w_.GetCircular(i);
+    if (prune_ && pl.valid_
+        && pl.lastFrame_+survivalTime_ < frame
+        && pl.Hp_ > pruneHThr_ && pl.numObs_ < pruneNumObsThr_) {
+      pl.valid_ = false;
+      numPruned_ ++;
+    }
+    if (!pl.valid_) numDead ++;
+  }
+  std::lock_guard<std::mutex> lock(mut_);
+  numDead_ = numDead;
+}
+
+size_t SurfelMapMaintenance::CarveFreeSpace(const Image<Vector3fda>& pc_c,
+    const SE3f& T_wc, int32_t frame, float dMin, size_t stride,
+    size_t numThreads) {
+  std::unique_lock<std::mutex> lock(hashMut_);
+  if (hash_.NumEntries() == 0 || stride == 0) return 0;
+  const size_t numHashed = numHashed_;
+  const Eigen::Vector3f o = T_wc.translation();
+  const Eigen::Matrix3f R_wc = T_wc.rotation().matrix();
+  const size_t numRows = (pc_c.h_+stride-1)/stride;
+  std::mutex hitsMut;
+  std::vector<uint32_t> hits;
+  ForEachBlock(numRows, 1, numThreads, [&](size_t r0, size_t r1) {
+    std::vector<uint32_t> hitsLocal;
+    for (size_t r=r0; r<r1; ++r) {
+      const Vector3fda* pcRow = pc_c.RowPtr(r*stride);
+      for (size_t u=0; u<pc_c.w_; u+=stride) {
+        const Vector3fda& p = pcRow[u];
+        if (!IsValidData(p) || p(2) <= dMin) continue;
+        const float range = p.norm();
+        const Eigen::Vector3f dir = R_wc*(p/range);
+        // axial noise model of Nguyen et al. scaled to range
+        const float sigma = 0.0012 + 0.0019*(p(2)-0.4)*(p(2)-0.4);
+        const float tMax = range - (carveNumSigma_*sigma + carveMargin_)
+          *range/p(2);
+        // visit all cells along the ray from dMin to tMax (3D DDA)
+        const Vector3fda p0 = o + dMin*dir;
+        Eigen::Vector3i c = hash_.Cell(p0);
+        Eigen::Vector3i step;
+        Eigen::Vector3f tNext, tDelta;
+        for (int d=0; d<3; ++d) {
+          step(d) = dir(d) < 0.f ? -1 : 1;
+          tDelta(d) = dir(d) != 0.f ? cellSize_/fabs(dir(d)) : INFINITY;
+          const float border = (c(d) + (dir(d) < 0.f ? 0 : 1))*cellSize_;
+          tNext(d) = dir(d) != 0.f ? dMin + (border - p0(d))/dir(d)
+            : INFINITY;
+        }
+        for (float t=dMin; t<tMax; ) {
+          hash_.ForEachInCell(SurfelHash::Key(c),
+            [&](uint32_t id, const Vector4fda& pr) {
+              const Eigen::Vector3f q = pr.head<3>() - o;
+              const float tq = q.dot(dir);
+              if (tq < dMin || tq > tMax) return;
+              if ((q-tq*dir).squaredNorm() < pr(3)*pr(3))
+                hitsLocal.push_back(id);
+            });
+          int d = 0;
+          tNext.minCoeff(&d);
+          t = tNext(d);
+          c(d) += step(d);
+          tNext(d) += tDelta(d);
+        }
+      }
+    }
+    std::lock_guard<std::mutex> lockHits(hitsMut);
+    hits.insert(hits.end(), hitsLocal.begin(), hitsLocal.end());
+  }, 64);
+  lock.unlock();
+  // one vote per surfel and frame
+  std::sort(hits.begin(), hits.end());
+  hits.erase(std::unique(hits.begin(), hits.end()), hits.end());
+  // the worker prunes the same flags
+  std::lock_guard<std::mutex> work(workMut_);
+  size_t numCarved = 0;
+  for (uint32_t id : hits) {
+    if (id >= numHashed) continue;
+    Plane& pl = pl_w_.GetCircular(id);
+    if (!pl.valid_) continue;
+    uint8_t& votes = votes_[(pl_w_.iRead_+id)%pl_w_.w_];
+    if (pl.lastFrame_ == (uint16_t)frame) {
+      votes = 0;
+      continue;
+    }
+    if (++votes >= carveVotesThr_) {
+      pl.valid_ = false;
+      numCarved ++;
+    }
+  }
+  numCarved_ += numCarved;
+  return numCarved;
+}
+
+bool SurfelMapMaintenance::CompactionPending() {
+  std::lock_guard<std::mutex> lock(mut_);
+  const size_t N = pl_w_.SizeToRead();
+  return numDead_ >= compactMin_ && numDead_ > compactFraction_*N;
+}
+
+size_t SurfelMapMaintenance::BeginCompaction() {
+  workMut_.lock();
+  const int32_t N = pl_w_.SizeToRead();
+  remap_.resize(N);
+  liveBefore_.resize(N+1);
+  liveBefore_[0] = 0;
+  firstDead_ = N;
+  for (int32_t i=0; i<N; ++i) {
+    const bool live = pl_w_.GetCircular(i).valid_;
+    remap_[i] = live ? liveBefore_[i] : -1;
+    liveBefore_[i+1] = liveBefore_[i] + (live ? 1 : 0);
+    if (!live && firstDead_ == N) firstDead_ = i;
+  }
+  const int32_t numLive = liveBefore_[N];
+  for (int32_t i=firstDead_; i<N; ++i) {
+    const size_t iOld = (pl_w_.iRead_+i)%pl_w_.w_;
+    if (remap_[i] >= 0)
+      votes_[(pl_w_.iRead_+remap_[i])%pl_w_.w_] = votes_[iOld];
+  }
+  for (int32_t i=numLive; i<N; ++i)
+    votes_[(pl_w_.iRead_+i)%pl_w_.w_] = 0;
+  Plane dead;
+  dead.valid_ = false;
+  dead.p_ = Vector3fda(NAN,NAN,NAN);
+  dead.n_ = Vector3fda(NAN,NAN,NAN);
+  Compact(pl_w_, dead);
+  {
+    // counted under hashMut_ so that the worker cannot install a hash
+    // of the old ids after it was cleared
+    std::lock_guard<std::mutex> lock(hashMut_);
+    hash_.Clear();
+    numHashed_ = 0;
+    numCompactions_ ++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    numDead_ = 0;
+  }
+  return numLive;
+}
+
+void SurfelMapMaintenance::EndCompaction() {
+  workMut_.unlock();
+  {
+    std::lock_guard<std::mutex> lock(mut_);
+    update_ = true;
+  }
+  cv_.notify_all();
+}
+
+int32_t SurfelMapMaintenance::RemapCount(int32_t n) const {
+  if (liveBefore_.empty() || n <= 0) return 0;
+  return liveBefore_[std::min<int32_t>(n, liveBefore_.size()-1)];
+}
+
+void SurfelMapMaintenance::RemapPairs(
+    std::vector<std::pair<int32_t,int32_t>>& pairs, size_t stride) const {
+  const int32_t N = std::min<int32_t>(pairs.size()/stride, remap_.size());
+  for (int32_t i=firstDead_; i<N; ++i) {
+    if (remap_[i] < 0) continue;
+    for (size_t k=0; k<stride; ++k)
+      pairs[remap_[i]*stride+k] = pairs[i*stride+k];
+  }
+  const int32_t numLive = RemapCount(N);
+  for (size_t i=0; i<pairs.size(); ++i) {
+    if ((int32_t)(i/stride) < numLive) {
+      pairs[i].first = Remap(pairs[i].first);
+      pairs[i].second = Remap(pairs[i].second);
+    } else {
+      pairs[i] = std::make_pair(-1,-1);
+    }
+  }
+}
+
+}
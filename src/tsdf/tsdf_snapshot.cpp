@@ -0,0 +1,431 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <tdp/tsdf/tsdf_snapshot.h>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tdp/utils/parallel_for.h>
+
+namespace tdp {
+
+namespace {
+
+const char SNAPSHOT_MAGIC[8] = {'T','D','P','T','S','D','F','\0'};
+/// f (float), w (float), r, g, b
+const size_t BYTES_PER_VOXEL = 11;
+const uint32_t CODEC_SHUFFLE = 0;
+const uint32_t CODEC_SHUFFLE_RLE = 1;
+/// magic, version, brick size, w,h,d, grid0, dGrid, R, t, #bricks,
+/// index offset
+const size_t HEADER_BYTES = 8 + 2*4 + 3*8 + 6*4 + 12*4 + 2*8;
+const size_t INDEX_ENTRY_BYTES = 4*4 + 2*8;
+
+template<typename T>
+void Put(std::vector<uint8_t>& buf, const T& val) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(&val);
+  buf.insert(buf.end(), p, p+sizeof(T));
+}
+
+template<typename T>
+T Get(const uint8_t*& p) {
+  T val;
+  std::memcpy(&val, p, sizeof(T));
+  p += sizeof(T);
+  return val;
+}
+
+struct BrickExtent {
+  size_t u0, v0, d0;
+  size_t nu, nv, nd;
+  size_t Vol() const { return nu*nv*nd; }
+};
+
+BrickExtent GetBrickExtent(const Volume<TSDFval>& tsdf,
+    size_t bx, size_t by, size_t bz) {
+  const size_t B = TSDFSnapshot::BrickSize;
+  BrickExtent e;
+  e.u0 = bx*B; e.v0 = by*B; e.d0 = bz*B;
+  e.nu = std::min(B, tsdf.w_-e.u0);
+  e.nv = std::min(B, tsdf.h_-e.v0);
+  e.nd = std::min(B, tsdf.d_-e.d0);
+  return e;
+}
+
+bool IsObserved(const Volume<TSDFval>& tsdf, const BrickExtent& e) {
+  for (size_t d=e.d0; d<e.d0+e.nd; ++d)
+    for (size_t v=e.v0; v<e.v0+e.nv; ++v) {
+      const TSDFval* row = tsdf.RowPtr(v,d);
+      for (size_t u=e.u0; u<e.u0+e.nu; ++u)
+        if (row[u].w > 0.f) return true;
+    }
+  return false;
+}
+
+/// Gather the brick into byte planes: all first bytes of f, all second
+/// bytes of f, ... all b values. Similar voxels then yield long runs.
+void ShuffleBrick(const Volume<TSDFval>& tsdf, const BrickExtent& e,
+    std::vector<uint8_t>& planes) {
+  const size_t N = e.Vol();
+  planes.resize(N*BYTES_PER_VOXEL);
+  uint8_t* p = &planes[0];
+  size_t i = 0;
+  for (size_t d=e.d0; d<e.d0+e.nd; ++d)
+    for (size_t v=e.v0; v<e.v0+e.nv; ++v) {
+      const TSDFval* row = tsdf.RowPtr(v,d);
+      for (size_t u=e.u0; u<e.u0+e.nu; ++u, ++i) {
+        uint8_t fw[8];
+        std::memcpy(fw, &row[u].f, 4);
+        std::memcpy(fw+4, &row[u].w, 4);
+        for (size_t k=0; k<8; ++k) p[k*N+i] = fw[k];
+        p[8*N+i] = row[u].r;
+        p[9*N+i] = row[u].g;
+        p[10*N+i] = row[u].b;
+      }
+    }
+}
+
+void UnshuffleBrick(const uint8_t* p, const BrickExtent& e,
+    Volume<TSDFval>& tsdf) {
+  const size_t N = e.Vol();
+  size_t i = 0;
+  for (size_t d=e.d0; d<e.d0+e.nd; ++d)
+    for (size_t v=e.v0; v<e.v0+e.nv; ++v) {
+      TSDFval* row = tsdf.RowPtr(v,d);
+      for (size_t u=e.u0; u<e.u0+e.nu; ++u, ++i) {
+        uint8_t fw[8];
+        for (size_t k=0; k<8; ++k) fw[k] = p[k*N+i];
+        std::memcpy(&row[u].f, fw, 4);
+        std::memcpy(&row[u].w, fw+4, 4);
+        row[u].r = p[8*N+i];
+        row[u].g = p[9*N+i];
+        row[u].b = p[10*N+i];
+      }
+    }
+}
+
+/// Run-length encoding: control byte c < 128 is followed by c+1 literal
+/// bytes; c >= 128 is followed by one byte repeated c-125 times.
+void EncodeRLE(const std::vector<uint8_t>& in, std::vector<uint8_t>& out) {
+  const size_t n = in.size();
+  out.clear();
+  out.reserve(n/4);
+  size_t i = 0;
+  size_t litStart = 0;
+  while (i < n) {
+    size_t run = 1;
+    while (i+run < n && run < 130 && in[i+run] == in[i]) ++run;
+    if (run >= 3) {
+      while (litStart < i) {
+        size_t len = std::min<size_t>(128, i-litStart);
+        out.push_back(uint8_t(len-1));
+        out.insert(out.end(), in.begin()+litStart, in.begin()+litStart+len);
+        litStart += len;
+      }
+      out.push_back(uint8_t(run+125));
+      out.push_back(in[i]);
+      i += run;
+      litStart = i;
+    } else {
+      i += run;
+    }
+  }
+  while (litStart < n) {
+    size_t len = std::min<size_t>(128, n-litStart);
+    out.push_back(uint8_t(len-1));
+    out.insert(out.end(), in.begin()+litStart, in.begin()+litStart+len);
+    litStart += len;
+  }
+}
+
+bool DecodeRLE(const uint8_t* in, size_t bytes, uint8_t* out, size_t n) {
+  const uint8_t* end = in+bytes;
+  size_t j = 0;
+  while (in < end) {
+    uint8_t c = *in++;
+    if (c < 128) {
+      size_t len = size_t(c)+1;
+      if (in+len > end || j+len > n) return false;
+      std::memcpy(out+j, in, len);
+      in += len;
+      j += len;
+    } else {
+      size_t len = size_t(c)-125;
+      if (in >= end || j+len > n) return false;
+      std::memset(out+j, *in++, len);
+      j += len;
+    }
+  }
+  return j == n;
+}
+
+}
+
+const uint32_t TSDFSnapshot::Version;
+const uint32_t TSDFSnapshot::BrickSize;
+
+TSDFSnapshot::TSDFSnapshot()
+  : w_(0), h_(0), d_(0), fd_(-1), data_(nullptr), size_(0)
+{}
+
+TSDFSnapshot::~TSDFSnapshot() {
+  Close();
+}
+
+void TSDFSnapshot::Close() {
+  if (data_) munmap(const_cast<uint8_t*>(data_), size_);
+  if (fd_ >= 0) close(fd_);
+  data_ = nullptr;
+  size_ = 0;
+  fd_ = -1;
+  bricks_.clear();
+}
+
+bool TSDFSnapshot::IsSnapshot(const std::string& path) {
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  char magic[8];
+  if (!in.is_open() || !in.read(magic, 8))
+    return false;
+  return std::memcmp(magic, SNAPSHOT_MAGIC, 8) == 0;
+}
+
+bool TSDFSnapshot::Open(const std::string& path) {
+  Close();
+  fd_ = open(path.c_str(), O_RDONLY);
+  if (fd_ < 0) return false;
+  struct stat st;
+  if (fstat(fd_, &st) != 0 || (size_t)st.st_size < HEADER_BYTES) {
+    Close();
+    return false;
+  }
+  size_ = st.st_size;
+  void* ptr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (ptr == MAP_FAILED) {
+    data_ = nullptr;
+    Close();
+    return false;
+  }
+  data_ = static_cast<const uint8_t*>(ptr);
+
+  const uint8_t* p = data_;
+  if (std::memcmp(p, SNAPSHOT_MAGIC, 8) != 0) {
+    Close();
+    return false;
+  }
+  p += 8;
+  uint32_t version = Get<uint32_t>(p);
+  uint32_t brickSize = Get<uint32_t>(p);
+  if (version > Version || brickSize != BrickSize) {
+    std::cerr << "unsupported TSDF snapshot version " << version
+      << " brick size " << brickSize << std::endl;
+    Close();
+    return false;
+  }
+  w_ = Get<uint64_t>(p);
+  h_ = Get<uint64_t>(p);
+  d_ = Get<uint64_t>(p);
+  for (size_t i=0; i<3; ++i) grid0_(i) = Get<float>(p);
+  for (size_t i=0; i<3; ++i) dGrid_(i) = Get<float>(p);
+  Eigen::Matrix3f R;
+  Eigen::Vector3f t;
+  for (size_t i=0; i<3; ++i)
+    for (size_t j=0; j<3; ++j)
+      R(i,j) = Get<float>(p);
+  for (size_t i=0; i<3; ++i) t(i) = Get<float>(p);
+  T_wG_ = SE3f(R,t);
+  uint64_t numBricks = Get<uint64_t>(p);
+  uint64_t indexOffset = Get<uint64_t>(p);
+  if (indexOffset + numBricks*INDEX_ENTRY_BYTES > size_) {
+    Close();
+    return false;
+  }
+  p = data_+indexOffset;
+  bricks_.resize(numBricks);
+  for (auto& brick : bricks_) {
+    brick.bx = Get<uint32_t>(p);
+    brick.by = Get<uint32_t>(p);
+    brick.bz = Get<uint32_t>(p);
+    brick.codec = Get<uint32_t>(p);
+    brick.offset = Get<uint64_t>(p);
+    brick.bytes = Get<uint64_t>(p);
+    if (brick.offset+brick.bytes > size_) {
+      Close();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TSDFSnapshot::LoadBrick(size_t i, Volume<TSDFval>& tsdf) const {
+  if (!data_ || i >= bricks_.size()
+      || tsdf.w_ != w_ || tsdf.h_ != h_ || tsdf.d_ != d_)
+    return false;
+  const TSDFBrickIndex& brick = bricks_[i];
+  BrickExtent e = GetBrickExtent(tsdf, brick.bx, brick.by, brick.bz);
+  const uint8_t* payload = data_+brick.offset;
+  if (brick.codec == CODEC_SHUFFLE) {
+    if (brick.bytes != e.Vol()*BYTES_PER_VOXEL) return false;
+    UnshuffleBrick(payload, e, tsdf);
+    return true;
+  } else if (brick.codec == CODEC_SHUFFLE_RLE) {
+    std::vector<uint8_t> planes(e.Vol()*BYTES_PER_VOXEL);
+    if (!DecodeRLE(payload, brick.bytes, &planes[0], planes.size()))
+      return false;
+    UnshuffleBrick(&planes[0], e, tsdf);
+    return true;
+  }
+  std::cerr << "unknown TSDF brick codec " << brick.codec << std::endl;
+  return false;
+}
+
+bool TSDFSnapshot::Load(ManagedHostVolume<TSDFval>& tsdf,
+    size_t numThreads) const {
+  if (!data_) return false;
+  tsdf.Reinitialize(w_, h_, d_);
+  const size_t B = BrickSize;
+  const size_t nbx = (w_+B-1)/B, nby = (h_+B-1)/B, nbz = (d_+B-1)/B;
+  const size_t numAll = nbx*nby*nbz;
+  // -1 marks bricks that are not stored and need to be reset.
+  std::vector<int64_t> stored(numAll, -1);
+  for (size_t i=0; i<bricks_.size(); ++i) {
+    const TSDFBrickIndex& b = bricks_[i];
+    if (b.bx >= nbx || b.by >= nby || b.bz >= nbz) return false;
+    stored[(b.bz*nby+b.by)*nbx+b.bx] = i;
+  }
+  std::atomic<bool> ok(true);
+  ParallelFor(numAll, 1, [&](size_t j0, size_t j1) {
+    for (size_t j=j0; j<j1; ++j) {
+      if (stored[j] >= 0) {
+        if (!LoadBrick(stored[j], tsdf)) ok = false;
+      } else {
+        BrickExtent e = GetBrickExtent(tsdf, j%nbx, (j/nbx)%nby,
+            j/(nbx*nby));
+        for (size_t d=e.d0; d<e.d0+e.nd; ++d)
+          for (size_t v=e.v0; v<e.v0+e.nv; ++v)
+            std::fill(tsdf.RowPtr(v,d)+e.u0, tsdf.RowPtr(v,d)+e.u0+e.nu,
+                TSDFval());
+      }
+    }
+  }, numThreads);
+  return ok;
+}
+
+bool TSDFSnapshot::Save(const std::string& path,
+    const Volume<TSDFval>& tsdf,
+    const Vector3fda& grid0, const Vector3fda& dGrid,
+    const SE3f& T_wG, size_t numThreads) {
+  const size_t B = BrickSize;
+  const size_t nbx = (tsdf.w_+B-1)/B;
+  const size_t nby = (tsdf.h_+B-1)/B;
+  const size_t nbz = (tsdf.d_+B-1)/B;
+  const size_t numAll = nbx*nby*nbz;
+
+  // compress all observed bricks in parallel; only the compressed
+  // payloads are held in memory.
+  std::vector<std::vector<uint8_t>> payloads(numAll);
+  std::vector<uint32_t> codecs(numAll, CODEC_SHUFFLE);
+  std::vector<uint8_t> observed(numAll, 0);
+  ParallelFor(numAll, 8, [&](size_t j0, size_t j1) {
+    std::vector<uint8_t> planes;
+    for (size_t j=j0; j<j1; ++j) {
+      BrickExtent e = GetBrickExtent(tsdf, j%nbx, (j/nbx)%nby,
+          j/(nbx*nby));
+      if (!IsObserved(tsdf, e)) continue;
+      observed[j] = 1;
+      ShuffleBrick(tsdf, e, planes);
+      EncodeRLE(planes, payloads[j]);
+      if (payloads[j].size() < planes.size()) {
+        codecs[j] = CODEC_SHUFFLE_RLE;
+        payloads[j].shrink_to_fit();
+      } else {
+        payloads[j].swap(planes);
+      }
+    }
+  }, numThreads);
+
+  std::vector<TSDFBrickIndex> index;
+  uint64_t offset = HEADER_BYTES;
+  for (size_t j=0; j<numAll; ++j) {
+    if (!observed[j]) continue;
+    TSDFBrickIndex brick;
+    brick.bx = j%nbx;
+    brick.by = (j/nbx)%nby;
+    brick.bz = j/(nbx*nby);
+    brick.codec = codecs[j];
+    brick.offset = offset;
+    brick.bytes = payloads[j].size();
+    offset += brick.bytes;
+    index.push_back(brick);
+  }
+
+  std::vector<uint8_t> header;
+  header.insert(header.end(), SNAPSHOT_MAGIC, SNAPSHOT_MAGIC+8);
+  Put<uint32_t>(header, Version);
+  Put<uint32_t>(header, BrickSize);
+  Put<uint64_t>(header, tsdf.w_);
+  Put<uint64_t>(header, tsdf.h_);
+  Put<uint64_t>(header, tsdf.d_);
+  for (size_t i=0; i<3; ++i) Put<float>(header, grid0(i));
+  for (size_t i=0; i<3; ++i) Put<float>(header, dGrid(i));
+  Eigen::Matrix3f R = T_wG.rotation().matrix();
+  for (size_t i=0; i<3; ++i)
+    for (size_t j=0; j<3; ++j)
+      Put<float>(header, R(i,j));
+  for (size_t i=0; i<3; ++i) Put<float>(header, T_wG.translation()(i));
+  Put<uint64_t>(header, index.size());
+  Put<uint64_t>(header, offset);
+  assert(header.size() == HEADER_BYTES);
+
+  std::vector<uint8_t> indexBytes;
+  indexBytes.reserve(index.size()*INDEX_ENTRY_BYTES);
+  for (auto& brick : index) {
+    Put<uint32_t>(indexBytes, brick.bx);
+    Put<uint32_t>(indexBytes, brick.by);
+    Put<uint32_t>(indexBytes, brick.bz);
+    Put<uint32_t>(indexBytes, brick.codec);
+    Put<uint64_t>(indexBytes, brick.offset);
+    Put<uint64_t>(indexBytes, brick.bytes);
+  }
+
+  std::ofstream out(path, std::ios::out | std::ios::binary);
+  if (!out.is_open()) return false;
+  out.write((const char*)&header[0], header.size());
+  for (size_t j=0; j<numAll; ++j)
+    if (observed[j] && payloads[j].size() > 0)
+      out.write((const char*)&payloads[j][0], payloads[j].size());
+  if (indexBytes.size() > 0)
+    out.write((const char*)&indexBytes[0], indexBytes.size());
+  out.close();
+  return !out.fail();
+}
+
+bool TSDF::SaveTSDFSnapshot(const Volume<TSDFval>& tsdf,
+      Vector3fda grid0, Vector3fda dGrid,
+      const SE3f& T_wG,
+      const std::string& path) {
+  return TSDFSnapshot::Save(path, tsdf, grid0, dGrid, T_wG);
+}
+
+bool TSDF::LoadTSDFSnapshot(const std::string& path,
+      ManagedHostVolume<TSDFval>& tsdf,
+      SE3f& T_wG,
+      Vector3fda& grid0, Vector3fda& dGrid) {
+  TSDFSnapshot snapshot;
+  if (!snapshot.Open(path) || !snapshot.Load(tsdf))
+    return false;
+  T_wG = snapshot.T_wG_;
+  grid0 = snapshot.grid0_;
+  dGrid = snapshot.dGrid_;
+  return true;
+}
+
+bool TSDF::IsTSDFSnapshot(const std::string& path) {
+  return TSDFSnapshot::IsSnapshot(path);
+}
+
+}
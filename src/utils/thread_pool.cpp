@@ -0,0 +1,178 @@
+/* Copyright (c) 2016, Julian Straub <jstraub@csail.mit.edu> Licensed
+ * under the MIT license. See the license file LICENSE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <utility>
+#include <tdp/utils/thread_pool.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace tdp {
+
+namespace {
+
+std::atomic<size_t> maxConcurrency(0);
+std::atomic<bool> pinGlobal(false);
+
+// pool and worker index of the calling thread if it is a worker
+thread_local ThreadPool* workerPool = nullptr;
+thread_local size_t workerId = 0;
+
+#ifdef __linux__
+/// Cores the process may run on, grouped by socket so that neighbouring
+/// workers share a memory node.
+std::vector<int> AllowedCpus() {
+  std::vector<std::pair<int,int>> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    return std::vector<int>();
+  for (int c=0; c<CPU_SETSIZE; ++c) {
+    if (!CPU_ISSET(c, &set)) continue;
+    int socket = 0;
+    char path[128];
+    snprintf(path, sizeof(path),
+        "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", c);
+    FILE* f = fopen(path, "r");
+    if (f) {
+      if (fscanf(f, "%d", &socket) != 1) socket = 0;
+      fclose(f);
+    }
+    cpus.push_back(std::make_pair(socket, c));
+  }
+  std::stable_sort(cpus.begin(), cpus.end());
+  std::vector<int> ids;
+  for (auto& cpu : cpus) ids.push_back(cpu.second);
+  return ids;
+}
+#endif
+
+}
+
+ThreadPool::ThreadPool(size_t numWorkers, bool pin)
+  : numPending_(0), stop_(false) {
+  for (size_t i=0; i<numWorkers+1; ++i)
+    queues_.emplace_back(new Queue);
+  for (size_t i=0; i<numWorkers; ++i)
+    workers_.push_back(std::thread(&ThreadPool::Worker, this, i, pin));
+}
+
+ThreadPool::~ThreadPool() {
+  stop_ = true;
+  Notify();
+  for (auto& worker : workers_) worker.join();
+}
+
+ThreadPool& ThreadPool::Global() {
+  // never destroyed so that it outlives all static objects using it
+  static ThreadPool* pool = new ThreadPool(MaxConcurrency()-1,
+      pinGlobal.load());
+  return *pool;
+}
+
+void ThreadPool::SetMaxConcurrency(size_t numThreads) {
+  maxConcurrency = std::max<size_t>(1, numThreads);
+}
+
+size_t ThreadPool::MaxConcurrency() {
+  size_t n = maxConcurrency.load();
+  if (n > 0) return n;
+  const char* env = getenv("TDP_NUM_THREADS");
+  if (env && atoi(env) > 0) {
+    n = atoi(env);
+  } else {
+    n = std::max<size_t>(1, std::thread::hardware_concurrency());
+  }
+  size_t unset = 0;
+  maxConcurrency.compare_exchange_strong(unset, n);
+  return maxConcurrency.load();
+}
+
+void ThreadPool::SetPinning(bool pin) {
+  pinGlobal = pin;
+}
+
+void ThreadPool::Submit(Task task) {
+  Queue& q = workerPool == this ? *queues_[workerId] : *queues_.back();
+  // counted first so that the count never drops below the queued tasks
+  numPending_ ++;
+  {
+    std::lock_guard<std::mutex> lock(q.mut);
+    q.tasks.push_back(std::move(task));
+  }
+  Notify();
+}
+
+bool ThreadPool::RunOne() {
+  Task task;
+  if (!Pop(workerPool == this ? workerId : queues_.size()-1, task))
+    return false;
+  task();
+  return true;
+}
+
+bool ThreadPool::PopBack(Queue& q, Task& task) {
+  std::lock_guard<std::mutex> lock(q.mut);
+  if (q.tasks.empty()) return false;
+  task = std::move(q.tasks.back());
+  q.tasks.pop_back();
+  return true;
+}
+
+bool ThreadPool::PopFront(Queue& q, Task& task) {
+  std::lock_guard<std::mutex> lock(q.mut);
+  if (q.tasks.empty()) return false;
+  task = std::move(q.tasks.front());
+  q.tasks.pop_front();
+  return true;
+}
+
+bool ThreadPool::Pop(size_t id, Task& task) {
+  if (numPending_.load() == 0) return false;
+  const size_t numWorkers = queues_.size()-1;
+  // own tasks newest first, then the oldest ones of the shared queue and
+  // of the other workers
+  bool found = id < numWorkers && PopBack(*queues_[id], task);
+  if (!found) found = PopFront(*queues_.back(), task);
+  for (size_t i=1; !found && i<=numWorkers; ++i) {
+    const size_t j = (id+i) % (numWorkers+1);
+    if (j < numWorkers) found = PopFront(*queues_[j], task);
+  }
+  if (found) numPending_ --;
+  return found;
+}
+
+void ThreadPool::Worker(size_t id, bool pin) {
+  workerPool = this;
+  workerId = id;
+#ifdef __linux__
+  if (pin) {
+    const std::vector<int> cpus = AllowedCpus();
+    if (cpus.size() > 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      // the first core is left to the thread that created the pool
+      CPU_SET(cpus[(id+1) % cpus.size()], &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+  }
+#else
+  (void)pin;
+#endif
+  Task task;
+  while (!stop_) {
+    if (Pop(id, task)) {
+      task();
+      task = nullptr;
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(sleepMut_);
+    sleepCv_.wait(lock, [&]{ return stop_ || numPending_.load() > 0; });
+  }
+}
+
+}
@@ -4,7 +4,9 @@
 #include <tdp/manifold/SO3.h>
 #include <tdp/manifold/rotation.h>
 #include <tdp/manifold/SE3.h>
+#include <tdp/manifold/batch.h>
 
+#include <tdp/cuda/cuda.h>
 #include <tdp/data/managed_image.h>
 #include <tdp/eigen/dense.h>
 #include <tdp/preproc/pc.h>
@@ -268,6 +270,38 @@ TEST(SE3, gpu) {
 }
 #endif
 
+TEST(SE3, batchTransform) {
+  // wide enough to be split into several row chunks
+  ManagedHostImage<Vector3fda> x(5000,9);
+  ManagedHostImage<Vector3fda> y(5000,9);
+  for (size_t i=0; i<x.Area(); ++i)
+    x[i] = Vector3fda::Random();
+  x[17](1) = NAN;
+  SE3f T = SE3f::Random(1., Eigen::Vector3f::Zero(), 1.);
+  TransformBatch(T, x, y);
+  for (size_t i=0; i<x.Area(); ++i) {
+    if (i == 17) {
+      ASSERT_FALSE(IsValidData(y[i]));
+    } else {
+      ASSERT_TRUE(IsAppox(y[i], T*x[i], 1e-5));
+    }
+  }
+  InverseTransformBatch(T, y, y);
+  for (size_t i=0; i<x.Area(); ++i)
+    if (i != 17) ASSERT_TRUE(IsAppox(y[i], x[i], 1e-5));
+
+  std::vector<Eigen::Matrix<float,6,1>> w(2000);
+  for (auto& wi : w) wi = 0.5*Eigen::Matrix<float,6,1>::Random();
+  std::vector<SE3f> Ts(w.size());
+  std::vector<Eigen::Matrix<float,6,1>> wLog(w.size());
+  ExpBatch(w.data(), w.size(), Ts.data());
+  LogBatch(Ts.data(), Ts.size(), wLog.data());
+  for (size_t i=0; i<w.size(); ++i) {
+    ASSERT_TRUE(IsAppox(Ts[i].matrix(), SE3f::Exp_(w[i]).matrix(), 1e-6));
+    ASSERT_TRUE(IsAppox(wLog[i], SE3f::Log_(Ts[i]), 1e-6));
+  }
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
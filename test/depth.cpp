@@ -0,0 +1,112 @@
+#include <tdp/testing/testing.h>
+#include <math.h>
+#include <random>
+#include <tdp/camera/camera.h>
+#include <tdp/camera/ray.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/data/managed_pyramid.h>
+#include <tdp/preproc/depth.h>
+
+using namespace tdp;
+
+namespace {
+
+bool SameOrBothNan(float a, float b) {
+  return (a != a && b != b) || fabs(a-b) <= 1e-6f*fabs(a);
+}
+
+/// Per-pixel reference of ConvertDepthToPc: conversion, unprojection and
+/// NaN aware 2x2 averaging level by level.
+template<int LEVELS, class Scale>
+void ConvertDepthToPcReference(const Image<uint16_t>& dRaw, Scale scale,
+    float dMin, float dMax, const Image<Vector3fda>& ray,
+    Pyramid<float,LEVELS>& pyrD, Pyramid<Vector3fda,LEVELS>& pyrPc) {
+  Image<float> d = pyrD.GetImage(0);
+  Image<Vector3fda> pc = pyrPc.GetImage(0);
+  for (size_t v=0; v<d.h_; ++v)
+    for (size_t u=0; u<d.w_; ++u) {
+      const float di = scale(u, v, dRaw(u,v));
+      d(u,v) = (dMin < di && di < dMax) ? di : NAN;
+      pc(u,v) = ray(u,v)*d(u,v);
+    }
+  for (int lvl=1; lvl<LEVELS; ++lvl) {
+    Image<float> dIn = pyrD.GetImage(lvl-1);
+    Image<float> dOut = pyrD.GetImage(lvl);
+    Image<Vector3fda> pcIn = pyrPc.GetImage(lvl-1);
+    Image<Vector3fda> pcOut = pyrPc.GetImage(lvl);
+    for (size_t v=0; v<dOut.h_; ++v)
+      for (size_t u=0; u<dOut.w_; ++u) {
+        float dSum = 0.f, num = 0.f;
+        Vector3fda pcSum(0,0,0);
+        for (size_t k=0; k<4; ++k) {
+          const size_t uk = 2*u+k%2, vk = 2*v+k/2;
+          if (dIn(uk,vk) == dIn(uk,vk)) {
+            dSum += dIn(uk,vk);
+            pcSum += pcIn(uk,vk);
+            num ++;
+          }
+        }
+        dOut(u,v) = dSum/num;
+        pcOut(u,v) = pcSum/num;
+      }
+  }
+}
+
+template<int LEVELS>
+void ExpectSame(Pyramid<float,LEVELS>& pyrD, Pyramid<Vector3fda,LEVELS>& pyrPc,
+    Pyramid<float,LEVELS>& pyrDRef, Pyramid<Vector3fda,LEVELS>& pyrPcRef) {
+  for (int lvl=0; lvl<LEVELS; ++lvl) {
+    Image<float> d = pyrD.GetImage(lvl);
+    Image<float> dRef = pyrDRef.GetImage(lvl);
+    Image<Vector3fda> pc = pyrPc.GetImage(lvl);
+    Image<Vector3fda> pcRef = pyrPcRef.GetImage(lvl);
+    size_t numBad = 0;
+    for (size_t i=0; i<d.Area(); ++i) {
+      if (!SameOrBothNan(d[i], dRef[i])) numBad ++;
+      for (int j=0; j<3; ++j)
+        if (!SameOrBothNan(pc[i](j), pcRef[i](j))) numBad ++;
+    }
+    EXPECT_EQ(0, numBad) << "level " << lvl;
+  }
+}
+
+}
+
+TEST(depth, convertDepthToPc) {
+  const size_t w = 160, h = 120;
+  ManagedHostImage<uint16_t> dRaw(w,h);
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<int> raw(0, 6000);
+  for (size_t i=0; i<dRaw.Area(); ++i) dRaw[i] = raw(gen);
+  Cameraf cam(Eigen::Vector4f(150, 150, 79.5, 59.5));
+  ManagedHostImage<Vector3fda> ray(w,h);
+  ComputeCameraRaysCpu(cam, ray);
+  const float scale = 1e-3f, dMin = 0.1f, dMax = 4.f;
+
+  ManagedHostPyramid<float,3> pyrDRef(w,h);
+  ManagedHostPyramid<Vector3fda,3> pyrPcRef(w,h);
+  ConvertDepthToPcReference(dRaw,
+      [&](size_t, size_t, uint16_t r) { return r*scale; },
+      dMin, dMax, ray, pyrDRef, pyrPcRef);
+  for (size_t numThreads : {1, 3}) {
+    ManagedHostPyramid<float,3> pyrD(w,h);
+    ManagedHostPyramid<Vector3fda,3> pyrPc(w,h);
+    ConvertDepthToPc(dRaw, scale, dMin, dMax, ray, pyrD, pyrPc, numThreads);
+    ExpectSame(pyrD, pyrPc, pyrDRef, pyrPcRef);
+  }
+
+  // per-pixel scale and the depth dependent scale model
+  ManagedHostImage<float> scaleImg(w,h);
+  for (size_t i=0; i<scaleImg.Area(); ++i)
+    scaleImg[i] = 1e-3f*(0.9f + 0.2f*(i%7)/7.f);
+  const float a = 0.01f, b = 0.98f;
+  ConvertDepthToPcReference(dRaw,
+      [&](size_t u, size_t v, uint16_t r) {
+        const float di = r*scaleImg(u,v);
+        return di*(a*di + b);
+      }, dMin, dMax, ray, pyrDRef, pyrPcRef);
+  ManagedHostPyramid<float,3> pyrD(w,h);
+  ManagedHostPyramid<Vector3fda,3> pyrPc(w,h);
+  ConvertDepthToPc(dRaw, scaleImg, a, b, dMin, dMax, ray, pyrD, pyrPc, 2);
+  ExpectSame(pyrD, pyrPc, pyrDRef, pyrPcRef);
+}
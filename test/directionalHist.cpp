@@ -82,6 +82,56 @@ TEST(areas, GeoGrid3) {
   }
 }
 
+TEST(locate, GeoGrid4) {
+  GeodesicGrid<4> grid;
+  ASSERT_EQ(grid.tri_edges_.size(), grid.tri_.size()*3);
+  const size_t leaf0 = grid.tri_lvls_[grid.tri_lvls_.size()-2];
+  for (size_t k=0; k<1000; ++k) {
+    Vector3fda n = Vector3fda::Random();
+    n /= n.norm();
+    // brute force search for the leaf triangle containing n
+    uint32_t idBrute = 0;
+    float best = -2.;
+    for (size_t i=0; i<grid.NTri(); ++i) {
+      float score = GeodesicTriScore(n, &grid.tri_edges_[3*(leaf0+i)]);
+      if (score > best) {
+        best = score;
+        idBrute = i;
+      }
+    }
+    ASSERT_GT(best, -1e-6);
+    uint32_t id = grid.Locate(n);
+    ASSERT_GT(GeodesicTriScore(n, &grid.tri_edges_[3*(leaf0+id)]), -1e-6);
+    if (best > 1e-4) {
+      ASSERT_EQ(id, idBrute);
+    }
+  }
+}
+
+TEST(compute, GeoHist4) {
+  GeodesicGrid<4> grid;
+  ManagedHostImage<Vector3fda> n(64, 48);
+  for (size_t i=0; i<n.Area(); ++i) {
+    n[i] = Vector3fda::Random();
+    n[i] /= n[i].norm();
+  }
+  n[7] = Vector3fda(NAN,NAN,NAN);
+  Image<Vector3fda> triEdges(grid.tri_edges_.size(), 1,
+      &grid.tri_edges_[0], Storage::Cpu);
+  ManagedHostImage<uint32_t> hist(grid.NTri(), 1);
+  hist.Fill(0);
+  ComputeGeodesicHist(n, triEdges, 4, hist, 3);
+  std::vector<uint32_t> histRef(grid.NTri(), 0);
+  for (size_t i=0; i<n.Area(); ++i) 
+    if (IsValidData(n[i])) histRef[grid.Locate(n[i])] ++;
+  uint32_t sum = 0;
+  for (size_t i=0; i<grid.NTri(); ++i) {
+    ASSERT_EQ(hist[i], histRef[i]);
+    sum += hist[i];
+  }
+  ASSERT_EQ(sum, n.Area()-1);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
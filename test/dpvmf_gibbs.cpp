@@ -0,0 +1,234 @@
+#include <tdp/testing/testing.h>
+#include <math.h>
+#include <algorithm>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <vector>
+#include <tdp/data/managed_image.h>
+#include <tdp/sampling/dpvmf_gibbs.hpp>
+
+using namespace tdp;
+
+namespace {
+
+const int kD = 4;
+
+/// Unnormalized log probabilities of the labels of surfel i straight
+/// from the vMF densities and the cluster counts.
+void LogProbsReference(uint32_t i, const Image<Vector3fda>& n,
+    const Image<DpvmfLabelSampler<kD>::VectorNNida>& nn,
+    const Image<uint16_t>& z, const std::vector<vMF<float,3>>& vmfs,
+    const Image<Vector4fda>& ss, const vMFprior<float>& base,
+    float logAlpha, float lambdaMRF, std::vector<double>& logPdfs) {
+  const size_t K = vmfs.size();
+  logPdfs.assign(K+1, 0.);
+  for (size_t k=0; k<K; ++k) {
+    const double count = ss[k](3) - (z[i] == k ? 1. : 0.);
+    double mrf = 0.;
+    for (int d=0; d<kD; ++d) {
+      const int32_t j = nn[i][d];
+      mrf += lambdaMRF*((j > -1 && z[j] == k) ? 0. : -1.);
+    }
+    logPdfs[k] = log(count) + vmfs[k].logPdf(n[i]) + mrf;
+  }
+  logPdfs[K] = logAlpha + base.logMarginal(n[i]);
+}
+
+/// Surfels on a grid of width W with normals around three directions.
+/// Each surfel links to random grid neighbors (-1 for some); every
+/// tenth surfel is unlabeled (9999 as in sparseFusion).
+struct Scene {
+  Scene(size_t N, uint32_t seed) : n(N,1), nn(N,1), z(N,1), ss(100,1),
+    gen(seed) {
+    std::normal_distribution<float> gauss(0.f, 1.f);
+    const Vector3fda mus[3] = {Vector3fda(0,0,1), Vector3fda(1,0,0),
+      Vector3fda(0,-1,0)};
+    for (size_t k=0; k<3; ++k) vmfs.push_back(vMF<float,3>(mus[k], 30.f));
+    for (size_t i=0; i<N; ++i) {
+      const Vector3fda e(gauss(gen), gauss(gen), gauss(gen));
+      n[i] = (mus[(i/W)%3] + 0.3f*e).normalized();
+      z[i] = i%10 == 0 ? 9999 : (i/W)%3;
+    }
+    Relink();
+    Accumulate(ss);
+  }
+  /// Draw new neighbors so that the coloring has to be repaired.
+  void Relink() {
+    std::uniform_int_distribution<int32_t> offset(-2, 2);
+    const int32_t N = n.Area();
+    for (int32_t i=0; i<N; ++i)
+      for (int d=0; d<kD; ++d) {
+        const int32_t j = i + offset(gen) + W*offset(gen);
+        nn[i][d] = (j == i || j < 0 || j >= N || d == kD-1) ? -1 : j;
+      }
+  }
+  /// Sufficient statistics of the labels z.
+  void Accumulate(Image<Vector4fda>& ssRef) const {
+    ssRef.Fill(Vector4fda::Zero());
+    for (size_t i=0; i<z.Area(); ++i)
+      if (z[i] < vmfs.size())
+        ssRef[z[i]] += Vector4fda(n[i](0), n[i](1), n[i](2), 1.f);
+  }
+  static const int32_t W = 50;
+  ManagedHostImage<Vector3fda> n;
+  ManagedHostImage<DpvmfLabelSampler<kD>::VectorNNida> nn;
+  ManagedHostImage<uint16_t> z;
+  ManagedHostImage<Vector4fda> ss;
+  std::vector<vMF<float,3>> vmfs;
+  std::mutex vmfsLock;
+  std::mt19937 gen;
+};
+
+}
+
+TEST(dpvmfGibbs, cachedLogProbs) {
+  const size_t N = 2000;
+  std::mt19937 gen(1);
+  std::normal_distribution<float> gauss(0.f, 1.f);
+  std::uniform_int_distribution<int32_t> nnId(-1, N-1);
+  const Vector3fda mus[3] = {Vector3fda(0,0,1), Vector3fda(1,0,0),
+    Vector3fda(0,-1,0)};
+  ManagedHostImage<Vector3fda> n(N,1);
+  ManagedHostImage<DpvmfLabelSampler<kD>::VectorNNida> nn(N,1);
+  ManagedHostImage<uint16_t> z(N,1);
+  ManagedHostImage<Vector4fda> ss(100,1);
+  ss.Fill(Vector4fda::Zero());
+  std::vector<vMF<float,3>> vmfs;
+  for (size_t k=0; k<3; ++k) vmfs.push_back(vMF<float,3>(mus[k], 30.f));
+  // an empty cluster with an almost uniform density
+  vmfs.push_back(vMF<float,3>(mus[0], 0.f));
+  for (size_t i=0; i<N; ++i) {
+    const Vector3fda e(gauss(gen), gauss(gen), gauss(gen));
+    n[i] = (mus[i%3] + 0.2f*e).normalized();
+    z[i] = i%3;
+    ss[z[i]] += Vector4fda(n[i](0), n[i](1), n[i](2), 1.f);
+    for (int d=0; d<kD; ++d) nn[i][d] = nnId(gen);
+  }
+  const vMFprior<float> base(Vector3fda(0,0,1), 1., 0.01);
+  const float logAlpha = log(1.f), lambdaMRF = 0.5f;
+  std::mutex vmfsLock;
+
+  DpvmfLabelSampler<kD> sampler(3);
+  sampler.Sweep(N, [](size_t) { return true; }, n, nn, z, vmfs, vmfsLock,
+      base, logAlpha, lambdaMRF, ss);
+  const size_t K = vmfs.size();
+  ASSERT_GE(K, (size_t)4);
+  std::vector<float> logPdfs(K+1);
+  std::vector<double> logPdfsRef;
+  size_t numBad = 0;
+  for (uint32_t i=0; i<N; ++i) {
+    sampler.LogProbs(i, K, n, nn, z, base, logAlpha, lambdaMRF,
+        logPdfs.data());
+    LogProbsReference(i, n, nn, z, vmfs, ss, base, logAlpha, lambdaMRF,
+        logPdfsRef);
+    for (size_t k=0; k<=K; ++k) {
+      if (std::isinf(logPdfsRef[k])) {
+        if (logPdfs[k] != logPdfsRef[k]) numBad ++;
+      } else if (fabs(logPdfs[k]-logPdfsRef[k])
+          > 1e-4*std::max(1., fabs(logPdfsRef[k]))) {
+        numBad ++;
+      }
+    }
+  }
+  EXPECT_EQ(0, numBad);
+}
+
+TEST(dpvmfGibbs, sufficientStatsAndColoring) {
+  const size_t N = 5000;
+  Scene scene(N, 2);
+  const vMFprior<float> base(Vector3fda(0,0,1), 1., 0.01);
+  auto valid = [](size_t i) { return i%7 != 3; };
+  DpvmfLabelSampler<kD> sampler(4);
+  sampler.chunkSize_ = 64;
+  ManagedHostImage<Vector4fda> ssRef(scene.ss.w_, 1);
+  std::vector<uint32_t> unlabeled;
+  for (size_t i=0; i<N; ++i)
+    if (valid(i) && scene.z[i] == 9999) unlabeled.push_back(i);
+  for (size_t sweep=0; sweep<4; ++sweep) {
+    if (sweep > 0) scene.Relink();
+    sampler.Sweep(N, valid, scene.n, scene.nn, scene.z, scene.vmfs,
+        scene.vmfsLock, base, log(1.f), 0.5f, scene.ss);
+    const size_t K = scene.vmfs.size();
+    ASSERT_LT(K, scene.ss.Area());
+
+    // ss follows z; invalid surfels keep their labels
+    scene.Accumulate(ssRef);
+    for (size_t k=0; k<scene.ss.Area(); ++k) {
+      EXPECT_EQ(scene.ss[k](3), ssRef[k](3)) << "cluster " << k;
+      // emptied clusters keep the rounding residue of their sums
+      EXPECT_LT((scene.ss[k]-ssRef[k]).norm(), 1e-4f*(1.f+ssRef[k](3)))
+        << "cluster " << k;
+    }
+    for (size_t i=0; i<N; ++i) {
+      if (valid(i)) ASSERT_LT(scene.z[i], K) << "surfel " << i;
+      else if (i%10 == 0) ASSERT_EQ(scene.z[i], 9999) << "surfel " << i;
+    }
+
+    // every valid surfel is sampled once; the groups of more than one
+    // surfel share no kNN edge
+    ASSERT_EQ(sampler.NumSampled(), N - (N+3)/7);
+    std::vector<uint32_t> group(N, 0xFFFFFFFF);
+    for (uint32_t c=0; c<sampler.NumColors(); ++c)
+      for (uint32_t j=sampler.GroupBegin(c); j<sampler.GroupBegin(c+1); ++j) {
+        const uint32_t i = sampler.Order()[j];
+        ASSERT_TRUE(valid(i));
+        ASSERT_EQ(group[i], 0xFFFFFFFF) << "surfel " << i;
+        group[i] = c;
+      }
+    if (sweep == 0) {
+      // the unlabeled surfels come first, one at a time
+      for (uint32_t c=0; c<=unlabeled.size(); ++c)
+        ASSERT_EQ(sampler.GroupBegin(c), c);
+      ASSERT_TRUE(std::equal(unlabeled.begin(), unlabeled.end(),
+            sampler.Order().begin()));
+    }
+    size_t numSingle = 0;
+    for (uint32_t c=0; c<sampler.NumColors(); ++c)
+      if (sampler.GroupBegin(c+1)-sampler.GroupBegin(c) == 1) numSingle ++;
+    EXPECT_LT(sampler.NumColors() - numSingle, 64u);
+    for (size_t i=0; i<N; ++i) {
+      if (!valid(i)) continue;
+      const uint32_t c = group[i];
+      ASSERT_NE(c, 0xFFFFFFFF) << "surfel " << i;
+      if (sampler.GroupBegin(c+1)-sampler.GroupBegin(c) == 1) continue;
+      for (int d=0; d<kD; ++d) {
+        const int32_t j = scene.nn[i][d];
+        if (j > -1 && valid(j))
+          ASSERT_NE(group[j], c) << "surfels " << i << " " << j;
+      }
+    }
+  }
+}
+
+TEST(dpvmfGibbs, threadIndependence) {
+  const size_t N = 5000;
+  const vMFprior<float> base(Vector3fda(0,0,1), 1., 0.01);
+  auto valid = [](size_t i) { return i%11 != 5; };
+  Scene scene1(N, 3), scene3(N, 3);
+  DpvmfLabelSampler<kD> sampler1(5), sampler3(5);
+  sampler1.chunkSize_ = sampler3.chunkSize_ = 64;
+  sampler1.numThreads_ = 1;
+  sampler3.numThreads_ = 3;
+  for (size_t sweep=0; sweep<3; ++sweep) {
+    if (sweep > 0) {
+      scene1.Relink();
+      scene3.Relink();
+    }
+    sampler1.Sweep(N, valid, scene1.n, scene1.nn, scene1.z, scene1.vmfs,
+        scene1.vmfsLock, base, log(1.f), 0.5f, scene1.ss);
+    sampler3.Sweep(N, valid, scene3.n, scene3.nn, scene3.z, scene3.vmfs,
+        scene3.vmfsLock, base, log(1.f), 0.5f, scene3.ss);
+    ASSERT_GT(sampler1.Moved().size(), 0u);
+    ASSERT_EQ(sampler1.Moved(), sampler3.Moved());
+    ASSERT_EQ(sampler1.Order(), sampler3.Order());
+    for (size_t i=0; i<N; ++i) ASSERT_EQ(scene1.z[i], scene3.z[i]);
+    ASSERT_EQ(scene1.vmfs.size(), scene3.vmfs.size());
+    for (size_t k=0; k<scene1.vmfs.size(); ++k) {
+      ASSERT_TRUE(scene1.vmfs[k].mu_ == scene3.vmfs[k].mu_);
+      ASSERT_EQ(scene1.vmfs[k].tau_, scene3.vmfs[k].tau_);
+    }
+    for (size_t k=0; k<scene1.ss.Area(); ++k)
+      ASSERT_TRUE(scene1.ss[k] == scene3.ss[k]);
+  }
+}
@@ -0,0 +1,85 @@
+#include <tdp/testing/testing.h>
+#include <math.h>
+#include <vector>
+#include <tdp/data/managed_pyramid.h>
+#include <tdp/esm/esm_tracker.h>
+#include <tdp/manifold/SL3.h>
+
+using namespace tdp;
+
+namespace {
+
+/// Smooth texture in pixel coordinates of the finest level.
+float Texture(float x, float y) {
+  return sin(0.11f*x) + cos(0.07f*y) + 0.5f*sin(0.05f*(x+y));
+}
+
+Eigen::Vector2f TextureGrad(float x, float y) {
+  return Eigen::Vector2f(0.11f*cos(0.11f*x) + 0.025f*cos(0.05f*(x+y)),
+      -0.07f*sin(0.07f*y) + 0.025f*cos(0.05f*(x+y)));
+}
+
+/// Render gray(x) = Texture(H^-1 x) and its gradients at every level;
+/// pixel x_l of level l is at S_l^-1 x_l in the finest level.
+template<int LEVELS>
+void Render(const Eigen::Matrix3f& H, Pyramid<float,LEVELS>& gray,
+    Pyramid<float,LEVELS>& gradDu, Pyramid<float,LEVELS>& gradDv) {
+  const Eigen::Matrix3f Hinv = H.inverse();
+  for (int lvl=0; lvl<LEVELS; ++lvl) {
+    const float s = 1 << lvl;
+    Image<float> I = gray.GetImage(lvl);
+    Image<float> Iu = gradDu.GetImage(lvl);
+    Image<float> Iv = gradDv.GetImage(lvl);
+    for (size_t v=0; v<I.h_; ++v)
+      for (size_t u=0; u<I.w_; ++u) {
+        const Eigen::Vector3f x = Hinv*Eigen::Vector3f(s*u, s*v, 1.f);
+        const float x0 = x(0)/x(2), y0 = x(1)/x(2);
+        I(u,v) = Texture(x0, y0);
+        // chain rule through H^-1 and the level scale
+        Eigen::Matrix<float,2,3> Jproj;
+        Jproj << 1.f/x(2), 0.f, -x(0)/(x(2)*x(2)),
+              0.f, 1.f/x(2), -x(1)/(x(2)*x(2));
+        const Eigen::Matrix<float,2,2> J =
+          s*Jproj*Hinv.leftCols<2>();
+        const Eigen::Vector2f g = J.transpose()*TextureGrad(x0, y0);
+        Iu(u,v) = g(0);
+        Iv(u,v) = g(1);
+      }
+  }
+}
+
+}
+
+TEST(esmTracker, recoverHomography) {
+  const size_t w = 160, h = 128;
+  Eigen::Matrix3f H_true;
+  H_true << 1.02f, 0.03f, 4.f,
+            -0.02f, 0.99f, -3.f,
+            1e-5f, 2e-5f, 1.f;
+  H_true /= cbrt(H_true.determinant());
+
+  ManagedHostPyramid<float,3> gray_m(w,h), gradDu_m(w,h), gradDv_m(w,h);
+  ManagedHostPyramid<float,3> gray_c(w,h), gradDu_c(w,h), gradDv_c(w,h);
+  Render(Eigen::Matrix3f::Identity(), gray_m, gradDu_m, gradDv_m);
+  Render(H_true, gray_c, gradDu_c, gradDv_c);
+
+  std::vector<Eigen::Matrix3f> Hs;
+  for (size_t numThreads : {1, 3}) {
+    ESMTracker tracker(numThreads);
+    tracker.SetTemplate(gray_m, gradDu_m, gradDv_m);
+    // the coarsest level alone has to give H in finest level pixels
+    SL3<float> H;
+    tracker.Track(gray_c, gradDu_c, gradDv_c, {0, 0, 50}, H);
+    EXPECT_NEAR(H_true(0,2), H.matrix()(0,2), 0.2f);
+    EXPECT_NEAR(H_true(1,2), H.matrix()(1,2), 0.2f);
+
+    H = SL3<float>();
+    const float F = tracker.Track(gray_c, gradDu_c, gradDv_c,
+        {50, 50, 50}, H);
+    EXPECT_LT(F, 1e-3f);
+    EXPECT_TRUE(IsAppox(H.matrix(), H_true, 1e-3f));
+    Hs.push_back(H.matrix());
+  }
+  // the reduction runs over fixed blocks, independent of the threads
+  EXPECT_EQ(Hs[0], Hs[1]);
+}
@@ -0,0 +1,304 @@
+#include <tdp/testing/testing.h>
+#include <math.h>
+#include <vector>
+#include <Eigen/Dense>
+#include <tdp/camera/camera.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/icp/icp_cpu.h>
+#include <tdp/icp/icpGrad3d.h>
+#include <tdp/icp/icpRot.h>
+#include <tdp/manifold/SE3.h>
+
+using namespace tdp;
+
+namespace {
+
+/// Wavy surface seen by cam with analytic normals.
+void RenderSurface(const Cameraf& cam, Image<Vector3fda>& pc,
+    Image<Vector3fda>& n) {
+  for (size_t v=0; v<pc.h_; ++v)
+    for (size_t u=0; u<pc.w_; ++u) {
+      const Vector3fda ray = cam.Unproject(u, v, 1.f);
+      // z = 2 + 0.2 sin(3x) cos(3y) along the ray
+      float z = 2.f;
+      for (size_t it=0; it<20; ++it)
+        z = 2.f + 0.2f*sin(3.f*ray(0)*z)*cos(3.f*ray(1)*z);
+      const Vector3fda p = ray*z;
+      Vector3fda ni(-0.6f*cos(3.f*p(0))*cos(3.f*p(1)),
+          0.6f*sin(3.f*p(0))*sin(3.f*p(1)), 1.f);
+      pc(u,v) = p;
+      n(u,v) = -ni.normalized();
+    }
+}
+
+/// Smooth grey image and its gradient.
+void RenderGrey(float phase, Image<float>& grey, Image<Vector2fda>& grad) {
+  for (size_t v=0; v<grey.h_; ++v)
+    for (size_t u=0; u<grey.w_; ++u) {
+      grey(u,v) = sin(0.1f*u+phase) + cos(0.13f*v);
+      grad(u,v) = Vector2fda(0.1f*cos(0.1f*u+phase), -0.13f*sin(0.13f*v));
+    }
+}
+
+/// Sums of the outer products of rows [a b] in double precision.
+template<int N>
+struct NormalEquations {
+  NormalEquations() : ATA(Eigen::Matrix<double,N,N>::Zero()),
+    ATb(Eigen::Matrix<double,N,1>::Zero()), error(0.), count(0.) {}
+  void Add(const Eigen::Matrix<double,N,1>& a, double b) {
+    ATA += a*a.transpose();
+    ATb += a*b;
+    error += b*b;
+  }
+  template<class MatA, class Vecb>
+  void ExpectNear(const MatA& ATAf, const Vecb& ATbf, float errorf,
+      float countf) const {
+    EXPECT_EQ(countf, count);
+    EXPECT_TRUE(IsAppox(ATAf.template cast<double>(), ATA,
+          1e-5*ATA.norm()));
+    EXPECT_TRUE(IsAppox(ATbf.template cast<double>(), ATb,
+          1e-5*ATA.norm()));
+    EXPECT_NEAR(errorf, error/count, 1e-4*error/count);
+  }
+  Eigen::Matrix<double,N,N> ATA;
+  Eigen::Matrix<double,N,1> ATb;
+  double error;
+  double count;
+};
+
+}
+
+TEST(icpCpu, reduceNormalEquations) {
+  const size_t N = 10007;
+  std::vector<Eigen::Matrix<float,2,7>> rows(N);
+  for (auto& r : rows) r.setRandom();
+  auto rowsOf = [&](size_t i, float (&ab)[2][7]) -> bool {
+    if (i%5 == 0) return false;
+    for (int r=0; r<2; ++r)
+      for (int j=0; j<7; ++j) ab[r][j] = rows[i](r,j);
+    return true;
+  };
+  Eigen::Matrix<double,7,7> S = Eigen::Matrix<double,7,7>::Zero();
+  double numInliers = 0.;
+  for (size_t i=0; i<N; ++i) {
+    if (i%5 == 0) continue;
+    S += rows[i].cast<double>().transpose()*rows[i].cast<double>();
+    numInliers ++;
+  }
+  Matrix6fda ATA1, ATA3;
+  Vector6fda ATb1, ATb3;
+  float err1, err3, count1, count3;
+  ReduceNormalEquations<6,2>(N, rowsOf, ATA1, ATb1, err1, count1, 1);
+  ReduceNormalEquations<6,2>(N, rowsOf, ATA3, ATb3, err3, count3, 3);
+  EXPECT_EQ(count1, numInliers);
+  EXPECT_TRUE(IsAppox(ATA1.cast<double>(), S.topLeftCorner<6,6>(), 1e-4));
+  EXPECT_TRUE(IsAppox(ATb1.cast<double>(), S.topRightCorner<6,1>(), 1e-3));
+  EXPECT_NEAR(err1, S(6,6), 1e-4*S(6,6));
+  // independent of the number of threads
+  EXPECT_EQ(count1, count3);
+  EXPECT_EQ(err1, err3);
+  EXPECT_TRUE(ATA1 == ATA3);
+  EXPECT_TRUE(ATb1 == ATb3);
+}
+
+TEST(icpCpu, grad3dConverges) {
+  const size_t w = 160, h = 120;
+  Cameraf cam(Eigen::Vector4f(150, 150, 79.5, 59.5));
+  ManagedHostImage<Vector3fda> pc_o(w,h), n_o(w,h), g(w,h);
+  ManagedHostImage<Vector3fda> pc_m(w,h), n_m(w,h);
+  RenderSurface(cam, pc_o, n_o);
+  g.Fill(Vector3fda(NAN,NAN,NAN));
+  Eigen::Matrix<float,6,1> xi;
+  xi << 0.01, -0.02, 0.015, 0.02, 0.01, -0.03;
+  const SE3f T_mo_true = SE3f::Exp_(xi);
+  for (size_t i=0; i<pc_o.Area(); ++i) {
+    pc_m[i] = T_mo_true*pc_o[i];
+    n_m[i] = T_mo_true.rotation()*n_o[i];
+  }
+  SE3f T_mo;
+  Eigen::Matrix<float,6,6,Eigen::DontAlign> ATA;
+  Eigen::Matrix<float,6,1,Eigen::DontAlign> ATb;
+  float error = 0.f, count = 0.f;
+  for (size_t it=0; it<20; ++it) {
+    ICPStepCpu<4,Camera<float>>(pc_m, n_m, g, pc_o, n_o, g, T_mo, SE3f(),
+        cam, cos(30.*M_PI/180.), 0.2, ATA, ATb, error, count);
+    ASSERT_GT(count, 1000);
+    const Eigen::Matrix<float,6,1> x =
+      (ATA.cast<double>().ldlt().solve(ATb.cast<double>())).cast<float>();
+    T_mo = SE3f::Exp_(x) * T_mo;
+  }
+  EXPECT_LT(error, 1e-6);
+  EXPECT_TRUE(IsAppox(T_mo.matrix(), T_mo_true.matrix(), 1e-3));
+}
+
+TEST(icpCpu, rotationNormals) {
+  const size_t w = 160, h = 120;
+  Cameraf cam(Eigen::Vector4f(150, 150, 79.5, 59.5));
+  ManagedHostImage<Vector3fda> pc_o(w,h), n_o(w,h);
+  RenderSurface(cam, pc_o, n_o);
+  // identical frames: N is the scatter matrix of the normals
+  Eigen::Matrix<float,3,3,Eigen::DontAlign> N;
+  float count = 0.f;
+  ICPStepRotationCpu<4,Camera<float>>(n_o, n_o, pc_o, SE3f(), SE3f(), cam,
+      cos(30.*M_PI/180.), N, count, 1);
+  Eigen::Matrix3d S = Eigen::Matrix3d::Zero();
+  for (size_t i=0; i<n_o.Area(); ++i)
+    S += n_o[i].cast<double>()*n_o[i].cast<double>().transpose();
+  EXPECT_EQ(count, w*h);
+  EXPECT_TRUE(IsAppox(N.cast<double>(), S, 1e-5));
+  Eigen::Matrix<float,3,3,Eigen::DontAlign> N3;
+  float count3 = 0.f;
+  ICPStepRotationCpu<4,Camera<float>>(n_o, n_o, pc_o, SE3f(), SE3f(), cam,
+      cos(30.*M_PI/180.), N3, count3, 3);
+  EXPECT_EQ(count, count3);
+  EXPECT_TRUE(N == N3);
+}
+
+TEST(icpCpu, so3Texture) {
+  const size_t w = 160, h = 120;
+  Cameraf cam(Eigen::Vector4f(150, 150, 79.5, 59.5));
+  ManagedHostImage<float> grey_p(w,h), grey_c(w,h);
+  ManagedHostImage<Vector2fda> grad_p(w,h), grad_c(w,h);
+  ManagedHostImage<Vector3fda> rays(w,h);
+  RenderGrey(0.f, grey_p, grad_p);
+  RenderGrey(0.3f, grey_c, grad_c);
+  for (size_t v=0; v<h; ++v)
+    for (size_t u=0; u<w; ++u) rays(u,v) = cam.Unproject(u, v, 1.f);
+  const SO3f R_cp = SO3f::Exp_(Eigen::Vector3f(0.05f, -0.03f, 0.02f));
+
+  NormalEquations<3> ref;
+  const Eigen::Matrix3d R = R_cp.matrix().cast<double>();
+  for (size_t v=0; v<h; ++v)
+    for (size_t u=0; u<w; ++u) {
+      const Vector3fda ray_c = R_cp*rays(u,v);
+      const Vector2fda x = cam.Project(ray_c);
+      if (!grey_p.Inside(x)) continue;
+      const Eigen::Vector3d a = -(R*SO3mat<double>::invVee(
+            rays(u,v).cast<double>())).transpose()
+        * cam.Jproject(ray_c).transpose().cast<double>()
+        * grad_c.GetBilinear(x).cast<double>();
+      ref.Add(a, (double)grey_p(u,v) - grey_c.GetBilinear(x));
+      ref.count ++;
+    }
+  ASSERT_GT(ref.count, w*h/2);
+  Eigen::Matrix<float,3,3,Eigen::DontAlign> ATA[2];
+  Eigen::Matrix<float,3,1,Eigen::DontAlign> ATb[2];
+  float error[2], count[2];
+  for (size_t k=0; k<2; ++k)
+    SO3TextureStepCpu<4,Camera<float>>(grey_p, grey_c, grad_c, rays, R_cp,
+        cam, ATA[k], ATb[k], error[k], count[k], k == 0 ? 1 : 3);
+  ref.ExpectNear(ATA[0], ATb[0], error[0], count[0]);
+  EXPECT_TRUE(ATA[0] == ATA[1]);
+  EXPECT_TRUE(ATb[0] == ATb[1]);
+  EXPECT_EQ(error[0], error[1]);
+}
+
+TEST(icpCpu, texture) {
+  const size_t w = 160, h = 120;
+  Cameraf cam(Eigen::Vector4f(150, 150, 79.5, 59.5));
+  ManagedHostImage<Vector3fda> pc_o(w,h), n_o(w,h), pc_m(w,h), n_m(w,h);
+  ManagedHostImage<float> grey_o(w,h), grey_m(w,h);
+  ManagedHostImage<Vector2fda> grad_o(w,h), grad_m(w,h);
+  RenderSurface(cam, pc_o, n_o);
+  RenderGrey(0.f, grey_o, grad_o);
+  RenderGrey(0.2f, grey_m, grad_m);
+  const SE3f T_mo_true(SO3f::Exp_(Eigen::Vector3f(0.01f,-0.02f,0.01f)),
+      Eigen::Vector3f(0.02f,0.01f,-0.01f));
+  for (size_t i=0; i<pc_o.Area(); ++i) {
+    pc_m[i] = T_mo_true*pc_o[i];
+    n_m[i] = T_mo_true.rotation()*n_o[i];
+  }
+  const SE3f T_mo(SO3f::Exp_(Eigen::Vector3f(0.005f,-0.01f,0.f)),
+      Eigen::Vector3f(0.01f,0.f,-0.005f));
+  const float dotThr = cos(30.*M_PI/180.), distThr = 0.2f, lambda = 0.3f;
+
+  NormalEquations<6> ref;
+  for (size_t y=0; y<h; ++y)
+    for (size_t x=0; x<w; ++x) {
+      const Vector3fda& pc_mi = pc_m(x,y);
+      const Vector3fda pc_m_in_o = T_mo.InverseTransform(pc_mi);
+      const Vector2fda x_m_in_o = cam.Project(pc_m_in_o);
+      const int u = floor(x_m_in_o(0)+0.5f);
+      const int v = floor(x_m_in_o(1)+0.5f);
+      if (!(0 <= u && u < (int)w && 0 <= v && v < (int)h
+            && pc_m_in_o(2) > 0.))
+        continue;
+      const Vector3fda& pc_oi = pc_o(u,v);
+      const Vector3fda pc_o_in_m = T_mo*pc_oi;
+      const Vector3fda& n_mi = n_m(x,y);
+      if (!(n_mi.dot(T_mo.rotation()*n_o(u,v)) > dotThr
+            && (pc_mi-pc_o_in_m).norm() < distThr))
+        continue;
+      const Eigen::Vector3d n_mi_in_o =
+        T_mo.rotation().InverseTransform(n_mi).cast<double>();
+      Eigen::Matrix<double,6,1> a;
+      a << pc_oi.cast<double>().cross(n_mi_in_o), n_mi_in_o;
+      ref.Add(a, n_mi.cast<double>().dot((pc_mi-pc_o_in_m).cast<double>()));
+      Eigen::Matrix<double,3,6> Jse3;
+      Jse3 << -(T_mo.rotation().matrix().cast<double>()
+          *SO3mat<double>::invVee(pc_oi.cast<double>())),
+           Eigen::Matrix3d::Identity();
+      a = sqrt(lambda) * Jse3.transpose()
+        * cam.Jproject(pc_o_in_m).transpose().cast<double>()
+        * grad_m(x,y).cast<double>();
+      ref.Add(a, sqrt(lambda)*((double)grey_o(u,v) - grey_m(x,y)));
+      ref.count ++;
+    }
+  ASSERT_GT(ref.count, w*h/2);
+  Eigen::Matrix<float,6,6,Eigen::DontAlign> ATA[2];
+  Eigen::Matrix<float,6,1,Eigen::DontAlign> ATb[2];
+  float error[2], count[2];
+  for (size_t k=0; k<2; ++k)
+    ICPStepCpu<4,Camera<float>>(pc_m, n_m, grad_m, grey_m, pc_o, n_o,
+        grad_o, grey_o, T_mo, SE3f(), cam, dotThr, distThr, lambda,
+        ATA[k], ATb[k], error[k], count[k], k == 0 ? 1 : 3);
+  ref.ExpectNear(ATA[0], ATb[0], error[0], count[0]);
+  EXPECT_TRUE(ATA[0] == ATA[1]);
+  EXPECT_TRUE(ATb[0] == ATb[1]);
+  EXPECT_EQ(error[0], error[1]);
+}
+
+#ifdef CUDA_FOUND
+TEST(icpCpu, matchesGpu) {
+  const size_t w = 160, h = 120;
+  Cameraf cam(Eigen::Vector4f(150, 150, 79.5, 59.5));
+  ManagedHostImage<Vector3fda> pc_o(w,h), n_o(w,h), g(w,h);
+  ManagedHostImage<Vector3fda> pc_m(w,h), n_m(w,h);
+  RenderSurface(cam, pc_o, n_o);
+  for (size_t i=0; i<g.Area(); ++i) g[i] = Vector3fda::Random();
+  const SE3f T_mo = SE3f::Random(0.05, 0.05);
+  for (size_t i=0; i<pc_o.Area(); ++i) {
+    pc_m[i] = T_mo*pc_o[i];
+    n_m[i] = T_mo.rotation()*n_o[i];
+  }
+  ManagedDeviceImage<Vector3fda> cuPc_o(w,h), cuN_o(w,h), cuG(w,h);
+  ManagedDeviceImage<Vector3fda> cuPc_m(w,h), cuN_m(w,h);
+  cuPc_o.CopyFrom(pc_o);
+  cuN_o.CopyFrom(n_o);
+  cuG.CopyFrom(g);
+  cuPc_m.CopyFrom(pc_m);
+  cuN_m.CopyFrom(n_m);
+  const SE3f T_mo0 = SE3f::Exp_(Eigen::Matrix<float,6,1>::Constant(0.003));
+  const float dotThr = cos(30.*M_PI/180.);
+
+  Eigen::Matrix<float,6,6,Eigen::DontAlign> ATA, cuATA;
+  Eigen::Matrix<float,6,1,Eigen::DontAlign> ATb, cuATb;
+  float error, cuError, count, cuCount;
+  ICPStepCpu<4,Camera<float>>(pc_m, n_m, g, pc_o, n_o, g, T_mo0, SE3f(),
+      cam, dotThr, 0.2, ATA, ATb, error, count);
+  ICPStep<4,Camera<float>>(cuPc_m, cuN_m, cuG, cuPc_o, cuN_o, cuG, T_mo0,
+      SE3f(), cam, dotThr, 0.2, cuATA, cuATb, cuError, cuCount);
+  EXPECT_EQ(count, cuCount);
+  EXPECT_NEAR(error, cuError, 1e-4*cuError);
+  EXPECT_TRUE(IsAppox(ATA, cuATA, 1e-4));
+  EXPECT_TRUE(IsAppox(ATb, cuATb, 1e-3));
+
+  Eigen::Matrix<float,3,3,Eigen::DontAlign> N, cuN;
+  ICPStepRotationCpu<4,Camera<float>>(n_m, n_o, pc_o, T_mo0, SE3f(), cam,
+      dotThr, N, count);
+  ICPStepRotation<4,Camera<float>>(cuN_m, cuN_o, cuPc_o, T_mo0, SE3f(),
+      cam, dotThr, cuN, cuCount);
+  EXPECT_EQ(count, cuCount);
+  EXPECT_TRUE(IsAppox(N, cuN, 1e-4));
+}
+#endif
@@ -0,0 +1,151 @@
+#include <tdp/testing/testing.h> 
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <Eigen/Dense>
+#include <tdp/manifold/SO3.h>
+#include <tdp/inertial/imu_preintegration.h>
+#include <tdp/inertial/imu_interface.h>
+#include <tdp/inertial/imu_interpolator.h>
+
+using namespace tdp;
+
+TEST(imuPreint, predict) {
+  // constant rotational velocity and body acceleration; the IMU measures
+  // the specific force a_b - R_wb^T g_w
+  const Eigen::Vector3f g_w(0,0,-9.81);
+  const Eigen::Vector3f omega(0.3,-0.2,0.5);
+  const Eigen::Vector3f a_b(0.5,0.1,-0.2);
+  const float dt = 1e-3;
+  const size_t N = 1000;
+
+  ImuPreintegration preint;
+  SO3f R_wb;
+  Eigen::Vector3f v_w(0.1,0,0);
+  Eigen::Vector3f p_w(0,0,0);
+  const SO3f R_w0 = R_wb;
+  const Eigen::Vector3f v_w0 = v_w;
+  const Eigen::Vector3f p_w0 = p_w;
+  for (size_t i=0; i<N; ++i) {
+    preint.Integrate(a_b - R_wb.InverseTransform(g_w), omega, dt);
+    const Eigen::Vector3f a_w = R_wb*a_b;
+    p_w += v_w*dt + 0.5*a_w*dt*dt;
+    v_w += a_w*dt;
+    R_wb = R_wb*SO3f::Exp_(omega*dt);
+  }
+  SO3f R_wj;
+  Eigen::Vector3f v_wj, p_wj;
+  preint.Predict(R_w0, v_w0, p_w0, g_w, R_wj, v_wj, p_wj);
+  ASSERT_NEAR(preint.dt_, N*dt, 1e-3);
+  ASSERT_TRUE(IsAppox(R_wj.matrix(), R_wb.matrix(), 1e-4));
+  ASSERT_TRUE(IsAppox(v_wj, v_w, 1e-3));
+  ASSERT_TRUE(IsAppox(p_wj, p_w, 1e-3));
+}
+
+TEST(imuPreint, biasJacobians) {
+  const Eigen::Vector3f bg(0.01,-0.02,0.005);
+  const Eigen::Vector3f ba(0.05,0.02,-0.03);
+  const Eigen::Vector3f dbg(1e-3,-2e-3,1e-3);
+  const Eigen::Vector3f dba(-1e-2,1e-2,2e-2);
+  ImuPreintegration preint(bg, ba);
+  ImuPreintegration preintRef(bg+dbg, ba+dba);
+  for (size_t i=0; i<200; ++i) {
+    const Eigen::Vector3f acc = Eigen::Vector3f(0,0,9.81)
+      + Eigen::Vector3f::Random();
+    const Eigen::Vector3f omega = Eigen::Vector3f::Random();
+    preint.Integrate(acc, omega, 5e-3);
+    preintRef.Integrate(acc, omega, 5e-3);
+  }
+  // first order correction is close to reintegration ...
+  ASSERT_TRUE(IsAppox(preint.DeltaR(bg+dbg).matrix(), preintRef.dR_,
+        1e-4));
+  ASSERT_TRUE(IsAppox(preint.DeltaV(bg+dbg,ba+dba), preintRef.dv_, 1e-3));
+  ASSERT_TRUE(IsAppox(preint.DeltaP(bg+dbg,ba+dba), preintRef.dp_, 1e-3));
+  // ... and better than no correction
+  ASSERT_LT((preint.DeltaP(bg+dbg,ba+dba)-preintRef.dp_).norm(),
+      0.1*(preint.dp_-preintRef.dp_).norm());
+  // covariance is symmetric positive definite
+  ASSERT_TRUE(IsAppox(preint.cov_, preint.cov_.transpose(), 1e-5));
+  ASSERT_EQ(preint.cov_.ldlt().info(), Eigen::Success);
+}
+
+namespace {
+
+/// IMU fed by the test; announces every observation like a driver with
+/// its own receiver thread.
+class FakeImu : public ImuInterface {
+ public:
+  void Push(const ImuObs& obs) {
+    {
+      std::lock_guard<std::mutex> lock(mut_);
+      obs_.push_back(obs);
+    }
+    NotifyObs();
+  }
+  virtual bool GrabNext(ImuObs& obs) {
+    std::lock_guard<std::mutex> lock(mut_);
+    if (obs_.empty()) return false;
+    obs = obs_.front();
+    obs_.pop_front();
+    return true;
+  }
+  virtual bool GrabNewest(ImuObs& obs) { return GrabNext(obs); }
+  virtual void Start() {}
+  virtual void Stop() {}
+  virtual pangolin::json::value GetProperties() const {
+    return pangolin::json::value();
+  }
+ private:
+  std::mutex mut_;
+  std::deque<ImuObs> obs_;
+};
+
+}
+
+TEST(imuPreint, interpolatorWithoutConsumer) {
+  // far more measurements than are queued for preintegration arrive
+  // before the first frame; none of them may get lost
+  FakeImu imu;
+  ImuInterpolator interp(&imu);
+  interp.Start();
+  const Eigen::Vector3f bias(0.01,0.,0.);
+  const Eigen::Vector3f omega(0.2,-0.1,0.3);
+  const int64_t dt_ns = 1000000;
+  ImuObs obs;
+  obs.acc = Eigen::Vector3f(0,0,9.81);
+  obs.rpy = obs.mag = Eigen::Vector3f::Zero();
+  int64_t t = 0;
+  // at rest for the gyro bias calibration, then moving
+  for (size_t i=0; i<30; ++i, t+=dt_ns) {
+    obs.omega = bias;
+    obs.t_host = obs.t_device = t;
+    imu.Push(obs);
+  }
+  const size_t M = 5000;
+  for (size_t i=0; i<M+1; ++i, t+=dt_ns) {
+    obs.omega = bias+omega;
+    obs.t_host = obs.t_device = t;
+    imu.Push(obs);
+  }
+  ImuPreintegration delta;
+  const int64_t tFrame = t-dt_ns;
+  // false until the receiver has seen the end of the calibration
+  for (size_t it=0; it<1000; ++it) {
+    if (interp.GetPreintegration(tFrame, delta, 1000000)) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  interp.Stop();
+  // the first moving measurement ends the calibration and starts the
+  // preintegration; the next one is held from there on
+  ASSERT_EQ(tFrame, delta.t1_);
+  // dt_ is summed in float
+  EXPECT_NEAR((M-1)*1e-3, delta.dt_, 1e-3);
+  EXPECT_TRUE(IsAppox(delta.dR_,
+        SO3f::Exp_(omega*(M-1)*1e-3).matrix(), 1e-3));
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
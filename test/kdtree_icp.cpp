@@ -0,0 +1,87 @@
+#include <tdp/testing/testing.h>
+#include <math.h>
+#include <random>
+#include <Eigen/Dense>
+#include <tdp/data/managed_image.h>
+#include <tdp/icp/kdtree_icp.h>
+#include <tdp/manifold/SE3.h>
+#include <tdp/nn/kdtree.h>
+
+using namespace tdp;
+
+namespace {
+
+/// Points on the six bumpy walls of a box with some invalid ones.
+void BoxScene(Image<Vector3fda>& pc, Image<Vector3fda>& n) {
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<float> unif(-1.f, 1.f);
+  for (size_t i=0; i<pc.Area(); ++i) {
+    const int a = i%3;
+    const float side = i%6 < 3 ? -1.f : 1.f;
+    Vector3fda p(unif(gen), unif(gen), unif(gen));
+    p(a) = side;
+    p *= 1.5f;
+    p(a) += 0.05f*sin(4.f*p((a+1)%3))*cos(3.f*p((a+2)%3));
+    pc[i] = i%97 == 0 ? Vector3fda(NAN,NAN,NAN) : p;
+    n[i] = Vector3fda::Zero();
+    n[i](a) = -side;
+  }
+}
+
+}
+
+TEST(kdTree, nearestBruteForce) {
+  ManagedHostImage<Vector3fda> pc(160,120), n(160,120);
+  BoxScene(pc, n);
+  KdTree tree;
+  tree.Build(pc, 1, 8);
+  std::mt19937 gen(2);
+  std::uniform_real_distribution<float> unif(-2.f, 2.f);
+  const float maxDist2 = 0.3f*0.3f;
+  for (size_t q=0; q<500; ++q) {
+    const Vector3fda x(unif(gen), unif(gen), unif(gen));
+    int idBf = -1;
+    float dist2Bf = maxDist2;
+    for (size_t i=0; i<pc.Area(); ++i) {
+      if (!IsValidData(pc[i])) continue;
+      const float d2 = (pc[i]-x).squaredNorm();
+      if (d2 < dist2Bf) {
+        dist2Bf = d2;
+        idBf = i;
+      }
+    }
+    float dist2 = 0.f;
+    const int id = tree.Nearest(x, maxDist2, dist2);
+    ASSERT_EQ(id < 0, idBf < 0);
+    if (id >= 0) {
+      EXPECT_FLOAT_EQ(dist2, dist2Bf);
+      EXPECT_FLOAT_EQ((pc[id]-x).squaredNorm(), dist2Bf);
+    }
+  }
+}
+
+TEST(kdTreeIcp, recoverPose) {
+  ManagedHostImage<Vector3fda> pc_o(160,120), n_o(160,120);
+  ManagedHostImage<Vector3fda> pc_m(160,120), n_m(160,120);
+  BoxScene(pc_o, n_o);
+  const SE3f T_mo_true(SO3f::Exp_(Eigen::Vector3f(0.03f,-0.02f,0.04f)),
+      Eigen::Vector3f(0.04f,0.02f,-0.03f));
+  for (size_t i=0; i<pc_o.Area(); ++i) {
+    pc_m[i] = T_mo_true*pc_o[i];
+    n_m[i] = T_mo_true.rotation()*n_o[i];
+  }
+  const KdTreeICP::RobustLoss losses[] = {KdTreeICP::L2, KdTreeICP::HUBER,
+    KdTreeICP::TUKEY};
+  for (KdTreeICP::RobustLoss loss : losses) {
+    KdTreeICP icp;
+    icp.SetTarget(pc_o, n_o, 2);
+    icp.loss_ = loss;
+    icp.lossScale_ = 0.02f;
+    SE3f T_mo;
+    float err = 0.f, count = 0.f;
+    icp.Compute(pc_m, n_m, T_mo, 30, 30.f, 0.2f, 1, false, err, count);
+    EXPECT_GT(count, 1000);
+    EXPECT_LT(err, 1e-8);
+    EXPECT_TRUE(IsAppox(T_mo.matrix(), T_mo_true.matrix(), 1e-4));
+  }
+}
@@ -0,0 +1,153 @@
+#include <tdp/testing/testing.h>
+#include <math.h>
+#include <vector>
+#include <tdp/camera/camera.h>
+#include <tdp/camera/ray.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/slam/keyframe_store.h>
+#include <tdp/utils/parallel_for.h>
+
+using namespace tdp;
+
+namespace {
+
+/// Tilted plane z = z0 + 0.2 x with a grey ramp and invalid pixels.
+void RenderPlane(const Image<Vector3fda>& ray, float z0,
+    Image<float>& d, Image<float>& grey, Image<Vector3bda>& rgb) {
+  for (size_t v=0; v<d.h_; ++v)
+    for (size_t u=0; u<d.w_; ++u) {
+      const Vector3fda& r = ray(u,v);
+      d(u,v) = (u+v)%17 == 0 ? NAN : z0/(r(2) - 0.2f*r(0));
+      grey(u,v) = (float)((u*7+v*3)%256)/255.f;
+      rgb(u,v) = Vector3bda(u%256, v%256, (u+v)%256);
+    }
+}
+
+}
+
+TEST(keyFrameStore, compressRoundTrip) {
+  CompactKeyFrame ckf, ref;
+  for (CompactKeyFrame* c : {&ckf, &ref}) {
+    c->d_.Reinitialise(33,17);
+    c->grey_.Reinitialise(33,17);
+    c->rgb_.Reinitialise(33,17);
+    for (size_t i=0; i<c->d_.Area(); ++i) {
+      c->d_[i] = i%5 == 0 ? 0 : (i < 200 ? 1000 : 65535-i*7);
+      c->grey_[i] = (i*13)%256;
+      c->rgb_[i] = Vector3bda(i%256, 255-i%256, 7);
+    }
+  }
+
+  CompressKeyFrame(ckf);
+  EXPECT_EQ(0, ckf.d_.Area());
+  EXPECT_LT(ckf.blob_.size(), ref.SizeBytes());
+  ASSERT_TRUE(DecompressKeyFrame(ckf));
+  ASSERT_EQ(33, ckf.d_.w_);
+  ASSERT_EQ(17, ckf.d_.h_);
+  EXPECT_TRUE(ckf.blob_.empty());
+  size_t numBad = 0;
+  for (size_t i=0; i<ref.d_.Area(); ++i)
+    if (ckf.d_[i] != ref.d_[i] || ckf.grey_[i] != ref.grey_[i]
+        || ckf.rgb_[i] != ref.rgb_[i])
+      numBad ++;
+  EXPECT_EQ(0, numBad);
+
+  // truncated data is rejected
+  CompressKeyFrame(ckf);
+  ckf.blob_.resize(ckf.blob_.size()/2);
+  EXPECT_FALSE(DecompressKeyFrame(ckf));
+}
+
+TEST(keyFrameStore, deriveAndEvict) {
+  const size_t w = 64, h = 48;
+  Cameraf cam(Eigen::Vector4f(60, 60, 31.5, 23.5));
+  ManagedHostImage<Vector3fda> ray(w,h);
+  ComputeCameraRaysCpu(cam, ray);
+  const float dScale = 1e-3f;
+  // two hot keyframes; the others are compressed and spilled
+  KeyFrameStore kfs(ray, nullptr, 2, true, ".", dScale);
+
+  const size_t numKfs = 5;
+  ManagedHostImage<float> d(w,h), grey(w,h);
+  ManagedHostImage<Vector3bda> rgb(w,h);
+  for (size_t k=0; k<numKfs; ++k) {
+    RenderPlane(ray, 1.f+0.2f*k, d, grey, rgb);
+    const SE3f T_wk(SO3f(), Eigen::Vector3f(k, 0., 0.));
+    ASSERT_EQ(k, kfs.Add(d, grey, rgb, T_wk));
+  }
+  ASSERT_EQ(numKfs, kfs.size());
+  kfs.SetPose(1, SE3f(SO3f(), Eigen::Vector3f(0., 1., 0.)));
+
+  // fetch in an order that makes keyframes cold and hot again
+  for (size_t k : {0, 4, 1, 3, 2, 0, 1}) {
+    RenderPlane(ray, 1.f+0.2f*k, d, grey, rgb);
+    std::shared_ptr<KeyFrame> kf = kfs.Get(k);
+    ASSERT_TRUE(kf != nullptr);
+    EXPECT_TRUE(IsAppox(kf->T_wk_.matrix(), kfs.Pose(k).matrix(), 0.f));
+    // n = (0.2, 0, -1) normalized, pointing towards the camera
+    const Vector3fda nTrue = Vector3fda(0.2f, 0.f, -1.f).normalized();
+    size_t numBad = 0, numNormals = 0;
+    for (size_t v=0; v<h; ++v)
+      for (size_t u=0; u<w; ++u) {
+        if (d(u,v) != d(u,v)) {
+          if (kf->d_(u,v) == kf->d_(u,v)) numBad ++;
+          continue;
+        }
+        const float dk = kf->d_(u,v);
+        if (fabs(dk - d(u,v)) > 0.5f*dScale) numBad ++;
+        if ((kf->pc_(u,v) - ray(u,v)*dk).norm() > 1e-6f) numBad ++;
+        if (fabs(kf->pyrGrey_.GetImage(0)(u,v) - grey(u,v)) > 0.5f/255.f)
+          numBad ++;
+        if (kf->rgb_(u,v) != rgb(u,v)) numBad ++;
+        const Vector3fda& n = kf->n_(u,v);
+        // quantization of the depth limits the accuracy of the normals
+        if (n(0) != n(0)) continue;
+        if ((n-nTrue).norm() > 0.05f) numBad ++;
+        numNormals ++;
+      }
+    EXPECT_EQ(0, numBad) << "keyframe " << k;
+    EXPECT_GT(numNormals, w*h/2);
+  }
+  EXPECT_TRUE(IsAppox(kfs.Pose(1).translation(),
+        Eigen::Vector3f(0.,1.,0.), 0.f));
+  // the cold keyframes live on disk
+  const size_t bytes = kfs.MemoryBytes();
+  EXPECT_LT(bytes, 3*w*h*(sizeof(uint16_t)+sizeof(uint8_t)
+        +sizeof(Vector3bda)) + 2*w*h*100 + 2*ray.SizeBytes());
+}
+
+TEST(keyFrameStore, concurrentGet) {
+  const size_t w = 64, h = 48;
+  Cameraf cam(Eigen::Vector4f(60, 60, 31.5, 23.5));
+  ManagedHostImage<Vector3fda> ray(w,h);
+  ComputeCameraRaysCpu(cam, ray);
+  KeyFrameStore kfs(ray, nullptr, 3, true);
+  ManagedHostImage<float> d(w,h), grey(w,h);
+  ManagedHostImage<Vector3bda> rgb(w,h);
+  const size_t numKfs = 8;
+  for (size_t k=0; k<numKfs; ++k) {
+    RenderPlane(ray, 1.f+0.1f*k, d, grey, rgb);
+    kfs.Add(d, grey, rgb, SE3f());
+  }
+  // keyframes are derived concurrently and evicted while in use
+  std::vector<size_t> numBad(4*numKfs, 0);
+  ParallelFor(numBad.size(), 1, [&](size_t i0, size_t i1) {
+      for (size_t i=i0; i<i1; ++i) {
+        const size_t k = i%numKfs;
+        std::shared_ptr<KeyFrame> kf = kfs.Get(k);
+        if (!kf) {
+          numBad[i] ++;
+          continue;
+        }
+        const float z0 = 1.f+0.1f*k;
+        for (size_t j=0; j<kf->d_.Area(); ++j) {
+          const float dj = kf->d_[j];
+          const Vector3fda& r = ray[j];
+          if (dj == dj && fabs(dj - z0/(r(2) - 0.2f*r(0))) > 1e-3f)
+            numBad[i] ++;
+        }
+      }
+    }, 4);
+  for (size_t i=0; i<numBad.size(); ++i)
+    EXPECT_EQ(0, numBad[i]) << "fetch " << i;
+}
@@ -0,0 +1,139 @@
+#include <tdp/testing/testing.h>
+#include <math.h>
+#include <random>
+#include <vector>
+#include <tdp/stats/label_sufficient_stats.h>
+
+using namespace tdp;
+
+namespace {
+
+/// Items with a label (kNone if they do not contribute) and a value.
+struct Items {
+  Items(size_t N, size_t K, uint32_t seed) : z(N), x(N), gen(seed) {
+    for (size_t i=0; i<N; ++i) Draw(i, K);
+  }
+  void Draw(size_t i, size_t K) {
+    std::uniform_int_distribution<uint32_t> label(0, K);
+    std::normal_distribution<float> gauss(0.f, 1.f);
+    z[i] = label(gen);
+    if (z[i] == K) z[i] = LabelSufficientStats::kNone;
+    x[i] = Vector3fda(gauss(gen), gauss(gen), gauss(gen));
+  }
+  bool Get(size_t i, uint32_t& k, Vector3fda& xi) const {
+    if (z[i] == LabelSufficientStats::kNone) return false;
+    k = z[i];
+    xi = x[i];
+    return true;
+  }
+  std::vector<uint32_t> z;
+  std::vector<Vector3fda> x;
+  std::mt19937 gen;
+};
+
+void ExpectSame(const LabelSufficientStats& a,
+    const LabelSufficientStats& b) {
+  ASSERT_EQ(a.K(), b.K());
+  for (uint32_t k=0; k<a.K(); ++k) {
+    EXPECT_NEAR(a.Count(k), b.Count(k), 1e-3) << "label " << k;
+    EXPECT_TRUE(IsAppox(a.Sum(k), b.Sum(k), 1e-3)) << "label " << k;
+    if (a.SecondOrder())
+      EXPECT_TRUE(IsAppox(a.Outer(k), b.Outer(k), 1e-3)) << "label " << k;
+  }
+  for (uint32_t i=0; i<a.NumItems(); ++i)
+    ASSERT_EQ(a.Label(i), b.Label(i)) << "item " << i;
+}
+
+}
+
+TEST(labelSufficientStats, incrementalMatchesAccumulate) {
+  const size_t N = 5000, K = 20;
+  Items items(N, K, 1);
+  auto get = [&](size_t i, uint32_t& k, Vector3fda& x) {
+    return items.Get(i, k, x);
+  };
+  LabelSufficientStats stats(K, N, true);
+  stats.Accumulate(N, get);
+
+  // Set() directly and SyncTouched() for touched items
+  for (size_t i=0; i<N; i+=7) {
+    items.Draw(i, K);
+    stats.Set(i, items.z[i], items.x[i]);
+  }
+  for (size_t i=3; i<N; i+=5) {
+    items.Draw(i, K);
+    stats.Touch(i);
+    stats.Touch(i);
+  }
+  EXPECT_EQ((N-3+4)/5, stats.SyncTouched(get));
+  EXPECT_EQ(0, stats.SyncTouched(get));
+  LabelSufficientStats ref(K, N, true);
+  ref.Accumulate(N, get, 3);
+  ExpectSame(stats, ref);
+
+  // drop the odd labels and merge the even ones pairwise
+  std::vector<uint32_t> labelMap(K);
+  for (uint32_t k=0; k<K; ++k) labelMap[k] = k%2 == 0 ? k/4 : K;
+  const size_t Knew = (K+3)/4;
+  stats.Relabel(labelMap, Knew);
+  for (size_t i=0; i<N; ++i)
+    if (items.z[i] != LabelSufficientStats::kNone)
+      items.z[i] = labelMap[items.z[i]] < Knew ? labelMap[items.z[i]]
+        : LabelSufficientStats::kNone;
+  LabelSufficientStats refRelabel(Knew, N, true);
+  refRelabel.Accumulate(N, get);
+  ExpectSame(stats, refRelabel);
+
+  // the relabeled statistics keep following item changes
+  stats.Resize(K);
+  for (size_t i=0; i<N; i+=3) {
+    items.Draw(i, K);
+    stats.Touch(i);
+  }
+  stats.SyncTouched(get);
+  LabelSufficientStats refResize(K, N, true);
+  refResize.Accumulate(N, get);
+  ExpectSame(stats, refResize);
+}
+
+TEST(labelSufficientStats, moveMatchesAccumulate) {
+  const size_t N = 3000, K = 10;
+  Items items(N, K, 2);
+  auto get = [&](size_t i, uint32_t& k, Vector3fda& x) {
+    return items.Get(i, k, x);
+  };
+  // plain deltas without item tracking
+  LabelSufficientStats stats(K, 0);
+  for (size_t i=0; i<N; ++i) stats.Add(items.z[i], items.x[i]);
+  std::uniform_int_distribution<uint32_t> label(0, K-1);
+  for (size_t i=0; i<N; i+=2) {
+    if (items.z[i] == LabelSufficientStats::kNone) continue;
+    const uint32_t k = label(items.gen);
+    stats.Move(items.z[i], k, items.x[i]);
+    items.z[i] = k;
+  }
+  LabelSufficientStats ref(K, N);
+  ref.Accumulate(N, get);
+  for (uint32_t k=0; k<K; ++k) {
+    EXPECT_NEAR(stats.Count(k), ref.Count(k), 1e-3) << "label " << k;
+    EXPECT_TRUE(IsAppox(stats.Sum(k), ref.Sum(k), 1e-3)) << "label " << k;
+  }
+}
+
+TEST(labelSufficientStats, accumulateThreads) {
+  const size_t N = 200000, K = 30;
+  Items items(N, K, 3);
+  auto get = [&](size_t i, uint32_t& k, Vector3fda& x) {
+    return items.Get(i, k, x);
+  };
+  LabelSufficientStats stats1(K, N, true), stats3(K, N, true);
+  stats1.Accumulate(N, get, 1);
+  stats3.Accumulate(N, get, 3);
+  for (uint32_t k=0; k<K; ++k) {
+    EXPECT_EQ(stats1.FirstOrder(k), stats3.FirstOrder(k));
+    EXPECT_EQ(stats1.Outer(k), stats3.Outer(k));
+  }
+  // items beyond N are forgotten
+  stats1.Accumulate(N/2, get, 1);
+  EXPECT_EQ(LabelSufficientStats::kNone, stats1.Label(N/2));
+}
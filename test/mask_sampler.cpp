@@ -0,0 +1,108 @@
+#include <tdp/testing/testing.h>
+#include <math.h>
+#include <random>
+#include <vector>
+#include <tdp/camera/camera.h>
+#include <tdp/cuda/cuda.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/preproc/mask.h>
+#include <tdp/preproc/mask_sampler.h>
+
+using namespace tdp;
+
+namespace {
+
+/// Depth between 1 and 3m with a few holes and a grey gradient norm
+/// with some strong edges.
+void RenderScene(Image<Vector3fda>& pc, Image<float>& greyGradNorm) {
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<float> unif(0.f, 1.f);
+  for (size_t v=0; v<pc.h_; ++v)
+    for (size_t u=0; u<pc.w_; ++u) {
+      const float z = 1.f + 2.f*u/pc.w_;
+      pc(u,v) = unif(gen) < 0.1f ? Vector3fda(NAN,NAN,NAN)
+        : Vector3fda(0.f, 0.f, z);
+      greyGradNorm(u,v) = (u%17 == 0 || v%11 == 0) ? 2.f : 0.1f*unif(gen);
+    }
+}
+
+struct MaskStats {
+  MaskStats() : count(0.), gradSum(0.) {}
+  void Add(const Image<uint8_t>& mask, const Image<float>& greyGradNorm) {
+    for (size_t i=0; i<mask.Area(); ++i)
+      if (mask[i]) {
+        count ++;
+        gradSum += greyGradNorm[i];
+      }
+  }
+  double count;
+  double gradSum;
+};
+
+}
+
+TEST(maskSampler, matchesPerPixelCoins) {
+  const size_t w = 128, h = 96, I = 8, J = 8;
+  Cameraf cam(Eigen::Vector4f(120, 120, 63.5, 47.5));
+  ManagedHostImage<Vector3fda> pc(w,h);
+  ManagedHostImage<float> greyGradNorm(w,h);
+  RenderScene(pc, greyGradNorm);
+  ManagedHostImage<uint8_t> mask(w,h);
+  std::vector<uint32_t> idNew;
+  const float pUniform = 0.3f;
+  const size_t T = 300;
+  // sparse sampling and dense sampling where many pixels have p >= 1
+  for (float subsample : {0.5f, 20.f}) {
+    MaskStats ref, fast;
+    std::mt19937 genRef(2), gen(3);
+    GradientMaskSampler sampler;
+    for (size_t t=0; t<T; ++t) {
+      mask.Fill(0);
+      idNew.clear();
+      GradientNormBiasedResampleEmptyPartsOfMask(pc, cam, mask,
+          greyGradNorm, 0, subsample, genRef, I, J, w, h, pUniform, idNew);
+      ref.Add(mask, greyGradNorm);
+      mask.Fill(0);
+      idNew.clear();
+      sampler.ResampleEmptyParts(pc, mask, greyGradNorm, subsample, gen,
+          I, J, w, h, pUniform, idNew);
+      const double countBefore = fast.count;
+      fast.Add(mask, greyGradNorm);
+      ASSERT_EQ(idNew.size(), fast.count-countBefore);
+    }
+    // the counts of a frame are sums of independent coins with a
+    // variance below the mean
+    const double meanRef = ref.count/T;
+    const double meanFast = fast.count/T;
+    EXPECT_NEAR(meanFast, meanRef, 5.*sqrt(2.*meanRef/T))
+      << "subsample " << subsample;
+    EXPECT_NEAR(fast.gradSum/fast.count, ref.gradSum/ref.count,
+        0.03*ref.gradSum/ref.count) << "subsample " << subsample;
+  }
+}
+
+TEST(maskSampler, threadIndependence) {
+  const size_t w = 128, h = 96, I = 8, J = 8;
+  ManagedHostImage<Vector3fda> pc(w,h);
+  ManagedHostImage<float> greyGradNorm(w,h);
+  RenderScene(pc, greyGradNorm);
+  std::vector<uint32_t> ids[2];
+  ManagedHostImage<uint8_t> mask1(w,h), mask3(w,h);
+  for (size_t k=0; k<2; ++k) {
+    ManagedHostImage<uint8_t>& mask = k == 0 ? mask1 : mask3;
+    // some blocks already have pixels and are only cleared
+    mask.Fill(0);
+    for (size_t i=0; i<mask.Area(); i+=613) mask[i] = 255;
+    GradientMaskSampler sampler;
+    sampler.numThreads_ = k == 0 ? 1 : 3;
+    std::mt19937 gen(4);
+    sampler.ResampleEmptyParts(pc, mask, greyGradNorm, 2.f, gen, I, J,
+        w, h, 0.3f, ids[k]);
+  }
+  ASSERT_GT(ids[0].size(), 0u);
+  ASSERT_EQ(ids[0], ids[1]);
+  for (size_t i=0; i<mask1.Area(); ++i) {
+    ASSERT_EQ(mask1[i], mask3[i]);
+    ASSERT_TRUE(mask1[i] == 0 || mask1[i] == 128);
+  }
+}
@@ -0,0 +1,212 @@
+#include <tdp/testing/testing.h>
+#include <math.h>
+#include <vector>
+#include <Eigen/Dense>
+#include <tdp/camera/camera.h>
+#include <tdp/camera/photometric.h>
+#include <tdp/camera/rig.h>
+#include <tdp/cuda/cuda.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/manifold/SE3.h>
+#include <tdp/slam/keyframe.h>
+
+using namespace tdp;
+
+namespace {
+
+const size_t kW = 128, kH = 96;
+
+/// Texture of the wall z = 1 + 0.1 sin(3x) in the world frame.
+float Texture(const Vector3fda& p_w) {
+  return sin(7.f*p_w(0)) + cos(5.f*p_w(1));
+}
+
+/// Grey image and point cloud (in the frame of T_wr) of the wall seen
+/// by cam at T_wr*T_rc, written into the rows of the stream.
+void Render(const Cameraf& cam, const SE3f& T_wr, const SE3f& T_rc,
+    Image<float> grey, Image<Vector3fda> pc) {
+  const SE3f T_wc = T_wr*T_rc;
+  for (size_t v=0; v<grey.h_; ++v)
+    for (size_t u=0; u<grey.w_; ++u) {
+      const Vector3fda dir = T_wc.rotation()*cam.Unproject(u, v, 1.f);
+      const Vector3fda o = T_wc.translation();
+      float t = 1.f;
+      for (size_t it=0; it<30; ++it) {
+        const Vector3fda p = o + t*dir;
+        t = (1.f + 0.1f*sin(3.f*p(0)) - o(2))/dir(2);
+      }
+      const Vector3fda p_w = o + t*dir;
+      // a few holes
+      pc(u,v) = (u*7+v*13)%37 == 0 ? Vector3fda(NAN,NAN,NAN)
+        : Vector3fda(T_wr.Inverse()*p_w);
+      grey(u,v) = Texture(p_w);
+    }
+}
+
+/// Rig of two cameras with stacked streams of kW x kH.
+Rig<Cameraf> MakeRig() {
+  Rig<Cameraf> rig;
+  rig.cams_.push_back(Cameraf(Eigen::Vector4f(110, 110, 63.5, 47.5)));
+  rig.cams_.push_back(Cameraf(Eigen::Vector4f(100, 105, 60.5, 49.5)));
+  Eigen::Matrix<float,6,1> x;
+  x << 0.f, 0.1f, 0.f, 0.05f, 0.f, 0.f;
+  rig.T_rcs_.push_back(SE3f());
+  rig.T_rcs_.push_back(SE3f::Exp_(x));
+  for (int32_t c=0; c<2; ++c) {
+    rig.rgbStream2cam_.push_back(c);
+    rig.dStream2cam_.push_back(c);
+    rig.rgbdStream2cam_.push_back(c);
+  }
+  rig.wOrig = rig.wSingle = kW;
+  rig.hOrig = rig.hSingle = kH;
+  rig.camMin_ = 0;
+  return rig;
+}
+
+/// Stacked grey images and point clouds of the rig at T_wr and scale.
+void RenderRig(const Rig<Cameraf>& rig, const SE3f& T_wr, float scale,
+    Image<float> grey, Image<Vector3fda> pc) {
+  for (size_t s=0; s<rig.rgbStream2cam_.size(); ++s) {
+    const int32_t c = rig.rgbStream2cam_[s];
+    Render(rig.cams_[c].Scale(scale), T_wr, rig.T_rcs_[c],
+        rig.GetStreamRoiOrigSize(grey, s, scale),
+        rig.GetStreamRoiOrigSize(pc, s, scale));
+  }
+}
+
+SE3f Pose(float a, float b, float c, float d, float e, float f) {
+  Eigen::Matrix<float,6,1> x;
+  x << a, b, c, d, e, f;
+  return SE3f::Exp_(x);
+}
+
+}
+
+TEST(photometric, overlapStatsMatchOverlap) {
+  const Cameraf cam(Eigen::Vector4f(110, 110, 63.5, 47.5));
+  const SE3f T_wa, T_wb = Pose(0.02f, -0.05f, 0.01f, 0.1f, -0.03f, 0.02f);
+  const SE3f T_ab = T_wa.Inverse()*T_wb;
+  ManagedHostImage<float> greyA(kW,kH), greyB(kW,kH);
+  ManagedHostImage<Vector3fda> pcA(kW,kH), pcB(kW,kH);
+  Render(cam, T_wa, SE3f(), greyA, pcA);
+  Render(cam, T_wb, SE3f(), greyB, pcB);
+
+  float overlap = 0.f, rmse = 0.f;
+  ManagedHostImage<float> errB(kW,kH), errBstats(kW,kH);
+  errB.Fill(-1.f);
+  errBstats.Fill(-1.f);
+  Overlap(greyA, greyB, pcA, pcB, T_ab, cam, overlap, rmse, &errB);
+  ASSERT_GT(overlap, 0.5f);
+  ASSERT_LT(overlap, 0.99f);
+
+  // without the distance test every projection into A counts
+  Eigen::Vector3d stats = Eigen::Vector3d::Zero();
+  OverlapStatsCpu(greyA, greyB, pcA, pcB, T_ab, cam, stats, &errBstats,
+      SE3f(), INFINITY);
+  size_t numValid = 0, numHoles = 0;
+  for (size_t i=0; i<pcB.Area(); ++i) {
+    if (!IsValidData(pcB[i])) continue;
+    numValid ++;
+    // points that land on a hole of A are dropped
+    if (errB[i] >= 0.f && errBstats[i] < 0.f) {
+      numHoles ++;
+      continue;
+    }
+    EXPECT_NEAR(errB[i], errBstats[i], 1e-4f) << "pixel " << i;
+  }
+  ASSERT_GT(numHoles, 0u);
+  EXPECT_EQ(stats(2), numValid);
+  EXPECT_NEAR(stats(1)+numHoles, overlap*stats(2), 1e-3*stats(2));
+  EXPECT_LE(stats(0), rmse*rmse*stats(2)*(1.+1e-4));
+
+  // the true pose passes the distance test almost everywhere; a pose
+  // 10cm off along the optical axis nowhere
+  Eigen::Vector3d statsThr = Eigen::Vector3d::Zero();
+  OverlapStatsCpu(greyA, greyB, pcA, pcB, T_ab, cam, statsThr);
+  EXPECT_EQ(statsThr(2), stats(2));
+  EXPECT_GT(statsThr(1), 0.95*stats(1));
+  EXPECT_LT(sqrt(statsThr(0)/statsThr(1)), 0.05);
+  Eigen::Vector3d statsOff = Eigen::Vector3d::Zero();
+  OverlapStatsCpu(greyA, greyB, pcA, pcB, Pose(0,0,0,0,0,0.1f)*T_ab, cam,
+      statsOff);
+  EXPECT_LT(statsOff(1), 0.01*stats(1));
+}
+
+TEST(photometric, overlapCpuMatchesOverlap) {
+  const Rig<Cameraf> rig = MakeRig();
+  const SE3f T_wa = Pose(0.01f, 0.f, 0.f, 0.f, 0.02f, 0.f);
+  const SE3f T_wb = Pose(0.f, -0.04f, 0.02f, 0.06f, 0.f, 0.03f);
+  const SE3f T_ab = T_wa.Inverse()*T_wb;
+  for (int lvl=0; lvl<2; ++lvl) {
+    const float scale = pow(0.5,lvl);
+    const size_t w = kW >> lvl, h = 2*kH >> lvl;
+    ManagedHostImage<float> greyA(w,h), greyB(w,h);
+    ManagedHostImage<Vector3fda> pcA(w,h), pcB(w,h);
+    RenderRig(rig, T_wa, scale, greyA, pcA);
+    RenderRig(rig, T_wb, scale, greyB, pcB);
+
+    float overlap = 0.f, rmse = 0.f;
+    OverlapCpu(greyA, greyB, pcA, pcB, T_ab, rig, scale, overlap, rmse);
+    // the scalar reference per stream in the camera frames
+    float overlapRef = 0.f, rmseRef = 0.f;
+    for (size_t s=0; s<2; ++s) {
+      float overlapi = 0.f, rmsei = 0.f;
+      Overlap(rig.GetStreamRoiOrigSize(greyA, s, scale),
+          rig.GetStreamRoiOrigSize(greyB, s, scale),
+          rig.GetStreamRoiOrigSize(pcA, s, scale),
+          rig.GetStreamRoiOrigSize(pcB, s, scale),
+          rig.T_rcs_[s].Inverse()*T_ab, rig.cams_[s].Scale(scale),
+          overlapi, rmsei);
+      ASSERT_GT(overlapi, 0.3f) << "stream " << s;
+      overlapRef += 0.5f*overlapi;
+      rmseRef += 0.5f*rmsei;
+    }
+    // only the holes of A and the distance test make the difference
+    EXPECT_LT(overlap, overlapRef) << "level " << lvl;
+    EXPECT_GT(overlap, overlapRef - 0.06f) << "level " << lvl;
+    EXPECT_LT(rmse, 0.05f) << "level " << lvl;
+    EXPECT_LE(rmse, rmseRef) << "level " << lvl;
+  }
+}
+
+TEST(photometric, overlapHypothesesThreads) {
+  const Rig<Cameraf> rig = MakeRig();
+  const int lvl = 1;
+  const float scale = pow(0.5,lvl);
+  std::vector<SE3f> T_wk;
+  for (size_t k=0; k<5; ++k)
+    T_wk.push_back(Pose(0.01f*k, -0.02f*(k%2), 0.f, 0.03f*k, 0.01f*k, 0.f));
+  std::vector<KeyFrame> kfs(T_wk.size());
+  for (size_t k=0; k<kfs.size(); ++k) {
+    kfs[k].pyrGrey_.Reinitialise(kW, 2*kH);
+    kfs[k].pyrPc_.Reinitialise(kW, 2*kH);
+    kfs[k].T_wk_ = T_wk[k];
+    RenderRig(rig, T_wk[k], scale, kfs[k].pyrGrey_.GetImage(lvl),
+        kfs[k].pyrPc_.GetImage(lvl));
+  }
+  std::vector<OverlapHypothesis> hyps;
+  for (size_t a=0; a<kfs.size(); ++a)
+    for (size_t b=0; b<kfs.size(); ++b)
+      if (a != b)
+        hyps.push_back(OverlapHypothesis(a, b,
+              T_wk[a].Inverse()*T_wk[b]));
+  auto getKf = [&](size_t id) { return &kfs[id]; };
+
+  std::vector<OverlapHypothesis> hyps1 = hyps, hyps3 = hyps;
+  OverlapCpu(getKf, rig, lvl, hyps1, 1);
+  OverlapCpu(getKf, rig, lvl, hyps3, 3);
+  for (size_t i=0; i<hyps.size(); ++i) {
+    const OverlapHypothesis& hyp = hyps[i];
+    float overlap = 0.f, rmse = 0.f;
+    OverlapCpu(kfs[hyp.idA].pyrGrey_.GetConstImage(lvl),
+        kfs[hyp.idB].pyrGrey_.GetConstImage(lvl),
+        kfs[hyp.idA].pyrPc_.GetConstImage(lvl),
+        kfs[hyp.idB].pyrPc_.GetConstImage(lvl),
+        hyp.T_ab, rig, scale, overlap, rmse);
+    EXPECT_GT(overlap, 0.1f) << "hypothesis " << i;
+    EXPECT_EQ(hyps1[i].overlap, overlap) << "hypothesis " << i;
+    EXPECT_EQ(hyps1[i].rmse, rmse) << "hypothesis " << i;
+    EXPECT_EQ(hyps3[i].overlap, overlap) << "hypothesis " << i;
+    EXPECT_EQ(hyps3[i].rmse, rmse) << "hypothesis " << i;
+  }
+}
@@ -0,0 +1,134 @@
+#include <cstdio>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <tdp/testing/testing.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/io/ply.h>
+#include <tdp/io/ply_cache.h>
+#include <tdp/io/tinyply.h>
+
+TEST(ply, streamedPointCloudRoundTrip) {
+  tdp::ManagedHostImage<tdp::Vector3fda> pc(64,48);
+  tdp::ManagedHostImage<tdp::Vector3fda> n(64,48);
+  tdp::ManagedHostImage<tdp::Vector3bda> rgb(64,48);
+  size_t numValid = 0;
+  for (size_t i=0; i<pc.Area(); ++i) {
+    pc[i] = tdp::Vector3fda::Random();
+    n[i] = tdp::Vector3fda::Random().normalized();
+    rgb[i] = tdp::Vector3bda(i%256, (i/3)%256, (i/7)%256);
+    if (i%5 == 0) {
+      pc[i](1) = NAN;
+    } else {
+      ++numValid;
+    }
+  }
+  std::string path = "./testStreamedPc.ply";
+  ASSERT_TRUE(tdp::SavePointCloudStreamed(path, pc, n, rgb));
+
+  tdp::ManagedHostImage<tdp::Vector3fda> pcL, nL;
+  tdp::ManagedHostImage<tdp::Vector3bda> rgbL;
+  ASSERT_TRUE(tdp::LoadPointCloudMapped(path, pcL, &nL, &rgbL));
+  ASSERT_EQ(numValid, pcL.Area());
+  ASSERT_EQ(numValid, nL.Area());
+  ASSERT_EQ(numValid, rgbL.Area());
+  size_t j = 0;
+  for (size_t i=0; i<pc.Area(); ++i) {
+    if (i%5 == 0) continue;
+    ASSERT_TRUE(IsAppox(pc[i], pcL[j], 1e-6f));
+    ASSERT_TRUE(IsAppox(n[i], nL[j], 1e-6f));
+    ASSERT_TRUE(rgb[i] == rgbL[j]);
+    ++j;
+  }
+
+  // the tinyply reader has to agree with the mapped reader
+  tdp::ManagedHostImage<tdp::Vector3fda> pcT;
+  std::ifstream in(path, std::ios::binary);
+  tinyply::PlyFile ply(in);
+  std::vector<float> vertices;
+  ply.request_properties_from_element("vertex", {"x", "y", "z"}, vertices);
+  ply.read(in);
+  ASSERT_EQ(numValid*3, vertices.size());
+  for (size_t i=0; i<numValid; ++i)
+    for (size_t k=0; k<3; ++k)
+      ASSERT_EQ(pcL[i](k), vertices[i*3+k]);
+  std::remove(path.c_str());
+}
+
+TEST(ply, streamedMeshRoundTrip) {
+  tdp::ManagedHostImage<tdp::Vector3fda> pc(4,1);
+  tdp::ManagedHostImage<tdp::Vector3uda> tri(2,1);
+  pc[0] = tdp::Vector3fda(0,0,0);
+  pc[1] = tdp::Vector3fda(NAN,0,0);
+  pc[2] = tdp::Vector3fda(1,0,0);
+  pc[3] = tdp::Vector3fda(0,1,0);
+  tri[0] = tdp::Vector3uda(0,2,3);
+  tri[1] = tdp::Vector3uda(0,1,2);
+  std::string path = "./testStreamedMesh.ply";
+  ASSERT_TRUE(tdp::SaveMeshStreamed(path, pc, tri));
+
+  tdp::ManagedHostImage<tdp::Vector3fda> pcL;
+  tdp::ManagedHostImage<tdp::Vector3uda> triL;
+  ASSERT_TRUE(tdp::LoadMeshMapped(path, pcL, triL));
+  ASSERT_EQ(3, pcL.Area());
+  ASSERT_EQ(1, triL.Area());
+  ASSERT_TRUE(triL[0] == tdp::Vector3uda(0,1,2));
+  ASSERT_TRUE(IsAppox(pcL[2], pc[3], 1e-6f));
+  std::remove(path.c_str());
+}
+
+TEST(ply, asciiIsNotMapped) {
+  std::string path = "./testAscii.ply";
+  std::ofstream out(path);
+  out << "ply\nformat ascii 1.0\nelement vertex 1\n"
+    << "property float x\nproperty float y\nproperty float z\n"
+    << "end_header\n0 1 2\n";
+  out.close();
+  tdp::ManagedHostImage<tdp::Vector3fda> pc;
+  ASSERT_FALSE(tdp::LoadPointCloudMapped(path, pc));
+  tdp::LoadPointCloud(path, pc);
+  ASSERT_EQ(1, pc.Area());
+  ASSERT_EQ(2.f, pc[0](2));
+  std::remove(path.c_str());
+}
+
+TEST(plyCache, visibleTilesAreNotEvicted) {
+  const size_t N = 6;
+  tdp::ManagedHostImage<tdp::Vector3fda> pc(100,1), n(100,1);
+  for (size_t i=0; i<pc.Area(); ++i) {
+    pc[i] = tdp::Vector3fda::Random();
+    n[i] = tdp::Vector3fda::UnitZ();
+  }
+  std::vector<std::string> paths;
+  for (size_t i=0; i<N+2; ++i) {
+    paths.push_back("./testPlyCache"+std::to_string(i)+".ply");
+    ASSERT_TRUE(tdp::SavePointCloudStreamed(paths.back(), pc, n));
+  }
+  const size_t assetBytes = pc.SizeBytes() + n.SizeBytes();
+  // N tiles fit up to one byte so that the last load has to evict
+  tdp::PlyCache cache(paths, N*assetBytes-1, 1);
+  cache.Schedule(0, N, 1, 0);
+  size_t numLoaded = 0;
+  for (size_t it=0; it<5000 && numLoaded < N; ++it) {
+    size_t i;
+    std::shared_ptr<tdp::PlyAsset> asset;
+    if (cache.PopLoaded(i, asset)) {
+      numLoaded ++;
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  ASSERT_EQ(N, numLoaded);
+  for (size_t i=0; i<N; ++i) {
+    std::shared_ptr<tdp::PlyAsset> asset = cache.Get(i);
+    ASSERT_TRUE(asset != nullptr) << "tile " << i << " was evicted";
+    EXPECT_EQ(pc.Area(), asset->pc.Area());
+  }
+  EXPECT_EQ(N*assetBytes, cache.SizeBytes());
+  for (auto& path : paths) std::remove(path.c_str());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,90 @@
+#include <tdp/testing/testing.h>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <Eigen/Dense>
+#include <tdp/manifold/SE3.h>
+#include <tdp/slam/pose_graph.h>
+#include <tdp/slam/keyframe_slam.h>
+
+using namespace tdp;
+
+static SE3d Perturb(const SE3d& T, const Eigen::Matrix<double,6,1>& d) {
+  return T*SE3d(SO3d::Exp_(d.head<3>()), Eigen::Vector3d(d.tail<3>()));
+}
+
+TEST(poseGraph, jacobians) {
+  SE3d T_wa = SE3d::Random(1., Eigen::Vector3d::Zero(), 1.);
+  SE3d T_wb = SE3d::Random(1., Eigen::Vector3d::Zero(), 1.);
+  SE3d T_ab = SE3d::Random(1., Eigen::Vector3d::Zero(), 1.);
+  Eigen::Matrix<double,6,6> J_a, J_b, Jn_a, Jn_b;
+  Eigen::Matrix<double,6,1> r = PoseGraph::Residual(T_wa, T_wb, T_ab,
+      &J_a, &J_b);
+  const double eps = 1e-6;
+  for (size_t i=0; i<6; ++i) {
+    Eigen::Matrix<double,6,1> d = Eigen::Matrix<double,6,1>::Zero();
+    d(i) = eps;
+    Jn_a.col(i) = (PoseGraph::Residual(Perturb(T_wa,d), T_wb, T_ab) - r)/eps;
+    Jn_b.col(i) = (PoseGraph::Residual(T_wa, Perturb(T_wb,d), T_ab) - r)/eps;
+  }
+  ASSERT_TRUE(IsAppox(J_a, Jn_a, 1e-4));
+  ASSERT_TRUE(IsAppox(J_b, Jn_b, 1e-4));
+}
+
+TEST(poseGraph, loopClosure) {
+  // poses on a circle with noisy odometry and one loop closure
+  const size_t N = 10000;
+  std::mt19937 gen(1);
+  std::normal_distribution<double> normal(0., 1e-3);
+  std::vector<SE3d> T_gt;
+  for (size_t i=0; i<N; ++i) {
+    double alpha = 2.*M_PI*i/N;
+    Eigen::Matrix<double,6,1> w;
+    w << 0, 0, alpha, 10.*cos(alpha), 10.*sin(alpha), 0;
+    T_gt.push_back(SE3d(SO3d::Exp_(w.head<3>()),
+          Eigen::Vector3d(w.tail<3>())));
+  }
+  const Eigen::Matrix<double,6,6> info =
+    1e4*Eigen::Matrix<double,6,6>::Identity();
+  PoseGraph graph;
+  graph.AddPose(T_gt[0]);
+  graph.AddPrior(0, T_gt[0], info);
+  for (size_t i=1; i<N; ++i) {
+    Eigen::Matrix<double,6,1> noise;
+    for (size_t j=0; j<6; ++j) noise(j) = normal(gen);
+    SE3d T_ab = Perturb(T_gt[i-1].Inverse()*T_gt[i], noise);
+    graph.AddPose(graph.GetPose(i-1)*T_ab);
+    graph.AddFactor(i-1, i, T_ab, info);
+  }
+  double errBefore = graph.GetPose(N-1).Log(T_gt[N-1]).norm();
+  graph.Optimize();
+
+  graph.AddFactor(0, N-1, T_gt[0].Inverse()*T_gt[N-1], 1e2*info);
+  double chi2Before = graph.Chi2();
+  auto t0 = std::chrono::high_resolution_clock::now();
+  double chi2 = graph.Optimize();
+  auto t1 = std::chrono::high_resolution_clock::now();
+  std::cout << "loop closure over " << N << " poses: "
+    << std::chrono::duration_cast<std::chrono::milliseconds>(t1-t0).count()
+    << "ms" << std::endl;
+  double errAfter = graph.GetPose(N-1).Log(T_gt[N-1]).norm();
+  std::cout << "chi2 " << chi2Before << " -> " << chi2
+    << " err " << errBefore << " -> " << errAfter << std::endl;
+  ASSERT_LT(chi2, chi2Before);
+  ASSERT_LT(errAfter, errBefore);
+  ASSERT_LT(errAfter, 1e-2);
+}
+
+TEST(poseGraph, keyframeSLAM) {
+  SE3f T_wk0;
+  SE3f T_wk1(SO3f::Rx(5.*M_PI/180.), Eigen::Vector3f(0,0,1));
+  SE3f dT_01(SO3f::Rx(6.*M_PI/180.), Eigen::Vector3f(0,0,1.1));
+
+  KeyframeSLAM kfSLAM;
+  kfSLAM.AddOrigin(T_wk0);
+  kfSLAM.AddPose(T_wk1);
+  kfSLAM.AddLoopClosure(0,1,dT_01);
+  kfSLAM.Optimize();
+  ASSERT_TRUE(IsAppox(kfSLAM.GetPose(0).matrix(), T_wk0.matrix(), 1e-3));
+  ASSERT_TRUE(IsAppox(kfSLAM.GetPose(1).matrix(), dT_01.matrix(), 1e-3));
+}
@@ -0,0 +1,65 @@
+#include <tdp/testing/testing.h>
+#include <cmath>
+#include <vector>
+#include <tdp/camera/camera.h>
+#include <tdp/camera/projective_raster.h>
+#include <tdp/data/circular_buffer.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/data/managed_pyramid.h>
+
+using namespace tdp;
+
+TEST(projectiveRaster, zbuffer) {
+  Cameraf cam(Eigen::Vector4f(100, 100, 15.5, 11.5));
+  const size_t w = 32, h = 24;
+  ManagedHostCircularBuffer<Vector3fda> pc_w(10);
+  ManagedHostCircularBuffer<Vector3fda> n_w(10);
+  ManagedHostCircularBuffer<uint16_t> ts(10);
+  // two surfels on the optical axis; the closer one wins
+  pc_w.Insert(Vector3fda(0,0,2));   n_w.Insert(Vector3fda(0,0,-1)); ts.Insert(5);
+  pc_w.Insert(Vector3fda(0,0,1));   n_w.Insert(Vector3fda(0,0,-1)); ts.Insert(5);
+  // facing away from the camera
+  pc_w.Insert(Vector3fda(0.1,0,1)); n_w.Insert(Vector3fda(0,0,1));  ts.Insert(5);
+  // too old
+  pc_w.Insert(Vector3fda(0,0.1,1)); n_w.Insert(Vector3fda(0,0,-1)); ts.Insert(1);
+  // beyond dMax
+  pc_w.Insert(Vector3fda(-0.1,0,5)); n_w.Insert(Vector3fda(0,0,-1)); ts.Insert(5);
+  // visible
+  pc_w.Insert(Vector3fda(0,-0.1,1)); n_w.Insert(Vector3fda(0,0,-1)); ts.Insert(5);
+  pc_w.Insert(Vector3fda(NAN,NAN,NAN)); n_w.Insert(Vector3fda(0,0,-1)); ts.Insert(5);
+
+  ProjectiveRasterizer<Cameraf> raster(cam, w, h);
+  raster.Associate(pc_w, n_w, ts, SE3f(), 0.1, 4., 2, pc_w.SizeToRead());
+  ManagedHostImage<uint32_t> z(w, h);
+  raster.GetAssoc(z);
+  std::vector<uint32_t> ids;
+  for (size_t i=0; i<z.Area(); ++i)
+    if (z[i] > 0) ids.push_back(z[i]-1);
+  ASSERT_EQ(ids.size(), (size_t)2);
+  ASSERT_EQ(z(16,12), (uint32_t)2);
+  ASSERT_EQ(z(16,2), (uint32_t)6);
+  ManagedHostImage<float> d(w, h);
+  raster.GetDepth(d);
+  ASSERT_NEAR(d(16,12), 1., 1e-6);
+  ASSERT_TRUE(std::isnan(d(0,0)));
+
+  // the measured surface is at 1m only at the optical axis
+  ManagedHostPyramid<Vector3fda,2> pyrPc(w, h);
+  Image<Vector3fda> pc0 = pyrPc.GetImage(0);
+  pc0.Fill(Vector3fda(0,0,3));
+  pc0(16,12) = Vector3fda(0,0,1.01);
+  Image<Vector3fda> pc1 = pyrPc.GetImage(1);
+  pc1.Fill(Vector3fda(0,0,3));
+  ManagedHostPyramid<uint32_t,2> pyrZ(w, h);
+  ManagedHostPyramid<uint8_t,2> pyrMask(w, h);
+  pyrMask.Fill(0);
+  std::vector<uint32_t> ids0, ids1;
+  std::vector<std::vector<uint32_t>*> idsLvl = {&ids0, &ids1};
+  raster.GetAssocOcclusion(pyrPc, 0.05, 0.1, 4., 2, pyrZ, pyrMask, idsLvl);
+  ASSERT_EQ(ids0.size(), (size_t)1);
+  ASSERT_EQ(ids0[0], (uint32_t)1);
+  ASSERT_EQ(pyrMask.GetImage(0)(16,2), 0);
+  ASSERT_EQ(pyrMask.GetImage(0)(16,12), 255);
+  ASSERT_EQ(ids1.size(), (size_t)2);
+  ASSERT_EQ(pyrZ.GetImage(1)(8,6), (uint32_t)2);
+}
@@ -0,0 +1,77 @@
+#include <tdp/testing/testing.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <tdp/data/circular_buffer.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/data/published_cursor.h>
+
+using namespace tdp;
+
+TEST(publishedCursor, producerConsumers) {
+  const int32_t N = 20000;
+  ManagedHostCircularBuffer<int32_t> buf(N+1);
+  buf.Fill(-1);
+  PublishedCursor cursor;
+  std::atomic<int32_t> numBad(0);
+  std::vector<std::thread> consumers;
+  for (size_t t=0; t<3; ++t) {
+    consumers.push_back(std::thread([&]() {
+      int32_t seen = 0;
+      while (seen < N) {
+        const int32_t i = cursor.WaitChange(seen);
+        // every published entry has been written
+        for (int32_t j=seen; j<i; ++j)
+          if (buf[j] != j) numBad ++;
+        seen = i;
+      }
+    }));
+  }
+  for (int32_t i=0; i<N; ++i) {
+    buf.Insert(i);
+    if (i%7 == 0 || i+1 == N) cursor.Publish(buf.iInsert_);
+  }
+  for (auto& consumer : consumers) consumer.join();
+  ASSERT_EQ(numBad.load(), 0);
+  ASSERT_EQ(cursor.Acquire(), N);
+}
+
+TEST(publishedCursor, close) {
+  PublishedCursor cursor;
+  std::thread waiter([&]() { ASSERT_EQ(cursor.WaitChange(0), 0); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  cursor.Close();
+  waiter.join();
+  ASSERT_TRUE(cursor.Closed());
+  ASSERT_EQ(cursor.WaitChange(0, std::chrono::milliseconds(1)), 0);
+}
+
+TEST(readEpoch, synchronize) {
+  ReadEpoch epoch;
+  std::atomic<bool> writing(false);
+  std::atomic<bool> run(true);
+  std::atomic<int32_t> numInside(0);
+  std::atomic<int32_t> numOverlap(0);
+  std::vector<std::thread> readers;
+  for (size_t t=0; t<4; ++t) {
+    readers.push_back(std::thread([&]() {
+      while (run) {
+        ReadEpoch::Guard guard(epoch);
+        if (writing) continue;
+        numInside ++;
+        numInside --;
+      }
+    }));
+  }
+  for (size_t it=0; it<200; ++it) {
+    writing = true;
+    epoch.Synchronize();
+    // no reader may be inside now
+    if (numInside.load() != 0) numOverlap ++;
+    writing = false;
+  }
+  run = false;
+  for (auto& reader : readers) reader.join();
+  ASSERT_EQ(numOverlap.load(), 0);
+}
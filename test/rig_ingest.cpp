@@ -0,0 +1,115 @@
+#include <tdp/testing/testing.h>
+#include <math.h>
+#include <vector>
+#include <tdp/camera/camera.h>
+#include <tdp/camera/rig.h>
+#include <tdp/camera/rig_ingest.h>
+#include <tdp/cuda/cuda.h>
+#include <tdp/data/managed_image.h>
+
+using namespace tdp;
+
+namespace {
+
+/// Two rgbd cameras as set up by CorrespondOpenniStreams2Cams: rgb
+/// camera 2i and depth camera 2i+1 for rgbd stream i.
+void SetupRig(Rig<Cameraf>& rig, size_t w, size_t h) {
+  for (size_t i=0; i<4; ++i) {
+    rig.cams_.push_back(Cameraf(Eigen::Vector4f(50+i, 50+i, 31.5, 31.5)));
+    rig.T_rcs_.push_back(SE3f(SO3f::Exp_(Eigen::Vector3f(0.,0.1*i,0.)),
+          Eigen::Vector3f(0.1*i, 0., 0.)));
+  }
+  rig.rgbStream2cam_ = {0, 2};
+  rig.dStream2cam_ = {1, 3};
+  rig.rgbdStream2cam_ = {0, 1};
+  rig.depthSensorUniformScale_ = {1e-3f, 2e-3f, 1e-3f, 2e-3f};
+  rig.SetStreamGeometry(w, h);
+}
+
+}
+
+TEST(rigIngest, collect) {
+  const size_t w = 64, h = 64;
+  Rig<Cameraf> rig;
+  SetupRig(rig, w, h);
+  RigIngest<Cameraf> ingest(rig, 10000);
+  ASSERT_EQ(2, ingest.NumStreams());
+
+  std::vector<ManagedHostImage<uint16_t>> dRaw;
+  std::vector<ManagedHostImage<Vector3bda>> rgbRaw;
+  for (size_t sId=0; sId<2; ++sId) {
+    dRaw.emplace_back(w,h);
+    rgbRaw.emplace_back(w,h);
+    for (size_t i=0; i<w*h; ++i) {
+      dRaw[sId][i] = i%13 == 0 ? 0 : 500+i%1000+100*sId;
+      rgbRaw[sId][i] = Vector3bda(i%256, sId, 7);
+    }
+  }
+  std::vector<Image<uint16_t>> dStreams(dRaw.begin(), dRaw.end());
+  std::vector<Image<Vector3bda>> rgbStreams(rgbRaw.begin(), rgbRaw.end());
+  ManagedHostImage<float> d(rig.wSingle, 2*rig.hSingle);
+  ManagedHostImage<Vector3fda> pc(rig.wSingle, 2*rig.hSingle);
+  ManagedHostImage<Vector3bda> rgb(rig.wSingle, 2*rig.hSingle);
+  const float dMin = 0.1f, dMax = 4.f;
+
+  // both streams within the allowed skew
+  std::vector<int64_t> ts = {1000, 1500};
+  int64_t t_host_us = 0;
+  for (bool useRgbCam : {true, false}) {
+    ASSERT_EQ(2, ingest.Collect(dStreams, rgbStreams, ts, dMin, dMax,
+          useRgbCam, d, pc, &rgb, t_host_us));
+    EXPECT_EQ(1250, t_host_us);
+    for (size_t sId=0; sId<2; ++sId) {
+      const int32_t cId = rig.rgbdStream2cam_[sId];
+      const int32_t camId = useRgbCam ? rig.rgbStream2cam_[sId]
+        : rig.dStream2cam_[sId];
+      Image<float> d_i = rig.GetStreamRoi(d, sId);
+      Image<Vector3fda> pc_i = rig.GetStreamRoi(pc, sId);
+      Image<Vector3bda> rgb_i = rig.GetStreamRoi(rgb, sId);
+      size_t numBad = 0;
+      for (size_t v=0; v<h; ++v)
+        for (size_t u=0; u<w; ++u) {
+          const float di = dRaw[sId](u,v)*rig.depthSensorUniformScale_[cId];
+          if (!(dMin < di && di < dMax)) {
+            if (d_i(u,v) == d_i(u,v) || !isNan(pc_i(u,v))) numBad ++;
+            continue;
+          }
+          const Vector3fda p = rig.T_rcs_[camId]
+            * rig.cams_[camId].Unproject(u, v, di);
+          if (fabs(d_i(u,v)-di) > 1e-6f) numBad ++;
+          if ((pc_i(u,v)-p).norm() > 1e-5f) numBad ++;
+          if (rgb_i(u,v) != rgbRaw[sId](u,v)) numBad ++;
+        }
+      EXPECT_EQ(0, numBad) << "stream " << sId;
+      EXPECT_TRUE(ingest.synced_[sId]);
+    }
+  }
+
+  // stream 1 lags too much and is dropped for this frame
+  ts = {30000, 1500};
+  ASSERT_EQ(1, ingest.Collect(dStreams, rgbStreams, ts, dMin, dMax, true,
+        d, pc, &rgb, t_host_us));
+  EXPECT_EQ(30000, t_host_us);
+  EXPECT_TRUE(ingest.synced_[0]);
+  EXPECT_FALSE(ingest.synced_[1]);
+  Image<float> d_1 = rig.GetStreamRoi(d, 1);
+  Image<Vector3fda> pc_1 = rig.GetStreamRoi(pc, 1);
+  Image<Vector3bda> rgb_1 = rig.GetStreamRoi(rgb, 1);
+  size_t numValid = 0;
+  for (size_t i=0; i<d_1.Area(); ++i) {
+    const size_t u = i%d_1.w_, v = i/d_1.w_;
+    if (d_1(u,v) == d_1(u,v) || !isNan(pc_1(u,v))
+        || rgb_1(u,v) != Vector3bda::Zero())
+      numValid ++;
+  }
+  EXPECT_EQ(0, numValid);
+
+  // stream 0 without a frame
+  dStreams[0] = Image<uint16_t>();
+  ts = {0, 1500};
+  ASSERT_EQ(1, ingest.Collect(dStreams, rgbStreams, ts, dMin, dMax, true,
+        d, pc, nullptr, t_host_us));
+  EXPECT_EQ(1500, t_host_us);
+  EXPECT_FALSE(ingest.synced_[0]);
+  EXPECT_TRUE(ingest.synced_[1]);
+}
@@ -0,0 +1,284 @@
+#include <tdp/testing/testing.h>
+#include <math.h>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <Eigen/Dense>
+#include <tdp/camera/camera.h>
+#include <tdp/data/circular_buffer.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/icp/sparse_surfel_icp.h>
+#include <tdp/manifold/SE3.h>
+
+using namespace tdp;
+
+namespace {
+
+const size_t kW = 160, kH = 120;
+
+/// Room corner of three planes n.x = d: a back wall, a side wall and a
+/// floor. Normals point towards the origin.
+struct Corner {
+  Corner() {
+    n[0] = Vector3fda(0,0,-1);  d[0] = -3.f;
+    n[1] = Vector3fda(1,0,0);   d[1] = -1.f;
+    n[2] = Vector3fda(0,-1,0);  d[2] = -1.f;
+  }
+  /// Closest intersection of the ray o + t dir with the planes.
+  bool Intersect(const Vector3fda& o, const Vector3fda& dir,
+      Vector3fda& p, Vector3fda& np) const {
+    float tMin = std::numeric_limits<float>::max();
+    for (int k=0; k<3; ++k) {
+      const float t = (d[k] - n[k].dot(o))/n[k].dot(dir);
+      if (t > 0.f && t < tMin) {
+        tMin = t;
+        np = n[k];
+      }
+    }
+    p = o + tMin*dir;
+    return tMin < std::numeric_limits<float>::max();
+  }
+  Vector3fda n[3];
+  float d[3];
+};
+
+/// Depth, point cloud and normals (camera frame) of the corner seen by
+/// cam at T_wc.
+void Render(const Cameraf& cam, const SE3f& T_wc, Image<float>& d,
+    Image<Vector3fda>& pc, Image<Vector3fda>& n, Image<Vector3fda>& ray) {
+  const Corner corner;
+  const SE3f T_cw = T_wc.Inverse();
+  for (size_t v=0; v<kH; ++v)
+    for (size_t u=0; u<kW; ++u) {
+      ray(u,v) = cam.Unproject(u, v, 1.f);
+      Vector3fda p_w, n_w;
+      corner.Intersect(T_wc.translation(),
+          T_wc.rotation()*ray(u,v).normalized(), p_w, n_w);
+      pc(u,v) = T_cw*p_w;
+      n(u,v) = T_cw.rotation()*n_w;
+      d(u,v) = pc(u,v)(2);
+    }
+}
+
+/// Frame at T_wc with normals that are only filled in by
+/// EnsureNormal(u,v) as the sparse ICP asks for them.
+struct Frame {
+  Frame(const Cameraf& cam, const SE3f& T_wc)
+    : d(kW,kH), pc(kW,kH), nTrue(kW,kH), n(kW,kH), ray(kW,kH),
+    grey(kW,kH), gradGrey(kW,kH) {
+    Render(cam, T_wc, d, pc, nTrue, ray);
+    n.Fill(Vector3fda(NAN,NAN,NAN));
+    grey.Fill(0.f);
+    gradGrey.Fill(Vector2fda::Zero());
+    f.cam = cam;
+    f.d = d;
+    f.pc = pc;
+    f.n = n;
+    f.ray = ray;
+    f.grey = grey;
+    f.gradGrey = gradGrey;
+    f.Sigma_t.setZero();
+    f.p2plThr = 0.1f;
+    f.dotThr = cos(20.*M_PI/180.);
+    SetPose(SE3f());
+  }
+  void SetPose(const SE3f& T_wc) {
+    f.T_wc = T_wc;
+    f.T_cw = T_wc.Inverse();
+  }
+  bool EnsureNormal(int32_t u, int32_t v) {
+    if (!IsValidData(n(u,v))) n(u,v) = nTrue(u,v);
+    return true;
+  }
+  ManagedHostImage<float> d;
+  ManagedHostImage<Vector3fda> pc, nTrue, n, ray;
+  ManagedHostImage<float> grey;
+  ManagedHostImage<Vector2fda> gradGrey;
+  SparseIcpFrame<Cameraf> f;
+};
+
+/// Surfels on every stride-th pixel of the corner seen from the origin
+/// in two interleaved buckets.
+void MakeMap(const Cameraf& cam, size_t stride,
+    CircularBuffer<Plane>& pl_w,
+    std::vector<std::vector<uint32_t>>& buckets) {
+  ManagedHostImage<float> d(kW,kH);
+  ManagedHostImage<Vector3fda> pc(kW,kH), n(kW,kH), ray(kW,kH);
+  Render(cam, SE3f(), d, pc, n, ray);
+  buckets.assign(2, std::vector<uint32_t>());
+  for (size_t i=0; i<pc.Area(); i+=stride) {
+    Plane pl;
+    pl.p_ = pc[i];
+    pl.n_ = n[i];
+    pl.grey_ = 0.f;
+    pl.valid_ = true;
+    buckets[pl_w.SizeToRead()%2].push_back(pl_w.SizeToRead());
+    pl_w.Insert(pl);
+  }
+}
+
+}
+
+TEST(sparseSurfelIcp, recoverPose) {
+  Cameraf cam(Eigen::Vector4f(150, 150, 79.5, 59.5));
+  ManagedHostCircularBuffer<Plane> pl_w(kW*kH);
+  std::vector<std::vector<uint32_t>> buckets;
+  MakeMap(cam, 7, pl_w, buckets);
+  Eigen::Matrix<float,6,1> x;
+  x << 0.02f, -0.03f, 0.01f, 0.03f, 0.02f, -0.04f;
+  const SE3f T_true = SE3f::Exp_(x);
+  Frame frame(cam, T_true);
+
+  SparseSurfelIcp icp;
+  icp.maxObs_ = 100000;
+  icp.HThr_ = -1e9;
+  icp.condEntropyThr_ = -1e9;
+  icp.SetCandidates(buckets);
+  P2PlResidual res;
+  SE3f T_wc;
+  for (size_t it=0; it<10; ++it) {
+    frame.SetPose(T_wc);
+    const size_t numAssoc = icp.Step(pl_w, frame.f, res,
+        [&](int32_t u, int32_t v) { return frame.EnsureNormal(u,v); });
+    ASSERT_GT(numAssoc, 1000u);
+    const Eigen::Matrix<float,6,1> dx = (icp.A_.cast<double>().ldlt()
+        .solve(icp.b_.cast<double>())).cast<float>();
+    T_wc = T_wc * SE3f::Exp_(dx);
+  }
+  const Eigen::Matrix<float,6,1> err = T_wc.Log(T_true);
+  EXPECT_LT(err.norm(), 1e-4f) << err.transpose();
+}
+
+TEST(sparseSurfelIcp, threadIndependence) {
+  Cameraf cam(Eigen::Vector4f(150, 150, 79.5, 59.5));
+  ManagedHostCircularBuffer<Plane> pl_w(kW*kH);
+  std::vector<std::vector<uint32_t>> buckets;
+  MakeMap(cam, 3, pl_w, buckets);
+  Eigen::Matrix<float,6,1> x;
+  x << 0.01f, 0.02f, -0.01f, -0.02f, 0.01f, 0.03f;
+
+  SparseSurfelIcp icps[2];
+  const size_t numThreads[2] = {1, 4};
+  for (size_t k=0; k<2; ++k) {
+    // the normals are extracted lazily in both runs
+    Frame frame(cam, SE3f::Exp_(x));
+    SparseSurfelIcp& icp = icps[k];
+    icp.chunkSize_ = 64;
+    icp.numThreads_ = numThreads[k];
+    icp.maxObs_ = 100000;
+    icp.HThr_ = -1e9;
+    icp.condEntropyThr_ = -1e9;
+    icp.SetCandidates(buckets);
+    icp.Step(pl_w, frame.f, P2PlResidual(),
+        [&](int32_t u, int32_t v) { return frame.EnsureNormal(u,v); });
+  }
+  ASSERT_GT(icps[0].assoc_.size(), 1000u);
+  EXPECT_TRUE(icps[0].assoc_ == icps[1].assoc_);
+  EXPECT_TRUE(icps[0].A_ == icps[1].A_);
+  EXPECT_TRUE(icps[0].b_ == icps[1].b_);
+  EXPECT_EQ(icps[0].err_, icps[1].err_);
+  EXPECT_EQ(icps[0].numProjected_, icps[1].numProjected_);
+}
+
+TEST(sparseSurfelIcp, terminateAtChunkBoundary) {
+  Cameraf cam(Eigen::Vector4f(150, 150, 79.5, 59.5));
+  ManagedHostCircularBuffer<Plane> pl_w(kW*kH);
+  std::vector<std::vector<uint32_t>> buckets;
+  MakeMap(cam, 5, pl_w, buckets);
+  // a single bucket that visits the whole scene early on; chunk[i] is
+  // the chunk surfel i is tried in
+  const uint32_t M = pl_w.SizeToRead();
+  const size_t chunkSize = 32;
+  buckets.assign(1, std::vector<uint32_t>());
+  ASSERT_NE(M%97, 0u);
+  std::vector<size_t> chunk(M);
+  for (uint32_t j=0; j<M; ++j) {
+    buckets[0].push_back((j*97)%M);
+    chunk[buckets[0].back()] = j/chunkSize;
+  }
+  Eigen::Matrix<float,6,1> x;
+  x << 0.01f, 0.02f, -0.01f, -0.02f, 0.01f, 0.03f;
+  Frame frame(cam, SE3f::Exp_(x));
+  auto ensureNormal = [&](int32_t u, int32_t v) {
+    return frame.EnsureNormal(u,v);
+  };
+  P2PlResidual res;
+
+  SparseSurfelIcp full;
+  full.chunkSize_ = chunkSize;
+  full.maxObs_ = 100000;
+  full.HThr_ = -1e9;
+  full.condEntropyThr_ = -1e9;
+  full.SetCandidates(buckets);
+  full.Step(pl_w, frame.f, res, ensureNormal);
+  ASSERT_GT(full.assoc_.size(), 1000u);
+
+  // reference: the running normal equations after every chunk from the
+  // associations of the full pass
+  const size_t numChunks = (pl_w.SizeToRead()+chunkSize-1)/chunkSize;
+  std::vector<size_t> numAssocUpTo(numChunks, 0);
+  std::vector<Eigen::Matrix<float,6,6>> AUpTo(numChunks);
+  Eigen::Matrix<float,6,6> A = Eigen::Matrix<float,6,6>::Zero();
+  size_t j = 0;
+  for (size_t c=0; c<numChunks; ++c) {
+    Eigen::Matrix<float,6,6> Ac = Eigen::Matrix<float,6,6>::Zero();
+    Eigen::Matrix<float,6,1> bc = Eigen::Matrix<float,6,1>::Zero();
+    float errc = 0.f;
+    for (; j<full.assoc_.size() && chunk[full.assoc_[j].first] == c;
+        ++j) {
+      const size_t i = full.assoc_[j].first;
+      const int32_t u = full.assoc_[j].second%kW;
+      const int32_t v = full.assoc_[j].second/kW;
+      ASSERT_TRUE(res(pl_w[i], i, frame.f, u, v, Eigen::Vector2f(u,v),
+            Ac, bc, errc));
+    }
+    A += Ac;
+    AUpTo[c] = A;
+    numAssocUpTo[c] = j;
+  }
+
+  // maxObs_ stops after the chunk that reaches it
+  for (size_t maxObs : {1u, 100u, 500u, 777u}) {
+    SparseSurfelIcp icp;
+    icp.chunkSize_ = chunkSize;
+    icp.numThreads_ = 3;
+    icp.maxObs_ = maxObs;
+    icp.HThr_ = -1e9;
+    icp.condEntropyThr_ = -1e9;
+    icp.SetCandidates(buckets);
+    icp.Step(pl_w, frame.f, res, ensureNormal);
+    size_t c = 0;
+    while (numAssocUpTo[c] < maxObs) ++c;
+    ASSERT_EQ(icp.assoc_.size(), numAssocUpTo[c]) << "maxObs " << maxObs;
+    EXPECT_TRUE(std::equal(icp.assoc_.begin(), icp.assoc_.end(),
+          full.assoc_.begin()));
+    EXPECT_TRUE(icp.A_ == AUpTo[c]);
+  }
+
+  // entropy termination stops after the first chunk below HThr_; the
+  // conditional entropy and eigenvalue tests never trigger on their own
+  std::vector<float> Hs(numChunks);
+  for (size_t c=0; c<numChunks; ++c)
+    Hs[c] = -Eigen::SelfAdjointEigenSolver<Eigen::Matrix<float,6,6>>(
+        AUpTo[c]).eigenvalues().array().log().sum();
+  for (size_t cStop : {3u, 10u, 25u}) {
+    ASSERT_LT(cStop, numChunks);
+    ASSERT_LT(Hs[cStop], Hs[cStop-1]);
+    SparseSurfelIcp icp;
+    icp.chunkSize_ = chunkSize;
+    icp.numThreads_ = 3;
+    icp.maxObs_ = 100000;
+    icp.HThr_ = 0.5f*(Hs[cStop-1] + Hs[cStop]);
+    icp.condEntropyThr_ = -1e9;
+    icp.negLogEvThr_ = 1e9;
+    icp.SetCandidates(buckets);
+    icp.Step(pl_w, frame.f, res, ensureNormal);
+    size_t c = 0;
+    while (!(Hs[c] < icp.HThr_)) ++c;
+    ASSERT_EQ(icp.assoc_.size(), numAssocUpTo[c]) << "chunk " << cStop;
+    EXPECT_TRUE(std::equal(icp.assoc_.begin(), icp.assoc_.end(),
+          full.assoc_.begin()));
+    EXPECT_TRUE(icp.A_ == AUpTo[c]);
+  }
+}
@@ -0,0 +1,152 @@
+#include <tdp/testing/testing.h>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <tdp/data/circular_buffer.h>
+#include <tdp/data/managed_image.h>
+#include <tdp/eigen/dense.h>
+#include <tdp/slam/surfel_map.h>
+
+using namespace tdp;
+
+typedef Eigen::Matrix<int32_t,2,1,Eigen::DontAlign> Vector2ida;
+
+static Plane MakeSurfel(const Vector3fda& p) {
+  Plane pl;
+  pl.p_ = p;
+  pl.n_ = Vector3fda(0,0,-1);
+  pl.r_ = 0.02;
+  pl.lastFrame_ = 0;
+  pl.numObs_ = 100;
+  pl.Hp_ = -10.;
+  pl.valid_ = true;
+  return pl;
+}
+
+/// the map is pruned and hashed asynchronously
+template<class F>
+static bool WaitFor(const F& done) {
+  for (size_t it=0; it<500 && !done(); ++it)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  return done();
+}
+
+TEST(surfelMap, carveAndCompact) {
+  // a wall at 2m and a row of ghost surfels at 1m in front of it
+  ManagedHostCircularBuffer<Plane> pl_w(1000);
+  ManagedHostCircularBuffer<int32_t> tag(1000);
+  ManagedHostCircularBuffer<Vector2ida> nn(1000);
+  tag.Fill(-1);
+  const int32_t W = 21;
+  for (int32_t i=0; i<W; ++i) {
+    const float x = 0.1*(i-W/2);
+    pl_w.Insert(MakeSurfel(Vector3fda(x,0,2)));
+    tag.Insert(2*i);
+    pl_w.Insert(MakeSurfel(Vector3fda(x,0,1)));
+    tag.Insert(2*i+1);
+  }
+  const int32_t N = pl_w.SizeToRead();
+  for (int32_t i=0; i<N; ++i)
+    nn[i] = Vector2ida((i+1)%N, (i+2)%N);
+  nn.iInsert_ = N;
+
+  // depth frame of a camera at the origin looking along z that sees
+  // the wall through the ghost surfels
+  ManagedHostImage<Vector3fda> pc(W, 1);
+  for (int32_t i=0; i<W; ++i)
+    pc[i] = Vector3fda(0.2*(i-W/2),0,2);
+
+  SurfelMapMaintenance maint(pl_w, 0.05);
+  maint.compactMin_ = 1;
+  maint.Update(1);
+  ASSERT_TRUE(WaitFor([&]{ return maint.NumHashed() == (size_t)N; }));
+  for (int32_t frame=1; frame<=3; ++frame)
+    maint.CarveFreeSpace(pc, SE3f(), frame, 0.1, 1);
+  ASSERT_EQ(maint.NumCarved(), (size_t)W);
+  for (int32_t i=0; i<N; ++i)
+    ASSERT_EQ(pl_w[i].valid_, tag[i]%2 == 0);
+
+  maint.Update(4);
+  ASSERT_TRUE(WaitFor([&]{ return maint.CompactionPending(); }));
+  ASSERT_EQ(maint.BeginCompaction(), (size_t)W);
+  maint.Compact(tag, -1);
+  maint.RemapIds(nn);
+  maint.EndCompaction();
+
+  ASSERT_EQ(pl_w.SizeToRead(), (size_t)W);
+  ASSERT_EQ(nn.SizeToRead(), (size_t)W);
+  ASSERT_EQ(tag.SizeToRead(), (size_t)W);
+  for (int32_t i=0; i<W; ++i) {
+    ASSERT_TRUE(pl_w[i].valid_);
+    ASSERT_EQ(tag[i], 2*i);
+    ASSERT_NEAR(pl_w[i].p_(2), 2., 1e-6);
+    // every surfel pointed to the ghost after it and the wall after that
+    ASSERT_EQ(nn[i](0), -1);
+    ASSERT_EQ(nn[i](1), (i+1)%W);
+  }
+  for (int32_t i=W; i<N; ++i) {
+    ASSERT_FALSE(pl_w[i].valid_);
+    ASSERT_EQ(tag[i], -1);
+  }
+}
+
+TEST(surfelMap, columns) {
+  ManagedHostCircularBuffer<Plane> pl_w(100);
+  SurfelColumns surfels(100);
+  surfels.Fill(Vector3fda(NAN,NAN,NAN), Vector3fda(NAN,NAN,NAN),
+      Vector3bda::Zero(), Vector3fda(NAN,NAN,NAN), NAN, 0,
+      Vector3fda(NAN,NAN,NAN));
+  ASSERT_EQ(SurfelColumns::EntryBytes(), 4*sizeof(Vector3fda)
+      + sizeof(Vector3bda) + sizeof(float) + sizeof(uint16_t));
+  for (int32_t i=0; i<10; ++i) {
+    Plane pl = MakeSurfel(Vector3fda(i,0,1));
+    pl.lastFrame_ = i;
+    pl.valid_ = i%3 != 0;
+    pl_w.Insert(pl);
+    InsertColumns(pl, surfels);
+  }
+  ASSERT_EQ(surfels.SizeToRead(), (size_t)10);
+  ASSERT_EQ(surfels.Get<kSurfelT>().SizeToRead(), (size_t)10);
+  ASSERT_EQ(surfels.Get<kSurfelP0>()[4](0), 4.f);
+
+  SurfelMapMaintenance maint(pl_w, 0.05);
+  ASSERT_EQ(maint.BeginCompaction(), (size_t)6);
+  maint.Compact(surfels, Vector3fda(NAN,NAN,NAN), Vector3fda(NAN,NAN,NAN),
+      Vector3bda::Zero(), Vector3fda(NAN,NAN,NAN), NAN, 0,
+      Vector3fda(NAN,NAN,NAN));
+  maint.EndCompaction();
+  ASSERT_EQ(surfels.SizeToRead(), (size_t)6);
+  ASSERT_EQ(surfels.iInsert(), surfels.Get<kSurfelN>().iInsert_);
+  for (int32_t i=0; i<6; ++i) {
+    ASSERT_EQ(surfels.Get<kSurfelT>()[i], pl_w[i].lastFrame_);
+    ASSERT_NEAR(surfels.Get<kSurfelP>()[i](0), pl_w[i].p_(0), 1e-6);
+    ASSERT_TRUE(pl_w[i].lastFrame_%3 != 0);
+  }
+  ASSERT_TRUE(std::isnan(surfels.Get<kSurfelP0>()[6](0)));
+}
+
+TEST(surfelMap, compactDuringRehash) {
+  // a large map so that the hash is still being built while the map
+  // is compacted; only the last surfel is pruned
+  const int32_t N = 200000;
+  ManagedHostCircularBuffer<Plane> pl_w(N+1);
+  for (int32_t i=0; i<N; ++i)
+    pl_w.Insert(MakeSurfel(Vector3fda(0.01*(i%500), 0.01*(i/500), 2)));
+  pl_w[N-1].numObs_ = 1;
+  pl_w[N-1].Hp_ = 0.;
+
+  SurfelMapMaintenance maint(pl_w, 0.05);
+  maint.compactMin_ = 1;
+  maint.compactFraction_ = 0.;
+  maint.survivalTime_ = 10;
+  // the worker counts the pruned surfel while it takes the snapshot and
+  // hashes the old ids after it dropped workMut_
+  maint.Update(20);
+  ASSERT_TRUE(WaitFor([&]{ return maint.CompactionPending(); }));
+  ASSERT_EQ(maint.BeginCompaction(), (size_t)(N-1));
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  // the hash of the old ids must not be installed
+  ASSERT_EQ(maint.NumHashed(), (size_t)0);
+  maint.EndCompaction();
+  ASSERT_TRUE(WaitFor([&]{ return maint.NumHashed() == (size_t)(N-1); }));
+}
@@ -0,0 +1,94 @@
+#include <tdp/testing/testing.h>
+#include <atomic>
+#include <vector>
+#include <Eigen/Dense>
+#include <tdp/utils/parallel_for.h>
+#include <tdp/utils/thread_pool.h>
+
+using namespace tdp;
+
+TEST(threadPool, parallelForNested) {
+  const size_t N = 1000;
+  std::vector<std::atomic<int>> count(N*N);
+  for (auto& c : count) c = 0;
+  ParallelFor(N, 7, [&](size_t i0, size_t i1) {
+    for (size_t i=i0; i<i1; ++i)
+      ParallelFor(N, 13, [&](size_t j0, size_t j1) {
+        for (size_t j=j0; j<j1; ++j) count[i*N+j] ++;
+      });
+  });
+  size_t numBad = 0;
+  for (auto& c : count) if (c != 1) numBad ++;
+  EXPECT_EQ(numBad, 0);
+}
+
+TEST(threadPool, tiles) {
+  const size_t w = 101, h = 53, d = 7;
+  std::vector<std::atomic<int>> count(w*h*d);
+  for (auto& c : count) c = 0;
+  ParallelForTiles(w, h, d, 16, 8, 2, [&](size_t u0, size_t u1,
+        size_t v0, size_t v1, size_t d0, size_t d1) {
+    for (size_t z=d0; z<d1; ++z)
+      for (size_t v=v0; v<v1; ++v)
+        for (size_t u=u0; u<u1; ++u) count[(z*h+v)*w+u] ++;
+  });
+  size_t numBad = 0;
+  for (auto& c : count) if (c != 1) numBad ++;
+  EXPECT_EQ(numBad, 0);
+}
+
+TEST(threadPool, reduceDeterministic) {
+  typedef Eigen::Matrix<float,6,7> Ab;
+  const size_t N = 100000;
+  auto map = [&](size_t i0, size_t i1, Ab& s) {
+    for (size_t i=i0; i<i1; ++i) {
+      Eigen::Matrix<float,6,1> J;
+      for (int k=0; k<6; ++k) J(k) = sinf(0.1f*i+k);
+      s.leftCols<6>() += J*J.transpose();
+      s.col(6) += J*cosf(0.01f*i);
+    }
+  };
+  auto combine = [](Ab& a, const Ab& b) { a += b; };
+  const Ab ref = ParallelReduce<Ab>(N, 1000, Ab::Zero(), map, combine, 1);
+  for (size_t numThreads=2; numThreads<6; ++numThreads) {
+    const Ab sys = ParallelReduce<Ab>(N, 1000, Ab::Zero(), map, combine,
+        numThreads);
+    EXPECT_TRUE(sys == ref);
+  }
+}
+
+TEST(threadPool, taskGraph) {
+  ThreadPool pool(3);
+  std::vector<std::atomic<int>> order(6);
+  std::atomic<int> clock(0);
+  TaskGraph graph;
+  std::vector<size_t> ids;
+  for (size_t i=0; i<6; ++i)
+    ids.push_back(graph.Add([&, i]{ order[i] = clock++; }));
+  // 0 -> {1,2} -> 3 -> {4,5}
+  graph.Precede(ids[0], ids[1]);
+  graph.Precede(ids[0], ids[2]);
+  graph.Precede(ids[1], ids[3]);
+  graph.Precede(ids[2], ids[3]);
+  graph.Precede(ids[3], ids[4]);
+  graph.Precede(ids[3], ids[5]);
+  for (size_t it=0; it<10; ++it) {
+    clock = 0;
+    graph.Run(pool);
+    EXPECT_EQ(order[0], 0);
+    EXPECT_LT(order[1], order[3]);
+    EXPECT_LT(order[2], order[3]);
+    EXPECT_EQ(order[3], 3);
+    EXPECT_GT(order[4], 3);
+    EXPECT_GT(order[5], 3);
+  }
+}
+
+TEST(threadPool, shortTaskGroups) {
+  // the group of a ParallelFor is destroyed right after the last task
+  // finished; the task must not touch the group after that
+  std::atomic<size_t> sum(0);
+  for (size_t it=0; it<20000; ++it)
+    ParallelFor(64, 1, [&](size_t i0, size_t i1) { sum += i1-i0; }, 4);
+  EXPECT_EQ(sum.load(), 64*20000);
+}
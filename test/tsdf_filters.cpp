@@ -0,0 +1,121 @@
+#include <tdp/testing/testing.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <tdp/data/managed_volume.h>
+#include <tdp/filters/tsdfFilters.h>
+#include <tdp/tsdf/tsdf.h>
+
+using namespace tdp;
+
+namespace {
+
+/// Random TSDF with some voxels of low weight; not a multiple of the
+/// median tile width in x.
+void RandomTsdf(Volume<TSDFval>& tsdf) {
+  std::mt19937 gen(1);
+  std::uniform_real_distribution<float> unif(-1.f, 1.f);
+  for (size_t i=0; i<tsdf.w_*tsdf.h_*tsdf.d_; ++i) {
+    const size_t x = i%tsdf.w_;
+    const size_t y = (i/tsdf.w_)%tsdf.h_;
+    const size_t z = i/(tsdf.w_*tsdf.h_);
+    tsdf(x,y,z).f = unif(gen);
+    tsdf(x,y,z).w = unif(gen) < -0.8f ? 0.5f : 10.f;
+  }
+}
+
+/// Brute force median as in the GPU kernel: sort the whole
+/// neighbourhood with voxels outside the volume counting as 1.
+float MedianReference(const Volume<TSDFval>& tsdf, int x, int y, int z,
+    int radius, float wThr) {
+  std::vector<float> values;
+  for (int k=-radius; k<=radius; ++k)
+    for (int j=-radius; j<=radius; ++j)
+      for (int i=-radius; i<=radius; ++i) {
+        const int xi = x+i, yj = y+j, zk = z+k;
+        if (xi < 0 || xi >= (int)tsdf.w_ || yj < 0 || yj >= (int)tsdf.h_
+            || zk < 0 || zk >= (int)tsdf.d_) {
+          values.push_back(1.f);
+        } else if (tsdf(xi,yj,zk).w >= wThr) {
+          values.push_back(tsdf(xi,yj,zk).f);
+        }
+      }
+  std::sort(values.begin(), values.end());
+  const size_t n = values.size();
+  return 0.5f*(values[(n-1)/2] + values[n/2]);
+}
+
+}
+
+TEST(tsdfFilters, medianMatchesSort) {
+  ManagedHostVolume<TSDFval> tsdf(70,19,13);
+  RandomTsdf(tsdf);
+  ManagedHostVolume<TSDFval> out(70,19,13);
+  for (int radius : {1, 2, 3})
+    for (float wThr : {0.f, 1.f})
+      for (size_t numThreads : {1, 3}) {
+        out.Fill(TSDFval());
+        TSDFFilters::medianFilterCpu(tsdf, out, wThr, radius, numThreads);
+        size_t numBad = 0;
+        for (int z=0; z<(int)tsdf.d_; ++z)
+          for (int y=0; y<(int)tsdf.h_; ++y)
+            for (int x=0; x<(int)tsdf.w_; ++x) {
+              const float f = tsdf(x,y,z).w < wThr ? tsdf(x,y,z).f
+                : MedianReference(tsdf, x, y, z, radius, wThr);
+              if (out(x,y,z).f != f || out(x,y,z).w != tsdf(x,y,z).w)
+                numBad ++;
+            }
+        EXPECT_EQ(0, numBad) << "radius " << radius << " wThr " << wThr
+          << " threads " << numThreads;
+      }
+}
+
+TEST(tsdfFilters, bilateral) {
+  ManagedHostVolume<TSDFval> tsdf(70,19,13);
+  RandomTsdf(tsdf);
+  ManagedHostVolume<TSDFval> out1(70,19,13), out3(70,19,13);
+  TSDFFilters::bilateralFilterCpu(tsdf, out1, 1.f, 0.1f, 1.f, 2, 1);
+  TSDFFilters::bilateralFilterCpu(tsdf, out3, 1.f, 0.1f, 1.f, 2, 3);
+  size_t numDiff = 0;
+  for (size_t i=0; i<tsdf.w_*tsdf.h_*tsdf.d_; ++i) {
+    const size_t x = i%tsdf.w_;
+    const size_t y = (i/tsdf.w_)%tsdf.h_;
+    const size_t z = i/(tsdf.w_*tsdf.h_);
+    if (out1(x,y,z).f != out3(x,y,z).f) numDiff ++;
+    // low weight voxels stay as they are
+    if (tsdf(x,y,z).w < 1.f && out1(x,y,z).f != tsdf(x,y,z).f) numDiff ++;
+  }
+  EXPECT_EQ(0, numDiff);
+
+  // a constant field is a fixed point
+  tsdf.Fill(TSDFval(0.3f, 10.f));
+  TSDFFilters::bilateralFilterCpu(tsdf, out1, 1.f, 0.1f, 0.f, 2, 2);
+  for (size_t i=0; i<tsdf.w_*tsdf.h_*tsdf.d_; ++i) {
+    const size_t x = i%tsdf.w_;
+    const size_t y = (i/tsdf.w_)%tsdf.h_;
+    const size_t z = i/(tsdf.w_*tsdf.h_);
+    ASSERT_NEAR(0.3f, out1(x,y,z).f, 1e-6f);
+  }
+}
+
+#ifdef CUDA_FOUND
+TEST(tsdfFilters, medianMatchesGpu) {
+  ManagedHostVolume<TSDFval> tsdf(70,19,13), out(70,19,13);
+  RandomTsdf(tsdf);
+  ManagedDeviceVolume<TSDFval> cuTsdf(70,19,13), cuOut(70,19,13);
+  cuTsdf.CopyFrom(tsdf);
+  cuOut.CopyFrom(tsdf);
+  TSDFFilters::medianFilter(cuTsdf, cuOut);
+  ManagedHostVolume<TSDFval> outGpu(70,19,13);
+  outGpu.CopyFrom(cuOut);
+  TSDFFilters::medianFilterCpu(tsdf, out, 0.f, 2, 0);
+  size_t numBad = 0;
+  for (size_t i=0; i<tsdf.w_*tsdf.h_*tsdf.d_; ++i) {
+    const size_t x = i%tsdf.w_;
+    const size_t y = (i/tsdf.w_)%tsdf.h_;
+    const size_t z = i/(tsdf.w_*tsdf.h_);
+    if (out(x,y,z).f != outGpu(x,y,z).f) numBad ++;
+  }
+  EXPECT_EQ(0, numBad);
+}
+#endif
@@ -0,0 +1,129 @@
+#include <cstdio>
+#include <fstream>
+#include <algorithm>
+#include <tdp/testing/testing.h>
+#include <tdp/data/managed_volume.h>
+#include <tdp/tsdf/tsdf.h>
+#include <tdp/tsdf/tsdf_snapshot.h>
+
+TEST(tsdfSnapshot, roundTrip) {
+  // not a multiple of the brick size to exercise partial bricks
+  tdp::ManagedHostVolume<tdp::TSDFval> tsdf(70,40,33);
+  tsdf.Fill(tdp::TSDFval());
+  for (size_t d=0; d<20; ++d)
+    for (size_t v=0; v<40; ++v)
+      for (size_t u=0; u<70; ++u) {
+        tdp::TSDFval& val = tsdf(u,v,d);
+        val.f = u < 35 ? 1.f : (float)(u%7)/7.f;
+        val.w = 10.f;
+        val.r = u; val.g = v; val.b = d;
+      }
+  tdp::Vector3fda grid0(-1,-2,-3);
+  tdp::Vector3fda dGrid(2,4,6);
+  tdp::SE3f T_wG(tdp::SO3f::Random().matrix(),
+      Eigen::Vector3f(1,2,3));
+  std::string path = "./testTsdfSnapshot.tsdf";
+  ASSERT_TRUE(tdp::TSDF::SaveTSDFSnapshot(tsdf, grid0, dGrid, T_wG, path));
+  ASSERT_TRUE(tdp::TSDF::IsTSDFSnapshot(path));
+
+  tdp::TSDFSnapshot snapshot;
+  ASSERT_TRUE(snapshot.Open(path));
+  // the upper brick layer in z is unobserved and not stored
+  ASSERT_EQ(3*2*1, snapshot.bricks_.size());
+  snapshot.Close();
+
+  tdp::ManagedHostVolume<tdp::TSDFval> tsdfL(1,1,1);
+  tdp::SE3f T_wGL;
+  tdp::Vector3fda grid0L, dGridL;
+  ASSERT_TRUE(tdp::TSDF::LoadTSDF(path, tsdfL, T_wGL, grid0L, dGridL));
+  ASSERT_EQ(tsdf.w_, tsdfL.w_);
+  ASSERT_EQ(tsdf.h_, tsdfL.h_);
+  ASSERT_EQ(tsdf.d_, tsdfL.d_);
+  ASSERT_TRUE(IsAppox(grid0, grid0L, 1e-6f));
+  ASSERT_TRUE(IsAppox(dGrid, dGridL, 1e-6f));
+  ASSERT_TRUE(IsAppox(T_wG.matrix(), T_wGL.matrix(), 1e-6f));
+  for (size_t i=0; i<tsdf.Vol(); ++i) {
+    ASSERT_EQ(tsdf.ptr_[i].f, tsdfL.ptr_[i].f);
+    ASSERT_EQ(tsdf.ptr_[i].w, tsdfL.ptr_[i].w);
+    ASSERT_EQ(tsdf.ptr_[i].r, tsdfL.ptr_[i].r);
+    ASSERT_EQ(tsdf.ptr_[i].g, tsdfL.ptr_[i].g);
+    ASSERT_EQ(tsdf.ptr_[i].b, tsdfL.ptr_[i].b);
+  }
+  std::remove(path.c_str());
+}
+
+/// TSDF of a sphere in front of a wall fused from a camera looking
+/// along z: truncated signed distances along the viewing rays, weights
+/// saturated at wMax and shaded colors; space behind the surfaces is
+/// unobserved.
+void FuseSphereScene(tdp::ManagedHostVolume<tdp::TSDFval>& tsdf,
+    float mu, float wMax) {
+  const Eigen::Vector3f c(0.5f*tsdf.w_, 0.5f*tsdf.h_, 0.45f*tsdf.d_);
+  const float radius = 0.25f*tsdf.w_;
+  const float wall = 0.7f*tsdf.d_;
+  for (size_t d=0; d<tsdf.d_; ++d)
+    for (size_t v=0; v<tsdf.h_; ++v)
+      for (size_t u=0; u<tsdf.w_; ++u) {
+        // orthographic ray along z through (u,v)
+        const float dx = u-c(0), dy = v-c(1);
+        const float r2 = radius*radius - dx*dx - dy*dy;
+        const float depth = r2 > 0.f ? c(2)-sqrt(r2) : wall;
+        const float sdf = depth - d;
+        tdp::TSDFval& val = tsdf(u,v,d);
+        if (sdf < -mu) {
+          val = tdp::TSDFval();
+          continue;
+        }
+        val.f = std::max(-1.f, std::min(1.f, sdf/mu));
+        val.w = wMax;
+        const uint8_t shade = r2 > 0.f ? 55+200*sqrt(r2)/radius : 128;
+        val.r = shade;
+        val.g = r2 > 0.f ? shade/2 : 128;
+        val.b = r2 > 0.f ? 0 : 200;
+      }
+}
+
+TEST(tsdfSnapshot, fusedSceneCompression) {
+  tdp::ManagedHostVolume<tdp::TSDFval> tsdf(128,128,128);
+  FuseSphereScene(tsdf, 5.f, 100.f);
+  std::string path = "./testTsdfSnapshotFused.tsdf";
+  ASSERT_TRUE(tdp::TSDFSnapshot::Save(path, tsdf, tdp::Vector3fda(0,0,0),
+        tdp::Vector3fda(1,1,1), tdp::SE3f()));
+
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  const size_t bytes = in.tellg();
+  const size_t rawBytes = tsdf.Vol()*sizeof(tdp::TSDFval);
+  std::cout << "compressed " << bytes << " of " << rawBytes
+    << " bytes: " << 100.*bytes/rawBytes << "%" << std::endl;
+  EXPECT_LT(bytes, rawBytes/8);
+
+  tdp::TSDFSnapshot snapshot;
+  ASSERT_TRUE(snapshot.Open(path));
+  // the bricks behind the wall are unobserved
+  EXPECT_EQ(4*4*3, snapshot.bricks_.size());
+  // the codec itself, not only skipping bricks, has to pay off
+  const size_t B = tdp::TSDFSnapshot::BrickSize;
+  EXPECT_LT(bytes, snapshot.bricks_.size()*B*B*B*11/8);
+  size_t numRle = 0;
+  for (auto& brick : snapshot.bricks_) if (brick.codec == 1) numRle ++;
+  EXPECT_GT(numRle, 0);
+  for (size_t numThreads : {1, 3}) {
+    tdp::ManagedHostVolume<tdp::TSDFval> tsdfL(1,1,1);
+    ASSERT_TRUE(snapshot.Load(tsdfL, numThreads));
+    ASSERT_EQ(tsdf.Vol(), tsdfL.Vol());
+    for (size_t i=0; i<tsdf.Vol(); ++i) {
+      ASSERT_EQ(tsdf.ptr_[i].f, tsdfL.ptr_[i].f);
+      ASSERT_EQ(tsdf.ptr_[i].w, tsdfL.ptr_[i].w);
+      ASSERT_EQ(tsdf.ptr_[i].r, tsdfL.ptr_[i].r);
+      ASSERT_EQ(tsdf.ptr_[i].g, tsdfL.ptr_[i].g);
+      ASSERT_EQ(tsdf.ptr_[i].b, tsdfL.ptr_[i].b);
+    }
+  }
+  snapshot.Close();
+  std::remove(path.c_str());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,6 +1,7 @@
 #include <tdp/testing/testing.h>
 #include <tdp/rtmf/vMFMMF.h>
 #include <tdp/manifold/SO3.h>
+#include <random>
 
 using namespace tdp;
 
@@ -34,6 +35,50 @@ TEST(vmfmf, simple) {
   std::cout << R.matrix() << std::endl;
 }
 
+TEST(vmfmf, cpu) {
+  tdp::vMFMMF<2> mf(1.);
+
+  size_t Nmmf = 6000;
+  ManagedHostImage<Vector3fda> n(Nmmf,1);
+
+  std::mt19937 gen(1);
+  std::normal_distribution<float> normal(0,0.1);
+
+  tdp::SO3f Rs[2] = {tdp::SO3f::Random(), tdp::SO3f::Random()};
+  for (size_t i=0; i<Nmmf; i+=6) {
+    const tdp::SO3f& R = Rs[(i/6)%2];
+    n[i+0] = R*Vector3fda( 1.+normal(gen), normal(gen), normal(gen)).normalized();
+    n[i+1] = R*Vector3fda(-1.+normal(gen), normal(gen), normal(gen)).normalized();
+    n[i+2] = R*Vector3fda(normal(gen), 1.+normal(gen), normal(gen)).normalized();
+    n[i+3] = R*Vector3fda(normal(gen),-1.+normal(gen), normal(gen)).normalized();
+    n[i+4] = R*Vector3fda(normal(gen), normal(gen), 1.+normal(gen)).normalized();
+    n[i+5] = R*Vector3fda(normal(gen), normal(gen),-1.+normal(gen)).normalized();
+  }
+  n[0] = Vector3fda(NAN,NAN,NAN);
+
+  // initialize close to the true MFs; with random initializations the
+  // MFs could converge to the same mode
+  mf.Rs_[0] = (Rs[0]*tdp::SO3f::Exp_(Eigen::Vector3f(0.1,0.,0.))).matrix();
+  mf.Rs_[1] = (Rs[1]*tdp::SO3f::Exp_(Eigen::Vector3f(0.,0.1,0.))).matrix();
+  mf.ComputeCpu(n, 20, false, 0, 3);
+  for (size_t k=0; k<2; ++k) {
+    // identical up to permutation and sign of the axes
+    Eigen::Matrix3f dR = Rs[k].matrix().transpose()*mf.Rs_[k];
+    for (int i=0; i<3; ++i)
+      ASSERT_GT(dR.row(i).cwiseAbs().maxCoeff(), 0.99);
+  }
+  ASSERT_NEAR(mf.Ns_[0]+mf.Ns_[1], Nmmf-1, 1e-3);
+
+  // warm start from the previous frame with subsampling
+  mf.ComputeCpu(n, 20, false, 1000, 3);
+  for (size_t k=0; k<2; ++k) {
+    Eigen::Matrix3f dR = Rs[k].matrix().transpose()*mf.Rs_[k];
+    for (int i=0; i<3; ++i)
+      ASSERT_GT(dR.row(i).cwiseAbs().maxCoeff(), 0.99);
+  }
+  ASSERT_LT(mf.Ns_[0]+mf.Ns_[1], 1100);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();